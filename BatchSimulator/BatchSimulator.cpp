@@ -0,0 +1,965 @@
+// Headless batch runner for balancing the levels table.
+//
+// Plays thousands of games with a scripted player on every core and prints
+// what happened on each level - how long players last, how fast they kill
+// and what kills them.  Nothing gets drawn (SetLeds is never called) so the
+// engine only runs its simulation.
+//
+// Every game starts from the same snapshot of a fresh engine with its own
+// seed so a run gives the same numbers no matter how many threads it uses.
+//
+// BatchSimulator [-games N] [-threads N] [-policy name] [-seed N]
+//                [-frame ticks] [-step ticks] [-minutes N] [-layout file]
+//
+// With -replay it plays back an input log recorded on the tree instead
+// (drawing every frame like the tree does), says whether every frame still
+// matches and how long it took.  The tree dumps logs as hex - turn that
+// back into a binary file with something like xxd -r -p.  Add -wav to also
+// write the sound the game events made during the session.
+//
+// With -bake it renders one of the tree's shows into an animation clip (see
+// AnimationClip.h) at -frame ticks per frame, checks the clip plays back
+// exactly and prints how big it is and how long a frame takes to decode.
+// -clip writes the clip and -header writes it as a const array to paste
+// into the firmware.
+//
+// -render draws a show (the attract loop too) into a file of frames (see
+// FrameRenderer.h) split up across -threads workers, -frame ticks apart,
+// from -start ticks for -seconds (the whole show by default).  With -replay
+// and -out it renders the log's frames instead.
+//
+// -bench N times the color kernels (see ColorKernels.h) on N LEDs at a time
+// and prints nanoseconds per LED for each version.  The SWAR column is the
+// code the tree runs.
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../TempestInATree/src/Animator.h"
+#include "../TempestInATree/src/GameEngine.h"
+#include "../TempestInATree/src/InputLog.h"
+#include "../TempestInATree/src/AudioMixer.h"
+#include "../TempestInATree/src/AnimationClip.h"
+#include "../TempestInATree/src/ColorKernels.h"
+#include "FrameRenderer.h"
+
+// Decides what the controls do each frame.  A policy only sees the engine
+// through its public queries, same as a person looking at the tree.
+class PlayerPolicy
+{
+public:
+    virtual ~PlayerPolicy() {}
+    virtual void Reset(uint32_t seed) = 0;
+    // playerPosition is where the encoder is now in path LEDs - the policy moves it
+    virtual void Decide(const GameEngine& ge, TickCount time, int& playerPosition, bool& fire) = 0;
+
+protected:
+    // The encoder can only be turned so fast
+    static int MoveToward(int position, int target, int maxMove)
+    {
+        if (target > position + maxMove) return position + maxMove;
+        if (target < position - maxMove) return position - maxMove;
+        return target;
+    }
+
+    static int NextRandom(uint32_t& state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (int)(state >> 1);
+    }
+};
+
+// Stands still and taps fire - the player who walked up and didn't touch the knob
+class IdlePolicy : public PlayerPolicy
+{
+    bool fire_ = false;
+
+public:
+    virtual void Reset(uint32_t seed) { fire_ = false; }
+    virtual void Decide(const GameEngine& ge, TickCount time, int& playerPosition, bool& fire)
+    {
+        fire_ = !fire_;
+        fire = fire_;
+    }
+};
+
+// Spins the knob back and forth at random and mashes fire
+class RandomPolicy : public PlayerPolicy
+{
+    uint32_t random_ = 1;
+    int target_ = 0;
+    bool fire_ = false;
+
+public:
+    virtual void Reset(uint32_t seed) { random_ = seed | 1; target_ = 0; fire_ = false; }
+    virtual void Decide(const GameEngine& ge, TickCount time, int& playerPosition, bool& fire)
+    {
+        if (target_ == playerPosition)
+        {
+            target_ = NextRandom(random_) % ge.GetPathLedCount();
+        }
+        playerPosition = MoveToward(playerPosition, target_, 1);
+        fire_ = !fire_ && (NextRandom(random_) % 4) != 0;
+        fire = fire_;
+    }
+};
+
+// Goes after the enemy furthest down its lane and steps away from enemies
+// that made it onto the path.  Roughly how a decent player plays.
+class HunterPolicy : public PlayerPolicy
+{
+    bool fire_ = false;
+
+public:
+    virtual void Reset(uint32_t seed) { fire_ = false; }
+    virtual void Decide(const GameEngine& ge, TickCount time, int& playerPosition, bool& fire)
+    {
+        int pathLedCount = ge.GetPathLedCount();
+        int target = playerPosition;
+        float furthest = -1.0f;
+        int closestPathEnemy = -1;
+        for (int enemyIndex = 0; enemyIndex < ge.GetEnemyCount(); ++enemyIndex)
+        {
+            if (ge.IsEnemyOnPlayerPath(enemyIndex))
+            {
+                int ledIndex = ge.GetEnemyPathLedIndex(enemyIndex);
+                if (closestPathEnemy < 0 || abs(ledIndex - playerPosition) < abs(closestPathEnemy - playerPosition))
+                {
+                    closestPathEnemy = ledIndex;
+                }
+                continue;
+            }
+
+            float lanePosition = ge.GetEnemyLanePosition(enemyIndex);
+            if (lanePosition > furthest)
+            {
+                furthest = lanePosition;
+                target = ge.GetLanePathLedIndex(ge.GetEnemyLaneIndex(enemyIndex));
+            }
+        }
+
+        // An enemy on the path is about to run into us - get out of the way
+        // unless it's close enough to shoot
+        if (closestPathEnemy >= 0 && abs(closestPathEnemy - playerPosition) <= 3)
+        {
+            target = (closestPathEnemy >= pathLedCount / 2) ? 0 : pathLedCount - 1;
+        }
+
+        playerPosition = MoveToward(playerPosition, target, 1);
+        fire_ = !fire_;
+        fire = fire_;
+    }
+};
+
+static PlayerPolicy* CreatePolicy(const char* name)
+{
+    if (0 == strcmp(name, "idle")) return new IdlePolicy();
+    if (0 == strcmp(name, "random")) return new RandomPolicy();
+    if (0 == strcmp(name, "hunter")) return new HunterPolicy();
+    return NULL;
+}
+
+struct BatchOptions
+{
+    int games = 10000;
+    int threads = 0; // 0 for one per core
+    const char* policyName = "hunter";
+    uint32_t seed = 1;
+    TickCount frameTicks = 16; // about what the tree manages with 400 LEDs
+    TickCount stepTicks = 4; // same fixed timestep as the tree.  0 for one step per frame
+    int maxMinutes = 30; // games that last longer than this are stopped
+    std::vector<uint8_t> layout;
+    std::vector<uint8_t> replayLog;
+    const char* pWavFileName = NULL;
+    const char* pBakeShowName = NULL;
+    const char* pClipFileName = NULL;
+    const char* pHeaderFileName = NULL;
+    int keyframeInterval = 32;
+    int benchLedCount = 0;
+    const char* pRenderShowName = NULL;
+    const char* pOutFileName = NULL;
+    FrameFormat outFormat = FrameFormat::FF_RAW;
+    TickCount renderStartTicks = 0;
+    int renderSeconds = 0; // 0 for up to the end of the show
+};
+
+// GameStats added up over many games - 64 bit so big runs don't wrap
+struct BatchTotals
+{
+    uint64_t games = 0;
+    uint64_t timedOutGames = 0;
+    uint64_t gameTicks = 0;
+    uint64_t simulationSteps = 0;
+    uint64_t shotsFired = 0;
+    uint64_t enemiesSpawned = 0;
+    uint64_t laneKills = 0;
+    uint64_t pathKills = 0;
+    uint64_t enemyShotsDestroyed = 0;
+    uint64_t deathsByEnemyShot = 0;
+    uint64_t deathsByEnemyCollision = 0;
+    std::vector<uint64_t> levelGames; // games that got to the level
+    std::vector<uint64_t> levelPlayTicks;
+    std::vector<uint64_t> levelKills;
+    std::vector<uint64_t> levelDeaths;
+    std::vector<uint64_t> levelClears;
+
+    explicit BatchTotals(int levelCount) :
+        levelGames(levelCount), levelPlayTicks(levelCount), levelKills(levelCount), levelDeaths(levelCount), levelClears(levelCount)
+    {
+    }
+
+    void AddGame(const GameEngine::GameStats& stats, TickCount ticks, bool timedOut)
+    {
+        games++;
+        timedOutGames += timedOut ? 1 : 0;
+        gameTicks += ticks;
+        simulationSteps += stats.simulationSteps;
+        shotsFired += stats.shotsFired;
+        enemiesSpawned += stats.enemiesSpawned;
+        laneKills += stats.laneKills;
+        pathKills += stats.pathKills;
+        enemyShotsDestroyed += stats.enemyShotsDestroyed;
+        deathsByEnemyShot += stats.deathsByEnemyShot;
+        deathsByEnemyCollision += stats.deathsByEnemyCollision;
+        for (size_t levelIndex = 0; levelIndex < levelGames.size(); ++levelIndex)
+        {
+            levelGames[levelIndex] += (stats.levelPlayTicks[levelIndex] > 0) ? 1 : 0;
+            levelPlayTicks[levelIndex] += stats.levelPlayTicks[levelIndex];
+            levelKills[levelIndex] += stats.levelKills[levelIndex];
+            levelDeaths[levelIndex] += stats.levelDeaths[levelIndex];
+            levelClears[levelIndex] += stats.levelClears[levelIndex];
+        }
+    }
+
+    void Add(const BatchTotals& other)
+    {
+        games += other.games;
+        timedOutGames += other.timedOutGames;
+        gameTicks += other.gameTicks;
+        simulationSteps += other.simulationSteps;
+        shotsFired += other.shotsFired;
+        enemiesSpawned += other.enemiesSpawned;
+        laneKills += other.laneKills;
+        pathKills += other.pathKills;
+        enemyShotsDestroyed += other.enemyShotsDestroyed;
+        deathsByEnemyShot += other.deathsByEnemyShot;
+        deathsByEnemyCollision += other.deathsByEnemyCollision;
+        for (size_t levelIndex = 0; levelIndex < levelGames.size(); ++levelIndex)
+        {
+            levelGames[levelIndex] += other.levelGames[levelIndex];
+            levelPlayTicks[levelIndex] += other.levelPlayTicks[levelIndex];
+            levelKills[levelIndex] += other.levelKills[levelIndex];
+            levelDeaths[levelIndex] += other.levelDeaths[levelIndex];
+            levelClears[levelIndex] += other.levelClears[levelIndex];
+        }
+    }
+};
+
+// Seeds are spread out so neighboring games don't start from similar states
+static uint32_t GameSeed(uint32_t batchSeed, int gameIndex)
+{
+    uint32_t seed = batchSeed + (uint32_t)gameIndex * 0x9E3779B9u;
+    seed ^= seed >> 16;
+    seed *= 0x85EBCA6Bu;
+    seed ^= seed >> 13;
+    return seed;
+}
+
+// One worker thread - one engine reused for every game it picks up
+static void RunGames(const BatchOptions& options, std::atomic<int>& nextGame, BatchTotals& totals)
+{
+    std::unique_ptr<GameEngine> pEngine(new GameEngine());
+    GameEngine& ge = *pEngine;
+    std::unique_ptr<PlayerPolicy> pPolicy(CreatePolicy(options.policyName));
+    if (!options.layout.empty())
+    {
+        ge.LoadLayout(options.layout.data(), (int)options.layout.size());
+    }
+    ge.SetFixedTimestep(options.stepTicks, false);
+
+    // Fresh engine in attract mode with the start button up.  Every game
+    // starts from here.
+    int startPosition = ge.GetPathLedCount() / 2;
+    ge.Step(0, startPosition, false, false);
+    GameEngine::Snapshot start;
+    ge.SaveSnapshot(start);
+
+    TickCount maxGameTicks = (TickCount)options.maxMinutes * 60 * TicksPerSecond;
+    for (int gameIndex = nextGame++; gameIndex < options.games; gameIndex = nextGame++)
+    {
+        uint32_t seed = GameSeed(options.seed, gameIndex);
+        ge.LoadSnapshot(start);
+        ge.SetRandomSeed(seed);
+        ge.ResetStats();
+        pPolicy->Reset(seed);
+
+        TickCount time = options.frameTicks;
+        int playerPosition = startPosition;
+        ge.Step(time, playerPosition, false, true);
+
+        bool timedOut = true;
+        while (time < maxGameTicks)
+        {
+            time += options.frameTicks;
+            bool fire = false;
+            if (ge.IsPlayingLevel())
+            {
+                pPolicy->Decide(ge, time, playerPosition, fire);
+            }
+            ge.Step(time, playerPosition, fire, false);
+
+            if (ge.GetRemainingLives() <= 0 || ge.IsAttractMode())
+            {
+                timedOut = false;
+                break;
+            }
+        }
+
+        totals.AddGame(ge.GetStats(), time, timedOut);
+    }
+}
+
+static bool ReadFile(const char* fileName, std::vector<uint8_t>& contents)
+{
+    FILE* pFile = fopen(fileName, "rb");
+    if (NULL == pFile) return false;
+    uint8_t buffer[256];
+    size_t readSize;
+    while ((readSize = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+    {
+        contents.insert(contents.end(), buffer, buffer + readSize);
+    }
+    fclose(pFile);
+    return true;
+}
+
+static double PerMinute(uint64_t count, uint64_t ticks)
+{
+    return (ticks > 0) ? (double)count * 60.0 * TicksPerSecond / (double)ticks : 0.0;
+}
+
+static double Percent(uint64_t part, uint64_t whole)
+{
+    return (whole > 0) ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+static void PrintTotals(const BatchOptions& options, const BatchTotals& totals, int threadCount, double wallSeconds)
+{
+    printf("%llu games, policy %s, seed %u, %d threads\n", (unsigned long long)totals.games, options.policyName, options.seed, threadCount);
+    printf("average game %.1f s, %llu stopped at %d minutes\n",
+        (totals.games > 0) ? (double)totals.gameTicks / TicksPerSecond / (double)totals.games : 0.0,
+        (unsigned long long)totals.timedOutGames, options.maxMinutes);
+    printf("\n");
+    printf("level  reached  clears/game  play s/game  s/death  kills/min  deaths/min\n");
+    for (size_t levelIndex = 0; levelIndex < totals.levelGames.size(); ++levelIndex)
+    {
+        uint64_t games = totals.levelGames[levelIndex];
+        uint64_t ticks = totals.levelPlayTicks[levelIndex];
+        uint64_t deaths = totals.levelDeaths[levelIndex];
+        printf("%5d  %6.1f%%  %11.2f  %11.1f  %7.1f  %9.1f  %10.2f\n",
+            (int)levelIndex + 1,
+            Percent(games, totals.games),
+            (games > 0) ? (double)totals.levelClears[levelIndex] / (double)games : 0.0,
+            (games > 0) ? (double)ticks / TicksPerSecond / (double)games : 0.0,
+            (deaths > 0) ? (double)ticks / TicksPerSecond / (double)deaths : 0.0,
+            PerMinute(totals.levelKills[levelIndex], ticks),
+            PerMinute(deaths, ticks));
+    }
+    printf("\n");
+    uint64_t deaths = totals.deathsByEnemyShot + totals.deathsByEnemyCollision;
+    printf("deaths: %llu by enemy shot (%.1f%%), %llu by enemy collision (%.1f%%)\n",
+        (unsigned long long)totals.deathsByEnemyShot, Percent(totals.deathsByEnemyShot, deaths),
+        (unsigned long long)totals.deathsByEnemyCollision, Percent(totals.deathsByEnemyCollision, deaths));
+    printf("kills: %llu in lanes, %llu on the path, %.1f%% of %llu spawned enemies\n",
+        (unsigned long long)totals.laneKills, (unsigned long long)totals.pathKills,
+        Percent(totals.laneKills + totals.pathKills, totals.enemiesSpawned), (unsigned long long)totals.enemiesSpawned);
+    printf("shots: %llu fired, %.1f%% hit an enemy, %llu enemy shots destroyed\n",
+        (unsigned long long)totals.shotsFired, Percent(totals.laneKills + totals.pathKills, totals.shotsFired),
+        (unsigned long long)totals.enemyShotsDestroyed);
+    printf("\n");
+    printf("%llu simulation steps in %.2f s - %.1f million steps per second\n",
+        (unsigned long long)totals.simulationSteps, wallSeconds,
+        (wallSeconds > 0) ? (double)totals.simulationSteps / wallSeconds / 1000000.0 : 0.0);
+}
+
+static void WriteWavInt(FILE* pFile, uint32_t value, int byteCount)
+{
+    for (int byteIndex = 0; byteIndex < byteCount; ++byteIndex)
+    {
+        fputc((int)((value >> (8 * byteIndex)) & 0xFF), pFile);
+    }
+}
+
+// 16 bit mono PCM
+static bool WriteWavFile(const char* pFileName, const std::vector<int16_t>& samples)
+{
+    FILE* pFile = fopen(pFileName, "wb");
+    if (NULL == pFile) return false;
+
+    uint32_t dataSize = (uint32_t)(samples.size() * sizeof(int16_t));
+    fwrite("RIFF", 1, 4, pFile);
+    WriteWavInt(pFile, 36 + dataSize, 4);
+    fwrite("WAVEfmt ", 1, 8, pFile);
+    WriteWavInt(pFile, 16, 4); // fmt chunk size
+    WriteWavInt(pFile, 1, 2); // PCM
+    WriteWavInt(pFile, 1, 2); // channels
+    WriteWavInt(pFile, AudioMixer::sampleRate, 4);
+    WriteWavInt(pFile, AudioMixer::sampleRate * 2, 4); // bytes per second
+    WriteWavInt(pFile, 2, 2); // bytes per sample frame
+    WriteWavInt(pFile, 16, 2); // bits per sample
+    fwrite("data", 1, 4, pFile);
+    WriteWavInt(pFile, dataSize, 4);
+    for (size_t sampleIndex = 0; sampleIndex < samples.size(); ++sampleIndex)
+    {
+        WriteWavInt(pFile, (uint16_t)samples[sampleIndex], 2);
+    }
+    return 0 == fclose(pFile);
+}
+
+// Plays the log frame by frame and feeds the game events to the mixer the
+// way the tree does, mixing blocks as the session's time goes by
+static int ReplayAudio(const BatchOptions& options, InputLogReader& reader, GameEngine& engine)
+{
+    std::vector<LedColor> leds(TreeConfig::totalLedCount, 0);
+    AudioMixer mixer;
+    std::vector<int16_t> samples;
+    double mixSeconds = 0;
+    int blockCount = 0;
+
+    engine.SetRandomSeed(reader.GetRandomSeed());
+    engine.SetFixedTimestep(reader.GetFixedStepTicks(), reader.GetInterpolate());
+    reader.Rewind();
+    InputLogFrame frame;
+    bool firstFrame = true;
+    TickCount firstTime = 0;
+    while (reader.NextFrame(frame))
+    {
+        if (firstFrame)
+        {
+            firstTime = frame.time;
+            firstFrame = false;
+        }
+        engine.Step(frame.time, frame.playerPosition, frame.fireButtonPressed, frame.startButtonPressed);
+        engine.SetLeds(leds.data());
+        GameEvent event;
+        while (engine.PopEvent(event))
+        {
+            mixer.PlayEvent(event);
+        }
+
+        uint64_t sampleCount = (uint64_t)(frame.time - firstTime) * AudioMixer::sampleRate / TicksPerSecond;
+        while (samples.size() < sampleCount)
+        {
+            size_t blockStart = samples.size();
+            samples.resize(blockStart + AudioMixer::blockSize);
+            auto mixStartTime = std::chrono::steady_clock::now();
+            mixer.MixBlock(samples.data() + blockStart);
+            mixSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - mixStartTime).count();
+            blockCount++;
+        }
+    }
+
+    if (!WriteWavFile(options.pWavFileName, samples))
+    {
+        printf("can't write %s\n", options.pWavFileName);
+        return 1;
+    }
+    printf("%.1f s of sound in %d blocks, %.2f us per block\n",
+        (double)samples.size() / AudioMixer::sampleRate, blockCount, (blockCount > 0) ? mixSeconds * 1000000.0 / blockCount : 0.0);
+    return 0;
+}
+
+static int RenderReplayFrames(const BatchOptions& options, InputLogReader& reader, GameEngine& engine);
+
+static int Replay(const BatchOptions& options)
+{
+    InputLogReader reader(options.replayLog.data(), (int)options.replayLog.size());
+    if (!reader.IsValid())
+    {
+        printf("not an input log\n");
+        return 1;
+    }
+
+    std::unique_ptr<GameEngine> pEngine(new GameEngine());
+    if (!options.layout.empty())
+    {
+        pEngine->LoadLayout(options.layout.data(), (int)options.layout.size());
+    }
+    if (NULL != options.pWavFileName)
+    {
+        return ReplayAudio(options, reader, *pEngine);
+    }
+    if (NULL != options.pOutFileName)
+    {
+        return RenderReplayFrames(options, reader, *pEngine);
+    }
+    std::vector<LedColor> leds(TreeConfig::totalLedCount, 0);
+
+    auto startTime = std::chrono::steady_clock::now();
+    int frameCount = 0;
+    int firstDifferentFrame = reader.Replay(*pEngine, leds.data(), &frameCount);
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    printf("%d frames, %u simulation steps in %.3f s - %.0f frames per second\n",
+        frameCount, pEngine->GetStats().simulationSteps, wallSeconds, (wallSeconds > 0) ? frameCount / wallSeconds : 0.0);
+    if (!reader.HasFrameHashes())
+    {
+        printf("log has no LED hashes to check\n");
+        return 0;
+    }
+    if (firstDifferentFrame >= 0)
+    {
+        printf("frame %d draws differently than when it was recorded\n", firstDifferentFrame);
+        return 2;
+    }
+    printf("every frame matches\n");
+    return 0;
+}
+
+static Animator* CreateBakeAnimator(const char* pShowName, GameEngine& engine)
+{
+    if (0 == strcmp(pShowName, "lights")) return CreateChristmasLightsAnimator(TreeConfig::totalLedCount, 0.4f, 30 * 1000); // powerScale from the tree
+    if (0 == strcmp(pShowName, "attract")) return engine.CreateShowAnimator(GameEngine::Show::SH_ATTRACT);
+    if (0 == strcmp(pShowName, "gamestart")) return engine.CreateShowAnimator(GameEngine::Show::SH_GAME_START);
+    if (0 == strcmp(pShowName, "levelstart")) return engine.CreateShowAnimator(GameEngine::Show::SH_LEVEL_START);
+    if (0 == strcmp(pShowName, "gameover")) return engine.CreateShowAnimator(GameEngine::Show::SH_GAME_OVER);
+    return NULL;
+}
+
+static bool WriteClipHeader(const char* pFileName, const char* pShowName, const std::vector<uint8_t>& clip)
+{
+    FILE* pFile = fopen(pFileName, "w");
+    if (NULL == pFile) return false;
+
+    fprintf(pFile, "// Baked by BatchSimulator -bake %s\n", pShowName);
+    fprintf(pFile, "const uint8_t %sClip[%d] =\n{", pShowName, (int)clip.size());
+    for (size_t byteIndex = 0; byteIndex < clip.size(); ++byteIndex)
+    {
+        fprintf(pFile, "%s0x%02X,", (0 == byteIndex % 16) ? "\n    " : " ", clip[byteIndex]);
+    }
+    fprintf(pFile, "\n};\n");
+    return 0 == fclose(pFile);
+}
+
+static int Bake(const BatchOptions& options, GameEngine& engine)
+{
+    std::unique_ptr<Animator> pAnimator(CreateBakeAnimator(options.pBakeShowName, engine));
+    if (!pAnimator)
+    {
+        printf("unknown show %s - lights, attract, gamestart, levelstart or gameover\n", options.pBakeShowName);
+        return 1;
+    }
+
+    std::vector<uint8_t> clip;
+    if (!BakeAnimationClip(*pAnimator, TreeConfig::totalLedCount, options.frameTicks, options.keyframeInterval, clip))
+    {
+        printf("%s doesn't draw anything\n", options.pBakeShowName);
+        return 1;
+    }
+
+    // Play it back against a fresh copy of the show, frame by frame the way
+    // it was baked
+    ClipAnimator player(clip.data(), (int)clip.size(), TreeConfig::totalLedCount);
+    pAnimator.reset(CreateBakeAnimator(options.pBakeShowName, engine));
+    std::vector<LedColor> expected(TreeConfig::totalLedCount);
+    std::vector<LedColor> actual(TreeConfig::totalLedCount);
+    LedSpanList spans;
+    int firstDifferentFrame = -1;
+    double decodeSeconds = 0;
+    for (int frameIndex = 0; frameIndex < player.GetFrameCount(); ++frameIndex)
+    {
+        TickCount time = frameIndex * options.frameTicks;
+        std::fill(expected.begin(), expected.end(), color_black);
+        std::fill(actual.begin(), actual.end(), color_black);
+        pAnimator->StepSpans(time, expected.data(), spans);
+
+        auto decodeStartTime = std::chrono::steady_clock::now();
+        player.StepSpans(time, actual.data(), spans);
+        decodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - decodeStartTime).count();
+
+        for (int ledIndex = 0; ledIndex < TreeConfig::totalLedCount && firstDifferentFrame < 0; ++ledIndex)
+        {
+            if ((expected[ledIndex] & 0x00FFFFFF) != actual[ledIndex]) firstDifferentFrame = frameIndex;
+        }
+    }
+
+    int frameCount = player.GetFrameCount();
+    int rawSize = frameCount * player.GetLedCount() * 3;
+    printf("%s: %d frames of %d ms, LEDs %d to %d\n", options.pBakeShowName, frameCount, (int)options.frameTicks,
+        player.GetStartLedIndex(), player.GetStartLedIndex() + player.GetLedCount() - 1);
+    printf("%d bytes (%.1f%% of %d raw), %.1f bytes per frame, keyframe every %d frames\n",
+        (int)clip.size(), 100.0 * clip.size() / rawSize, rawSize, (double)clip.size() / frameCount, options.keyframeInterval);
+    printf("%.2f us per frame to decode\n", decodeSeconds * 1000000.0 / frameCount);
+    if (firstDifferentFrame >= 0)
+    {
+        printf("frame %d plays back differently than the show\n", firstDifferentFrame);
+        return 2;
+    }
+
+    if (NULL != options.pClipFileName)
+    {
+        FILE* pFile = fopen(options.pClipFileName, "wb");
+        if (NULL == pFile || clip.size() != fwrite(clip.data(), 1, clip.size(), pFile) || 0 != fclose(pFile))
+        {
+            printf("can't write %s\n", options.pClipFileName);
+            return 1;
+        }
+    }
+    if (NULL != options.pHeaderFileName && !WriteClipHeader(options.pHeaderFileName, options.pBakeShowName, clip))
+    {
+        printf("can't write %s\n", options.pHeaderFileName);
+        return 1;
+    }
+    return 0;
+}
+
+// Nanoseconds per LED for kernel, best of a few runs
+template<typename Kernel>
+static double BenchKernel(std::vector<LedColor>& leds, Kernel kernel)
+{
+    const int callCount = 2000;
+    double bestNanoseconds = 0;
+    for (int runIndex = 0; runIndex < 5; ++runIndex)
+    {
+        auto startTime = std::chrono::steady_clock::now();
+        for (int callIndex = 0; callIndex < callCount; ++callIndex)
+        {
+            kernel(leds.data(), (int)leds.size());
+        }
+        double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startTime).count() / ((double)callCount * leds.size());
+        if (0 == runIndex || nanoseconds < bestNanoseconds) bestNanoseconds = nanoseconds;
+    }
+    return bestNanoseconds;
+}
+
+static int Bench(const BatchOptions& options)
+{
+    std::vector<LedColor> leds(options.benchLedCount);
+    std::vector<LedColor> add(options.benchLedCount);
+    std::vector<LedColor> pattern = { color_white, color_black, color_black, color_green, color_black, color_black, color_blue, color_black, color_black, color_red, color_black, color_black };
+    for (int ledIndex = 0; ledIndex < options.benchLedCount; ++ledIndex)
+    {
+        leds[ledIndex] = pattern[ledIndex % pattern.size()];
+        add[ledIndex] = 0x00102030;
+    }
+    const ColorScale scale = 200;
+    const LedColor fadeColor = 0x00336699;
+
+    printf("nanoseconds per LED, %d LEDs\n", options.benchLedCount);
+    printf("kernel          reference     SWAR     best\n");
+    printf("fill            %9.3f %8s %8.3f\n",
+        BenchKernel(leds, [&](LedColor* p, int n) { FillColorsReference(p, n, fadeColor); }), "",
+        BenchKernel(leds, [&](LedColor* p, int n) { FillColors(p, n, fadeColor); }));
+    printf("repeat pattern  %9.3f %8s %8.3f\n",
+        BenchKernel(leds, [&](LedColor* p, int n) { RepeatPatternReference(p, n, pattern.data(), (int)pattern.size(), 5); }), "",
+        BenchKernel(leds, [&](LedColor* p, int n) { RepeatPattern(p, n, pattern.data(), (int)pattern.size(), 5); }));
+    printf("scale           %9.3f %8.3f %8.3f\n",
+        BenchKernel(leds, [&](LedColor* p, int n) { ScaleColorsReference(p, n, scale); }),
+        BenchKernel(leds, [&](LedColor* p, int n) { ScaleColorsSwar(p, n, scale); }),
+        BenchKernel(leds, [&](LedColor* p, int n) { ScaleColors(p, n, scale); }));
+    printf("cross-fade      %9.3f %8.3f %8.3f\n",
+        BenchKernel(leds, [&](LedColor* p, int n) { CrossFadeColorsReference(p, n, fadeColor, 100); }),
+        BenchKernel(leds, [&](LedColor* p, int n) { CrossFadeColorsSwar(p, n, fadeColor, 100); }),
+        BenchKernel(leds, [&](LedColor* p, int n) { CrossFadeColors(p, n, fadeColor, 100); }));
+    printf("add saturate    %9.3f %8.3f %8.3f\n",
+        BenchKernel(leds, [&](LedColor* p, int n) { AddColorsSaturateReference(p, add.data(), n); }),
+        BenchKernel(leds, [&](LedColor* p, int n) { AddColorsSaturateSwar(p, add.data(), n); }),
+        BenchKernel(leds, [&](LedColor* p, int n) { AddColorsSaturate(p, add.data(), n); }));
+    printf("float scale     %9.3f\n",
+        BenchKernel(leds, [&](LedColor* p, int n)
+        {
+            // What FadeAnimator did per LED before the kernels
+            const float floatScale = scale / 256.0f;
+            for (int ledIndex = 0; ledIndex < n; ++ledIndex)
+            {
+                LedColor c = p[ledIndex];
+                p[ledIndex] = ((uint8_t)((float)Red(c) * floatScale) << 16) | ((uint8_t)((float)Green(c) * floatScale) << 8) | (uint8_t)((float)Blue(c) * floatScale);
+            }
+        }));
+    return 0;
+}
+
+// A show along with an engine of its own to draw it, so every render worker
+// can have one
+class EngineShowAnimator : public Animator
+{
+    std::unique_ptr<GameEngine> pEngine_;
+    std::unique_ptr<Animator> pShow_;
+
+public:
+    EngineShowAnimator(GameEngine* pEngine, Animator* pShow) : pEngine_(pEngine), pShow_(pShow)
+    {
+        duration_ = pShow->duration();
+    }
+
+    virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans) { return pShow_->StepSpans(localTime, pColors, spans); }
+    virtual bool IsSeekable() const { return pShow_->IsSeekable(); }
+};
+
+static Animator* CreateRenderAnimator(const BatchOptions& options)
+{
+    std::unique_ptr<GameEngine> pEngine(new GameEngine());
+    if (!options.layout.empty())
+    {
+        pEngine->LoadLayout(options.layout.data(), (int)options.layout.size());
+    }
+    Animator* pShow = CreateBakeAnimator(options.pRenderShowName, *pEngine);
+    if (NULL == pShow) return NULL;
+    return new EngineShowAnimator(pEngine.release(), pShow);
+}
+
+static void PrintRenderStats(const RenderStats& stats, TickCount showTicks, double wallSeconds)
+{
+    printf("%d frames on %d threads in %.3f s - %.0f frames per second, %.0fx real time\n",
+        stats.frameCount, stats.threadCount, wallSeconds, (wallSeconds > 0) ? stats.frameCount / wallSeconds : 0.0,
+        (wallSeconds > 0) ? showTicks / (wallSeconds * TicksPerSecond) : 0.0);
+    if (stats.threadCount > 1)
+    {
+        printf("%d chunks, %d stolen\n", stats.chunkCount, stats.stolenChunkCount);
+    }
+}
+
+static void PrintFrameFormat(const BatchOptions& options, const TreeFrameMap& map, TickCount frameTicks)
+{
+    if (FrameFormat::FF_TREE == options.outFormat)
+    {
+        printf("ffmpeg -f rawvideo -pix_fmt rgb24 -s %dx%d -r %.2f -i %s\n",
+            map.GetWidth(), map.GetHeight(), (double)TicksPerSecond / frameTicks, options.pOutFileName);
+    }
+}
+
+static int RenderShow(const BatchOptions& options, GameEngine& engine)
+{
+    std::unique_ptr<Animator> pShow(CreateBakeAnimator(options.pRenderShowName, engine));
+    if (!pShow)
+    {
+        printf("unknown show %s - lights, attract, gamestart, levelstart or gameover\n", options.pRenderShowName);
+        return 1;
+    }
+    TickCount endTicks = pShow->duration();
+    if (options.renderSeconds > 0)
+    {
+        endTicks = std::min(endTicks, options.renderStartTicks + (TickCount)options.renderSeconds * TicksPerSecond);
+    }
+    if (options.renderStartTicks >= endTicks)
+    {
+        printf("%s is only %u ticks long\n", options.pRenderShowName, pShow->duration());
+        return 1;
+    }
+    int frameCount = (int)((endTicks - options.renderStartTicks + options.frameTicks - 1) / options.frameTicks);
+
+    TreeFrameMap map(engine, 4);
+    FrameFile file;
+    if (!file.Open(options.pOutFileName, options.outFormat, frameCount, &map))
+    {
+        printf("can't write %s\n", options.pOutFileName);
+        return 1;
+    }
+
+    int threadCount = (options.threads > 0) ? options.threads : (int)std::thread::hardware_concurrency();
+    RenderStats stats;
+    auto startTime = std::chrono::steady_clock::now();
+    bool rendered = RenderAnimator([&options]() { return CreateRenderAnimator(options); },
+        options.renderStartTicks, options.frameTicks, frameCount, threadCount, file, stats);
+    if (!file.Close() || !rendered)
+    {
+        printf("can't write %s\n", options.pOutFileName);
+        return 1;
+    }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    printf("%s from %u to %u ticks%s\n", options.pRenderShowName, options.renderStartTicks, endTicks,
+        pShow->IsSeekable() ? "" : " - not seekable so drawn in order");
+    PrintRenderStats(stats, endTicks - options.renderStartTicks, wallSeconds);
+    PrintFrameFormat(options, map, options.frameTicks);
+    return 0;
+}
+
+static int RenderReplayFrames(const BatchOptions& options, InputLogReader& reader, GameEngine& engine)
+{
+    int frameCount = CountReplayFrames(reader);
+    TreeFrameMap map(engine, 4);
+    FrameFile file;
+    if (0 == frameCount || !file.Open(options.pOutFileName, options.outFormat, frameCount, &map))
+    {
+        printf("can't write %s\n", options.pOutFileName);
+        return 1;
+    }
+
+    RenderStats stats;
+    auto startTime = std::chrono::steady_clock::now();
+    bool rendered = RenderReplay(reader, engine, file, stats);
+    if (!file.Close() || !rendered)
+    {
+        printf("can't write %s\n", options.pOutFileName);
+        return 1;
+    }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    // The log's frames come as fast as the tree drew them
+    reader.Rewind();
+    InputLogFrame frame;
+    TickCount firstTime = reader.NextFrame(frame) ? frame.time : 0;
+    TickCount lastTime = firstTime;
+    while (reader.NextFrame(frame))
+    {
+        lastTime = frame.time;
+    }
+    PrintRenderStats(stats, lastTime - firstTime, wallSeconds);
+    PrintFrameFormat(options, map, (frameCount > 1) ? (lastTime - firstTime) / (frameCount - 1) : options.frameTicks);
+    return 0;
+}
+
+static bool ParseFrameFormat(const char* pName, FrameFormat& format)
+{
+    if (0 == strcmp(pName, "raw")) format = FrameFormat::FF_RAW;
+    else if (0 == strcmp(pName, "ppm")) format = FrameFormat::FF_PPM;
+    else if (0 == strcmp(pName, "tree")) format = FrameFormat::FF_TREE;
+    else return false;
+    return true;
+}
+
+static void PrintUsage()
+{
+    printf("BatchSimulator [-games N] [-threads N] [-policy idle|random|hunter] [-seed N]\n");
+    printf("               [-frame ticks] [-step ticks] [-minutes N] [-layout file]\n");
+    printf("BatchSimulator -replay logfile [-layout file] [-wav file]\n");
+    printf("BatchSimulator -replay logfile -out file [-format raw|ppm|tree] [-layout file]\n");
+    printf("BatchSimulator -bake lights|attract|gamestart|levelstart|gameover [-frame ticks] [-keyframes N]\n");
+    printf("               [-layout file] [-clip file] [-header file]\n");
+    printf("BatchSimulator -render lights|attract|gamestart|levelstart|gameover -out file\n");
+    printf("               [-format raw|ppm|tree] [-frame ticks] [-start ticks] [-seconds N]\n");
+    printf("               [-threads N] [-layout file]\n");
+    printf("BatchSimulator -bench ledcount\n");
+}
+
+int main(int argc, char** argv)
+{
+    BatchOptions options;
+    for (int argIndex = 1; argIndex < argc; ++argIndex)
+    {
+        const char* pArg = argv[argIndex];
+        const char* pValue = (argIndex + 1 < argc) ? argv[argIndex + 1] : NULL;
+        if (NULL == pValue)
+        {
+            PrintUsage();
+            return 1;
+        }
+        argIndex++;
+
+        if (0 == strcmp(pArg, "-games")) options.games = atoi(pValue);
+        else if (0 == strcmp(pArg, "-threads")) options.threads = atoi(pValue);
+        else if (0 == strcmp(pArg, "-policy")) options.policyName = pValue;
+        else if (0 == strcmp(pArg, "-seed")) options.seed = (uint32_t)strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "-frame")) options.frameTicks = (TickCount)atoi(pValue);
+        else if (0 == strcmp(pArg, "-step")) options.stepTicks = (TickCount)atoi(pValue);
+        else if (0 == strcmp(pArg, "-minutes")) options.maxMinutes = atoi(pValue);
+        else if (0 == strcmp(pArg, "-wav")) options.pWavFileName = pValue;
+        else if (0 == strcmp(pArg, "-bake")) options.pBakeShowName = pValue;
+        else if (0 == strcmp(pArg, "-clip")) options.pClipFileName = pValue;
+        else if (0 == strcmp(pArg, "-header")) options.pHeaderFileName = pValue;
+        else if (0 == strcmp(pArg, "-keyframes")) options.keyframeInterval = atoi(pValue);
+        else if (0 == strcmp(pArg, "-bench")) options.benchLedCount = atoi(pValue);
+        else if (0 == strcmp(pArg, "-render")) options.pRenderShowName = pValue;
+        else if (0 == strcmp(pArg, "-out")) options.pOutFileName = pValue;
+        else if (0 == strcmp(pArg, "-start")) options.renderStartTicks = (TickCount)atoi(pValue);
+        else if (0 == strcmp(pArg, "-seconds")) options.renderSeconds = atoi(pValue);
+        else if (0 == strcmp(pArg, "-format"))
+        {
+            if (!ParseFrameFormat(pValue, options.outFormat))
+            {
+                PrintUsage();
+                return 1;
+            }
+        }
+        else if (0 == strcmp(pArg, "-layout") || 0 == strcmp(pArg, "-replay"))
+        {
+            if (!ReadFile(pValue, (0 == strcmp(pArg, "-layout")) ? options.layout : options.replayLog))
+            {
+                printf("can't read %s\n", pValue);
+                return 1;
+            }
+        }
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+    if (options.benchLedCount > 0)
+    {
+        return Bench(options);
+    }
+
+    std::unique_ptr<PlayerPolicy> pPolicy(CreatePolicy(options.policyName));
+    if (!pPolicy)
+    {
+        printf("unknown policy %s\n", options.policyName);
+        return 1;
+    }
+    if (options.frameTicks == 0 || options.games <= 0)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    std::unique_ptr<GameEngine> pCheck(new GameEngine());
+    if (!options.layout.empty() && !pCheck->LoadLayout(options.layout.data(), (int)options.layout.size()))
+    {
+        printf("layout doesn't fit this build\n");
+        return 1;
+    }
+    if (!options.replayLog.empty())
+    {
+        return Replay(options);
+    }
+    if (NULL != options.pBakeShowName)
+    {
+        return Bake(options, *pCheck);
+    }
+    if (NULL != options.pRenderShowName)
+    {
+        if (NULL == options.pOutFileName)
+        {
+            PrintUsage();
+            return 1;
+        }
+        return RenderShow(options, *pCheck);
+    }
+    int levelCount = ARRAYSIZE(pCheck->GetStats().levelPlayTicks);
+
+    int threadCount = (options.threads > 0) ? options.threads : (int)std::thread::hardware_concurrency();
+    if (threadCount <= 0) threadCount = 1;
+
+    std::vector<BatchTotals> threadTotals(threadCount, BatchTotals(levelCount));
+    std::atomic<int> nextGame(0);
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+    {
+        threads.emplace_back(RunGames, std::cref(options), std::ref(nextGame), std::ref(threadTotals[threadIndex]));
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    BatchTotals totals(levelCount);
+    for (const BatchTotals& threadTotal : threadTotals)
+    {
+        totals.Add(threadTotal);
+    }
+    PrintTotals(options, totals, threadCount, wallSeconds);
+    return 0;
+}
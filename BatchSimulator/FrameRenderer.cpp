@@ -0,0 +1,359 @@
+#include <vector>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FrameRenderer.h"
+
+// Frames a worker draws before writing them out or looking for more work
+static const int renderChunkFrames = 64;
+
+// LedColors are in the strip's GRB order (color_red is the middle byte) so
+// the byte Red() gives is really green
+static void WritePixel(uint8_t* pPixel, LedColor color)
+{
+    pPixel[0] = (uint8_t)(color >> 8);
+    pPixel[1] = (uint8_t)(color >> 16);
+    pPixel[2] = (uint8_t)color;
+}
+
+TreeFrameMap::TreeFrameMap(const GameEngine& engine, int scale) :
+    scale_(scale)
+{
+    int laneRows = 1;
+    for (int laneIndex = 0; laneIndex < engine.GetLaneCount(); ++laneIndex)
+    {
+        const TreeLane& lane = engine.GetLane(laneIndex);
+        laneRows = std::max(laneRows, TreeLedRangeLength(lane.startIndex, lane.endIndex));
+    }
+    width_ = engine.GetPathLedCount();
+    height_ = laneRows + 2;
+    pixelLeds_.assign(width_ * height_, -1);
+
+    // Each lane runs from the player end at the bottom up to the top of the
+    // tree, leaning in toward the middle as it goes up.  Short lanes get
+    // stretched to the full height.
+    int middle = width_ / 2;
+    for (int laneIndex = 0; laneIndex < engine.GetLaneCount(); ++laneIndex)
+    {
+        const TreeLane& lane = engine.GetLane(laneIndex);
+        int ledCount = TreeLedRangeLength(lane.startIndex, lane.endIndex);
+        int direction = (lane.startIndex > lane.endIndex) ? 1 : -1;
+        for (int ledIndex = 0; ledIndex < ledCount; ++ledIndex)
+        {
+            int y = laneRows - 1 - (ledIndex * laneRows) / ledCount;
+            int x = middle + ((lane.pathLedIndex - middle) * (y + 1)) / laneRows;
+            SetLed(x, y, lane.endIndex + ledIndex * direction);
+        }
+    }
+
+    int pathDirection = (TreeConfig::pathRightLedIndex > TreeConfig::pathLeftLedIndex) ? 1 : -1;
+    for (int pathIndex = 0; pathIndex < width_; ++pathIndex)
+    {
+        SetLed(pathIndex, laneRows, TreeConfig::pathLeftLedIndex + pathIndex * pathDirection);
+    }
+
+    int baseLedCount = TreeLedRangeLength(TreeConfig::treeBaseStartLedIndex, TreeConfig::treeBaseEndLedIndex);
+    int baseStart = std::min(TreeConfig::treeBaseStartLedIndex, TreeConfig::treeBaseEndLedIndex);
+    for (int baseIndex = 0; baseIndex < baseLedCount; ++baseIndex)
+    {
+        SetLed(middle - baseLedCount / 2 + baseIndex, laneRows + 1, baseStart + baseIndex);
+    }
+}
+
+void TreeFrameMap::SetLed(int x, int y, int ledIndex)
+{
+    if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+    pixelLeds_[y * width_ + x] = ledIndex;
+}
+
+void TreeFrameMap::Draw(const LedColor* pLeds, uint8_t* pPixels) const
+{
+    int rowSize = GetWidth() * 3;
+    for (int y = 0; y < height_; ++y)
+    {
+        uint8_t* pRow = pPixels + (size_t)y * scale_ * rowSize;
+        uint8_t* pPixel = pRow;
+        for (int x = 0; x < width_; ++x)
+        {
+            int ledIndex = pixelLeds_[y * width_ + x];
+            LedColor color = (ledIndex >= 0) ? pLeds[ledIndex] : color_black;
+            for (int copy = 0; copy < scale_; ++copy, pPixel += 3)
+            {
+                WritePixel(pPixel, color);
+            }
+        }
+        for (int copy = 1; copy < scale_; ++copy)
+        {
+            memcpy(pRow + copy * rowSize, pRow, rowSize);
+        }
+    }
+}
+
+FrameFile::FrameFile() :
+    pFile_(NULL),
+    format_(FrameFormat::FF_RAW),
+    pMap_(NULL),
+    frameSize_(0),
+    headerSize_(0),
+    failed_(false)
+{
+}
+
+FrameFile::~FrameFile()
+{
+    Close();
+}
+
+bool FrameFile::Open(const char* pFileName, FrameFormat format, int frameCount, const TreeFrameMap* pMap)
+{
+    Close();
+    if (FrameFormat::FF_TREE == format && NULL == pMap) return false;
+
+    pFile_ = fopen(pFileName, "wb");
+    if (NULL == pFile_) return false;
+    format_ = format;
+    pMap_ = pMap;
+    failed_ = false;
+    frameSize_ = (FrameFormat::FF_TREE == format) ? pMap->GetWidth() * pMap->GetHeight() * 3 : TreeConfig::totalLedCount * 3;
+
+    headerSize_ = 0;
+    if (FrameFormat::FF_PPM == format)
+    {
+        headerSize_ = fprintf(pFile_, "P6\n%d %d\n255\n", (int)TreeConfig::totalLedCount, frameCount);
+        if (headerSize_ < 0) failed_ = true;
+    }
+    return !failed_;
+}
+
+bool FrameFile::Close()
+{
+    if (NULL == pFile_) return true;
+    bool closed = (0 == fclose(pFile_));
+    pFile_ = NULL;
+    return closed && !failed_;
+}
+
+void FrameFile::FormatFrame(const LedColor* pLeds, uint8_t* pFrame) const
+{
+    if (FrameFormat::FF_TREE == format_)
+    {
+        pMap_->Draw(pLeds, pFrame);
+        return;
+    }
+    for (int ledIndex = 0; ledIndex < TreeConfig::totalLedCount; ++ledIndex, pFrame += 3)
+    {
+        WritePixel(pFrame, pLeds[ledIndex]);
+    }
+}
+
+bool FrameFile::WriteFrames(int firstFrameIndex, const uint8_t* pFrames, int frameCount)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (NULL == pFile_ || failed_) return false;
+
+    // An hour of tree video is a few GB so the offset needs 64 bits
+    int64_t offset = headerSize_ + (int64_t)firstFrameIndex * frameSize_;
+#if defined(_MSC_VER)
+    bool seeked = (0 == _fseeki64(pFile_, offset, SEEK_SET));
+#else
+    bool seeked = (0 == fseeko(pFile_, (off_t)offset, SEEK_SET));
+#endif
+    size_t size = (size_t)frameCount * frameSize_;
+    if (!seeked || size != fwrite(pFrames, 1, size, pFile_))
+    {
+        failed_ = true;
+    }
+    return !failed_;
+}
+
+namespace
+{
+    // One worker's chunks, in frame order
+    struct ChunkQueue
+    {
+        std::mutex mutex;
+        std::deque<int> chunks;
+    };
+
+    struct RenderJob
+    {
+        const AnimatorFactory* pCreateAnimator;
+        TickCount startTime;
+        TickCount frameTicks;
+        int frameCount;
+        FrameFile* pFile;
+        int workerCount;
+        std::unique_ptr<ChunkQueue[]> queues;
+        std::atomic<int> stolenChunkCount;
+        std::atomic<bool> failed;
+    };
+}
+
+// From the front of its own queue, or the back of someone else's
+static bool TakeChunk(ChunkQueue& queue, bool steal, int& chunkIndex)
+{
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.chunks.empty()) return false;
+    if (steal)
+    {
+        chunkIndex = queue.chunks.back();
+        queue.chunks.pop_back();
+    }
+    else
+    {
+        chunkIndex = queue.chunks.front();
+        queue.chunks.pop_front();
+    }
+    return true;
+}
+
+// One worker - draws chunks with its own animator until there are none left
+static void RenderChunks(RenderJob& job, int workerIndex)
+{
+    std::unique_ptr<Animator> pAnimator((*job.pCreateAnimator)());
+    if (!pAnimator)
+    {
+        job.failed = true;
+        return;
+    }
+    std::vector<LedColor> leds(TreeConfig::totalLedCount);
+    std::vector<uint8_t> frames((size_t)renderChunkFrames * job.pFile->GetFrameSize());
+
+    int chunkIndex;
+    while (!job.failed)
+    {
+        if (!TakeChunk(job.queues[workerIndex], false, chunkIndex))
+        {
+            bool stole = false;
+            for (int offset = 1; offset < job.workerCount && !stole; ++offset)
+            {
+                stole = TakeChunk(job.queues[(workerIndex + offset) % job.workerCount], true, chunkIndex);
+            }
+            if (!stole) break;
+            job.stolenChunkCount++;
+        }
+
+        int firstFrameIndex = chunkIndex * renderChunkFrames;
+        int frameCount = std::min(renderChunkFrames, job.frameCount - firstFrameIndex);
+        for (int frameIndex = 0; frameIndex < frameCount; ++frameIndex)
+        {
+            std::fill(leds.begin(), leds.end(), color_black);
+            pAnimator->Step(job.startTime + (firstFrameIndex + frameIndex) * job.frameTicks, leds.data());
+            job.pFile->FormatFrame(leds.data(), frames.data() + (size_t)frameIndex * job.pFile->GetFrameSize());
+        }
+        if (!job.pFile->WriteFrames(firstFrameIndex, frames.data(), frameCount))
+        {
+            job.failed = true;
+        }
+    }
+}
+
+bool RenderAnimator(const AnimatorFactory& createAnimator, TickCount startTime, TickCount frameTicks, int frameCount, int threadCount, FrameFile& file, RenderStats& stats)
+{
+    // Only seekable animators can be split up
+    std::unique_ptr<Animator> pCheck(createAnimator());
+    if (!pCheck) return false;
+    if (!pCheck->IsSeekable()) threadCount = 1;
+    pCheck.reset();
+
+    int chunkCount = (frameCount + renderChunkFrames - 1) / renderChunkFrames;
+    threadCount = std::max(1, std::min(threadCount, chunkCount));
+
+    RenderJob job;
+    job.pCreateAnimator = &createAnimator;
+    job.startTime = startTime;
+    job.frameTicks = frameTicks;
+    job.frameCount = frameCount;
+    job.pFile = &file;
+    job.workerCount = threadCount;
+    job.queues.reset(new ChunkQueue[threadCount]);
+    job.stolenChunkCount = 0;
+    job.failed = false;
+
+    // Each worker gets a run of chunks next to each other so its animator
+    // mostly steps forward
+    for (int chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex)
+    {
+        job.queues[(int)((int64_t)chunkIndex * threadCount / chunkCount)].chunks.push_back(chunkIndex);
+    }
+
+    if (1 == threadCount)
+    {
+        RenderChunks(job, 0);
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for (int workerIndex = 0; workerIndex < threadCount; ++workerIndex)
+        {
+            threads.emplace_back(RenderChunks, std::ref(job), workerIndex);
+        }
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    stats.frameCount = frameCount;
+    stats.threadCount = threadCount;
+    stats.chunkCount = chunkCount;
+    stats.stolenChunkCount = job.stolenChunkCount;
+    return !job.failed;
+}
+
+int CountReplayFrames(InputLogReader& reader)
+{
+    reader.Rewind();
+    int frameCount = 0;
+    InputLogFrame frame;
+    while (reader.NextFrame(frame))
+    {
+        frameCount++;
+    }
+    reader.Rewind();
+    return frameCount;
+}
+
+bool RenderReplay(InputLogReader& reader, GameEngine& engine, FrameFile& file, RenderStats& stats)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.threadCount = 1;
+    if (!reader.IsValid()) return false;
+
+    engine.SetRandomSeed(reader.GetRandomSeed());
+    engine.SetFixedTimestep(reader.GetFixedStepTicks(), reader.GetInterpolate());
+
+    // The LEDs carry over from frame to frame like they do on the tree
+    std::vector<LedColor> leds(TreeConfig::totalLedCount, color_black);
+    std::vector<uint8_t> frames((size_t)renderChunkFrames * file.GetFrameSize());
+    int chunkFrameCount = 0;
+    bool written = true;
+
+    reader.Rewind();
+    InputLogFrame frame;
+    while (reader.NextFrame(frame) && written)
+    {
+        engine.Step(frame.time, frame.playerPosition, frame.fireButtonPressed, frame.startButtonPressed);
+        engine.SetLeds(leds.data());
+        file.FormatFrame(leds.data(), frames.data() + (size_t)chunkFrameCount * file.GetFrameSize());
+        stats.frameCount++;
+        if (++chunkFrameCount == renderChunkFrames)
+        {
+            written = file.WriteFrames(stats.frameCount - chunkFrameCount, frames.data(), chunkFrameCount);
+            chunkFrameCount = 0;
+            stats.chunkCount++;
+        }
+    }
+    if (written && chunkFrameCount > 0)
+    {
+        written = file.WriteFrames(stats.frameCount - chunkFrameCount, frames.data(), chunkFrameCount);
+        stats.chunkCount++;
+    }
+    return written;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <stdio.h>
+
+#include "../TempestInATree/src/Animator.h"
+#include "../TempestInATree/src/GameEngine.h"
+#include "../TempestInATree/src/InputLog.h"
+
+// Renders shows and replays to files of frames on the PC - for looking over
+// something like the hour long attract loop without standing in front of the
+// tree for an hour, and for reference frames to check changes against.
+//
+// Every frame in a file is the same size so each one has a fixed place in
+// it and frames can be written in any order:
+//   FF_RAW   3 bytes per LED (red, green, blue - not the strip's order), no
+//            header
+//   FF_PPM   one binary PPM with a row per frame and a column per LED - the
+//            whole show in one picture with time going down
+//   FF_TREE  rgb24 video frames of the LEDs laid out like the tree, for
+//            ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -i file
+//
+// Seekable animators (see Animator::IsSeekable) get split into chunks of
+// frames that worker threads draw with their own copy of the animator.  Each
+// worker starts with a run of chunks next to each other and once it's done
+// with those it takes chunks from the far end of another worker's run, so
+// the workers all finish about together even when some stretches of the
+// show are slower to draw.  Everything else, replays included, gets drawn
+// one frame after another on one thread.
+
+enum class FrameFormat
+{
+    FF_RAW,
+    FF_PPM,
+    FF_TREE,
+};
+
+// Where each LED goes in a picture of the tree.  The lanes come down from
+// the top of the tree to the path with the base under it.  Every LED is a
+// square of scale x scale pixels.
+class TreeFrameMap
+{
+    int width_; // in LEDs
+    int height_;
+    int scale_;
+    std::vector<int> pixelLeds_; // LED index of each spot, -1 for none
+
+    void SetLed(int x, int y, int ledIndex);
+
+public:
+    TreeFrameMap(const GameEngine& engine, int scale);
+
+    int GetWidth() const { return width_ * scale_; }
+    int GetHeight() const { return height_ * scale_; }
+
+    // pPixels gets GetWidth() x GetHeight() rgb24 pixels
+    void Draw(const LedColor* pLeds, uint8_t* pPixels) const;
+};
+
+class FrameFile
+{
+    FILE* pFile_;
+    FrameFormat format_;
+    const TreeFrameMap* pMap_;
+    int frameSize_;
+    int headerSize_;
+    bool failed_;
+    std::mutex mutex_;
+
+public:
+    FrameFile();
+    ~FrameFile();
+
+    // pMap is only needed for FF_TREE and has to outlive the file
+    bool Open(const char* pFileName, FrameFormat format, int frameCount, const TreeFrameMap* pMap);
+    // False if any write failed
+    bool Close();
+
+    int GetFrameSize() const { return frameSize_; }
+
+    // The bytes for a frame of LEDs
+    void FormatFrame(const LedColor* pLeds, uint8_t* pFrame) const;
+
+    // frameCount formatted frames starting at firstFrameIndex.  Any thread.
+    bool WriteFrames(int firstFrameIndex, const uint8_t* pFrames, int frameCount);
+};
+
+// Makes a copy of the animator for a worker.  Called on the worker threads.
+typedef std::function<Animator*()> AnimatorFactory;
+
+struct RenderStats
+{
+    int frameCount;
+    int threadCount;
+    int chunkCount;
+    int stolenChunkCount; // chunks a worker took from another worker's run
+};
+
+// Draws frameCount frames frameTicks apart from startTime, each over black,
+// into file.  Uses threadCount workers if the animator is seekable.
+bool RenderAnimator(const AnimatorFactory& createAnimator, TickCount startTime, TickCount frameTicks, int frameCount, int threadCount, FrameFile& file, RenderStats& stats);
+
+// Frames in the log, for opening the file
+int CountReplayFrames(InputLogReader& reader);
+
+// Plays the log on engine like InputLogReader::Replay and writes what every
+// frame drew
+bool RenderReplay(InputLogReader& reader, GameEngine& engine, FrameFile& file, RenderStats& stats);
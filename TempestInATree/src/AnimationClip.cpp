@@ -0,0 +1,312 @@
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AnimationClip.h"
+
+static void WriteClipInt(std::vector<uint8_t>& clip, uint32_t value, int byteCount)
+{
+    for (int byteIndex = 0; byteIndex < byteCount; ++byteIndex)
+    {
+        clip.push_back((uint8_t)(value >> (8 * byteIndex)));
+    }
+}
+
+static void SetClipInt(std::vector<uint8_t>& clip, int offset, uint32_t value, int byteCount)
+{
+    for (int byteIndex = 0; byteIndex < byteCount; ++byteIndex)
+    {
+        clip[offset + byteIndex] = (uint8_t)(value >> (8 * byteIndex));
+    }
+}
+
+static uint32_t ReadClipInt(const uint8_t* p, int byteCount)
+{
+    uint32_t value = 0;
+    for (int byteIndex = 0; byteIndex < byteCount; ++byteIndex)
+    {
+        value |= (uint32_t)p[byteIndex] << (8 * byteIndex);
+    }
+    return value;
+}
+
+static void WriteClipVarint(std::vector<uint8_t>& clip, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        clip.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    clip.push_back((uint8_t)value);
+}
+
+static void WriteClipRun(std::vector<uint8_t>& clip, AnimationClipRun run, const LedColor* pColors, int ledCount)
+{
+    WriteClipVarint(clip, ((uint32_t)ledCount << 2) | run);
+    int colorCount = (ACR_LITERAL == run) ? ledCount : (ACR_FILL == run) ? 1 : 0;
+    for (int colorIndex = 0; colorIndex < colorCount; ++colorIndex)
+    {
+        clip.push_back(Red(pColors[colorIndex]));
+        clip.push_back(Green(pColors[colorIndex]));
+        clip.push_back(Blue(pColors[colorIndex]));
+    }
+}
+
+// pPrevious is NULL for a keyframe
+static void WriteClipFrame(std::vector<uint8_t>& clip, const LedColor* pFrame, const LedColor* pPrevious, int ledCount)
+{
+    int ledIndex = 0;
+    while (ledIndex < ledCount)
+    {
+        int runEnd = ledIndex + 1;
+        if (NULL != pPrevious && pFrame[ledIndex] == pPrevious[ledIndex])
+        {
+            while (runEnd < ledCount && pFrame[runEnd] == pPrevious[runEnd]) runEnd++;
+            WriteClipRun(clip, ACR_SKIP, NULL, runEnd - ledIndex);
+        }
+        else
+        {
+            while (runEnd < ledCount && pFrame[runEnd] == pFrame[ledIndex]) runEnd++;
+            if (runEnd - ledIndex > 1)
+            {
+                WriteClipRun(clip, ACR_FILL, pFrame + ledIndex, runEnd - ledIndex);
+            }
+            else
+            {
+                // Changed LEDs up to the next run of one color or the next
+                // LED that didn't change
+                while (runEnd < ledCount &&
+                    (NULL == pPrevious || pFrame[runEnd] != pPrevious[runEnd]) &&
+                    (runEnd + 1 >= ledCount || pFrame[runEnd + 1] != pFrame[runEnd]))
+                {
+                    runEnd++;
+                }
+                WriteClipRun(clip, ACR_LITERAL, pFrame + ledIndex, runEnd - ledIndex);
+            }
+        }
+        ledIndex = runEnd;
+    }
+}
+
+bool BakeAnimationClip(Animator& animator, int ledCount, TickCount frameTicks, int keyframeInterval, std::vector<uint8_t>& clip)
+{
+    clip.clear();
+    if (frameTicks == 0 || frameTicks > 0xFFFF || keyframeInterval <= 0 || keyframeInterval > 0xFFFF) return false;
+
+    int frameCount = (int)((animator.duration() + frameTicks - 1) / frameTicks);
+    if (frameCount <= 0) frameCount = 1;
+
+    // Step through once to find the LEDs the animator ever touches, then
+    // again to write the frames.  Only the frame before is kept so a long
+    // show doesn't need all of its frames in memory.
+    std::vector<LedColor> frame(ledCount);
+    std::vector<LedColor> previousFrame(ledCount);
+    LedSpanList spans;
+    int startLedIndex = ledCount;
+    int endLedIndex = 0;
+    for (int frameIndex = 0; frameIndex < frameCount; ++frameIndex)
+    {
+        std::fill(frame.begin(), frame.end(), color_black);
+        spans.Clear();
+        animator.StepSpans(frameIndex * frameTicks, frame.data(), spans);
+        for (int spanIndex = 0; spanIndex < spans.GetCount(); ++spanIndex)
+        {
+            if (spans[spanIndex].startLedIndex < startLedIndex) startLedIndex = spans[spanIndex].startLedIndex;
+        }
+        if (spans.GetEndLedIndex() > endLedIndex) endLedIndex = spans.GetEndLedIndex();
+    }
+    if (endLedIndex > ledCount) endLedIndex = ledCount;
+    if (startLedIndex >= endLedIndex) return false;
+    int clipLedCount = endLedIndex - startLedIndex;
+
+    int keyframeCount = (frameCount + keyframeInterval - 1) / keyframeInterval;
+    WriteClipInt(clip, animationClipMagic, 4);
+    WriteClipInt(clip, animationClipVersion, 1);
+    WriteClipInt(clip, 0, 1);
+    WriteClipInt(clip, frameTicks, 2);
+    WriteClipInt(clip, startLedIndex, 2);
+    WriteClipInt(clip, clipLedCount, 2);
+    WriteClipInt(clip, frameCount, 4);
+    WriteClipInt(clip, keyframeInterval, 2);
+    WriteClipInt(clip, 0, 2);
+    int keyframeTableOffset = (int)clip.size();
+    clip.resize(clip.size() + keyframeCount * 4);
+
+    for (int frameIndex = 0; frameIndex < frameCount; ++frameIndex)
+    {
+        std::swap(frame, previousFrame);
+        std::fill(frame.begin(), frame.end(), color_black);
+        spans.Clear();
+        animator.StepSpans(frameIndex * frameTicks, frame.data(), spans);
+        for (int ledIndex = startLedIndex; ledIndex < endLedIndex; ++ledIndex)
+        {
+            frame[ledIndex] &= 0x00FFFFFF;
+        }
+
+        if (0 == frameIndex % keyframeInterval)
+        {
+            SetClipInt(clip, keyframeTableOffset + (frameIndex / keyframeInterval) * 4, (uint32_t)clip.size(), 4);
+            WriteClipFrame(clip, frame.data() + startLedIndex, NULL, clipLedCount);
+        }
+        else
+        {
+            WriteClipFrame(clip, frame.data() + startLedIndex, previousFrame.data() + startLedIndex, clipLedCount);
+        }
+    }
+    return true;
+}
+
+ClipAnimator::ClipAnimator(const uint8_t* pClip, int clipSize, int ledCount) :
+    pClip_(pClip),
+    clipSize_(clipSize),
+    valid_(false),
+    frameTicks_(1),
+    startLedIndex_(0),
+    ledCount_(0),
+    frameCount_(0),
+    keyframeInterval_(1),
+    frameIndex_(-1),
+    readOffset_(0)
+{
+    if (clipSize < animationClipHeaderSize) return;
+    if (ReadClipInt(pClip, 4) != animationClipMagic || pClip[4] != animationClipVersion) return;
+
+    frameTicks_ = (TickCount)ReadClipInt(pClip + 6, 2);
+    startLedIndex_ = (LedIndex)ReadClipInt(pClip + 8, 2);
+    ledCount_ = (LedCount)ReadClipInt(pClip + 10, 2);
+    frameCount_ = (int)ReadClipInt(pClip + 12, 4);
+    keyframeInterval_ = (int)ReadClipInt(pClip + 16, 2);
+    if (frameTicks_ == 0 || ledCount_ == 0 || frameCount_ <= 0 || keyframeInterval_ <= 0) return;
+    if (startLedIndex_ + ledCount_ > ledCount) return;
+
+    // The frames get checked as they're decoded, so only the keyframe table
+    // here - the first keyframe straight after it and the rest in order
+    int keyframeCount = (frameCount_ + keyframeInterval_ - 1) / keyframeInterval_;
+    if (keyframeCount > (clipSize - animationClipHeaderSize) / 4) return;
+    uint32_t previousOffset = 0;
+    for (int keyframeIndex = 0; keyframeIndex < keyframeCount; ++keyframeIndex)
+    {
+        uint32_t offset = KeyframeOffset(keyframeIndex);
+        if ((0 == keyframeIndex) ? offset != (uint32_t)(animationClipHeaderSize + keyframeCount * 4) : offset <= previousOffset) return;
+        if (offset >= (uint32_t)clipSize) return;
+        previousOffset = offset;
+    }
+
+    frame_.assign(ledCount_, color_black);
+    valid_ = true;
+    duration_ = frameCount_ * frameTicks_;
+}
+
+uint32_t ClipAnimator::KeyframeOffset(int keyframeIndex) const
+{
+    return ReadClipInt(pClip_ + animationClipHeaderSize + keyframeIndex * 4, 4);
+}
+
+bool ClipAnimator::ReadVarint(uint32_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 32; shift += 7)
+    {
+        if (readOffset_ >= clipSize_) return false;
+        uint8_t b = pClip_[readOffset_++];
+        value |= (uint32_t)(b & 0x7F) << shift;
+        if (0 == (b & 0x80)) return true;
+    }
+    return false;
+}
+
+// Applies the frame at readOffset_ to frame_
+bool ClipAnimator::DecodeFrame(bool& changed)
+{
+    int ledIndex = 0;
+    while (ledIndex < ledCount_)
+    {
+        uint32_t header;
+        if (!ReadVarint(header)) return false;
+        int runLedCount = (int)(header >> 2);
+        if (runLedCount <= 0 || runLedCount > ledCount_ - ledIndex) return false;
+
+        LedColor* pLed = frame_.data() + ledIndex;
+        switch (header & 3)
+        {
+            case ACR_SKIP:
+                break;
+
+            case ACR_FILL:
+            {
+                if (readOffset_ + 3 > clipSize_) return false;
+                const uint8_t* p = pClip_ + readOffset_;
+                LedColor color = ((LedColor)p[0] << 16) | ((LedColor)p[1] << 8) | p[2];
+                for (int i = 0; i < runLedCount; ++i)
+                {
+                    pLed[i] = color;
+                }
+                readOffset_ += 3;
+                changed = true;
+                break;
+            }
+
+            case ACR_LITERAL:
+            {
+                if (readOffset_ + (3 * runLedCount) > clipSize_) return false;
+                const uint8_t* p = pClip_ + readOffset_;
+                for (int i = 0; i < runLedCount; ++i, p += 3)
+                {
+                    pLed[i] = ((LedColor)p[0] << 16) | ((LedColor)p[1] << 8) | p[2];
+                }
+                readOffset_ += 3 * runLedCount;
+                changed = true;
+                break;
+            }
+
+            default:
+                return false;
+        }
+        ledIndex += runLedCount;
+    }
+    return true;
+}
+
+bool ClipAnimator::SeekFrame(int frameIndex, bool& changed)
+{
+    int keyframeIndex = frameIndex / keyframeInterval_;
+    if (frameIndex < frameIndex_ || frameIndex_ < 0 || frameIndex_ < keyframeIndex * keyframeInterval_)
+    {
+        // Start over from the keyframe
+        readOffset_ = (int)KeyframeOffset(keyframeIndex);
+        frameIndex_ = keyframeIndex * keyframeInterval_ - 1;
+        changed = true;
+    }
+
+    while (frameIndex_ < frameIndex)
+    {
+        // Decoding up to a keyframe has to end where the table says it starts
+        int nextFrameIndex = frameIndex_ + 1;
+        if (0 == nextFrameIndex % keyframeInterval_ && (uint32_t)readOffset_ != KeyframeOffset(nextFrameIndex / keyframeInterval_)) return false;
+        if (!DecodeFrame(changed)) return false;
+        frameIndex_ = nextFrameIndex;
+    }
+    return true;
+}
+
+bool ClipAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+{
+    if (!valid_) return false;
+
+    int frameIndex = (int)(localTime / frameTicks_);
+    if (frameIndex >= frameCount_) frameIndex = frameCount_ - 1;
+
+    bool changed = false;
+    if (frameIndex != frameIndex_ && !SeekFrame(frameIndex, changed))
+    {
+        // The clip is broken from here on - draw nothing
+        valid_ = false;
+        return true;
+    }
+
+    memcpy(pColors + startLedIndex_, frame_.data(), ledCount_ * sizeof(LedColor));
+    spans.Add(startLedIndex_, ledCount_);
+    return changed;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Animator.h"
+
+// Animations baked into a clip ahead of time.  Shows like the Christmas
+// lights and the game transitions only depend on the time so there's no
+// need to work them out every frame - BakeAnimationClip renders one at a
+// fixed frame rate on the PC (the BatchSimulator's -bake option does it for
+// the tree's shows) and ClipAnimator plays the clip back with little more
+// than a memcpy per frame.  A clip is plain bytes so it can be a const array
+// that stays in flash on the tree or a file read into memory on the PC.
+//
+// Each frame only covers the LEDs the animation ever wrote and most frames
+// only store what changed since the frame before.  Every keyframeInterval
+// frames there's a keyframe that stands on its own so playback can jump
+// around without decoding from the start.
+//
+// Clip format, all values little endian:
+//   uint32  animationClipMagic
+//   uint8   animationClipVersion
+//   uint8   0
+//   uint16  frame ticks
+//   uint16  start LED index
+//   uint16  LED count
+//   uint32  frame count
+//   uint16  keyframe interval
+//   uint16  0
+//   uint32  offset of each keyframe from the start of the clip
+//   frames, one after the other.  A frame is a list of runs that add up to
+//   the LED count, each a varint of (LED count << 2) | ACR_* followed by:
+//     ACR_SKIP     nothing - the LEDs keep their color from the last frame
+//     ACR_FILL     uint8 red, green, blue for the whole run
+//     ACR_LITERAL  uint8 red, green, blue for each LED
+//   Keyframes have no ACR_SKIP runs.
+// Colors are stored as 24 bits - the strip ignores the top byte anyway.
+const uint32_t animationClipMagic = 0x504C4341; // "ACLP"
+const uint8_t animationClipVersion = 1;
+const int animationClipHeaderSize = 20;
+
+enum AnimationClipRun
+{
+    ACR_SKIP = 0,
+    ACR_FILL = 1,
+    ACR_LITERAL = 2,
+};
+
+// Steps animator from 0 up to its duration every frameTicks, each time over
+// black LEDs, and writes the clip.  ledCount is how many LEDs the animator
+// draws into.  Returns false if the animator never wrote anything.
+bool BakeAnimationClip(Animator& animator, int ledCount, TickCount frameTicks, int keyframeInterval, std::vector<uint8_t>& clip);
+
+// Plays a clip.  The clip isn't copied so it has to outlive the animator.
+//
+// The caller clears what an animator wrote between frames so the animator
+// keeps its own copy of the current frame to apply the next frame's changes
+// to.  Stepping forward a frame or two decodes just those frames, anything
+// else goes back to the closest keyframe first.
+class ClipAnimator : public Animator
+{
+    const uint8_t* pClip_;
+    int clipSize_;
+    bool valid_;
+    TickCount frameTicks_;
+    LedIndex startLedIndex_;
+    LedCount ledCount_;
+    int frameCount_;
+    int keyframeInterval_;
+
+    ArenaVector<LedColor> frame_;
+    int frameIndex_; // what frame_ holds, -1 for nothing yet
+    int readOffset_; // start of frame frameIndex_ + 1
+
+    uint32_t KeyframeOffset(int keyframeIndex) const;
+    bool ReadVarint(uint32_t& value);
+    bool DecodeFrame(bool& changed);
+    bool SeekFrame(int frameIndex, bool& changed);
+
+public:
+    // ledCount is how many LEDs StepSpans gets - a clip that draws past them
+    // isn't valid.  Only the header and keyframe table get checked here, the
+    // frames are checked as they play so a long clip doesn't cost its whole
+    // length to start.
+    ClipAnimator(const uint8_t* pClip, int clipSize, int ledCount);
+
+    bool IsValid() const { return valid_; }
+    TickCount GetFrameTicks() const { return frameTicks_; }
+    int GetFrameCount() const { return frameCount_; }
+    LedIndex GetStartLedIndex() const { return startLedIndex_; }
+    LedCount GetLedCount() const { return ledCount_; }
+
+    // Draws the frame for localTime.  Draws nothing if the clip isn't valid
+    // or once a frame turns out to be broken.
+    virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+};
@@ -1,19 +1,17 @@
 #include <vector>
 #include <memory>
+#include <new>
+#include <algorithm>
+#include <string.h>
 
 #include "Animator.h"
+#include "ColorKernels.h"
 
 
 
 LedColor ScaleColor(float scale, LedColor color)
 {
-	LedColor retval = 0;
-
-	retval |= (uint8_t)((float)Red(color) * scale) << 16;
-	retval |= (uint8_t)((float)Green(color) * scale) << 8;
-	retval |= (uint8_t)((float)Blue(color) * scale) << 0;
-
-	return retval;
+	return ScaleColorFixed(ColorScaleFromFloat(scale), color);
 }
 
 void ScalePattern(float scale, std::vector<LedColor>& pattern)
@@ -24,8 +22,180 @@ void ScalePattern(float scale, std::vector<LedColor>& pattern)
     }
 }
 
+AnimatorGroup* CreateChristmasLightsAnimator(LedCount ledCount, float powerScale, TickCount patternDuration)
+{
+	AnimatorGroup* pGroup = new AnimatorGroup();
+
+	std::vector<LedColor> pattern = {color_white, color_black, color_black, color_green, color_black, color_black, color_blue, color_black, color_black, color_red, color_black, color_black};
+	ScalePattern(powerScale, pattern);
+	auto pRep = new RepeatedPatternAnimator(patternDuration, 0, ledCount, pattern);
+	auto pFade = new FadeAnimator(1000, patternDuration - 2000, 1000, 0, ledCount, pRep);
+	pGroup->AppendAnimator(pFade);
+
+	// All leds black for a second
+	pGroup->AppendAnimator(new SolidColor(1000, 0, ledCount, color_black));
+	return pGroup;
+}
+
+void LedSpanList::Add(int startLedIndex, int ledCount)
+{
+	if (ledCount <= 0)
+	{
+		return;
+	}
+	int endLedIndex = startLedIndex + ledCount;
+
+	// Skip the spans that end before this one starts
+	int spanIndex = 0;
+	while (spanIndex < spanCount_ && spans_[spanIndex].startLedIndex + spans_[spanIndex].ledCount < startLedIndex)
+	{
+		++spanIndex;
+	}
+
+	// Swallow the spans it overlaps or touches
+	int mergeEndIndex = spanIndex;
+	while (mergeEndIndex < spanCount_ && spans_[mergeEndIndex].startLedIndex <= endLedIndex)
+	{
+		int spanEnd = spans_[mergeEndIndex].startLedIndex + spans_[mergeEndIndex].ledCount;
+		if (spans_[mergeEndIndex].startLedIndex < startLedIndex) startLedIndex = spans_[mergeEndIndex].startLedIndex;
+		if (spanEnd > endLedIndex) endLedIndex = spanEnd;
+		++mergeEndIndex;
+	}
+
+	if (mergeEndIndex > spanIndex)
+	{
+		memmove(spans_ + spanIndex + 1, spans_ + mergeEndIndex, (spanCount_ - mergeEndIndex) * sizeof(LedSpan));
+		spanCount_ -= (mergeEndIndex - spanIndex) - 1;
+	}
+	else
+	{
+		memmove(spans_ + spanIndex + 1, spans_ + spanIndex, (spanCount_ - spanIndex) * sizeof(LedSpan));
+		spanCount_++;
+	}
+	spans_[spanIndex].startLedIndex = (LedIndex)startLedIndex;
+	spans_[spanIndex].ledCount = (LedCount)(endLedIndex - startLedIndex);
+
+	if (spanCount_ > maxSpanCount)
+	{
+		// Out of room - merge the two spans with the smallest gap between them
+		int bestIndex = 0;
+		int bestGap = INT32_MAX;
+		for (int gapIndex = 0; gapIndex + 1 < spanCount_; ++gapIndex)
+		{
+			int gap = spans_[gapIndex + 1].startLedIndex - (spans_[gapIndex].startLedIndex + spans_[gapIndex].ledCount);
+			if (gap < bestGap)
+			{
+				bestGap = gap;
+				bestIndex = gapIndex;
+			}
+		}
+		spans_[bestIndex].ledCount = (LedCount)((spans_[bestIndex + 1].startLedIndex + spans_[bestIndex + 1].ledCount) - spans_[bestIndex].startLedIndex);
+		memmove(spans_ + bestIndex + 1, spans_ + bestIndex + 2, (spanCount_ - (bestIndex + 2)) * sizeof(LedSpan));
+		spanCount_--;
+	}
+}
+
+void LedSpanList::Add(const LedSpanList& other)
+{
+	for (int spanIndex = 0; spanIndex < other.spanCount_; ++spanIndex)
+	{
+		Add(other.spans_[spanIndex].startLedIndex, other.spans_[spanIndex].ledCount);
+	}
+}
+
+// The drawing for each kind of animator.  The animators and RenderProgram
+// both use these so the two always draw exactly the same thing.
+
+static void PaintSolid(LedColor* pColors, int startLedIndex, int ledCount, LedColor color)
+{
+	FillColors(pColors + startLedIndex, ledCount, color);
+}
+
+// Repeats the pattern over the LEDs starting patternIndex into it
+static void PaintPattern(LedColor* pColors, int startLedIndex, int ledCount, const LedColor* pPattern, int patternSize, int patternIndex)
+{
+	RepeatPattern(pColors + startLedIndex, ledCount, pPattern, patternSize, patternIndex);
+}
+
+// The pattern moves one LED toward the end every step
+static int ChasePatternIndex(TickCount localTime, TickCount stepTicks, int patternSize)
+{
+	uint32_t stepIndex = localTime / stepTicks;
+	return (patternSize - 1) - (int)(stepIndex % patternSize);
+}
+
+static int SingleChaseTicksPerStep(TickCount duration, int ledCount, int width)
+{
+	int stepCount = ledCount + width;
+	int ticksPerStep = duration / stepCount;
+	return (ticksPerStep == 0) ? 1 : ticksPerStep;
+}
+
+// Draws the part of the pattern that's on the LEDs
+static void PaintSingleChase(LedColor* pColors, int startLedIndex, int ledCount, const LedColor* pPattern, int patternSize, int stepIndex, LedSpanList& spans)
+{
+	int patternPosition = -(patternSize / 2) + stepIndex;
+	for (int iPatternLed = 0; iPatternLed < patternSize; ++iPatternLed)
+	{
+		int iDestination = patternPosition + iPatternLed;
+		if (iDestination >= 0 && iDestination < ledCount)
+		{
+			pColors[startLedIndex + iDestination] = pPattern[iPatternLed];
+		}
+	}
+
+	int firstLed = (patternPosition > 0) ? patternPosition : 0;
+	int endLed = patternPosition + patternSize;
+	if (endLed > ledCount)
+	{
+		endLed = ledCount;
+	}
+	spans.Add(startLedIndex + firstLed, endLed - firstLed);
+}
+
+static int FillInTicksPerStep(TickCount duration, int ledCount)
+{
+	int ticksPerStep = duration / ledCount;
+	return (ticksPerStep == 0) ? 1 : ticksPerStep;
+}
+
+// How many LEDs are filled in
+static int FillInStepIndex(TickCount localTime, int ticksPerStep, int ledCount)
+{
+	int stepIndex = localTime / ticksPerStep;
+	// duration doesn't always divide evenly by the LED count
+	return (stepIndex > ledCount) ? ledCount : stepIndex;
+}
+
+// Each range gets the next color, starting with colorIndex
+static void PaintRanges(LedColor* pColors, const LedSpan* pRanges, int rangeCount, const LedColor* pRangeColors, int colorCount, int colorIndex, LedSpanList& spans)
+{
+	for (const LedSpan* pRange = pRanges; pRange < pRanges + rangeCount; ++pRange)
+	{
+		PaintSolid(pColors, pRange->startLedIndex, pRange->ledCount, pRangeColors[colorIndex % colorCount]);
+		spans.Add(pRange->startLedIndex, pRange->ledCount);
+		colorIndex = (colorIndex + 1) % colorCount;
+	}
+}
+
+// Scales whatever is on the LEDs, not just what the faded animator drew
+static void PaintFade(LedColor* pColors, int startLedIndex, int ledCount, ColorScale scale, LedSpanList& spans)
+{
+	if (scale == colorScaleOne)
+	{
+		return;
+	}
+	ScaleColors(pColors + startLedIndex, ledCount, scale);
+	spans.Add(startLedIndex, ledCount);
+}
+
 AnimatorGroup::AnimatorGroup() :
-	duration_override_(0)
+	duration_override_(0),
+	childrenEnd_(0),
+	timelineValid_(false),
+	nextStart_(0),
+	lastLocalTime_(0),
+	longestChildDuration_(0)
 {
 
 }
@@ -35,6 +205,32 @@ Animator::~Animator()
 
 }
 
+// Each animator starts with the arena it came from so delete knows whether
+// there's anything to free
+union AnimatorAllocationHeader
+{
+	AnimatorArena* pArena;
+	double alignment;
+};
+
+void* Animator::operator new(size_t size)
+{
+	AnimatorArena* pArena = AnimatorArena::GetCurrent();
+	size_t allocationSize = sizeof(AnimatorAllocationHeader) + size;
+	AnimatorAllocationHeader* pHeader = (AnimatorAllocationHeader*)((NULL != pArena) ?
+		pArena->Allocate(allocationSize, alignof(AnimatorAllocationHeader)) : ::operator new(allocationSize, std::nothrow));
+	if (NULL == pHeader) AnimatorArena::OutOfMemory(allocationSize);
+	pHeader->pArena = pArena;
+	return pHeader + 1;
+}
+
+void Animator::operator delete(void* p)
+{
+	if (NULL == p) return;
+	AnimatorAllocationHeader* pHeader = (AnimatorAllocationHeader*)p - 1;
+	if (NULL == pHeader->pArena) ::operator delete(pHeader);
+}
+
 AnimatorGroup::~AnimatorGroup()
 {
 	while (!animators_.empty())
@@ -49,21 +245,18 @@ void AnimatorGroup::AddAnimator(Animator* pAnimator, TickCount startTime)
 {
 	AnimatorInfo info(pAnimator, startTime);
 	animators_.push_back(info);
+	timelineValid_ = false;
 
 	// Update the duration - the end of the last animation to complete
-	TickCount maxTickCount = 0;
-	for (auto animatorInfo = animators_.begin(); animatorInfo != animators_.end(); ++animatorInfo)
+	TickCount animationEnd = startTime + pAnimator->duration();
+	if (animationEnd > childrenEnd_)
 	{
-		TickCount animationEnd = animatorInfo->startTime + animatorInfo->pAnimator->duration();
-		if (animationEnd > maxTickCount)
-		{
-			maxTickCount = animationEnd;
-		}
+		childrenEnd_ = animationEnd;
 	}
 
 	if (duration_override_ == 0)
 	{
-		duration_ = maxTickCount;
+		duration_ = childrenEnd_;
 	}
 	else
 	{
@@ -82,75 +275,209 @@ void AnimatorGroup::OverrideDuration(TickCount forced_duration)
 	duration_ = duration_override_;
 }
 
-void AnimatorGroup::Step(TickCount localTime, LedColor* pColors)
+void AnimatorGroup::BuildTimeline()
 {
-	for (auto animatorInfo = animators_.begin(); animatorInfo != animators_.end(); ++animatorInfo)
+	timeline_.resize(animators_.size());
+	longestChildDuration_ = 0;
+	for (int animatorIndex = 0; animatorIndex < (int)animators_.size(); ++animatorIndex)
 	{
-		if (localTime >= animatorInfo->startTime && localTime < animatorInfo->startTime + animatorInfo->pAnimator->duration())
+		timeline_[animatorIndex] = animatorIndex;
+		TickCount childDuration = animators_[animatorIndex].pAnimator->duration();
+		if (childDuration > longestChildDuration_)
 		{
-			animatorInfo->pAnimator->Step(localTime - animatorInfo->startTime, pColors);
+			longestChildDuration_ = childDuration;
 		}
 	}
+	std::stable_sort(timeline_.begin(), timeline_.end(), [this](int a, int b) { return animators_[a].startTime < animators_[b].startTime; });
+	timelineValid_ = true;
 }
 
-FadeAnimator::FadeAnimator(TickCount fadeInDuration, TickCount holdDuration, TickCount fadeOutDuration, LedIndex startLedIndex, LedCount ledCount, Animator* childAnimator) :
-	fadeInDuration_(fadeInDuration), holdDuration_(holdDuration), fadeOutDuration_(fadeOutDuration),
-	startLedIndex_(startLedIndex), ledCount_(ledCount),
-	childAnimator_(childAnimator)
+// Finds the running children from scratch.  Anything running at localTime
+// started no more than the longest child's duration ago, so a binary search
+// on the start times skips everything before that.
+void AnimatorGroup::SeekTimeline(TickCount localTime)
 {
-	// Special case: holdDuration of 0 makes the whole fade animator duration be
-	// the duration of the child (maybe have a seperate constructor for this...)
-	if (holdDuration_ == 0)
+	auto startsBefore = [this](int animatorIndex, TickCount time) { return animators_[animatorIndex].startTime < time; };
+	auto startsAfter = [this](TickCount time, int animatorIndex) { return time < animators_[animatorIndex].startTime; };
+	nextStart_ = std::upper_bound(timeline_.begin(), timeline_.end(), localTime, startsAfter) - timeline_.begin();
+	TickCount earliestStart = (localTime > longestChildDuration_) ? localTime - longestChildDuration_ : 0;
+	size_t timelineIndex = std::lower_bound(timeline_.begin(), timeline_.begin() + nextStart_, earliestStart, startsBefore) - timeline_.begin();
+
+	nextActive_.clear();
+	for (; timelineIndex < nextStart_; ++timelineIndex)
 	{
-		holdDuration_ = childAnimator_->duration() - (fadeInDuration_ + fadeOutDuration_);
+		const AnimatorInfo& info = animators_[timeline_[timelineIndex]];
+		if (localTime < info.startTime + info.pAnimator->duration())
+		{
+			nextActive_.push_back(timeline_[timelineIndex]);
+		}
 	}
-
-	duration_ = fadeInDuration_ + holdDuration_ + fadeOutDuration_;
+	std::sort(nextActive_.begin(), nextActive_.end());
 }
 
-void FadeAnimator::Step(TickCount localTime, LedColor* pColors)
+// Time moved forward - drop the children that finished and pick up the ones
+// that started
+void AnimatorGroup::AdvanceTimeline(TickCount localTime)
 {
-	childAnimator_->Step(localTime, pColors);
-	if (localTime < fadeInDuration_)
+	nextActive_.clear();
+	for (int animatorIndex : active_)
 	{
-		float scale = (float)localTime / (float)fadeInDuration_;
-		for (LedIndex ledIndex = startLedIndex_; ledIndex < startLedIndex_ + ledCount_; ++ledIndex)
+		const AnimatorInfo& info = animators_[animatorIndex];
+		if (localTime < info.startTime + info.pAnimator->duration())
 		{
-			pColors[ledIndex] = ScaleColor(scale, pColors[ledIndex]);
+			nextActive_.push_back(animatorIndex);
 		}
 	}
-	else if (localTime < fadeInDuration_ + holdDuration_)
+
+	size_t stillRunningCount = nextActive_.size();
+	for (; nextStart_ < timeline_.size() && animators_[timeline_[nextStart_]].startTime <= localTime; ++nextStart_)
+	{
+		const AnimatorInfo& info = animators_[timeline_[nextStart_]];
+		if (localTime < info.startTime + info.pAnimator->duration())
+		{
+			nextActive_.push_back(timeline_[nextStart_]);
+		}
+	}
+	if (nextActive_.size() > stillRunningCount)
+	{
+		std::sort(nextActive_.begin(), nextActive_.end());
+	}
+}
+
+bool AnimatorGroup::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+{
+	if (!timelineValid_)
+	{
+		BuildTimeline();
+		SeekTimeline(localTime);
+	}
+	else if (localTime < lastLocalTime_)
 	{
-		// nothing to do
+		SeekTimeline(localTime);
 	}
 	else
 	{
-		float scale = 1.0f - ((float)(localTime - (fadeInDuration_ + holdDuration_)) / (float)fadeOutDuration_);
-		for (LedIndex ledIndex = startLedIndex_; ledIndex < startLedIndex_ + ledCount_; ++ledIndex)
+		AdvanceTimeline(localTime);
+	}
+	lastLocalTime_ = localTime;
+
+	// Starting or stopping a child changes the group's output
+	bool changed = false;
+	for (int animatorIndex : active_)
+	{
+		if (!std::binary_search(nextActive_.begin(), nextActive_.end(), animatorIndex))
+		{
+			animators_[animatorIndex].active = false;
+			changed = true;
+		}
+	}
+	active_.swap(nextActive_);
+
+	// The children add to the same list, which merges their spans
+	for (int animatorIndex : active_)
+	{
+		AnimatorInfo& info = animators_[animatorIndex];
+		changed |= !info.active;
+		info.active = true;
+		changed |= info.pAnimator->StepSpans(localTime - info.startTime, pColors, spans);
+	}
+	return changed;
+}
+
+bool AnimatorGroup::IsSeekable() const
+{
+	for (const AnimatorInfo& info : animators_)
+	{
+		if (!info.pAnimator->IsSeekable()) return false;
+	}
+	return true;
+}
+
+void AnimatorGroup::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	// Each child only runs in its slice of the group's window
+	for (auto animatorInfo = animators_.begin(); animatorInfo != animators_.end(); ++animatorInfo)
+	{
+		TickCount childOrigin = timeOrigin + animatorInfo->startTime;
+		TickCount childEnd = childOrigin + animatorInfo->pAnimator->duration();
+		TickCount childWindowStart = (childOrigin > windowStart) ? childOrigin : windowStart;
+		TickCount childWindowEnd = (childEnd < windowEnd) ? childEnd : windowEnd;
+		if (childWindowStart < childWindowEnd)
 		{
-			pColors[ledIndex] = ScaleColor(scale, pColors[ledIndex]);
+			animatorInfo->pAnimator->Compile(program, childOrigin, childWindowStart, childWindowEnd);
 		}
 	}
 }
 
+FadeAnimator::FadeAnimator(TickCount fadeInDuration, TickCount holdDuration, TickCount fadeOutDuration, LedIndex startLedIndex, LedCount ledCount, Animator* childAnimator) :
+	fadeInDuration_(fadeInDuration), holdDuration_(holdDuration), fadeOutDuration_(fadeOutDuration),
+	startLedIndex_(startLedIndex), ledCount_(ledCount),
+	childAnimator_(childAnimator),
+	lastScale_(-1)
+{
+	// Special case: holdDuration of 0 makes the whole fade animator duration be
+	// the duration of the child (maybe have a seperate constructor for this...)
+	if (holdDuration_ == 0)
+	{
+		holdDuration_ = childAnimator_->duration() - (fadeInDuration_ + fadeOutDuration_);
+	}
+
+	duration_ = fadeInDuration_ + holdDuration_ + fadeOutDuration_;
+}
+
+bool FadeAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+{
+	bool changed = childAnimator_->StepSpans(localTime, pColors, spans);
+
+	ColorScale scale = FadeScale(localTime, fadeInDuration_, holdDuration_, fadeOutDuration_);
+	PaintFade(pColors, startLedIndex_, ledCount_, scale, spans);
+
+	changed |= (scale != lastScale_);
+	lastScale_ = scale;
+	return changed;
+}
+
+void FadeAnimator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	// The child's ops come first so the fade scales what they drew
+	childAnimator_->Compile(program, timeOrigin, windowStart, windowEnd);
+
+	RenderOp& op = program.AddOp(RenderOpType::RO_FADE, timeOrigin, windowStart, windowEnd);
+	op.startLedIndex = startLedIndex_;
+	op.ledCount = ledCount_;
+	op.fadeInDuration = fadeInDuration_;
+	op.holdDuration = holdDuration_;
+	op.fadeOutDuration = fadeOutDuration_;
+}
+
 SolidColor::SolidColor(TickCount duration, LedIndex startLedIndex, LedCount ledCount, LedColor color) :
 	startLedIndex(startLedIndex),
 	ledCount(ledCount),
-	color(color)
+	color(color),
+	stepped_(false)
 {
 	duration_ = duration;
 }
 
-void SolidColor::Step(TickCount localTime, LedColor* pColors)
+bool SolidColor::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
 {
-	LedColor* pEnd = pColors + startLedIndex + ledCount;
-	for (LedColor* pScan = pColors + startLedIndex; pScan < pEnd; pScan++)
-	{
-		*pScan = color;
-	}
+	PaintSolid(pColors, startLedIndex, ledCount, color);
+	spans.Add(startLedIndex, ledCount);
+
+	bool changed = !stepped_;
+	stepped_ = true;
+	return changed;
 }
 
-void ChaseAnimator::CreatePattern(LedColor color, LedCount width, LedCount space, std::vector<LedColor>& pattern)
+void SolidColor::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	RenderOp& op = program.AddOp(RenderOpType::RO_SOLID, timeOrigin, windowStart, windowEnd);
+	op.startLedIndex = startLedIndex;
+	op.ledCount = ledCount;
+	op.color = color;
+}
+
+void ChaseAnimator::CreatePattern(LedColor color, LedCount width, LedCount space, ArenaVector<LedColor>& pattern)
 {
 	int rampCount = width / 2;
 	float slope = 1.0f / (rampCount + 1.0f);
@@ -177,7 +504,8 @@ ChaseAnimator::ChaseAnimator(TickCount duration, LedIndex startLedIndex, LedCoun
 	color(color),
 	width_(width),
 	space_(space),
-	step_time_(step_time)
+	step_time_(step_time),
+	lastPatternIndex_(-1)
 {
 	duration_ = duration;
 
@@ -190,19 +518,29 @@ ChaseAnimator::ChaseAnimator(TickCount duration, LedIndex startLedIndex, LedCoun
 	CreatePattern(color, width_, space_, pattern);
 }
 
-void ChaseAnimator::Step(TickCount localTime, LedColor* pColors)
+bool ChaseAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
 {
-	uint32_t step_index = localTime / step_time_;
+	int patternIndex = ChasePatternIndex(localTime, step_time_, (int)pattern.size());
+	PaintPattern(pColors, startLedIndex, ledCount, pattern.data(), (int)pattern.size(), patternIndex);
+	spans.Add(startLedIndex, ledCount);
 
-	LedIndex patternIndex = static_cast<LedIndex>((pattern.size() - 1) - (step_index % pattern.size()));
-	for (LedIndex ledIndex = startLedIndex; ledIndex < startLedIndex + ledCount; ++ledIndex)
-	{
-		pColors[ledIndex] = pattern[patternIndex];
-		patternIndex = (patternIndex + 1) % pattern.size();
-	}
+	bool changed = (patternIndex != lastPatternIndex_);
+	lastPatternIndex_ = patternIndex;
+	return changed;
+}
+
+void ChaseAnimator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	int dataIndex = program.AddColors(pattern.data(), (int)pattern.size());
+	RenderOp& op = program.AddOp(RenderOpType::RO_PATTERN, timeOrigin, windowStart, windowEnd);
+	op.startLedIndex = startLedIndex;
+	op.ledCount = ledCount;
+	op.stepTicks = step_time_;
+	op.dataIndex = dataIndex;
+	op.dataCount = (int)pattern.size();
 }
 
-void SingleChaseAnimator::CreatePattern(LedColor color, LedCount width, std::vector<LedColor>& pattern)
+void SingleChaseAnimator::CreatePattern(LedColor color, LedCount width, ArenaVector<LedColor>& pattern)
 {
 	int rampCount = width / 2;
 	float slope = 1.0f / (rampCount + 1.0f);
@@ -222,7 +560,8 @@ SingleChaseAnimator::SingleChaseAnimator(TickCount duration, LedIndex startLedIn
 	startLedIndex(startLedIndex),
 	ledCount(ledCount),
 	color(color),
-	width_(width)
+	width_(width),
+	lastStepIndex_(-1)
 {
 	duration_ = duration;
 
@@ -235,63 +574,67 @@ SingleChaseAnimator::SingleChaseAnimator(TickCount duration, LedIndex startLedIn
 	CreatePattern(color, width_, pattern);
 }
 
-void SingleChaseAnimator::Step(TickCount localTime, LedColor* pColors)
+bool SingleChaseAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
 {
-	int startOffset = -(static_cast<int>(width_) / 2);
-	int stepCount = ledCount + width_;
-	int ticksPerStep = duration_ / stepCount;
-	if (ticksPerStep == 0)
-	{
-		ticksPerStep = 1;
-	}
+	int stepIndex = localTime / SingleChaseTicksPerStep(duration_, ledCount, width_);
+	PaintSingleChase(pColors, startLedIndex, ledCount, pattern.data(), (int)pattern.size(), stepIndex, spans);
 
-	int stepIndex = localTime / ticksPerStep;
-	int patternPosition = startOffset + stepIndex;
+	bool changed = (stepIndex != lastStepIndex_);
+	lastStepIndex_ = stepIndex;
+	return changed;
+}
 
-	for (unsigned int iPatternLed = 0; iPatternLed < pattern.size(); ++iPatternLed)
-	{
-		int iDestination = patternPosition + iPatternLed;
-		if (iDestination >= 0 && iDestination < ledCount)
-		{
-			pColors[startLedIndex + iDestination] = pattern[iPatternLed];
-		}
-	}
+void SingleChaseAnimator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	int dataIndex = program.AddColors(pattern.data(), (int)pattern.size());
+	RenderOp& op = program.AddOp(RenderOpType::RO_SINGLE_CHASE, timeOrigin, windowStart, windowEnd);
+	op.startLedIndex = startLedIndex;
+	op.ledCount = ledCount;
+	op.stepTicks = SingleChaseTicksPerStep(duration_, ledCount, width_);
+	op.dataIndex = dataIndex;
+	op.dataCount = (int)pattern.size();
 }
 
 
 FillInAnimator::FillInAnimator(TickCount duration, LedIndex startLedIndex, LedCount ledCount, LedColor color) :
 	startLedIndex(startLedIndex),
 	ledCount(ledCount),
-	color(color)
+	color(color),
+	lastStepIndex_(-1)
 {
 	duration_ = duration;
 }
 
-void FillInAnimator::Step(TickCount localTime, LedColor* pColors)
+bool FillInAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
 {
-	int ticksPerStep = duration_ / ledCount;
-	if (ticksPerStep == 0)
-	{
-		ticksPerStep = 1;
-	}
+	int stepIndex = FillInStepIndex(localTime, FillInTicksPerStep(duration_, ledCount), ledCount);
+	PaintSolid(pColors, startLedIndex, stepIndex, color);
+	spans.Add(startLedIndex, stepIndex);
 
-	int stepIndex = localTime / ticksPerStep;
+	bool changed = (stepIndex != lastStepIndex_);
+	lastStepIndex_ = stepIndex;
+	return changed;
+}
 
-	for (int iLed = 0; iLed < stepIndex; ++iLed)
-	{
-		pColors[iLed + startLedIndex] = color;
-	}
+void FillInAnimator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	RenderOp& op = program.AddOp(RenderOpType::RO_FILL_IN, timeOrigin, windowStart, windowEnd);
+	op.startLedIndex = startLedIndex;
+	op.ledCount = ledCount;
+	op.color = color;
+	op.stepTicks = FillInTicksPerStep(duration_, ledCount);
 }
 
 RangeAnimator::RangeAnimator(TickCount duration, TickCount stepDuration) :
-	stepDuration_(stepDuration)
+	stepDuration_(stepDuration),
+	lastColorIndex_(-1)
 {
 	duration_ = duration;
 }
 
 void RangeAnimator::AddRange(LedIndex ledIndex, LedCount ledCount)
 {
-	Range range{ ledIndex, ledCount };
+	LedSpan range{ ledIndex, ledCount };
 	ranges.push_back(range);
 }
 
@@ -300,39 +643,159 @@ void RangeAnimator::AddColor(LedColor color)
 	colors.push_back(color);
 }
 
-void RangeAnimator::Step(TickCount localTime, LedColor* pColors)
+bool RangeAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
 {
-	int colorIndex = localTime / stepDuration_;
+	int colorIndex = (localTime / stepDuration_) % colors.size();
+	PaintRanges(pColors, ranges.data(), (int)ranges.size(), colors.data(), (int)colors.size(), colorIndex, spans);
 
-	for (auto range = ranges.begin(); range != ranges.end(); ++range)
-	{
-		LedColor color = colors[colorIndex % colors.size()];
-
-		for (LedIndex ledIndex = range->ledIndex; ledIndex < range->ledIndex + range->ledCount; ++ledIndex)
-		{
-			pColors[ledIndex] = color;
-		}
+	bool changed = (colorIndex != lastColorIndex_);
+	lastColorIndex_ = colorIndex;
+	return changed;
+}
 
-		colorIndex = (colorIndex + 1) % colors.size();
-	}
+void RangeAnimator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	int dataIndex = program.AddColors(colors.data(), (int)colors.size());
+	int rangeIndex = program.AddRanges(ranges.data(), (int)ranges.size());
+	RenderOp& op = program.AddOp(RenderOpType::RO_RANGE, timeOrigin, windowStart, windowEnd);
+	op.stepTicks = stepDuration_;
+	op.dataIndex = dataIndex;
+	op.dataCount = (int)colors.size();
+	op.rangeIndex = rangeIndex;
+	op.rangeCount = (int)ranges.size();
 }
 
 RepeatedPatternAnimator::RepeatedPatternAnimator(TickCount duration, LedIndex startLedIndex, LedCount ledCount, const std::vector<LedColor>& patternParam) :
 	startLedIndex(startLedIndex),
 	ledCount(ledCount),
-	pattern(patternParam)
+	pattern(patternParam.begin(), patternParam.end()),
+	stepped_(false)
 {
 	duration_ = duration;
 }
 
-void RepeatedPatternAnimator::Step(TickCount localTime, LedColor* pColors)
+bool RepeatedPatternAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
 {
+	PaintPattern(pColors, startLedIndex, ledCount, pattern.data(), (int)pattern.size(), 0);
+	spans.Add(startLedIndex, ledCount);
 
-	LedIndex patternIndex = 0;
-	for (LedIndex ledIndex = startLedIndex; ledIndex < startLedIndex + ledCount; ++ledIndex)
+	bool changed = !stepped_;
+	stepped_ = true;
+	return changed;
+}
+
+void RepeatedPatternAnimator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	int dataIndex = program.AddColors(pattern.data(), (int)pattern.size());
+	RenderOp& op = program.AddOp(RenderOpType::RO_PATTERN, timeOrigin, windowStart, windowEnd);
+	op.startLedIndex = startLedIndex;
+	op.ledCount = ledCount;
+	op.stepTicks = 0; // doesn't move
+	op.dataIndex = dataIndex;
+	op.dataCount = (int)pattern.size();
+}
+
+void Animator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	RenderOp& op = program.AddOp(RenderOpType::RO_ANIMATOR, timeOrigin, windowStart, windowEnd);
+	op.pAnimator = this;
+}
+
+void RenderProgram::Clear()
+{
+	ops_.clear();
+	colors_.clear();
+	ranges_.clear();
+}
+
+void RenderProgram::Compile(Animator* pRoot)
+{
+	Clear();
+	// Like stepping the tree, the root itself isn't limited to its duration
+	pRoot->Compile(*this, 0, 0, TickCountMax);
+}
+
+RenderOp& RenderProgram::AddOp(RenderOpType type, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+	RenderOp op = {};
+	op.type = type;
+	op.windowStart = windowStart;
+	op.windowEnd = windowEnd;
+	op.timeOrigin = timeOrigin;
+	ops_.push_back(op);
+	return ops_.back();
+}
+
+int RenderProgram::AddColors(const LedColor* pColors, int colorCount)
+{
+	int dataIndex = (int)colors_.size();
+	colors_.insert(colors_.end(), pColors, pColors + colorCount);
+	return dataIndex;
+}
+
+int RenderProgram::AddRanges(const LedSpan* pRanges, int rangeCount)
+{
+	int rangeIndex = (int)ranges_.size();
+	ranges_.insert(ranges_.end(), pRanges, pRanges + rangeCount);
+	return rangeIndex;
+}
+
+bool RenderProgram::Run(TickCount time, LedColor* pColors, LedSpanList& spans)
+{
+	bool changed = false;
+	for (RenderOp* pOp = ops_.data(); pOp < ops_.data() + ops_.size(); ++pOp)
 	{
-		pColors[ledIndex] = pattern[patternIndex];
-		patternIndex = (patternIndex + 1) % pattern.size();
+		bool active = time >= pOp->windowStart && time < pOp->windowEnd;
+		changed |= (active != pOp->active);
+		pOp->active = active;
+		if (!active)
+		{
+			continue;
+		}
+
+		// What the op drew depends only on its key - it changed if the key did
+		TickCount localTime = time - pOp->timeOrigin;
+		int32_t key = 0;
+		switch (pOp->type)
+		{
+			case RenderOpType::RO_SOLID:
+				PaintSolid(pColors, pOp->startLedIndex, pOp->ledCount, pOp->color);
+				spans.Add(pOp->startLedIndex, pOp->ledCount);
+				break;
+
+			case RenderOpType::RO_PATTERN:
+				key = (pOp->stepTicks > 0) ? ChasePatternIndex(localTime, pOp->stepTicks, pOp->dataCount) : 0;
+				PaintPattern(pColors, pOp->startLedIndex, pOp->ledCount, colors_.data() + pOp->dataIndex, pOp->dataCount, key);
+				spans.Add(pOp->startLedIndex, pOp->ledCount);
+				break;
+
+			case RenderOpType::RO_SINGLE_CHASE:
+				key = localTime / pOp->stepTicks;
+				PaintSingleChase(pColors, pOp->startLedIndex, pOp->ledCount, colors_.data() + pOp->dataIndex, pOp->dataCount, key, spans);
+				break;
+
+			case RenderOpType::RO_FILL_IN:
+				key = FillInStepIndex(localTime, pOp->stepTicks, pOp->ledCount);
+				PaintSolid(pColors, pOp->startLedIndex, key, pOp->color);
+				spans.Add(pOp->startLedIndex, key);
+				break;
+
+			case RenderOpType::RO_RANGE:
+				key = (localTime / pOp->stepTicks) % pOp->dataCount;
+				PaintRanges(pColors, ranges_.data() + pOp->rangeIndex, pOp->rangeCount, colors_.data() + pOp->dataIndex, pOp->dataCount, key, spans);
+				break;
+
+			case RenderOpType::RO_FADE:
+				key = FadeScale(localTime, pOp->fadeInDuration, pOp->holdDuration, pOp->fadeOutDuration);
+				PaintFade(pColors, pOp->startLedIndex, pOp->ledCount, (ColorScale)key, spans);
+				break;
+
+			case RenderOpType::RO_ANIMATOR:
+				changed |= pOp->pAnimator->StepSpans(localTime, pColors, spans);
+				break;
+		}
+		changed |= (key != pOp->lastKey);
+		pOp->lastKey = key;
 	}
+	return changed;
 }
-
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "AnimatorArena.h"
+
 typedef uint16_t LedIndex;
 typedef uint16_t LedCount;
 typedef uint32_t LedColor;
@@ -23,14 +25,78 @@ const LedColor color_yellow = 0x00FFFF33;
 const LedColor color_cyan = 0x00FF00FF;
 const LedColor color_black = 0;
 
+struct LedSpan
+{
+	LedIndex startLedIndex;
+	LedCount ledCount;
+};
+
+// The LEDs an animator step wrote, as a short list of spans sorted by start
+// index.  Spans that overlap or touch get merged, and when the list runs out
+// of room the two closest spans get merged too - so the list can cover more
+// LEDs than were written but never fewer.  Nothing gets allocated since a
+// list is filled every frame.
+class LedSpanList
+{
+public:
+	static const int maxSpanCount = 16;
+
+private:
+	LedSpan spans_[maxSpanCount + 1]; // one extra while adding
+	int spanCount_;
+
+public:
+	LedSpanList() : spanCount_(0) {}
+
+	void Clear() { spanCount_ = 0; }
+	void Add(int startLedIndex, int ledCount);
+	void Add(const LedSpanList& other);
+
+	bool IsEmpty() const { return spanCount_ == 0; }
+	int GetCount() const { return spanCount_; }
+	const LedSpan& operator[](int spanIndex) const { return spans_[spanIndex]; }
+	// One past the last LED in the list, 0 if it's empty
+	int GetEndLedIndex() const { return IsEmpty() ? 0 : spans_[spanCount_ - 1].startLedIndex + spans_[spanCount_ - 1].ledCount; }
+};
+
+class RenderProgram;
+
 class Animator
 {
 public:
 	// localTime - always between 0 and the duration
-	virtual void Step(TickCount localTime, LedColor* pColors) = 0;
+	// Adds the LEDs it wrote to spans and returns true if any of them may be
+	// a different color than the last time it was stepped.  Animators that
+	// blend with what's already in pColors assume they're drawing over the
+	// same thing as last time.  LEDs it wrote last time but not this time
+	// are left alone - clearing those is up to the caller.
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans) = 0;
+
+	// For callers that don't care what got written
+	void Step(TickCount localTime, LedColor* pColors)
+	{
+		LedSpanList spans;
+		StepSpans(localTime, pColors, spans);
+	}
+
+	// Adds ops to program that draw what StepSpans draws.  timeOrigin is the
+	// program time of this animator's local time 0 and it only draws from
+	// windowStart up to windowEnd.  The default adds an op that steps the
+	// animator itself, for animators that keep state between steps.
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
+
+	// True if what StepSpans draws over black only depends on localTime, so
+	// copies of the animator can draw different stretches of time in any
+	// order.  Animators whose drawing depends on earlier steps return false.
+	virtual bool IsSeekable() const { return true; }
 
 	TickCount duration() const { return duration_; }
 
+	// Animators come from the current AnimatorArena if there is one.  Out of
+	// memory goes to AnimatorArena::OutOfMemory so new never gives back NULL.
+	static void* operator new(size_t size);
+	static void operator delete(void* p);
+
 	Animator() : duration_(0) {}
 	virtual ~Animator();
 protected:
@@ -42,14 +108,31 @@ class AnimatorGroup : public Animator
 private:
 	struct AnimatorInfo
 	{
-		AnimatorInfo(Animator* pa, TickCount st) : pAnimator(pa), startTime(st) {}
+		AnimatorInfo(Animator* pa, TickCount st) : pAnimator(pa), startTime(st), active(false) {}
 
 		Animator* pAnimator;
 		TickCount startTime;
+		bool active; // stepped last time - starting or stopping a child changes the group's output
 	};
 
 	TickCount duration_override_;
-	std::vector<AnimatorInfo> animators_;
+	TickCount childrenEnd_; // end of the last child to finish
+	ArenaVector<AnimatorInfo> animators_; // in the order they paint
+
+	// The timeline - children by start time plus the ones running at
+	// lastLocalTime_, so a step only looks at the children that are running
+	// or just started.  It's rebuilt on the first step after adding a child.
+	bool timelineValid_;
+	ArenaVector<int> timeline_; // indices into animators_ sorted by start time
+	size_t nextStart_; // first child in timeline_ that hadn't started at lastLocalTime_
+	ArenaVector<int> active_; // indices of the running children, in paint order
+	ArenaVector<int> nextActive_;
+	TickCount lastLocalTime_;
+	TickCount longestChildDuration_;
+
+	void BuildTimeline();
+	void SeekTimeline(TickCount localTime);
+	void AdvanceTimeline(TickCount localTime);
 
 public:
 	AnimatorGroup();
@@ -57,7 +140,11 @@ public:
 	void AddAnimator(Animator* pAnimator, TickCount startTime);
 	void AppendAnimator(Animator* pAnimator, TickCount offset = 0);
 	void OverrideDuration(TickCount forced_duration);
-	virtual void Step(TickCount localTime, LedColor* pColors);
+	// Children paint in the order they were added.  Their durations
+	// shouldn't change once the group has been stepped.
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
+	virtual bool IsSeekable() const;
 };
 
 class FadeAnimator : public Animator
@@ -69,10 +156,13 @@ private:
 	LedIndex startLedIndex_;
 	LedCount ledCount_;
 	std::unique_ptr<Animator> childAnimator_;
+	int lastScale_;
 
 public:
 	FadeAnimator(TickCount fadeInDuration, TickCount holdDuration, TickCount fadeOutDuration, LedIndex startLedIndex, LedCount ledCount, Animator* childAnimator);
-	virtual void Step(TickCount localTime, LedColor* pColors);
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
+	virtual bool IsSeekable() const { return childAnimator_->IsSeekable(); }
 };
 
 class SolidColor : public Animator
@@ -81,10 +171,12 @@ private:
 	LedIndex startLedIndex;
 	LedCount ledCount;
 	LedColor color;
+	bool stepped_;
 
 public:
 	SolidColor(TickCount duration, LedIndex startLedIndex, LedCount ledCount, LedColor color);
-	virtual void Step(TickCount localTime, LedColor* pColors);
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
 };
 
 class ChaseAnimator : public Animator
@@ -96,13 +188,15 @@ private:
 	LedCount width_;
 	LedCount space_;
 	TickCount step_time_;
-	std::vector<LedColor> pattern;
+	ArenaVector<LedColor> pattern;
+	int lastPatternIndex_;
 
-	static void CreatePattern(LedColor color, LedCount width, LedCount space, std::vector<LedColor>& pattern);
+	static void CreatePattern(LedColor color, LedCount width, LedCount space, ArenaVector<LedColor>& pattern);
 
 public:
 	ChaseAnimator(TickCount duration, LedIndex startLedIndex, LedCount ledCount, LedColor color, LedCount width, LedCount space, TickCount step_time);
-	virtual void Step(TickCount localTime, LedColor* pColors);
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
 };
 
 
@@ -113,13 +207,15 @@ private:
 	LedCount ledCount;
 	LedColor color;
 	LedCount width_;
-	std::vector<LedColor> pattern;
+	ArenaVector<LedColor> pattern;
+	int lastStepIndex_;
 
-	static void CreatePattern(LedColor color, LedCount width, std::vector<LedColor>& pattern);
+	static void CreatePattern(LedColor color, LedCount width, ArenaVector<LedColor>& pattern);
 
 public:
 	SingleChaseAnimator(TickCount duration, LedIndex startLedIndex, LedCount ledCount, LedColor color, LedCount width);
-	virtual void Step(TickCount localTime, LedColor* pColors);
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
 };
 
 class FillInAnimator : public Animator
@@ -128,30 +224,28 @@ private:
 	LedIndex startLedIndex;
 	LedCount ledCount;
 	LedColor color;
+	int lastStepIndex_;
 
 public:
 
 	FillInAnimator(TickCount duration, LedIndex startLedIndex, LedCount ledCount, LedColor color);
-	virtual void Step(TickCount localTime, LedColor* pColors);
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
 };
 
 class RangeAnimator : public Animator
 {
 private:
-	struct Range
-	{
-		LedIndex ledIndex;
-		LedCount ledCount;
-	};
-
-	std::vector<Range> ranges;
-	std::vector<LedColor> colors;
+	ArenaVector<LedSpan> ranges;
+	ArenaVector<LedColor> colors;
 	TickCount stepDuration_;
+	int lastColorIndex_;
 public:
 	RangeAnimator(TickCount duration, TickCount stepDuration);
 	void AddRange(LedIndex ledIndex, LedCount ledCount);
 	void AddColor(LedColor color);
-	virtual void Step(TickCount localTime, LedColor* pColors);
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
 };
 
 class RepeatedPatternAnimator : public Animator
@@ -159,12 +253,81 @@ class RepeatedPatternAnimator : public Animator
 private:
 	LedIndex startLedIndex;
 	LedCount ledCount;
-	std::vector<LedColor> pattern;
+	ArenaVector<LedColor> pattern;
+	bool stepped_;
 
-	static void CreatePattern(LedColor color, LedCount width, LedCount space, std::vector<LedColor>& pattern);
+	static void CreatePattern(LedColor color, LedCount width, LedCount space, ArenaVector<LedColor>& pattern);
 
 public:
 	RepeatedPatternAnimator(TickCount duration, LedIndex startLedIndex, LedCount ledCount, const std::vector<LedColor>& pattern);
-	virtual void Step(TickCount localTime, LedColor* pColors);
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
+};
+
+// What the tree shows when nobody's playing - pretend to be normal Christmas
+// lights for patternDuration then go dark for a second.  Colors are scaled
+// by powerScale to keep the current down.
+AnimatorGroup* CreateChristmasLightsAnimator(LedCount ledCount, float powerScale, TickCount patternDuration);
+
+enum class RenderOpType : uint8_t
+{
+	RO_SOLID, // SolidColor
+	RO_PATTERN, // ChaseAnimator, or RepeatedPatternAnimator with no stepTicks
+	RO_SINGLE_CHASE,
+	RO_FILL_IN,
+	RO_RANGE,
+	RO_FADE, // scales what the ops before it drew
+	RO_ANIMATOR, // steps pAnimator
+};
+
+struct RenderOp
+{
+	RenderOpType type;
+	bool active; // ran last time
+	LedIndex startLedIndex;
+	LedCount ledCount;
+	TickCount windowStart; // runs from this program time...
+	TickCount windowEnd; // ...up to this one
+	TickCount timeOrigin; // program time of the animator's local time 0
+	TickCount stepTicks;
+	TickCount fadeInDuration;
+	TickCount holdDuration;
+	TickCount fadeOutDuration;
+	LedColor color;
+	int dataIndex; // pattern or range colors in the program
+	int dataCount;
+	int rangeIndex;
+	int rangeCount;
+	int32_t lastKey; // whatever decides what the op draws, from last time
+	Animator* pAnimator;
 };
 
+// An animator tree flattened into a list of ops.  Compile walks the tree
+// once and gives each animator's op its absolute time window and everything
+// it draws with, so Run is a single pass over an array with no virtual calls
+// and no per-group time checks - and draws exactly what stepping the tree
+// does, with the same spans.
+//
+// Ops that step an animator point back into the tree, so the tree has to
+// outlive the program.  Don't step the tree itself while using the program -
+// those animators would see time jump around.
+class RenderProgram
+{
+	std::vector<RenderOp> ops_;
+	std::vector<LedColor> colors_;
+	std::vector<LedSpan> ranges_;
+
+public:
+	void Compile(Animator* pRoot);
+	void Clear();
+
+	// Same as pRoot->StepSpans
+	bool Run(TickCount time, LedColor* pColors, LedSpanList& spans);
+
+	int GetOpCount() const { return (int)ops_.size(); }
+
+	// For Animator::Compile.  The op is only good until the next AddOp.
+	RenderOp& AddOp(RenderOpType type, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
+	int AddColors(const LedColor* pColors, int colorCount);
+	int AddRanges(const LedSpan* pRanges, int rangeCount);
+};
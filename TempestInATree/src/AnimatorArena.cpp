@@ -0,0 +1,98 @@
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "AnimatorArena.h"
+
+ANIMATOR_ARENA_THREAD_LOCAL AnimatorArena* AnimatorArena::pCurrent_ = NULL;
+
+static AnimatorArena::OutOfMemoryHandler pOutOfMemoryHandler = NULL;
+
+void AnimatorArena::SetOutOfMemoryHandler(OutOfMemoryHandler pHandler)
+{
+	pOutOfMemoryHandler = pHandler;
+}
+
+void AnimatorArena::OutOfMemory(size_t size)
+{
+	if (NULL != pOutOfMemoryHandler) pOutOfMemoryHandler(size);
+	abort();
+}
+
+static uint8_t* AlignUp(uint8_t* p, size_t alignment)
+{
+	return (uint8_t*)(((uintptr_t)p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+AnimatorArena::AnimatorArena(size_t chunkSize) :
+	pFirst_((uint8_t*)malloc(chunkSize)),
+	firstSize_(chunkSize),
+	ownsFirst_(true),
+	chunkSize_(chunkSize),
+	pExtraChunks_(NULL),
+	bytesUsed_(0),
+	extraChunkCount_(0)
+{
+	if (NULL == pFirst_) firstSize_ = 0;
+	pNext_ = pFirst_;
+	pEnd_ = pFirst_ + firstSize_;
+}
+
+AnimatorArena::AnimatorArena(void* pBuffer, size_t bufferSize, size_t chunkSize) :
+	pFirst_((uint8_t*)pBuffer),
+	firstSize_(bufferSize),
+	ownsFirst_(false),
+	chunkSize_(chunkSize),
+	pExtraChunks_(NULL),
+	pNext_(pFirst_),
+	pEnd_(pFirst_ + bufferSize),
+	bytesUsed_(0),
+	extraChunkCount_(0)
+{
+}
+
+AnimatorArena::~AnimatorArena()
+{
+	Reset();
+	if (ownsFirst_) free(pFirst_);
+}
+
+void* AnimatorArena::Allocate(size_t size, size_t alignment)
+{
+	uint8_t* p = AlignUp(pNext_, alignment);
+	if (p > pEnd_ || size > (size_t)(pEnd_ - p))
+	{
+		// Doesn't fit - the rest of this chunk goes to waste and the
+		// allocation starts a new one, a bigger one if it has to be
+		size_t newChunkSize = sizeof(Chunk) + alignment + size;
+		if (newChunkSize < chunkSize_) newChunkSize = chunkSize_;
+		Chunk* pChunk = (Chunk*)malloc(newChunkSize);
+		if (NULL == pChunk) OutOfMemory(newChunkSize);
+		pChunk->pNext = pExtraChunks_;
+		pExtraChunks_ = pChunk;
+		extraChunkCount_++;
+
+		pNext_ = (uint8_t*)(pChunk + 1);
+		pEnd_ = (uint8_t*)pChunk + newChunkSize;
+		p = AlignUp(pNext_, alignment);
+	}
+
+	bytesUsed_ += (p - pNext_) + size;
+	pNext_ = p + size;
+	return p;
+}
+
+void AnimatorArena::Reset()
+{
+	while (NULL != pExtraChunks_)
+	{
+		Chunk* pNext = pExtraChunks_->pNext;
+		free(pExtraChunks_);
+		pExtraChunks_ = pNext;
+	}
+	extraChunkCount_ = 0;
+	pNext_ = pFirst_;
+	pEnd_ = pFirst_ + firstSize_;
+	bytesUsed_ = 0;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+// Memory for a whole animator tree.  Animators and their vectors are
+// allocated from the arena while an AnimatorArena::Scope is open on it, one
+// bump of a pointer each, and Reset drops all of them at once without
+// running any destructors.  On the tree that means building or dropping a
+// show doesn't fragment the heap and nothing a show allocates can leak.
+//
+// The first chunk can be a buffer the caller owns (a static array on the
+// tree) - anything that doesn't fit goes in extra chunks from the heap,
+// which Reset gives back.  Size the buffer from GetBytesUsed so a show
+// never needs them.
+//
+// Everything allocated from an arena goes away with it, so an animator built
+// in one mustn't hold memory from anywhere else.  Animator vectors use
+// ArenaVector to stay in the arena they were made in even when they grow
+// later, and deleting an animator that lives in an arena runs its destructor
+// but doesn't free anything.
+//
+// Nothing that builds a show checks for NULL, so running out of memory goes
+// to one out of memory handler instead - abort() unless the app sets its
+// own.  The tree logs it and resets.
+
+// The tree has a single thread but the PC tools build engines on several
+#if defined(_WIN32) || defined(__linux__) || defined(__APPLE__)
+#define ANIMATOR_ARENA_THREAD_LOCAL thread_local
+#else
+#define ANIMATOR_ARENA_THREAD_LOCAL
+#endif
+
+class AnimatorArena
+{
+	struct Chunk
+	{
+		Chunk* pNext;
+	};
+
+	uint8_t* pFirst_;
+	size_t firstSize_;
+	bool ownsFirst_;
+	size_t chunkSize_;
+	Chunk* pExtraChunks_; // newest first
+	uint8_t* pNext_; // next free byte in the chunk being filled
+	uint8_t* pEnd_;
+	size_t bytesUsed_;
+	int extraChunkCount_;
+
+	static ANIMATOR_ARENA_THREAD_LOCAL AnimatorArena* pCurrent_;
+
+	AnimatorArena(const AnimatorArena&) = delete;
+	AnimatorArena& operator=(const AnimatorArena&) = delete;
+
+public:
+	// Mustn't return - it's called with the size that didn't fit
+	typedef void (*OutOfMemoryHandler)(size_t size);
+
+	// Chunks of chunkSize from the heap, the first one kept across resets
+	explicit AnimatorArena(size_t chunkSize);
+	// pBuffer first, then chunks of chunkSize from the heap
+	AnimatorArena(void* pBuffer, size_t bufferSize, size_t chunkSize = 1024);
+	~AnimatorArena();
+
+	// Calls the out of memory handler if the heap is out of memory too
+	void* Allocate(size_t size, size_t alignment);
+
+	// Frees everything allocated since the last reset
+	void Reset();
+
+	// Bytes handed out, counting alignment padding
+	size_t GetBytesUsed() const { return bytesUsed_; }
+	// Heap chunks past the first, 0 if everything fit
+	int GetExtraChunkCount() const { return extraChunkCount_; }
+
+	// The arena animators are being built in, NULL for the heap
+	static AnimatorArena* GetCurrent() { return pCurrent_; }
+
+	// NULL puts back abort()
+	static void SetOutOfMemoryHandler(OutOfMemoryHandler pHandler);
+	// For the heap allocations that go with animators too
+	static void OutOfMemory(size_t size);
+
+	// Builds animators in arena until it goes out of scope.  Scopes nest.
+	class Scope
+	{
+		AnimatorArena* pPrevious_;
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	public:
+		explicit Scope(AnimatorArena& arena) : pPrevious_(pCurrent_) { pCurrent_ = &arena; }
+		~Scope() { pCurrent_ = pPrevious_; }
+	};
+};
+
+// Allocates from the arena that was current when the container was made, or
+// the heap if there wasn't one
+template<typename T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	AnimatorArena* pArena_;
+
+	ArenaAllocator() : pArena_(AnimatorArena::GetCurrent()) {}
+	template<typename U> ArenaAllocator(const ArenaAllocator<U>& other) : pArena_(other.pArena_) {}
+
+	T* allocate(size_t count)
+	{
+		if (NULL != pArena_) return (T*)pArena_->Allocate(count * sizeof(T), alignof(T));
+		void* p = ::operator new(count * sizeof(T), std::nothrow);
+		if (NULL == p) AnimatorArena::OutOfMemory(count * sizeof(T));
+		return (T*)p;
+	}
+
+	void deallocate(T* p, size_t)
+	{
+		if (NULL == pArena_) ::operator delete(p);
+	}
+};
+
+template<typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.pArena_ == b.pArena_; }
+template<typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.pArena_ != b.pArena_; }
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
@@ -0,0 +1,210 @@
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AudioMixer.h"
+
+// The sound for each game event, in GameEventType order
+static const SoundEffect gameEventSounds[] =
+{
+    // waveform, start frequency, end frequency, duration, volume
+    {Waveform::WF_SQUARE,   220,  880,  500,  160}, // GE_GAME_STARTED
+    {Waveform::WF_TRIANGLE, 440,  880,  300,  200}, // GE_LEVEL_STARTED
+    {Waveform::WF_SQUARE,   1200, 600,  60,   90},  // GE_SHOT_FIRED
+    {Waveform::WF_NOISE,    4000, 500,  250,  220}, // GE_ENEMY_KILLED
+    {Waveform::WF_TRIANGLE, 2000, 1000, 40,   140}, // GE_ENEMY_SHOT_DESTROYED
+    {Waveform::WF_SAW,      400,  40,   900,  255}, // GE_PLAYER_DIED
+    {Waveform::WF_SQUARE,   440,  110,  1500, 200}, // GE_GAME_OVER
+};
+
+void AudioMixer::PlayEvent(const GameEvent& event)
+{
+    int index = static_cast<int>(event.type);
+    if (index < 0 || index >= (int)(sizeof(gameEventSounds) / sizeof(*gameEventSounds))) return;
+    Play(gameEventSounds[index]);
+}
+
+// A free voice or, if they're all busy, the one closest to finishing
+AudioMixer::Voice* AudioMixer::AllocateVoice()
+{
+    Voice* pBest = voices_;
+    for (Voice* pVoice = voices_; pVoice < voices_ + voiceCount; ++pVoice)
+    {
+        if (pVoice->samplesRemaining < pBest->samplesRemaining)
+        {
+            pBest = pVoice;
+        }
+    }
+    return pBest;
+}
+
+void AudioMixer::Play(const SoundEffect& effect)
+{
+    int sampleCount = (int)(((uint32_t)effect.duration * sampleRate) / 1000);
+    if (sampleCount <= 0 || effect.volume == 0) return;
+
+    Voice* pVoice = AllocateVoice();
+    pVoice->waveform = effect.waveform;
+    pVoice->phase = 0;
+    pVoice->phaseIncrement = PhaseIncrement(effect.startFrequency);
+    pVoice->phaseIncrementDelta = (int32_t)(((int64_t)PhaseIncrement(effect.endFrequency) - (int64_t)pVoice->phaseIncrement) / sampleCount);
+    pVoice->amplitude = (int32_t)effect.volume << 16;
+    pVoice->amplitudeDelta = pVoice->amplitude / sampleCount;
+    pVoice->samplesRemaining = sampleCount;
+    pVoice->noiseLevel = 0;
+    pVoice->pSamples = NULL;
+}
+
+void AudioMixer::PlaySample(const int8_t* pSamples, int sampleCount, uint8_t volume)
+{
+    if (sampleCount <= 0 || volume == 0) return;
+
+    Voice* pVoice = AllocateVoice();
+    pVoice->waveform = Waveform::WF_SAMPLE;
+    pVoice->phase = 0;
+    pVoice->phaseIncrement = 1 << 16; // one sample per output sample - the index is the top 16 bits
+    pVoice->phaseIncrementDelta = 0;
+    pVoice->amplitude = (int32_t)volume << 16;
+    pVoice->amplitudeDelta = 0;
+    pVoice->samplesRemaining = sampleCount;
+    pVoice->noiseLevel = 0;
+    pVoice->pSamples = pSamples;
+}
+
+void AudioMixer::StopAll()
+{
+    for (Voice* pVoice = voices_; pVoice < voices_ + voiceCount; ++pVoice)
+    {
+        pVoice->samplesRemaining = 0;
+    }
+}
+
+int AudioMixer::GetActiveVoiceCount() const
+{
+    int count = 0;
+    for (const Voice* pVoice = voices_; pVoice < voices_ + voiceCount; ++pVoice)
+    {
+        count += (pVoice->samplesRemaining > 0) ? 1 : 0;
+    }
+    return count;
+}
+
+// -128 to 127 for each waveform.  A separate loop per waveform keeps the
+// switch out of the per-sample code.
+template<Waveform waveform>
+static inline int WaveValue(uint32_t phase, int8_t noiseLevel, const int8_t* pSamples)
+{
+    switch (waveform)
+    {
+        case Waveform::WF_SQUARE: return (phase & 0x80000000u) ? 127 : -127;
+        case Waveform::WF_TRIANGLE:
+        {
+            int t = (int)(phase >> 24);
+            return (t < 128) ? (2 * t) - 128 : 383 - (2 * t);
+        }
+        case Waveform::WF_SAW: return (int)(phase >> 24) - 128;
+        case Waveform::WF_NOISE: return noiseLevel;
+        case Waveform::WF_SAMPLE: return pSamples[phase >> 16];
+    }
+    return 0;
+}
+
+template<Waveform waveform>
+static void MixVoiceSamples(int32_t* pMix, int count, uint32_t& phase, uint32_t& phaseIncrement, int32_t phaseIncrementDelta,
+    int32_t& amplitude, int32_t amplitudeDelta, int8_t& noiseLevel, uint32_t& noiseState, const int8_t* pSamples)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        pMix[i] += WaveValue<waveform>(phase, noiseLevel, pSamples) * (amplitude >> 16);
+        amplitude -= amplitudeDelta;
+
+        uint32_t nextPhase = phase + phaseIncrement;
+        if (Waveform::WF_NOISE == waveform && nextPhase < phase)
+        {
+            // 16 bit Galois LFSR - new level each cycle
+            noiseState = (noiseState >> 1) ^ ((0u - (noiseState & 1u)) & 0xB400u);
+            noiseLevel = (int8_t)noiseState;
+        }
+        phase = nextPhase;
+        phaseIncrement += phaseIncrementDelta;
+    }
+}
+
+void AudioMixer::MixBlock(int16_t* pBlock)
+{
+    int32_t mix[blockSize] = {};
+
+    for (Voice* pVoice = voices_; pVoice < voices_ + voiceCount; ++pVoice)
+    {
+        if (pVoice->samplesRemaining <= 0) continue;
+
+        int count = (pVoice->samplesRemaining < blockSize) ? pVoice->samplesRemaining : blockSize;
+        switch (pVoice->waveform)
+        {
+            case Waveform::WF_SQUARE:
+                MixVoiceSamples<Waveform::WF_SQUARE>(mix, count, pVoice->phase, pVoice->phaseIncrement, pVoice->phaseIncrementDelta, pVoice->amplitude, pVoice->amplitudeDelta, pVoice->noiseLevel, noiseState_, pVoice->pSamples);
+                break;
+            case Waveform::WF_TRIANGLE:
+                MixVoiceSamples<Waveform::WF_TRIANGLE>(mix, count, pVoice->phase, pVoice->phaseIncrement, pVoice->phaseIncrementDelta, pVoice->amplitude, pVoice->amplitudeDelta, pVoice->noiseLevel, noiseState_, pVoice->pSamples);
+                break;
+            case Waveform::WF_SAW:
+                MixVoiceSamples<Waveform::WF_SAW>(mix, count, pVoice->phase, pVoice->phaseIncrement, pVoice->phaseIncrementDelta, pVoice->amplitude, pVoice->amplitudeDelta, pVoice->noiseLevel, noiseState_, pVoice->pSamples);
+                break;
+            case Waveform::WF_NOISE:
+                MixVoiceSamples<Waveform::WF_NOISE>(mix, count, pVoice->phase, pVoice->phaseIncrement, pVoice->phaseIncrementDelta, pVoice->amplitude, pVoice->amplitudeDelta, pVoice->noiseLevel, noiseState_, pVoice->pSamples);
+                break;
+            case Waveform::WF_SAMPLE:
+                MixVoiceSamples<Waveform::WF_SAMPLE>(mix, count, pVoice->phase, pVoice->phaseIncrement, pVoice->phaseIncrementDelta, pVoice->amplitude, pVoice->amplitudeDelta, pVoice->noiseLevel, noiseState_, pVoice->pSamples);
+                break;
+        }
+        pVoice->samplesRemaining -= count;
+    }
+
+    // One voice at full volume is about half scale.  Clip when a lot of
+    // loud voices pile up.
+    for (int i = 0; i < blockSize; ++i)
+    {
+        int32_t sample = mix[i] >> 1;
+        pBlock[i] = (int16_t)((sample > INT16_MAX) ? INT16_MAX : (sample < INT16_MIN) ? INT16_MIN : sample);
+    }
+}
+
+AudioBlockBuffer::AudioBlockBuffer() :
+    playingBlock_(0),
+    samplePosition_(0),
+    fillBlock_(0),
+    underrunCount_(0)
+{
+    blockFull_[0].store(false);
+    blockFull_[1].store(false);
+}
+
+int16_t AudioBlockBuffer::NextSample()
+{
+    if (!blockFull_[playingBlock_].load(std::memory_order_acquire))
+    {
+        // The mixer didn't get to it in time
+        underrunCount_.store(underrunCount_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    int16_t sample = blocks_[playingBlock_][samplePosition_++];
+    if (samplePosition_ == AudioMixer::blockSize)
+    {
+        samplePosition_ = 0;
+        blockFull_[playingBlock_].store(false, std::memory_order_release);
+        playingBlock_ ^= 1;
+    }
+    return sample;
+}
+
+bool AudioBlockBuffer::FillBlock(AudioMixer& mixer)
+{
+    if (blockFull_[fillBlock_].load(std::memory_order_acquire)) return false;
+
+    mixer.MixBlock(blocks_[fillBlock_]);
+    blockFull_[fillBlock_].store(true, std::memory_order_release);
+    fillBlock_ ^= 1;
+    return true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+
+#include "Animator.h"
+#include "GameEvents.h"
+
+// Sound for the game.  AudioMixer turns game events into short synthesized
+// sound effects and mixes its voices into blocks of 16 bit PCM.
+// AudioBlockBuffer double buffers the blocks between the mixer, which runs
+// from loop(), and the output, which takes one sample at a time from a timer
+// interrupt and writes it to the DAC (or PWM).  That interrupt can't run
+// while the LEDs are being sent with interrupts off, so on the tree the
+// output can stall for as long as an LED send - see TempestInATree.ino.
+//
+// Everything is integer math - the Photon has no FPU.  Mixing a block costs
+// at most voiceCount * blockSize trips through the inner loop (roughly 15
+// cycles each, so about 25k cycles or 0.2ms at 120MHz for a 16ms block) and
+// it only happens when the output has finished with a block, so it never
+// holds up Step or the LEDs by more than that.  The tree logs the measured
+// worst case along with the FPS.
+
+enum class Waveform : uint8_t
+{
+    WF_SQUARE,
+    WF_TRIANGLE,
+    WF_SAW,
+    WF_NOISE, // new random level every cycle - frequency sets how rough it sounds
+    WF_SAMPLE, // plays pSamples at the mixer's sample rate
+};
+
+// Frequency sweeps linearly from start to end and the volume fades out
+// linearly over the duration
+struct SoundEffect
+{
+    Waveform waveform;
+    uint16_t startFrequency; // Hz
+    uint16_t endFrequency; // Hz
+    uint16_t duration; // ms
+    uint8_t volume; // 0-255
+};
+
+class AudioMixer
+{
+public:
+    static const int sampleRate = 16000;
+    static const int blockSize = 256; // 16ms
+    static const int voiceCount = 6;
+
+private:
+    struct Voice
+    {
+        Waveform waveform;
+        uint32_t phase; // a whole cycle is 2^32
+        uint32_t phaseIncrement;
+        int32_t phaseIncrementDelta; // per sample - the sweep
+        int32_t amplitude; // volume in the top 16 bits
+        int32_t amplitudeDelta; // per sample - the fade
+        int samplesRemaining; // 0 when the voice is free
+        int8_t noiseLevel;
+        const int8_t* pSamples;
+    };
+
+    Voice voices_[voiceCount] = {};
+    uint32_t noiseState_ = 0xACE1u;
+
+    Voice* AllocateVoice();
+    static uint32_t PhaseIncrement(int frequency) { return (uint32_t)(((uint64_t)frequency << 32) / sampleRate); }
+
+public:
+    void Play(const SoundEffect& effect);
+    void PlaySample(const int8_t* pSamples, int sampleCount, uint8_t volume);
+    // The sound for a game event, if it has one
+    void PlayEvent(const GameEvent& event);
+    void StopAll();
+
+    int GetActiveVoiceCount() const;
+    void MixBlock(int16_t* pBlock);
+};
+
+// Two blocks - the output plays one while the mixer fills the other.  Only
+// the mixer marks a block full and only the output marks it empty again, so
+// the two sides don't need a lock.  If the mixer doesn't keep up the output
+// plays silence and counts the underrun.
+class AudioBlockBuffer
+{
+    int16_t blocks_[2][AudioMixer::blockSize];
+    std::atomic<bool> blockFull_[2];
+    int playingBlock_; // output side
+    int samplePosition_; // output side
+    int fillBlock_; // mixer side
+    std::atomic<uint32_t> underrunCount_;
+
+public:
+    AudioBlockBuffer();
+
+    // Output side - call once per sample period
+    int16_t NextSample();
+
+    // Mixer side.  Returns false if both blocks are still full.
+    bool FillBlock(AudioMixer& mixer);
+
+    uint32_t GetUnderrunCount() const { return underrunCount_.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,243 @@
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ColorKernels.h"
+
+#ifdef COLOR_KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+void FillColors(LedColor* pColors, int count, LedColor color)
+{
+	LedColor* pEnd = pColors + count;
+	for (LedColor* pScan = pColors; pScan < pEnd; pScan++)
+	{
+		*pScan = color;
+	}
+}
+
+// One copy of the pattern and then copies of everything so far, doubling
+// each time, instead of a % per LED
+void RepeatPattern(LedColor* pColors, int count, const LedColor* pPattern, int patternSize, int patternIndex)
+{
+	if (count <= 0 || patternSize <= 0) return;
+
+	int firstCount = patternSize - patternIndex;
+	if (firstCount > count) firstCount = count;
+	memcpy(pColors, pPattern + patternIndex, firstCount * sizeof(LedColor));
+	int secondCount = (patternIndex < count - firstCount) ? patternIndex : count - firstCount;
+	memcpy(pColors + firstCount, pPattern, secondCount * sizeof(LedColor));
+
+	// Whole patterns so far, so the next LED starts the pattern over
+	int doneCount = firstCount + secondCount;
+	while (doneCount < count)
+	{
+		int copyCount = (doneCount < count - doneCount) ? doneCount : count - doneCount;
+		memcpy(pColors + doneCount, pColors, copyCount * sizeof(LedColor));
+		doneCount += copyCount;
+	}
+}
+
+void ScaleColorsSwar(LedColor* pColors, int count, ColorScale scale)
+{
+	for (LedColor* pScan = pColors; pScan < pColors + count; pScan++)
+	{
+		*pScan = ScaleColorFixed(scale, *pScan);
+	}
+}
+
+void CrossFadeColorsSwar(LedColor* pColors, int count, LedColor color, ColorScale t)
+{
+	for (LedColor* pScan = pColors; pScan < pColors + count; pScan++)
+	{
+		*pScan = CrossFadeColorFixed(t, *pScan, color);
+	}
+}
+
+void AddColorsSaturateSwar(LedColor* pColors, const LedColor* pAdd, int count)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		pColors[ledIndex] = AddColorSaturate(pColors[ledIndex], pAdd[ledIndex]);
+	}
+}
+
+// The layer blends only run for the LEDs a layer drew so they don't get
+// SSE2 versions
+void MixColors(LedColor* pColors, const LedColor* pMix, int count, ColorScale t)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		pColors[ledIndex] = CrossFadeColorFixed(t, pColors[ledIndex], pMix[ledIndex]);
+	}
+}
+
+void MultiplyColors(LedColor* pColors, const LedColor* pMultiply, int count)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		pColors[ledIndex] = MultiplyColorFixed(pColors[ledIndex], pMultiply[ledIndex]);
+	}
+}
+
+void AlphaBlendColors(LedColor* pColors, const LedColor* pBlend, int count, ColorScale opacity)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		pColors[ledIndex] = AlphaBlendColorFixed(opacity, pColors[ledIndex], pBlend[ledIndex]);
+	}
+}
+
+#ifdef COLOR_KERNELS_SSE2
+
+// Four LEDs at a time as 16 bit channels, then whatever is left over the
+// SWAR way
+void ScaleColors(LedColor* pColors, int count, ColorScale scale)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i scales = _mm_set1_epi16((short)scale);
+	const __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+	int ledIndex = 0;
+	for (; ledIndex + 4 <= count; ledIndex += 4)
+	{
+		__m128i colors = _mm_loadu_si128((const __m128i*)(pColors + ledIndex));
+		__m128i low = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(colors, zero), scales), 8);
+		__m128i high = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(colors, zero), scales), 8);
+		_mm_storeu_si128((__m128i*)(pColors + ledIndex), _mm_and_si128(_mm_packus_epi16(low, high), colorMask));
+	}
+	ScaleColorsSwar(pColors + ledIndex, count - ledIndex, scale);
+}
+
+void CrossFadeColors(LedColor* pColors, int count, LedColor color, ColorScale t)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i colorWeights = _mm_set1_epi16((short)(colorScaleOne - t));
+	const __m128i targetTerm = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero), _mm_set1_epi16((short)t));
+	const __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+	int ledIndex = 0;
+	for (; ledIndex + 4 <= count; ledIndex += 4)
+	{
+		__m128i colors = _mm_loadu_si128((const __m128i*)(pColors + ledIndex));
+		__m128i low = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(colors, zero), colorWeights), targetTerm), 8);
+		__m128i high = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(colors, zero), colorWeights), targetTerm), 8);
+		_mm_storeu_si128((__m128i*)(pColors + ledIndex), _mm_and_si128(_mm_packus_epi16(low, high), colorMask));
+	}
+	CrossFadeColorsSwar(pColors + ledIndex, count - ledIndex, color, t);
+}
+
+void AddColorsSaturate(LedColor* pColors, const LedColor* pAdd, int count)
+{
+	const __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+	int ledIndex = 0;
+	for (; ledIndex + 4 <= count; ledIndex += 4)
+	{
+		__m128i colors = _mm_loadu_si128((const __m128i*)(pColors + ledIndex));
+		__m128i add = _mm_loadu_si128((const __m128i*)(pAdd + ledIndex));
+		_mm_storeu_si128((__m128i*)(pColors + ledIndex), _mm_and_si128(_mm_adds_epu8(colors, add), colorMask));
+	}
+	AddColorsSaturateSwar(pColors + ledIndex, pAdd + ledIndex, count - ledIndex);
+}
+
+#else
+
+void ScaleColors(LedColor* pColors, int count, ColorScale scale) { ScaleColorsSwar(pColors, count, scale); }
+void CrossFadeColors(LedColor* pColors, int count, LedColor color, ColorScale t) { CrossFadeColorsSwar(pColors, count, color, t); }
+void AddColorsSaturate(LedColor* pColors, const LedColor* pAdd, int count) { AddColorsSaturateSwar(pColors, pAdd, count); }
+
+#endif
+
+// The reference versions - one channel at a time, no tricks
+
+static LedColor MakeColor(uint32_t red, uint32_t green, uint32_t blue)
+{
+	return (red << 16) | (green << 8) | blue;
+}
+
+void FillColorsReference(LedColor* pColors, int count, LedColor color)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		pColors[ledIndex] = color;
+	}
+}
+
+void ScaleColorsReference(LedColor* pColors, int count, ColorScale scale)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		LedColor c = pColors[ledIndex];
+		pColors[ledIndex] = MakeColor((Red(c) * scale) / 256, (Green(c) * scale) / 256, (Blue(c) * scale) / 256);
+	}
+}
+
+void CrossFadeColorsReference(LedColor* pColors, int count, LedColor color, ColorScale t)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		LedColor c = pColors[ledIndex];
+		pColors[ledIndex] = MakeColor(
+			(Red(c) * (256 - t) + Red(color) * t) / 256,
+			(Green(c) * (256 - t) + Green(color) * t) / 256,
+			(Blue(c) * (256 - t) + Blue(color) * t) / 256);
+	}
+}
+
+void AddColorsSaturateReference(LedColor* pColors, const LedColor* pAdd, int count)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		uint32_t red = Red(pColors[ledIndex]) + Red(pAdd[ledIndex]);
+		uint32_t green = Green(pColors[ledIndex]) + Green(pAdd[ledIndex]);
+		uint32_t blue = Blue(pColors[ledIndex]) + Blue(pAdd[ledIndex]);
+		pColors[ledIndex] = MakeColor((red > 255) ? 255 : red, (green > 255) ? 255 : green, (blue > 255) ? 255 : blue);
+	}
+}
+
+void MixColorsReference(LedColor* pColors, const LedColor* pMix, int count, ColorScale t)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		LedColor c = pColors[ledIndex];
+		LedColor m = pMix[ledIndex];
+		pColors[ledIndex] = MakeColor(
+			(Red(c) * (256 - t) + Red(m) * t) / 256,
+			(Green(c) * (256 - t) + Green(m) * t) / 256,
+			(Blue(c) * (256 - t) + Blue(m) * t) / 256);
+	}
+}
+
+void MultiplyColorsReference(LedColor* pColors, const LedColor* pMultiply, int count)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		LedColor c = pColors[ledIndex];
+		LedColor m = pMultiply[ledIndex];
+		pColors[ledIndex] = MakeColor((Red(c) * (Red(m) + 1)) / 256, (Green(c) * (Green(m) + 1)) / 256, (Blue(c) * (Blue(m) + 1)) / 256);
+	}
+}
+
+void AlphaBlendColorsReference(LedColor* pColors, const LedColor* pBlend, int count, ColorScale opacity)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		LedColor c = pColors[ledIndex];
+		LedColor b = pBlend[ledIndex];
+		uint32_t alpha = b >> 24;
+		uint32_t t = ((alpha == 255 ? 256 : alpha) * opacity) / 256;
+		pColors[ledIndex] = MakeColor(
+			(Red(c) * (256 - t) + Red(b) * t) / 256,
+			(Green(c) * (256 - t) + Green(b) * t) / 256,
+			(Blue(c) * (256 - t) + Blue(b) * t) / 256);
+	}
+}
+
+void RepeatPatternReference(LedColor* pColors, int count, const LedColor* pPattern, int patternSize, int patternIndex)
+{
+	for (int ledIndex = 0; ledIndex < count; ++ledIndex)
+	{
+		pColors[ledIndex] = pPattern[patternIndex];
+		patternIndex = (patternIndex + 1) % patternSize;
+	}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Animator.h"
+
+// The loops that touch every LED - fills, fades and patterns.  The Photon
+// has no FPU or SIMD so colors get scaled with 8 bit fixed point factors and
+// SWAR tricks: red and blue sit 16 bits apart in a LedColor, so masking out
+// green lets one 32 bit multiply scale both of them at once without the
+// results running into each other.  A color takes two multiplies instead of
+// three float conversions and multiplies.
+//
+// On the PC the scale, cross-fade and add kernels use SSE2 when the compiler
+// has it, four LEDs at a time.  Each kernel also has a Reference version -
+// plain per-channel code that the others have to match exactly.  The unit
+// tests check they do and BatchSimulator -bench times them.
+//
+// The top byte of a color isn't a channel (the strip ignores it) and comes
+// out of every kernel but fill and pattern as 0.  Layers blended with
+// AlphaBlendColors carry their alpha in it.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COLOR_KERNELS_SSE2
+#endif
+
+// 0 to colorScaleOne for 0.0 to 1.0
+typedef uint16_t ColorScale;
+const ColorScale colorScaleOne = 256;
+
+// These are constexpr so StaticAnimator.h can build patterns at compile
+// time, which means a single return each
+constexpr ColorScale ColorScaleFromFloat(float scale)
+{
+	return (scale <= 0.0f) ? 0 :
+		(scale >= 1.0f) ? colorScaleOne :
+		(ColorScale)(scale * colorScaleOne + 0.5f);
+}
+
+// Each channel times scale / 256, rounded down
+constexpr LedColor ScaleColorFixed(ColorScale scale, LedColor color)
+{
+	return ((((color & 0x00FF00FF) * scale) >> 8) & 0x00FF00FF) |
+		((((color & 0x0000FF00) * scale) >> 8) & 0x0000FF00);
+}
+
+// Up from 0 over fadeInDuration, colorScaleOne for holdDuration, then back
+// down to 0 over fadeOutDuration
+constexpr ColorScale FadeScale(TickCount localTime, TickCount fadeInDuration, TickCount holdDuration, TickCount fadeOutDuration)
+{
+	return (localTime < fadeInDuration) ? (ColorScale)(((uint64_t)localTime * colorScaleOne) / fadeInDuration) :
+		(localTime < fadeInDuration + holdDuration) ? colorScaleOne :
+		(localTime - (fadeInDuration + holdDuration) >= fadeOutDuration) ? 0 :
+		(ColorScale)(colorScaleOne - ((uint64_t)(localTime - (fadeInDuration + holdDuration)) * colorScaleOne) / fadeOutDuration);
+}
+
+// a at t of 0 up to b at t of colorScaleOne.  The weights add up to 256 so
+// each channel's sum stays under 16 bits.
+inline LedColor CrossFadeColorFixed(ColorScale t, LedColor a, LedColor b)
+{
+	uint32_t ta = colorScaleOne - t;
+	uint32_t redBlue = ((((a & 0x00FF00FF) * ta) + ((b & 0x00FF00FF) * t)) >> 8) & 0x00FF00FF;
+	uint32_t green = ((((a & 0x0000FF00) * ta) + ((b & 0x0000FF00) * t)) >> 8) & 0x0000FF00;
+	return redBlue | green;
+}
+
+// Each channel a + b, stopping at 255.  The low 7 bits of every byte add up
+// without carrying into the next byte, then the top bits get added in and
+// any byte that carried out gets all its bits set.
+inline LedColor AddColorSaturate(LedColor a, LedColor b)
+{
+	uint32_t low = (a & 0x7F7F7F7F) + (b & 0x7F7F7F7F);
+	uint32_t sum = low ^ ((a ^ b) & 0x80808080);
+	uint32_t carry = ((a & b) | ((a | b) & ~sum)) & 0x80808080;
+	return (sum | ((carry >> 7) * 0xFF)) & 0x00FFFFFF;
+}
+
+// Each channel a * (b + 1) / 256, so white leaves a alone and black makes it
+// black.  The channels of b are all different so this takes a multiply each.
+inline LedColor MultiplyColorFixed(LedColor a, LedColor b)
+{
+	uint32_t red = (((a >> 16) & 0xFF) * (((b >> 16) & 0xFF) + 1)) >> 8;
+	uint32_t green = (((a >> 8) & 0xFF) * (((b >> 8) & 0xFF) + 1)) >> 8;
+	uint32_t blue = ((a & 0xFF) * ((b & 0xFF) + 1)) >> 8;
+	return (red << 16) | (green << 8) | blue;
+}
+
+// a toward b by the alpha in b's top byte times opacity.  An alpha of 255
+// counts as colorScaleOne.
+inline LedColor AlphaBlendColorFixed(ColorScale opacity, LedColor a, LedColor b)
+{
+	uint32_t alpha = b >> 24;
+	uint32_t alphaScale = (alpha == 255) ? colorScaleOne : alpha;
+	return CrossFadeColorFixed((ColorScale)((alphaScale * opacity) >> 8), a, b);
+}
+
+void FillColors(LedColor* pColors, int count, LedColor color);
+void ScaleColors(LedColor* pColors, int count, ColorScale scale);
+// Moves every LED toward color by t
+void CrossFadeColors(LedColor* pColors, int count, LedColor color, ColorScale t);
+void AddColorsSaturate(LedColor* pColors, const LedColor* pAdd, int count);
+// Moves every LED toward the one in pMix by t
+void MixColors(LedColor* pColors, const LedColor* pMix, int count, ColorScale t);
+void MultiplyColors(LedColor* pColors, const LedColor* pMultiply, int count);
+void AlphaBlendColors(LedColor* pColors, const LedColor* pBlend, int count, ColorScale opacity);
+// The pattern over and over, starting patternIndex into it
+void RepeatPattern(LedColor* pColors, int count, const LedColor* pPattern, int patternSize, int patternIndex);
+
+// What the tree runs, for comparing against the SSE2 versions on the PC
+void ScaleColorsSwar(LedColor* pColors, int count, ColorScale scale);
+void CrossFadeColorsSwar(LedColor* pColors, int count, LedColor color, ColorScale t);
+void AddColorsSaturateSwar(LedColor* pColors, const LedColor* pAdd, int count);
+
+void FillColorsReference(LedColor* pColors, int count, LedColor color);
+void ScaleColorsReference(LedColor* pColors, int count, ColorScale scale);
+void CrossFadeColorsReference(LedColor* pColors, int count, LedColor color, ColorScale t);
+void AddColorsSaturateReference(LedColor* pColors, const LedColor* pAdd, int count);
+void MixColorsReference(LedColor* pColors, const LedColor* pMix, int count, ColorScale t);
+void MultiplyColorsReference(LedColor* pColors, const LedColor* pMultiply, int count);
+void AlphaBlendColorsReference(LedColor* pColors, const LedColor* pBlend, int count, ColorScale opacity);
+void RepeatPatternReference(LedColor* pColors, int count, const LedColor* pPattern, int patternSize, int patternIndex);
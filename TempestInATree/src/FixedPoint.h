@@ -0,0 +1,121 @@
+#pragma once
+
+// Q16.16 signed fixed point number.
+//
+// The Photon's Cortex-M3 doesn't have an FPU so every float operation in the
+// game simulation gets emulated in software.  Fixed keeps the same math in
+// integer registers and, as a bonus, is bit-exact between the device and the
+// unit tests on the PC.
+//
+// Values convert implicitly from int and float so constants like 0.05f can be
+// written the same way as before.  Converting a float rounds to the nearest
+// representable value.  Don't use the float conversion with non-constant
+// values in hot code - it's only free when the compiler can fold it.
+//
+// The range is -32768 to 32767.99998.  Converting an int outside of that,
+// and dividing by zero, saturates instead of wrapping - and won't compile in
+// a constant expression so a bad constant gets caught by the compiler.
+class Fixed
+{
+public:
+    static const int fractionBits = 16;
+    static const int32_t oneRaw = 1 << fractionBits;
+
+    constexpr Fixed() : raw_(0) {}
+    constexpr Fixed(int value) : raw_((value > INT32_MAX / oneRaw || value < INT32_MIN / oneRaw) ? SaturateRaw((int64_t)value * oneRaw) : value * oneRaw) {}
+    constexpr Fixed(float value) : raw_((int32_t)(value * (float)oneRaw + ((value < 0.0f) ? -0.5f : 0.5f))) {}
+
+    static constexpr Fixed FromRaw(int32_t raw) { return Fixed(raw, RawTag()); }
+
+    // numerator / denominator without going through float.  Saturates if the
+    // result doesn't fit.
+    static Fixed FromRatio(int64_t numerator, int64_t denominator)
+    {
+        if (denominator == 0) return FromRaw(DivideByZeroRaw(numerator));
+        return FromRaw(SaturateRaw((numerator * oneRaw) / denominator));
+    }
+
+    // A rate per tick with fractionBits more fraction bits than Fixed.  A
+    // speed in lane lengths per millisecond would only have a few significant
+    // bits left as a plain Fixed.
+    static int64_t RatePerTick(Fixed perSecond, int64_t ticksPerSecond) { return ((int64_t)perSecond.raw_ << fractionBits) / ticksPerSecond; }
+
+    // ticks * a RatePerTick without a divide.  Saturates like FromRatio.
+    static Fixed FromTicks(int64_t ticks, int64_t ratePerTick) { return FromRaw(SaturateRaw((ticks * ratePerTick) >> fractionBits)); }
+
+    constexpr int32_t Raw() const { return raw_; }
+    constexpr int ToInt() const { return raw_ / oneRaw; } // truncates towards zero like an (int) cast of a float
+    constexpr float ToFloat() const { return (float)raw_ / (float)oneRaw; }
+
+    constexpr Fixed operator-() const { return FromRaw(-raw_); }
+    Fixed& operator+=(Fixed other) { raw_ += other.raw_; return *this; }
+    Fixed& operator-=(Fixed other) { raw_ -= other.raw_; return *this; }
+    Fixed& operator*=(Fixed other) { *this = *this * other; return *this; }
+
+    friend constexpr Fixed operator+(Fixed a, Fixed b) { return FromRaw(a.raw_ + b.raw_); }
+    friend constexpr Fixed operator-(Fixed a, Fixed b) { return FromRaw(a.raw_ - b.raw_); }
+    friend constexpr Fixed operator*(Fixed a, Fixed b) { return FromRaw((int32_t)(((int64_t)a.raw_ * b.raw_) >> fractionBits)); }
+    friend constexpr Fixed operator/(Fixed a, Fixed b) { return (b.raw_ == 0) ? FromRaw(DivideByZeroRaw(a.raw_)) : FromRaw((int32_t)(((int64_t)a.raw_ * oneRaw) / b.raw_)); }
+
+    friend constexpr bool operator==(Fixed a, Fixed b) { return a.raw_ == b.raw_; }
+    friend constexpr bool operator!=(Fixed a, Fixed b) { return a.raw_ != b.raw_; }
+    friend constexpr bool operator<(Fixed a, Fixed b) { return a.raw_ < b.raw_; }
+    friend constexpr bool operator<=(Fixed a, Fixed b) { return a.raw_ <= b.raw_; }
+    friend constexpr bool operator>(Fixed a, Fixed b) { return a.raw_ > b.raw_; }
+    friend constexpr bool operator>=(Fixed a, Fixed b) { return a.raw_ >= b.raw_; }
+
+private:
+    struct RawTag {};
+    constexpr Fixed(int32_t raw, RawTag) : raw_(raw) {}
+
+    // Not constexpr on purpose, see the range comment at the top
+    static int32_t SaturateRaw(int64_t raw)
+    {
+        if (raw > INT32_MAX) return INT32_MAX;
+        if (raw < INT32_MIN) return INT32_MIN;
+        return (int32_t)raw;
+    }
+
+    static int32_t DivideByZeroRaw(int64_t numerator)
+    {
+        return (numerator > 0) ? INT32_MAX : (numerator < 0) ? INT32_MIN : 0;
+    }
+
+    int32_t raw_;
+};
+
+// GameReal is the number type used by the game simulation - lane and path
+// positions, speeds, time deltas and the collision thresholds.  GameTickRate
+// is a GameReal per tick, for positions that are worked out from a tick count
+// every step.
+// Define TEMPEST_FLOAT_SIMULATION to build the simulation with floats again
+// (handy for comparing against the fixed point version).
+#ifdef TEMPEST_FLOAT_SIMULATION
+
+typedef float GameReal;
+typedef float GameTickRate;
+
+inline GameReal GameRealFromRatio(int64_t numerator, int64_t denominator) { return (float)numerator / (float)denominator; }
+inline GameTickRate GameTickRateFromRate(GameReal perSecond, int64_t ticksPerSecond) { return perSecond / (float)ticksPerSecond; }
+inline GameReal GameRealFromTicks(int64_t ticks, GameTickRate ratePerTick) { return (float)ticks * ratePerTick; }
+inline int GameRealToInt(GameReal value) { return (int)value; }
+inline float GameRealToFloat(GameReal value) { return value; }
+inline GameReal GameRealAbs(GameReal value) { return (value < 0.0f) ? -value : value; }
+inline GameReal GameRealFromQ16(int32_t raw) { return (float)raw / (float)Fixed::oneRaw; }
+inline int32_t GameRealToQ16(GameReal value) { return Fixed(value).Raw(); }
+
+#else
+
+typedef Fixed GameReal;
+typedef int64_t GameTickRate;
+
+inline GameReal GameRealFromRatio(int64_t numerator, int64_t denominator) { return Fixed::FromRatio(numerator, denominator); }
+inline GameTickRate GameTickRateFromRate(GameReal perSecond, int64_t ticksPerSecond) { return Fixed::RatePerTick(perSecond, ticksPerSecond); }
+inline GameReal GameRealFromTicks(int64_t ticks, GameTickRate ratePerTick) { return Fixed::FromTicks(ticks, ratePerTick); }
+inline int GameRealToInt(GameReal value) { return value.ToInt(); }
+inline float GameRealToFloat(GameReal value) { return value.ToFloat(); }
+inline GameReal GameRealAbs(GameReal value) { return (value < Fixed()) ? -value : value; }
+inline GameReal GameRealFromQ16(int32_t raw) { return Fixed::FromRaw(raw); }
+inline int32_t GameRealToQ16(GameReal value) { return value.Raw(); }
+
+#endif
@@ -1,66 +1,233 @@
 #include <vector>
 #include <memory>
+#include <algorithm>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
 #include "GameEngine.h"
+#include "LayerCompositor.h"
 
 
-
-#ifndef _ASSERT
-#define _ASSERT(exp)
-#include <spark_wiring_logging.h>
-#endif
+// The flash tables are odr-used so they need a definition somewhere
+constexpr TreeLane TreeConfig::lanes[];
+constexpr GameEngine::AnimatedState GameEngine::animatedStates[];
+constexpr GameEngine::Level GameEngine::defaultLevels[];
 
 GameEngine::GameEngine()
 {
-    // start led index, end led index, count - calculated, player path led index of end
-    lanes[0] = {99,  56,  -1, 0};
-    lanes[1] = {100, 142, -1, 5};
-    lanes[2] = {188, 147, -1, 10};
-    lanes[3] = {189, 229, -1, 14};
-    lanes[4] = {274, 233, -1, 18};
-    lanes[5] = {275, 315, -1, 23};
-    lanes[6] = {363, 320, -1, 27};
-    _ASSERT(ARRAYSIZE(lanes) == 6 + 1);
-    _ASSERT(ARRAYSIZE(lanes) == laneCount);
-    // update the count of leds
-    for (int i = 0; i < ARRAYSIZE(lanes); ++i)
-    {
-        lanes[i].count = abs(lanes[i].endIndex - lanes[i].startIndex) + 1;
-    }
-
-    // whiteEnemyCount, redEnemyCount, greenEnemyCount, fireRateMultiplier, speedMultiplier, enemySpawnDelta
-    levels[0] = { 15,  0, 0,  1.0f, 1.0f, 2.0f };
-    levels[1] = { 15, 10, 0,  1.0f, 1.0f, 1.0f };
-    levels[2] = { 15, 10, 5,  2.0f, 1.0f, 0.75f };
-    levels[3] = { 20, 20, 10, 3.0f, 2.5f, 0.5f };
-    levels[4] = { 30, 30, 10, 4.0f, 3.5f, 0.5f };
-    _ASSERT(ARRAYSIZE(levels) == 4 + 1);
-    _ASSERT(ARRAYSIZE(levels) == levelCount);
-
-    Animator* pGameStartAnimator = new TreeTransitionAnimator(2000, lanes, ARRAYSIZE(lanes), color_black, color_blue);
-    Animator* pAttractAnimator = new AttractAnimator(treeBaseStartLedIndex, treeBaseEndLedIndex, pathLeftLedIndex, pathRightLedIndex, lanes, ARRAYSIZE(lanes));
-    Animator* pGameOverAnimator = new TreeTransitionAnimator(2000, lanes, ARRAYSIZE(lanes), color_blue, color_black);
-
-    animatedStates[0] = {GameState::GS_ATTRACT_ANIMATION, pAttractAnimator->duration(), true, pAttractAnimator};
-    animatedStates[1] = {GameState::GS_GAME_START_ANIMATION, pGameStartAnimator->duration(), false, pGameStartAnimator};
-    animatedStates[2] = {GameState::GS_LEVEL_START_ANIMATION, 4000, false, NULL};
-    animatedStates[3] = {GameState::GS_LIFE_LOST_ANIMATION, 1000, false, NULL};
-    animatedStates[4] = {GameState::GS_GAME_OVER_ANIMATION, pGameOverAnimator->duration(), false, pGameOverAnimator};
-    _ASSERT(ARRAYSIZE(animatedStates) == 4 + 1);
+    static_assert(LevelsValid(defaultLevels, levelCount), "every level needs enemies and positive speed and spawn delta");
+    static_assert(AnimatedStatesValid(animatedStates, ARRAYSIZE(animatedStates)), "animated states need an animator or a duration");
+
+    BuildGeometryTables();
+    CreateStateAnimators();
 
     StartAttractAnimation();
 }
 
+// stateArena takes the state animators with it
+GameEngine::~GameEngine()
+{
+    delete pLoadedLayout;
+}
+
+// The animators copy the lane layout when they're created so they get
+// recreated when the layout changes.  The old ones all go at once with the
+// arena reset - the programs still point at them until they're recompiled
+// below, but nothing runs them in between.
+void GameEngine::CreateStateAnimators()
+{
+    stateArena.Reset();
+    AnimatorArena::Scope arenaScope(stateArena);
+
+    stateAnimators[AS_ATTRACT] = new AttractAnimator(treeBaseStartLedIndex, treeBaseEndLedIndex, pathLeftLedIndex, pathRightLedIndex, lanes, laneCount);
+    stateAnimators[AS_GAME_START] = new TreeTransitionAnimator(2000, lanes, laneCount, color_black, color_blue);
+    stateAnimators[AS_GAME_OVER] = new TreeTransitionAnimator(2000, lanes, laneCount, color_blue, color_black);
+
+    for (int slot = 0; slot < AS_COUNT; ++slot)
+    {
+        statePrograms[slot].Compile(stateAnimators[slot]);
+    }
+}
+
+TickCount GameEngine::GetAnimatedStateDuration(const AnimatedState* pAnimatedState) const
+{
+    if(pAnimatedState->duration > 0) return pAnimatedState->duration;
+    return stateAnimators[pAnimatedState->animatorSlot]->duration();
+}
+
+static int ReadLayoutInt16(const uint8_t* p) { return (int16_t)(p[0] | (p[1] << 8)); }
+static int32_t ReadLayoutInt32(const uint8_t* p) { return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24)); }
+static void WriteLayoutInt16(uint8_t* p, int value) { p[0] = (uint8_t)value; p[1] = (uint8_t)(value >> 8); }
+static void WriteLayoutInt32(uint8_t* p, int32_t value) { WriteLayoutInt16(p, value & 0xFFFF); WriteLayoutInt16(p + 2, (value >> 16) & 0xFFFF); }
+
+bool GameEngine::LoadLayout(const uint8_t* pBlob, int blobSize)
+{
+    if(blobSize < layoutBlobSize) return false;
+    if((uint32_t)ReadLayoutInt32(pBlob) != layoutBlobMagic) return false;
+    if(pBlob[4] != layoutBlobVersion || pBlob[5] != laneCount || pBlob[6] != levelCount) return false;
+
+    // Parse into a local copy so a bad blob doesn't leave a half loaded layout
+    LoadedLayout layout;
+    const uint8_t* pScan = pBlob + 8;
+    for (int laneIndex = 0; laneIndex < laneCount; ++laneIndex, pScan += 6)
+    {
+        layout.lanes[laneIndex] = {ReadLayoutInt16(pScan), ReadLayoutInt16(pScan + 2), ReadLayoutInt16(pScan + 4)};
+    }
+    for (int levelIndex = 0; levelIndex < levelCount; ++levelIndex, pScan += 16)
+    {
+        Level& level = layout.levels[levelIndex];
+        level.whiteEnemyCount = pScan[0];
+        level.redEnemyCount = pScan[1];
+        level.greenEnemyCount = pScan[2];
+        level.fireRateMultiplier = GameRealFromQ16(ReadLayoutInt32(pScan + 4));
+        level.speedMultiplier = GameRealFromQ16(ReadLayoutInt32(pScan + 8));
+        level.enemySpawnDelta = GameRealFromQ16(ReadLayoutInt32(pScan + 12));
+    }
+
+    // Same checks the flash tables get at compile time
+    if(!TreeLanesFit(layout.lanes, laneCount, totalLedCount, pathLedCount, positionTableQuanta - 1)) return false;
+    if(!LevelsValid(layout.levels, levelCount)) return false;
+
+    if(NULL == pLoadedLayout)
+    {
+        pLoadedLayout = new LoadedLayout;
+    }
+    *pLoadedLayout = layout;
+    lanes = pLoadedLayout->lanes;
+    levels = pLoadedLayout->levels;
+
+    BuildGeometryTables();
+    CreateStateAnimators();
+    StartAttractAnimation();
+    return true;
+}
+
+int GameEngine::SaveLayout(uint8_t* pBlob, int blobSize) const
+{
+    if(blobSize < layoutBlobSize) return 0;
+
+    WriteLayoutInt32(pBlob, layoutBlobMagic);
+    pBlob[4] = layoutBlobVersion;
+    pBlob[5] = laneCount;
+    pBlob[6] = levelCount;
+    pBlob[7] = 0;
+
+    uint8_t* pScan = pBlob + 8;
+    for (int laneIndex = 0; laneIndex < laneCount; ++laneIndex, pScan += 6)
+    {
+        WriteLayoutInt16(pScan, lanes[laneIndex].startIndex);
+        WriteLayoutInt16(pScan + 2, lanes[laneIndex].endIndex);
+        WriteLayoutInt16(pScan + 4, lanes[laneIndex].pathLedIndex);
+    }
+    for (int levelIndex = 0; levelIndex < levelCount; ++levelIndex, pScan += 16)
+    {
+        const Level& level = levels[levelIndex];
+        pScan[0] = (uint8_t)level.whiteEnemyCount;
+        pScan[1] = (uint8_t)level.redEnemyCount;
+        pScan[2] = (uint8_t)level.greenEnemyCount;
+        pScan[3] = 0;
+        WriteLayoutInt32(pScan + 4, GameRealToQ16(level.fireRateMultiplier));
+        WriteLayoutInt32(pScan + 8, GameRealToQ16(level.speedMultiplier));
+        WriteLayoutInt32(pScan + 12, GameRealToQ16(level.enemySpawnDelta));
+    }
+
+    return layoutBlobSize;
+}
+
+void GameEngine::BuildGeometryTables()
+{
+    for (int laneIndex = 0; laneIndex < laneCount; ++laneIndex)
+    {
+        laneLedTables[laneIndex].Build(lanes[laneIndex].startIndex, lanes[laneIndex].endIndex);
+    }
+    pathLedTable.Build(pathLeftLedIndex, pathRightLedIndex);
+
+    for (int playerPosition = 0; playerPosition < pathLedCount; ++playerPosition)
+    {
+        playerPositionLaneIndices[playerPosition] = (int8_t)GetClosestLaneToPathPosition(GameRealFromRatio(playerPosition, pathLedCount));
+    }
+}
+
+void GameEngine::PositionLedTable::Build(int start, int end)
+{
+    _ASSERT(abs(end - start) < positionTableQuanta);
+
+    startIndex = start;
+    endIndex = end;
+    direction = (end < start) ? -1 : 1;
+
+    for (int quantum = 0; quantum <= positionTableQuanta; ++quantum)
+    {
+        GameReal quantumStart = GameRealFromRatio(quantum, positionTableQuanta);
+        GameReal quantumEnd = GameRealFromRatio(quantum + 1, positionTableQuanta);
+        int ledIndex = LedIndexFromRange(startIndex, endIndex, quantumStart);
+        ledIndices[quantum] = (LedIndex)ledIndex;
+
+        if (LedIndexFromRange(startIndex, endIndex, quantumEnd) == ledIndex)
+        {
+            // no LED change in this bucket
+            nextLedPositions[quantum] = quantumEnd;
+            continue;
+        }
+
+        // Binary search for the first position that lands on the next LED.
+        // This uses the same LedIndexFromRange the table replaces so the
+        // table is exact no matter how the rounding works out.
+        GameReal low = quantumStart;
+        GameReal high = quantumEnd;
+        for (;;)
+        {
+            GameReal middle = low + ((high - low) * GameReal(0.5f));
+            if (middle == low || middle == high) break;
+            if (LedIndexFromRange(startIndex, endIndex, middle) == ledIndex)
+            {
+                low = middle;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        _ASSERT(LedIndexFromRange(startIndex, endIndex, high) == ledIndex + direction);
+        nextLedPositions[quantum] = high;
+    }
+}
+
+void GameEngine::SetFixedTimestep(TickCount stepTicks, bool interpolate)
+{
+    fixedStepTicks = stepTicks;
+    interpolateRendering = interpolate && (stepTicks > 0);
+    frameTime = stepTime;
+}
+
 void GameEngine::Step(TickCount time, int playerPosition, bool fireButtonPressed, bool startButtonPressed)
 {
-    stepDeltaTicks = time - stepTime;
-    stepDeltaSeconds = (float)stepDeltaTicks / (float)TicksPerSecond;
-    stepTime = time;
+    frameTime = time;
+    if(0 == fixedStepTicks)
+    {
+        stepDeltaTicks = time - stepTime;
+        stepDeltaSeconds = GameRealFromRatio(stepDeltaTicks, TicksPerSecond);
+        stepTime = time;
+    }
+    else if(time - stepTime > maxSubstepsPerStep * fixedStepTicks)
+    {
+        // Too far behind to catch up - just lose the extra time
+        stepTime = time - maxSubstepsPerStep * fixedStepTicks;
+    }
 
-    stepPlayerPosition = (float)(playerPosition) / (float)pathLedCount;
+    int previousStepPlayerPathIndex = stepPlayerPathIndex;
+    previousStepPlayerPosition = stepPlayerPosition;
+    stepPlayerPathIndex = (playerPosition < 0) ? 0 : (playerPosition >= pathLedCount) ? pathLedCount - 1 : playerPosition;
+    stepPlayerPosition = GameRealFromRatio(stepPlayerPathIndex, pathLedCount);
+
+    // Only a move to the next LED gets swept.  The encoder wraps round the
+    // ends of the path, so anything bigger is a jump - the player didn't
+    // travel the LEDs in between and only gets checked where they landed.
+    if(abs(stepPlayerPathIndex - previousStepPlayerPathIndex) > 1)
+    {
+        previousStepPlayerPosition = stepPlayerPosition;
+    }
     stepFireButtonPressed = fireButtonPressed;
 
     if(startButtonPressed)
@@ -70,6 +237,7 @@ void GameEngine::Step(TickCount time, int playerPosition, bool fireButtonPressed
             startButtonWasReleased = false;
             if(GameState::GS_ATTRACT_ANIMATION == gameState)
             {
+                PushEvent(GameEventType::GE_GAME_STARTED);
                 BeginAnimatedState(GameState::GS_GAME_START_ANIMATION);
             }
             else
@@ -84,7 +252,29 @@ void GameEngine::Step(TickCount time, int playerPosition, bool fireButtonPressed
         startButtonWasReleased = true;
     }
     
+    if(0 == fixedStepTicks)
+    {
+        Simulate();
+        return;
+    }
+
+    while(time - stepTime >= fixedStepTicks)
+    {
+        stepDeltaTicks = fixedStepTicks;
+        stepDeltaSeconds = GameRealFromRatio(stepDeltaTicks, TicksPerSecond);
+        stepTime += fixedStepTicks;
+        Simulate();
+
+        // The player moved at the start of the frame - for the rest of the
+        // steps they're standing still
+        previousStepPlayerPosition = stepPlayerPosition;
+    }
+}
 
+// One step of the game simulation - stepTime and stepDeltaTicks are already
+// set for the step
+void GameEngine::Simulate()
+{
     switch (gameState)
     {
         case GameState::GS_ATTRACT_ANIMATION:
@@ -98,6 +288,92 @@ void GameEngine::Step(TickCount time, int playerPosition, bool fireButtonPressed
             StepLevel();
             break;
     }
+    stats.simulationSteps++;
+}
+
+void GameEngine::SaveSnapshot(Snapshot& snapshot) const
+{
+    // Clear the padding too so two snapshots of the same state compare equal
+    memset((void*)&snapshot, 0, sizeof(snapshot));
+
+    snapshot.version = snapshotVersion;
+    snapshot.gameState = gameState;
+    snapshot.stepTime = stepTime;
+    snapshot.stepDeltaTicks = stepDeltaTicks;
+    snapshot.stepDeltaSeconds = stepDeltaSeconds;
+    snapshot.frameTime = frameTime;
+    snapshot.currentLevelIndex = currentLevelIndex;
+    snapshot.score = score;
+    snapshot.livesRemaining = livesRemaining;
+    snapshot.stepPlayerPosition = stepPlayerPosition;
+    snapshot.previousStepPlayerPosition = previousStepPlayerPosition;
+    snapshot.stepPlayerPathIndex = stepPlayerPathIndex;
+    snapshot.playerShots = playerShots;
+    snapshot.enemyShots = enemyShots;
+    snapshot.enemies = enemies;
+    snapshot.nextEmenySpawnTime = nextEmenySpawnTime;
+    snapshot.whiteEnemiesRemaining = whiteEnemiesRemaining;
+    snapshot.redEnemiesRemaining = redEnemiesRemaining;
+    snapshot.greenEnemiesRemaining = greenEnemiesRemaining;
+    snapshot.stepFireButtonPressed = stepFireButtonPressed;
+    snapshot.fireButtonWasReleased = fireButtonWasReleased;
+    snapshot.startButtonWasReleased = startButtonWasReleased;
+    snapshot.randomState = randomState;
+    snapshot.animatedStateIndex = (NULL == pCurrentAnimatedState) ? -1 : (int)(pCurrentAnimatedState - animatedStates);
+    snapshot.animationStartTime = animationStartTime;
+    snapshot.animationEndTime = animationEndTime;
+}
+
+static bool LaneIndicesValid(const int8_t* pLaneIndices, int count, int laneCount)
+{
+    for(int index = 0; index < count; ++index)
+    {
+        if(pLaneIndices[index] < 0 || pLaneIndices[index] >= laneCount) return false;
+    }
+    return true;
+}
+
+bool GameEngine::LoadSnapshot(const Snapshot& snapshot)
+{
+    if(snapshot.version != snapshotVersion) return false;
+    if((int)snapshot.gameState < (int)GameState::GS_ATTRACT_ANIMATION || (int)snapshot.gameState > (int)GameState::GS_GAME_OVER_ANIMATION) return false;
+    if(snapshot.animatedStateIndex < -1 || snapshot.animatedStateIndex >= ARRAYSIZE(animatedStates)) return false;
+    if(snapshot.currentLevelIndex < 0 || snapshot.currentLevelIndex >= levelCount) return false;
+    if(snapshot.stepPlayerPathIndex < 0 || snapshot.stepPlayerPathIndex >= pathLedCount) return false;
+    if(snapshot.playerShots.count < 0 || snapshot.playerShots.count > snapshot.playerShots.maxCount) return false;
+    if(snapshot.enemyShots.count < 0 || snapshot.enemyShots.count > snapshot.enemyShots.maxCount) return false;
+    if(snapshot.enemies.count < 0 || snapshot.enemies.count > snapshot.enemies.maxCount) return false;
+    // Everything in the pools gets looked up by lane on the next step
+    if(!LaneIndicesValid(snapshot.playerShots.laneIndex, snapshot.playerShots.count, laneCount)) return false;
+    if(!LaneIndicesValid(snapshot.enemyShots.laneIndex, snapshot.enemyShots.count, laneCount)) return false;
+    if(!LaneIndicesValid(snapshot.enemies.laneIndex, snapshot.enemies.count, laneCount)) return false;
+
+    gameState = snapshot.gameState;
+    stepTime = snapshot.stepTime;
+    stepDeltaTicks = snapshot.stepDeltaTicks;
+    stepDeltaSeconds = snapshot.stepDeltaSeconds;
+    frameTime = snapshot.frameTime;
+    currentLevelIndex = snapshot.currentLevelIndex;
+    score = snapshot.score;
+    livesRemaining = snapshot.livesRemaining;
+    stepPlayerPosition = snapshot.stepPlayerPosition;
+    previousStepPlayerPosition = snapshot.previousStepPlayerPosition;
+    stepPlayerPathIndex = snapshot.stepPlayerPathIndex;
+    playerShots = snapshot.playerShots;
+    enemyShots = snapshot.enemyShots;
+    enemies = snapshot.enemies;
+    nextEmenySpawnTime = snapshot.nextEmenySpawnTime;
+    whiteEnemiesRemaining = snapshot.whiteEnemiesRemaining;
+    redEnemiesRemaining = snapshot.redEnemiesRemaining;
+    greenEnemiesRemaining = snapshot.greenEnemiesRemaining;
+    stepFireButtonPressed = snapshot.stepFireButtonPressed;
+    fireButtonWasReleased = snapshot.fireButtonWasReleased;
+    startButtonWasReleased = snapshot.startButtonWasReleased;
+    randomState = snapshot.randomState;
+    pCurrentAnimatedState = (snapshot.animatedStateIndex < 0) ? NULL : animatedStates + snapshot.animatedStateIndex;
+    animationStartTime = snapshot.animationStartTime;
+    animationEndTime = snapshot.animationEndTime;
+    return true;
 }
 
 void GameEngine::StartAttractAnimation()
@@ -106,24 +382,18 @@ void GameEngine::StartAttractAnimation()
     currentLevelIndex = 0;
     score = 0;
     livesRemaining = startingLifeCount;
-    stepPlayerPosition = 0.5;
+    stepPlayerPathIndex = pathLedCount / 2;
+    stepPlayerPosition = 0.5f;
+    previousStepPlayerPosition = stepPlayerPosition;
 
     ResetShotsAndEnemies();
 }
 
 void GameEngine::ResetShotsAndEnemies()
 {
-    memset(shots, 0, sizeof(shots));
-    for (int i = 0; i < ARRAYSIZE(shots); ++i)
-    {
-        shots[i].Invalidate();
-    }
-
-    memset(enemies, 0, sizeof(enemies));
-    for (int i = 0; i < ARRAYSIZE(enemies); ++i)
-    {
-        enemies[i].Invalidate();
-    }
+    playerShots.Clear();
+    enemyShots.Clear();
+    enemies.Clear();
 }
 
 void GameEngine::StartLevel()
@@ -136,10 +406,14 @@ void GameEngine::StartLevel()
     stepFireButtonPressed = false;
     fireButtonWasReleased = false;
     ResetShotsAndEnemies();
+
+    PushEvent(GameEventType::GE_LEVEL_STARTED, -1, currentLevelIndex);
 }
 
 void GameEngine::StepLevel()
 {
+    stats.levelPlayTicks[currentLevelIndex] += stepDeltaTicks;
+
     AdvanceGameObjects();
 
     SpawnNextEnemy();
@@ -151,8 +425,8 @@ void GameEngine::StepLevel()
     {
         if(fireButtonWasReleased)
         {
-            int laneIndex = GetClosestLaneToPathPosition(stepPlayerPosition);
-            AddShot(true, laneIndex, shotSpeed, 1.0f);
+            int laneIndex = playerPositionLaneIndices[stepPlayerPathIndex];
+            AddShot(true, laneIndex, shotSpeed, 1);
             fireButtonWasReleased = false;
         }
     }
@@ -168,35 +442,54 @@ void GameEngine::StepLevel()
 
 void GameEngine::AdvanceGameObjects()
 {
+    // Everything remembers where it was at the start of the step so
+    // HandleCollisions can test the whole distance covered, not just the end
+    // points.  Otherwise a slow frame lets things pass through each other.
+
     // shots
-    for (Shot* pShot = shots; pShot < shots + ARRAYSIZE(shots); ++pShot)
+    for (int shotIndex = 0; shotIndex < playerShots.count; ++shotIndex)
     {
-        if (!pShot->IsValid()) continue;
-        pShot->lanePosition += stepDeltaSeconds * pShot->speed;
+        playerShots.previousLanePosition[shotIndex] = playerShots.lanePosition[shotIndex];
+        playerShots.lanePosition[shotIndex] += stepDeltaSeconds * playerShots.speed[shotIndex];
+    }
+    for (int shotIndex = 0; shotIndex < enemyShots.count; ++shotIndex)
+    {
+        enemyShots.previousLanePosition[shotIndex] = enemyShots.lanePosition[shotIndex];
+        enemyShots.lanePosition[shotIndex] += stepDeltaSeconds * enemyShots.speed[shotIndex];
     }
 
     // enemies
-    for (Enemy* pEnemy = enemies; pEnemy < enemies + ARRAYSIZE(enemies); ++pEnemy)
+    for (int enemyIndex = 0; enemyIndex < enemies.count; ++enemyIndex)
     {
-        if(!pEnemy->IsValid()) continue;
-        if(pEnemy->state == EnemyState::inLane)
+        enemies.previousLanePosition[enemyIndex] = enemies.lanePosition[enemyIndex];
+        enemies.previousPathPosition[enemyIndex] = enemies.pathPosition[enemyIndex];
+
+        if(enemies.state[enemyIndex] == EnemyState::inLane)
         {
-            pEnemy->lanePosition = ((float)(stepTime - pEnemy->startTime) / (float)TicksPerSecond) * pEnemy->speed;
-            if (pEnemy->lanePosition > 1.0f)
+            GameReal lanePosition = GameRealFromTicks(stepTime - enemies.startTime[enemyIndex], enemies.speedPerTick[enemyIndex]);
+            if (lanePosition > 1)
             {
                 // Enemy made it to the end of the lane, have it travel towards the player now
-                pEnemy->lanePosition = 1.0f;
-                pEnemy->state = EnemyState::onPlayerPath;
-                pEnemy->startTime = stepTime;
-                pEnemy->pathPosition = lanes[pEnemy->laneIndex].GetPathPosition();
+                lanePosition = 1;
+                enemies.state[enemyIndex] = EnemyState::onPlayerPath;
+                enemies.startTime[enemyIndex] = stepTime;
+                enemies.pathPosition[enemyIndex] = GetLanePathPosition(enemies.laneIndex[enemyIndex]);
+                enemies.previousPathPosition[enemyIndex] = enemies.pathPosition[enemyIndex];
             }
+            enemies.lanePosition[enemyIndex] = lanePosition;
         }
         else
         {
             // enemy is in the EnemyState::onPlayerPath state
-            float delta = stepDeltaSeconds * pEnemy->speed;
-            delta *= (stepPlayerPosition > pEnemy->pathPosition) ? 1.0f : -1.0f;
-            pEnemy->pathPosition += delta;
+            GameReal delta = stepDeltaSeconds * enemies.speed[enemyIndex];
+            if (stepPlayerPosition > enemies.pathPosition[enemyIndex])
+            {
+                enemies.pathPosition[enemyIndex] += delta;
+            }
+            else
+            {
+                enemies.pathPosition[enemyIndex] -= delta;
+            }
         }
     }
 }
@@ -218,17 +511,15 @@ void GameEngine::SpawnNextEnemy()
         return;
     }
 
-    nextEmenySpawnTime = stepTime + (TickCount)(levels[currentLevelIndex].enemySpawnDelta * TicksPerSecond);
+    nextEmenySpawnTime = stepTime + (TickCount)GameRealToInt(levels[currentLevelIndex].enemySpawnDelta * (int)TicksPerSecond);
 
-    int newEnemyIndex = 0;
-    while(newEnemyIndex < ARRAYSIZE(enemies) && enemies[newEnemyIndex].IsValid()) newEnemyIndex++;
-    if(newEnemyIndex >= ARRAYSIZE(enemies))
+    if(enemies.IsFull())
     {
         // No space for new enemies.  Skip this spawn...
         return;
     }
 
-    int startingEnemyIndex = rand() % static_cast<int>(EnemyType::ET_COUNT);
+    int startingEnemyIndex = Random(static_cast<int>(EnemyType::ET_COUNT));
     for (int enemyIndex = startingEnemyIndex; ; enemyIndex = (enemyIndex + 1) % static_cast<int>(EnemyType::ET_COUNT))
     {
         int& enemyTypeRemainingToSpawn = GetEnemiesRemaining(static_cast<EnemyType>(enemyIndex));
@@ -237,40 +528,43 @@ void GameEngine::SpawnNextEnemy()
             enemyTypeRemainingToSpawn--;
 
 
-            Enemy* pNew = enemies + newEnemyIndex;
-            *pNew = {};
-            pNew->shotDelta = (TickCount)(1.5f * (float)TicksPerSecond);
-            pNew->state = EnemyState::inLane;
-            pNew->startTime = stepTime;
-            pNew->laneIndex = rand() % ARRAYSIZE(lanes);
-            pNew->lanePosition = 0.0f;
-            pNew->pathPosition = 0.0f;
+            int newEnemyIndex = enemies.Add();
+            stats.enemiesSpawned++;
+            enemies.shotDelta[newEnemyIndex] = (TicksPerSecond * 3) / 2; // 1.5 seconds
+            enemies.state[newEnemyIndex] = EnemyState::inLane;
+            enemies.startTime[newEnemyIndex] = stepTime;
+            enemies.laneIndex[newEnemyIndex] = Random(laneCount);
+            enemies.lanePosition[newEnemyIndex] = 0;
+            enemies.previousLanePosition[newEnemyIndex] = 0;
+            enemies.pathPosition[newEnemyIndex] = 0;
+            enemies.previousPathPosition[newEnemyIndex] = 0;
             switch (static_cast<EnemyType>(enemyIndex))
             {
                 case EnemyType::ET_WHITE:
-                    pNew->shotsRemaining = 1;
-                    pNew->speed = 0.2f;
-                    pNew->color = color_white;
-                    pNew->laneSwitching = false;
-                    pNew->nextLaneSwitchTime = 0;
+                    enemies.shotsRemaining[newEnemyIndex] = 1;
+                    enemies.speed[newEnemyIndex] = 0.2f;
+                    enemies.color[newEnemyIndex] = color_white;
+                    enemies.laneSwitching[newEnemyIndex] = false;
+                    enemies.nextLaneSwitchTime[newEnemyIndex] = 0;
                     break;
                 case EnemyType::ET_RED:
-                    pNew->shotsRemaining = 2;
-                    pNew->speed = 0.3f;
-                    pNew->color = color_red;
-                    pNew->laneSwitching = false;
-                    pNew->nextLaneSwitchTime = 0;
+                    enemies.shotsRemaining[newEnemyIndex] = 2;
+                    enemies.speed[newEnemyIndex] = 0.3f;
+                    enemies.color[newEnemyIndex] = color_red;
+                    enemies.laneSwitching[newEnemyIndex] = false;
+                    enemies.nextLaneSwitchTime[newEnemyIndex] = 0;
                     break;
                 case EnemyType::ET_GREEN:
-                    pNew->shotsRemaining = 4;
-                    pNew->speed = 0.4f;
-                    pNew->color = color_green;
-                    pNew->laneSwitching = true;
-                    pNew->nextLaneSwitchTime = 0;
+                    enemies.shotsRemaining[newEnemyIndex] = 4;
+                    enemies.speed[newEnemyIndex] = 0.4f;
+                    enemies.color[newEnemyIndex] = color_green;
+                    enemies.laneSwitching[newEnemyIndex] = true;
+                    enemies.nextLaneSwitchTime[newEnemyIndex] = 0;
                     break;
             }
 
-            pNew->nextShotTime = stepTime + pNew->shotDelta;
+            enemies.speedPerTick[newEnemyIndex] = GameTickRateFromRate(enemies.speed[newEnemyIndex], TicksPerSecond);
+            enemies.nextShotTime[newEnemyIndex] = stepTime + enemies.shotDelta[newEnemyIndex];
             break;
         }
     }
@@ -278,19 +572,17 @@ void GameEngine::SpawnNextEnemy()
 
 void GameEngine::FireEnemyShots()
 {
-    for(Enemy* pEnemy = enemies; pEnemy < enemies + ARRAYSIZE(enemies); ++pEnemy)
+    for (int enemyIndex = 0; enemyIndex < enemies.count; ++enemyIndex)
     {
-        if(!pEnemy->IsValid()) continue;
-
-        if(pEnemy->nextShotTime <= stepTime && pEnemy->shotsRemaining > 1)
+        if(enemies.nextShotTime[enemyIndex] <= stepTime && enemies.shotsRemaining[enemyIndex] > 1)
         {
             // Time to shoot
-            if(pEnemy->state == EnemyState::inLane)
+            if(enemies.state[enemyIndex] == EnemyState::inLane)
             {
-                AddShot(false, pEnemy->laneIndex, pEnemy->speed * 1.5f, pEnemy->lanePosition); // TODO - maybe we need a shotSpeed for enemies
-                pEnemy->shotsRemaining--;
+                AddShot(false, enemies.laneIndex[enemyIndex], enemies.speed[enemyIndex] * GameReal(1.5f), enemies.lanePosition[enemyIndex]); // TODO - maybe we need a shotSpeed for enemies
+                enemies.shotsRemaining[enemyIndex]--;
             }
-            pEnemy->nextShotTime = stepTime + pEnemy->shotDelta;
+            enemies.nextShotTime[enemyIndex] = stepTime + enemies.shotDelta[enemyIndex];
 
         }
     }
@@ -298,136 +590,294 @@ void GameEngine::FireEnemyShots()
 
 void GameEngine::HandleCollisions()
 {
-    // Check for collisions with player shots
-    for(Shot* pPlayerShot = shots; pPlayerShot < shots + ARRAYSIZE(shots); ++pPlayerShot)
+    // Entities that get used up in a collision are flagged here and removed
+    // from their pools at the end so the bucket indices stay valid
+    bool playerShotUsed[ARRAYSIZE(playerShots.laneIndex)] = {};
+    bool enemyShotUsed[ARRAYSIZE(enemyShots.laneIndex)] = {};
+    bool enemyUsed[ARRAYSIZE(enemies.laneIndex)] = {};
+
+    bool enemyInLane[ARRAYSIZE(enemies.laneIndex)];
+    for (int enemyIndex = 0; enemyIndex < enemies.count; ++enemyIndex)
     {
-        if(!pPlayerShot->IsValid() || !pPlayerShot->player) continue;
+        enemyInLane[enemyIndex] = (EnemyState::inLane == enemies.state[enemyIndex]);
+    }
 
-        // player shot and enemy - remove the shot and the enemy and count the hit
-        for(Enemy* pEnemy = enemies; pEnemy < enemies + ARRAYSIZE(enemies); ++pEnemy)
+    int killCount = 0;
+    LaneBuckets playerShotBuckets;
+    LaneBuckets enemyShotBuckets;
+    LaneBuckets enemyBuckets;
+    playerShotBuckets.Build(playerShots.laneIndex, playerShots.previousLanePosition, playerShots.lanePosition, playerShots.count, NULL);
+    enemyShotBuckets.Build(enemyShots.laneIndex, enemyShots.previousLanePosition, enemyShots.lanePosition, enemyShots.count, NULL);
+    enemyBuckets.Build(enemies.laneIndex, enemies.previousLanePosition, enemies.lanePosition, enemies.count, enemyInLane);
+
+    // A player shot hits an enemy, in a lane or on the path, before it can
+    // hit an enemy shot
+    for (int laneIndex = 0; laneIndex < laneCount; ++laneIndex)
+    {
+        if (playerShotBuckets.Count(laneIndex) == 0) continue;
+
+        SweepRun playerShotRun = { playerShotBuckets.Begin(laneIndex), playerShotBuckets.Count(laneIndex), playerShots.previousLanePosition, playerShots.lanePosition, playerShotUsed };
+        SweepRun enemyRun = { enemyBuckets.Begin(laneIndex), enemyBuckets.Count(laneIndex), enemies.previousLanePosition, enemies.lanePosition, enemyUsed };
+
+        // player shot and enemy in a lane - remove the shot and the enemy.
+        // The kill events go out below.
+        // TODO - score the hit
+        int kills = SweepLane(playerShotRun, enemyRun, shotEnemyCollisionThreshold);
+        stats.laneKills += kills;
+        stats.levelKills[currentLevelIndex] += kills;
+        killCount += kills;
+    }
+
+    // Enemies on the player path sorted by the low end of the path they
+    // covered this step.  Only the ones near the player matter.
+    uint8_t pathEnemies[ARRAYSIZE(enemies.laneIndex)];
+    int pathEnemyCount = 0;
+    for (int enemyIndex = 0; enemyIndex < enemies.count; ++enemyIndex)
+    {
+        if (enemyInLane[enemyIndex]) continue;
+
+        GameReal low = std::min(enemies.previousPathPosition[enemyIndex], enemies.pathPosition[enemyIndex]);
+        int insertAt = pathEnemyCount++;
+        while (insertAt > 0 && std::min(enemies.previousPathPosition[pathEnemies[insertAt - 1]], enemies.pathPosition[pathEnemies[insertAt - 1]]) > low)
         {
-            if(!pEnemy->IsValid()) continue;
+            pathEnemies[insertAt] = pathEnemies[insertAt - 1];
+            insertAt--;
+        }
+        pathEnemies[insertAt] = (uint8_t)enemyIndex;
+    }
 
-            bool enemyHit = false;
-            if(EnemyState::inLane == pEnemy->state)
-            {
-                // Enemy is in a lane so check lane index and how close the shot is to the enemy
-                if(pEnemy->laneIndex == pPlayerShot->laneIndex)
-                {
-                    enemyHit = abs(pEnemy->lanePosition - pPlayerShot->lanePosition) < shotEnemyCollisionThreshold;
-                }
-            }
-            else
-            {
-                // When an enemy is on the player path, the player needs to have
-                // just shot and the player must be close enough to the enemy.
-                enemyHit = (pPlayerShot->lanePosition > shotEnemySideCollisionPositionThreshold) &&
-                    (abs(pEnemy->pathPosition - stepPlayerPosition) < playerEnemySideDestroyPositionThreshold);
-            }
+    // When an enemy is on the player path, the player needs to have
+    // just shot and the player must be close enough to the enemy.  The shot
+    // comes from where the player is now but the enemy may have moved past
+    // that spot during the step.
+    int nextPathEnemy = 0;
+    for (int playerShotIndex = 0; playerShotIndex < playerShots.count; ++playerShotIndex)
+    {
+        if (playerShotUsed[playerShotIndex]) continue;
+        if (playerShots.lanePosition[playerShotIndex] <= shotEnemySideCollisionPositionThreshold) continue;
 
-            if(enemyHit)
-            {
-                // TODO - score the hit
-                // TODO - sound maybe some day :-)
-                pEnemy->Invalidate();
-                pPlayerShot->Invalidate();
-                break; // shot can only kill one enemy so don't look at more enemies and go to the next shot
-            }
+        // shot can only kill one enemy
+        for (; nextPathEnemy < pathEnemyCount; ++nextPathEnemy)
+        {
+            int enemyIndex = pathEnemies[nextPathEnemy];
+            if (std::min(enemies.previousPathPosition[enemyIndex], enemies.pathPosition[enemyIndex]) >= stepPlayerPosition + playerEnemySideDestroyPositionThreshold) break;
+            if (!SweptHit(stepPlayerPosition, stepPlayerPosition, enemies.previousPathPosition[enemyIndex], enemies.pathPosition[enemyIndex], playerEnemySideDestroyPositionThreshold)) continue;
+
+            playerShotUsed[playerShotIndex] = true;
+            enemyUsed[enemyIndex] = true;
+            stats.pathKills++;
+            stats.levelKills[currentLevelIndex]++;
+            killCount++;
+            nextPathEnemy++;
+            break;
         }
-        if(!pPlayerShot->IsValid()) continue;
+    }
+
+    for (int laneIndex = 0; laneIndex < laneCount; ++laneIndex)
+    {
+        if (playerShotBuckets.Count(laneIndex) == 0 || enemyShotBuckets.Count(laneIndex) == 0) continue;
+
+        SweepRun playerShotRun = { playerShotBuckets.Begin(laneIndex), playerShotBuckets.Count(laneIndex), playerShots.previousLanePosition, playerShots.lanePosition, playerShotUsed };
+        SweepRun enemyShotRun = { enemyShotBuckets.Begin(laneIndex), enemyShotBuckets.Count(laneIndex), enemyShots.previousLanePosition, enemyShots.lanePosition, enemyShotUsed };
 
         // player shot and enemy shot - remove the shot and the enemy shot - is this worth any points?
-        for(Shot* pEnemyShot = shots; pEnemyShot < shots + ARRAYSIZE(shots); ++pEnemyShot)
+        int shotsDestroyed = SweepLane(playerShotRun, enemyShotRun, playerShotEnemyShotCollisionThreshold);
+        stats.enemyShotsDestroyed += shotsDestroyed;
+        for (int i = 0; i < shotsDestroyed; ++i)
         {
-            if(!pEnemyShot->IsValid() || pEnemyShot->player) continue;
-            if(pPlayerShot->laneIndex != pEnemyShot->laneIndex) continue;
-            if(abs(pPlayerShot->lanePosition - pEnemyShot->lanePosition) < playerShotEnemyShotCollisionThreshold)
-            {
-                // TODO - score ?
-                pPlayerShot->Invalidate();
-                pEnemyShot->Invalidate();
-                break; // player shot can only hit one enemy shot even if the're very close
-            }
+            PushEvent(GameEventType::GE_ENEMY_SHOT_DESTROYED, laneIndex);
         }
-        if(!pPlayerShot->IsValid()) continue;
+    }
 
-        // Player shot goes away when it hits the start of the lane
-        if(pPlayerShot->lanePosition <= 0.0f)
+    // Only the player's shots have used enemies so far
+    for (int enemyIndex = 0; killCount > 0 && enemyIndex < enemies.count; ++enemyIndex)
+    {
+        if (!enemyUsed[enemyIndex]) continue;
+        PushEvent(GameEventType::GE_ENEMY_KILLED, enemies.laneIndex[enemyIndex], enemyInLane[enemyIndex] ? GEK_IN_LANE : GEK_ON_PATH, enemies.color[enemyIndex]);
+        killCount--;
+    }
+
+    // Player shot goes away when it hits the start of the lane
+    for (int playerShotIndex = playerShots.count - 1; playerShotIndex >= 0; --playerShotIndex)
+    {
+        if (playerShotUsed[playerShotIndex] || playerShots.lanePosition[playerShotIndex] <= 0)
         {
-            pPlayerShot->Invalidate();
+            playerShots.Remove(playerShotIndex);
         }
     }
 
     bool playerDied = false;
+    GameEventDeath deathCause = GED_ENEMY_SHOT;
 
     // See if player was hit by an enemy shot
-    for (Shot* pEnemyShot = shots; pEnemyShot < shots + ARRAYSIZE(shots); ++pEnemyShot)
+    for (int enemyShotIndex = enemyShots.count - 1; enemyShotIndex >= 0; --enemyShotIndex)
     {
-        if (!pEnemyShot->IsValid() || pEnemyShot->player) continue;
+        if (enemyShotUsed[enemyShotIndex])
+        {
+            enemyShots.Remove(enemyShotIndex);
+            continue;
+        }
 
         // enemy shot and end of lane - see if it hit the player - and remove the shot
-        if(pEnemyShot->lanePosition >= 1.0f)
+        if(enemyShots.lanePosition[enemyShotIndex] >= 1)
         {
-            if(abs(lanes[pEnemyShot->laneIndex].GetPathPosition() - stepPlayerPosition) < playerEnemyShotCollisionThreshold)
+            if(GameRealAbs(GetLanePathPosition(enemyShots.laneIndex[enemyShotIndex]) - stepPlayerPosition) < playerEnemyShotCollisionThreshold)
             {
                 playerDied = true;
             }
 
-            pEnemyShot->Invalidate();
+            enemyShots.Remove(enemyShotIndex);
         }
     }
+    if(playerDied)
+    {
+        stats.deathsByEnemyShot++;
+    }
 
-    // See if an enemy ran into the player
+    // See if an enemy ran into the player (or the player ran into an enemy)
+    // - same sorted run as above
     if(!playerDied)
     {
-        for(Enemy* pEnemy = enemies; pEnemy < enemies + ARRAYSIZE(enemies); pEnemy++)
+        GameReal playerHigh = std::max(previousStepPlayerPosition, stepPlayerPosition);
+        for (int pathEnemyIndex = 0; pathEnemyIndex < pathEnemyCount; ++pathEnemyIndex)
         {
-            if(!pEnemy->IsValid()) continue;
-            if(pEnemy->state == EnemyState::onPlayerPath)
-            {
-                if(abs(pEnemy->pathPosition - stepPlayerPosition) < playerEnemyCollisionThreshold)
-                {
-                    playerDied = true;
-                    pEnemy->Invalidate();
-                }
-            }
+            int enemyIndex = pathEnemies[pathEnemyIndex];
+            if (enemyUsed[enemyIndex]) continue;
+            if (std::min(enemies.previousPathPosition[enemyIndex], enemies.pathPosition[enemyIndex]) >= playerHigh + playerEnemyCollisionThreshold) break;
+            if (!SweptHit(previousStepPlayerPosition, stepPlayerPosition, enemies.previousPathPosition[enemyIndex], enemies.pathPosition[enemyIndex], playerEnemyCollisionThreshold)) continue;
+
+            playerDied = true;
+            enemyUsed[enemyIndex] = true;
+        }
+        if(playerDied)
+        {
+            stats.deathsByEnemyCollision++;
+            deathCause = GED_ENEMY_COLLISION;
+        }
+    }
+
+    for (int enemyIndex = enemies.count - 1; enemyIndex >= 0; --enemyIndex)
+    {
+        if (enemyUsed[enemyIndex])
+        {
+            enemies.Remove(enemyIndex);
         }
     }
 
     // Handle the player dieing
     if(playerDied)
     {
+        stats.levelDeaths[currentLevelIndex]++;
+        PushEvent(GameEventType::GE_PLAYER_DIED, playerPositionLaneIndices[stepPlayerPathIndex], deathCause);
         livesRemaining--;
-        for(Shot* pShot = shots; pShot < shots + ARRAYSIZE(shots); ++pShot)
+        ResetShotsAndEnemies();
+
+        BeginAnimatedState(GameState::GS_LIFE_LOST_ANIMATION);
+    }
+}
+
+// True if two things moving in a straight line from their previous to their
+// current positions came within threshold of each other during the step.
+// Both move at a constant speed so the gap between them changes linearly -
+// either it changed sign (they passed each other) or it was smallest at one
+// of the ends.
+bool GameEngine::SweptHit(GameReal previousA, GameReal a, GameReal previousB, GameReal b, GameReal threshold)
+{
+    GameReal previousGap = previousA - previousB;
+    GameReal gap = a - b;
+    if ((previousGap < 0) != (gap < 0)) return true;
+    return GameRealAbs(previousGap) < threshold || GameRealAbs(gap) < threshold;
+}
+
+// Pairs up entries of two lane buckets that came within threshold of each
+// other during the step.  Both runs are sorted by the low end of the stretch
+// each entry covered so for a given A the only candidates are the B entries
+// that start before A's stretch ends.  B entries that ended too far behind
+// one A are also too far behind every later A so the start of the scan only
+// moves forward.  Each entry is used in at most one pair and already used
+// entries are skipped.  Returns the number of pairs.
+int GameEngine::SweepLane(const SweepRun& a, const SweepRun& b, GameReal threshold)
+{
+    int pairCount = 0;
+    int firstB = 0;
+    for (int iA = 0; iA < a.count && firstB < b.count; ++iA)
+    {
+        int indexA = a.pSorted[iA];
+        if (a.pUsed[indexA]) continue;
+
+        GameReal lowA = std::min(a.pPreviousPositions[indexA], a.pPositions[indexA]);
+        GameReal highA = std::max(a.pPreviousPositions[indexA], a.pPositions[indexA]);
+        while (firstB < b.count)
         {
-            pShot->Invalidate();
+            int indexB = b.pSorted[firstB];
+            if (!b.pUsed[indexB] && std::max(b.pPreviousPositions[indexB], b.pPositions[indexB]) > lowA - threshold) break;
+            firstB++;
         }
-        for(Enemy* pEnemy = enemies; pEnemy < enemies + ARRAYSIZE(enemies); ++pEnemy)
+
+        for (int iB = firstB; iB < b.count; ++iB)
         {
-            pEnemy->Invalidate();
-        }
+            int indexB = b.pSorted[iB];
+            if (std::min(b.pPreviousPositions[indexB], b.pPositions[indexB]) >= highA + threshold) break;
+            if (b.pUsed[indexB]) continue;
 
-        BeginAnimatedState(GameState::GS_LIFE_LOST_ANIMATION);
+            if (SweptHit(a.pPreviousPositions[indexA], a.pPositions[indexA], b.pPreviousPositions[indexB], b.pPositions[indexB], threshold))
+            {
+                a.pUsed[indexA] = true;
+                b.pUsed[indexB] = true;
+                pairCount++;
+                break;
+            }
+        }
     }
+    return pairCount;
 }
 
-void GameEngine::HandleLevelCompleted()
+void GameEngine::LaneBuckets::Build(const int8_t* pLaneIndices, const GameReal* pPreviousPositions, const GameReal* pPositions, int count, const bool* pInclude)
 {
-    if(whiteEnemiesRemaining > 0 || redEnemiesRemaining > 0 || greenEnemiesRemaining > 0) return;
-    for(const Enemy* pEnemy = enemies; pEnemy < enemies + ARRAYSIZE(enemies) ; ++pEnemy)
+    // counting sort by lane
+    int laneCounts[laneCount] = {};
+    for (int i = 0; i < count; ++i)
+    {
+        if (pInclude != NULL && !pInclude[i]) continue;
+        laneCounts[pLaneIndices[i]]++;
+    }
+
+    laneStart[0] = 0;
+    for (int laneIndex = 0; laneIndex < laneCount; ++laneIndex)
+    {
+        laneStart[laneIndex + 1] = laneStart[laneIndex] + laneCounts[laneIndex];
+        laneCounts[laneIndex] = laneStart[laneIndex]; // now the insert position
+    }
+
+    for (int i = 0; i < count; ++i)
     {
-        if(pEnemy->IsValid())
+        if (pInclude != NULL && !pInclude[i]) continue;
+
+        // insertion sort by the low end of the covered stretch within the lane's bucket
+        int laneIndex = pLaneIndices[i];
+        GameReal low = std::min(pPreviousPositions[i], pPositions[i]);
+        int insertAt = laneCounts[laneIndex]++;
+        while (insertAt > laneStart[laneIndex] && std::min(pPreviousPositions[sortedIndices[insertAt - 1]], pPositions[sortedIndices[insertAt - 1]]) > low)
         {
-            return;
+            sortedIndices[insertAt] = sortedIndices[insertAt - 1];
+            insertAt--;
         }
+        sortedIndices[insertAt] = (uint8_t)i;
     }
+}
+
+void GameEngine::HandleLevelCompleted()
+{
+    if(whiteEnemiesRemaining > 0 || redEnemiesRemaining > 0 || greenEnemiesRemaining > 0) return;
+    if(enemies.count > 0) return;
 
     // All enemies have been spawned and there are no enemies on the board
     // so go to the next level
+    stats.levelClears[currentLevelIndex]++;
     currentLevelIndex++;
-    if(currentLevelIndex >= ARRAYSIZE(levels))
+    if(currentLevelIndex >= levelCount)
     {
-        currentLevelIndex = ARRAYSIZE(levels) - 1;
+        currentLevelIndex = levelCount - 1;
     }
 
     BeginAnimatedState(GameState::GS_LEVEL_START_ANIMATION);
@@ -436,13 +886,13 @@ void GameEngine::HandleLevelCompleted()
 
 void GameEngine::BeginAnimatedState(GameState newState)
 {
-    for(AnimatedState* pAnimatedState = animatedStates; pAnimatedState < animatedStates + ARRAYSIZE(animatedStates); ++pAnimatedState)
+    for(const AnimatedState* pAnimatedState = animatedStates; pAnimatedState < animatedStates + ARRAYSIZE(animatedStates); ++pAnimatedState)
     {
         if(pAnimatedState->state == newState)
         {
             gameState = newState;
             animationStartTime = stepTime;
-            animationEndTime = stepTime + pAnimatedState->duration;
+            animationEndTime = stepTime + GetAnimatedStateDuration(pAnimatedState);
             pCurrentAnimatedState = pAnimatedState;
             return;
         }
@@ -459,7 +909,7 @@ void GameEngine::StepAnimatedState()
             if(pCurrentAnimatedState->loop)
             {
                 animationStartTime = stepTime;
-                animationEndTime = stepTime + pCurrentAnimatedState->duration;
+                animationEndTime = stepTime + GetAnimatedStateDuration(pCurrentAnimatedState);
             }
             else
             {
@@ -486,6 +936,7 @@ void GameEngine::StepAnimatedState()
                         }
                         else
                         {
+                            PushEvent(GameEventType::GE_GAME_OVER, -1, currentLevelIndex);
                             BeginAnimatedState(GameState::GS_GAME_OVER_ANIMATION);
                         }
                         break;
@@ -505,13 +956,13 @@ void GameEngine::StepAnimatedState()
     // ERROR
 }
 
-void GameEngine::SetAnimatedStateLeds(LedColor* pLeds) const
+void GameEngine::SetAnimatedStateLeds(LedColor* pLeds, LedSpanList& spans)
 {
     if(NULL != pCurrentAnimatedState)
     {
-        if(NULL != pCurrentAnimatedState->pAnimator)
+        if(AS_NONE != pCurrentAnimatedState->animatorSlot)
         {
-            pCurrentAnimatedState->pAnimator->Step(stepTime - animationStartTime, pLeds);
+            statePrograms[pCurrentAnimatedState->animatorSlot].Run(stepTime - animationStartTime, pLeds, spans);
         }
         else
         {
@@ -519,6 +970,7 @@ void GameEngine::SetAnimatedStateLeds(LedColor* pLeds) const
             {
                 case GameState::GS_LEVEL_START_ANIMATION:
                     SetLevelStartAnimationLeds(stepTime - animationStartTime, pLeds);
+                    spans.Add(0, totalLedCount);
                     break;
                 
                 default:
@@ -542,41 +994,25 @@ int& GameEngine::GetEnemiesRemaining(EnemyType et)
     }
 }
 
-void GameEngine::AddShot(bool isPlayer, int laneIndex, float speed, float startingLanePosition)
+void GameEngine::AddShot(bool isPlayer, int laneIndex, GameReal speed, GameReal startingLanePosition)
 {
-    Shot* pShot;
-    Shot* pAvaliableShot = NULL;
-    int playerShotCount;
-
-    for (pShot = shots, playerShotCount = 0; pShot < shots + ARRAYSIZE(shots); ++pShot)
+    // Adding to a full pool does nothing - for the player that's the
+    // maxPlayerShots limit
+    if(isPlayer)
     {
-        if (pShot->IsValid())
+        if(playerShots.Add(laneIndex, -speed, startingLanePosition) >= 0) // lane-lengths per second
         {
-            if(isPlayer && pShot->player)
-            {
-                if(++playerShotCount >= maxPlayerShots)
-                {
-                    return;
-                }
-            }
-        }
-        else
-        {
-            pAvaliableShot = pShot;
+            stats.shotsFired++;
+            PushEvent(GameEventType::GE_SHOT_FIRED, laneIndex);
         }
     }
-
-    if(NULL != pAvaliableShot)
+    else
     {
-        pAvaliableShot->player = isPlayer;
-        pAvaliableShot->laneIndex = laneIndex;
-        pAvaliableShot->speed = speed * (isPlayer ? -1.0f : 1.0f); // lane-lengths per second
-        pAvaliableShot->lanePosition = startingLanePosition;
+        enemyShots.Add(laneIndex, speed, startingLanePosition);
     }
-
 }
 
-int GameEngine::GetClosestLaneToPathPosition(float pathPosition) const
+int GameEngine::GetClosestLaneToPathPosition(GameReal pathPosition) const
 {
     int ledIndex = LedIndexFromRange(pathLeftLedIndex, pathRightLedIndex, pathPosition);
     if(pathLeftLedIndex < pathRightLedIndex)
@@ -590,7 +1026,7 @@ int GameEngine::GetClosestLaneToPathPosition(float pathPosition) const
     
     int closestLaneIndex = -1;
     int closestLaneDistance = INT32_MAX;
-    for (int laneIndex = 0; laneIndex < ARRAYSIZE(lanes); ++laneIndex)
+    for (int laneIndex = 0; laneIndex < laneCount; ++laneIndex)
     {
         int laneDistance = abs(lanes[laneIndex].pathLedIndex - ledIndex);
         if (laneDistance < closestLaneDistance)
@@ -606,79 +1042,120 @@ int GameEngine::GetClosestLaneToPathPosition(float pathPosition) const
 }
 
 
-void GameEngine::SetLeds(LedColor* pLeds) const
+// How far between the previous and the current simulation step to draw
+// things - 1 draws the current step
+GameReal GameEngine::GetRenderAlpha() const
 {
-    // assumes caller set leds to all 0 before calling
+    if(!interpolateRendering) return 1;
+    return GameRealFromRatio(frameTime - stepTime, fixedStepTicks);
+}
 
+void GameEngine::SetLeds(LedColor* pLeds)
+{
     LedColor laneColor = color_blue;
 
-    if(GameState::GS_GAME_START_ANIMATION == gameState)
+    if(GameState::GS_LIFE_LOST_ANIMATION == gameState)
     {
-        SetAnimatedStateLeds(pLeds);
-        return;
+        laneColor = (stepTime % 200) < 50 ? color_black : color_blue;
     }
-    if(GameState::GS_LEVEL_START_ANIMATION == gameState)
+    else if(GameState::GS_PLAYING_LEVEL != gameState)
     {
-        SetAnimatedStateLeds(pLeds);
+        // The animations draw over black
+        if(ledsHoldAnimation)
+        {
+            for (int spanIndex = 0; spanIndex < animationSpans.GetCount(); ++spanIndex)
+            {
+                memset(pLeds + animationSpans[spanIndex].startLedIndex, 0, animationSpans[spanIndex].ledCount * sizeof(LedColor));
+            }
+        }
+        else
+        {
+            memset(pLeds, 0, totalLedCount * sizeof(LedColor));
+        }
+        animationSpans.Clear();
+        SetAnimatedStateLeds(pLeds, animationSpans);
+        ledsHoldAnimation = true;
+        ledsHoldBackground = false;
         return;
     }
-    if(gameState == GameState::GS_LIFE_LOST_ANIMATION)
+    ledsHoldAnimation = false;
+
+    if(!backgroundValid || livesRemaining != backgroundLivesRemaining || currentLevelIndex != backgroundLevelIndex || laneColor != backgroundLaneColor)
     {
-        laneColor = (stepTime % 200) < 50 ? color_black : color_blue;
+        BuildBackground(laneColor);
+        ledsHoldBackground = false;
     }
-    else if(gameState == GameState::GS_GAME_OVER_ANIMATION)
+
+    if(ledsHoldBackground)
     {
-        SetAnimatedStateLeds(pLeds);
-        return;
+        // Erase last frame's sprites
+        for (int i = 0; i < spriteLedCount; ++i)
+        {
+            pLeds[spriteLedIndices[i]] = background[spriteLedIndices[i]];
+        }
     }
-    else if(gameState == GameState::GS_ATTRACT_ANIMATION)
+    else
     {
-        SetAnimatedStateLeds(pLeds);
-        return;
+        memcpy(pLeds, background, sizeof(background));
+        ledsHoldBackground = true;
     }
+    spriteLedCount = 0;
 
+    SetSpriteLed(pLeds, pathLedTable.GetLedIndex(stepPlayerPosition), color_yellow);
 
-    FillLedRange(pLeds, treeBaseStartLedIndex, treeBaseEndLedIndex, color_red);
-    if(livesRemaining > 0)
-    {
-        FillLedRange(pLeds, treeBaseStartLedIndex, treeBaseStartLedIndex + livesRemaining - 1, color_yellow);
-    }
-    FillLedRange(pLeds, treeBaseEndLedIndex, treeBaseEndLedIndex - currentLevelIndex, color_cyan);
-    
-    
-    FillLedRange(pLeds, pathLeftLedIndex, pathRightLedIndex, color_blue);
+    GameReal alpha = GetRenderAlpha();
 
-    pLeds[LedIndexFromRange(pathLeftLedIndex, pathRightLedIndex, stepPlayerPosition)] = color_yellow;
-
-    for (const Lane* pLane = lanes; pLane < lanes + ARRAYSIZE(lanes); ++pLane)
+    for (int shotIndex = 0; shotIndex < playerShots.count; ++shotIndex)
     {
-        FillLedRange(pLeds, pLane->startIndex, pLane->endIndex, laneColor);
+        GameReal lanePosition = GetRenderPosition(playerShots.previousLanePosition[shotIndex], playerShots.lanePosition[shotIndex], alpha);
+        SetSpriteLed(pLeds, laneLedTables[playerShots.laneIndex[shotIndex]].GetLedIndex(lanePosition), color_white);
     }
-
-    for (const Shot* pShot = shots; pShot < shots + ARRAYSIZE(shots); ++pShot)
+    for (int shotIndex = 0; shotIndex < enemyShots.count; ++shotIndex)
     {
-        if (!pShot->IsValid()) continue;
-        LedIndex ledIndex = lanes[pShot->laneIndex].GetLedIndex(pShot->lanePosition);
-        pLeds[ledIndex] = pShot->player ? color_white : color_cyan;
+        GameReal lanePosition = GetRenderPosition(enemyShots.previousLanePosition[shotIndex], enemyShots.lanePosition[shotIndex], alpha);
+        SetSpriteLed(pLeds, laneLedTables[enemyShots.laneIndex[shotIndex]].GetLedIndex(lanePosition), color_cyan);
     }
 
-    for (const Enemy* pEnemy = enemies; pEnemy < enemies + ARRAYSIZE(enemies); ++pEnemy)
+    for (int enemyIndex = 0; enemyIndex < enemies.count; ++enemyIndex)
     {
-        if (!pEnemy->IsValid()) continue;
-
         LedIndex ledIndex;
-        if(pEnemy->state == EnemyState::inLane)
+        if(enemies.state[enemyIndex] == EnemyState::inLane)
         {
-            ledIndex = lanes[pEnemy->laneIndex].GetLedIndex(pEnemy->lanePosition);
+            GameReal lanePosition = GetRenderPosition(enemies.previousLanePosition[enemyIndex], enemies.lanePosition[enemyIndex], alpha);
+            ledIndex = laneLedTables[enemies.laneIndex[enemyIndex]].GetLedIndex(lanePosition);
         }
         else
         {
-            ledIndex = LedIndexFromRange(pathLeftLedIndex, pathRightLedIndex, pEnemy->pathPosition);
+            GameReal pathPosition = GetRenderPosition(enemies.previousPathPosition[enemyIndex], enemies.pathPosition[enemyIndex], alpha);
+            ledIndex = pathLedTable.GetLedIndex(pathPosition);
         }
 
-        pLeds[ledIndex] = pEnemy->color;
+        SetSpriteLed(pLeds, ledIndex, enemies.color[enemyIndex]);
     }
-    
+}
+
+void GameEngine::BuildBackground(LedColor laneColor)
+{
+    memset(background, 0, sizeof(background));
+
+    FillLedRange(background, treeBaseStartLedIndex, treeBaseEndLedIndex, color_red);
+    if(livesRemaining > 0)
+    {
+        FillLedRange(background, treeBaseStartLedIndex, treeBaseStartLedIndex + livesRemaining - 1, color_yellow);
+    }
+    FillLedRange(background, treeBaseEndLedIndex, treeBaseEndLedIndex - currentLevelIndex, color_cyan);
+
+    FillLedRange(background, pathLeftLedIndex, pathRightLedIndex, color_blue);
+
+    for (const Lane* pLane = lanes; pLane < lanes + laneCount; ++pLane)
+    {
+        FillLedRange(background, pLane->startIndex, pLane->endIndex, laneColor);
+    }
+
+    backgroundValid = true;
+    backgroundLivesRemaining = livesRemaining;
+    backgroundLevelIndex = currentLevelIndex;
+    backgroundLaneColor = laneColor;
 }
 
 void GameEngine::SetLevelStartAnimationLeds(TickCount animationTime, LedColor* pLeds) const
@@ -694,7 +1171,7 @@ void GameEngine::SetLevelStartAnimationLeds(TickCount animationTime, LedColor* p
     {
         float t = (float)animationTime / (float)firstPartDuration;
         //spark::Log("animation Time: %d    t:%f", animationTime, t);
-        for (const Lane* pLane = lanes; pLane < lanes + ARRAYSIZE(lanes); ++pLane)
+        for (const Lane* pLane = lanes; pLane < lanes + laneCount; ++pLane)
         {
             ColorWipeLed(pLeds, pLane->startIndex, pLane->endIndex, color_black, color_blue, t);
         }
@@ -703,7 +1180,7 @@ void GameEngine::SetLevelStartAnimationLeds(TickCount animationTime, LedColor* p
     {
         float t = (float)(animationTime - firstPartDuration) / (float)secondPartDuration;
 
-        for (const Lane* pLane = lanes; pLane < lanes + ARRAYSIZE(lanes); ++pLane)
+        for (const Lane* pLane = lanes; pLane < lanes + laneCount; ++pLane)
         {
             ColorWipeLed(pLeds, pLane->startIndex, pLane->endIndex, color_blue, color_black, t);
         }
@@ -713,6 +1190,49 @@ void GameEngine::SetLevelStartAnimationLeds(TickCount animationTime, LedColor* p
 
 }
 
+class GameEngine::ShowAnimator : public Animator
+{
+        GameEngine* pEngine_;
+        const AnimatedState* pAnimatedState_;
+    public:
+        ShowAnimator(GameEngine* pEngine, const AnimatedState* pAnimatedState) : pEngine_(pEngine), pAnimatedState_(pAnimatedState)
+        {
+            duration_ = pEngine->GetAnimatedStateDuration(pAnimatedState);
+        }
+
+        virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+        {
+            if(AS_NONE != pAnimatedState_->animatorSlot)
+            {
+                return pEngine_->stateAnimators[pAnimatedState_->animatorSlot]->StepSpans(localTime, pColors, spans);
+            }
+            // Only the level start draws itself
+            pEngine_->SetLevelStartAnimationLeds(localTime, pColors);
+            spans.Add(0, totalLedCount);
+            return true;
+        }
+
+        virtual bool IsSeekable() const
+        {
+            return (AS_NONE == pAnimatedState_->animatorSlot) || pEngine_->stateAnimators[pAnimatedState_->animatorSlot]->IsSeekable();
+        }
+};
+
+Animator* GameEngine::CreateShowAnimator(Show show)
+{
+    GameState state = (Show::SH_ATTRACT == show) ? GameState::GS_ATTRACT_ANIMATION :
+        (Show::SH_GAME_START == show) ? GameState::GS_GAME_START_ANIMATION :
+        (Show::SH_LEVEL_START == show) ? GameState::GS_LEVEL_START_ANIMATION : GameState::GS_GAME_OVER_ANIMATION;
+    for(const AnimatedState* pAnimatedState = animatedStates; pAnimatedState < animatedStates + ARRAYSIZE(animatedStates); ++pAnimatedState)
+    {
+        if(pAnimatedState->state == state)
+        {
+            return new ShowAnimator(this, pAnimatedState);
+        }
+    }
+    return NULL;
+}
+
 GameEngine::TreeTransitionAnimator::TreeTransitionAnimator(TickCount duration, const Lane* pLanes, int laneCount, LedColor colorStart, LedColor colorEnd)
 {
     duration_ = duration;
@@ -750,12 +1270,17 @@ GameEngine::TreeTransitionAnimator::TreeTransitionAnimator(TickCount duration, c
         pGroup->AddAnimator(pFadeEnd, startColorTime);
     }
 
-    pRootAnimator = pGroup;
+    pRootAnimator.reset(pGroup);
 }
 
-void GameEngine::TreeTransitionAnimator::Step(TickCount localTime, LedColor* pColors)
+bool GameEngine::TreeTransitionAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
 {
-    pRootAnimator->Step(localTime, pColors);
+    return pRootAnimator->StepSpans(localTime, pColors, spans);
+}
+
+void GameEngine::TreeTransitionAnimator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
+{
+    pRootAnimator->Compile(program, timeOrigin, windowStart, windowEnd);
 }
 
 GameEngine::AttractAnimator::AttractAnimator(int treeBaseStartLedIndex, int treeBaseEndLedIndex, int pathLeftLedIndex, int pathRightLedIndex, const Lane* pLanes, int laneCount)
@@ -770,105 +1295,135 @@ GameEngine::AttractAnimator::AttractAnimator(int treeBaseStartLedIndex, int tree
     const TickCount fadeDuration = 1000;
 
     AnimatorGroup* pGroup = new AnimatorGroup();
+    int lanesStartLedIndex = totalLedCount;
+    int lanesEndLedIndex = 0;
     for(int laneIndex = 0; laneIndex < laneCount; ++laneIndex)
     {
         const Lane* pLane = pLanes + laneIndex;
         LedIndicesToStartAndCount(pLane->startIndex, pLane->endIndex, startLedIndex, ledCount);
         pGroup->AddAnimator(new SolidColor(duration_, startLedIndex, ledCount, color_green), 0);
+        lanesStartLedIndex = std::min(lanesStartLedIndex, startLedIndex);
+        lanesEndLedIndex = std::max(lanesEndLedIndex, startLedIndex + ledCount);
     }
 
     LedIndicesToStartAndCount(treeBaseStartLedIndex, treeBaseEndLedIndex, startLedIndex, ledCount);
     pGroup->AddAnimator(new SolidColor(duration_, startLedIndex, ledCount, color_red), 0);
     LedIndicesToStartAndCount(pathLeftLedIndex, pathRightLedIndex, startLedIndex, ledCount);
     pGroup->AddAnimator(new SolidColor(duration_, startLedIndex, ledCount, color_green), 0);
-    pGroup->AddAnimator(new SparkleAnimator(duration_, pLanes, laneCount, 20, 2000, 5000, color_white), 0);
+
+    // The sparkles get alpha blended onto the lanes.  Only they go on a
+    // compositor so the solid colors still compile to plain fills, and its
+    // scratch LEDs only cover the lanes.
+    LayerCompositor* pSparkleLayer = new LayerCompositor(duration_);
+    pSparkleLayer->AddLayer(new SparkleAnimator(duration_, pLanes, laneCount, 20, 2000, 5000, color_white, defaultRandomSeed, true), 0, lanesStartLedIndex, lanesEndLedIndex - lanesStartLedIndex, BlendMode::BM_ALPHA);
+    pGroup->AddAnimator(pSparkleLayer, 0);
 
     auto pFade = new FadeAnimator(fadeDuration, duration_ - (2 * fadeDuration), fadeDuration,  0, totalLedCount, pGroup);
 
-    pRootAnimator = pFade;
+    pRootAnimator.reset(pFade);
+}
+
+bool GameEngine::AttractAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+{
+    return pRootAnimator->StepSpans(localTime, pColors, spans);
 }
 
-void GameEngine::AttractAnimator::Step(TickCount localTime, LedColor* pColors)
+void GameEngine::AttractAnimator::Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd)
 {
-    pRootAnimator->Step(localTime, pColors);
+    pRootAnimator->Compile(program, timeOrigin, windowStart, windowEnd);
 }
 
-GameEngine::SparkleAnimator::SparkleAnimator(TickCount duration, const Lane* pLanes, int laneCount, int sparkleCount, TickCount sparkleDuration,  TickCount sparkleCycleDuration,  LedColor sparkleColor) :
+GameEngine::SparkleAnimator::SparkleAnimator(TickCount duration, const Lane* pLanes, int laneCount, int sparkleCount, TickCount sparkleDuration,  TickCount sparkleCycleDuration,  LedColor sparkleColor, uint32_t seed, bool drawAlpha) :
     pLanes_(pLanes),
     laneCount_(laneCount),
     sparkleCount_(sparkleCount),
     sparkleDuration_(sparkleDuration),
-    sparkleCycleDuration_(sparkleCycleDuration),
-    sparkleColor_(sparkleColor)
+    sparkleCycleDuration_((sparkleCycleDuration > 0) ? sparkleCycleDuration : 1),
+    sparkleColor_(sparkleColor),
+    seed_(seed),
+    drawAlpha_(drawAlpha),
+    lastActiveSparkleCount_(0)
 {
     duration_ = duration;
-    lastLocalTime_ = 0;
-    pSparkles_ = new Sparkle[sparkleCount_];
+}
+
+// Counter based - each value is the lowbias32 mixer run over the inputs one
+// at a time, so there's nothing to carry from one call to the next
+uint32_t GameEngine::SparkleAnimator::SparkleHash(uint32_t seed, uint32_t slot, uint32_t cycle, SparkleStream stream)
+{
+    uint32_t x = seed;
+    uint32_t inputs[] = {slot, cycle, (uint32_t)stream};
+    for(uint32_t input : inputs)
+    {
+        x ^= input + 0x9E3779B9u;
+        x ^= x >> 16;
+        x *= 0x7FEB352Du;
+        x ^= x >> 15;
+        x *= 0x846CA68Bu;
+        x ^= x >> 16;
+    }
+    return x;
 }
 
 float sqr(float f) { return f * f; }
 LedColor CrossFadeColor(float t, LedColor a, LedColor b)
 {
-	LedColor retval = 0;
-    float ti = 1.0f - t;
-
-	retval |= (uint8_t)((float)Red(a)   * ti + (float)Red(b)   * t) << 16;
-	retval |= (uint8_t)((float)Green(a) * ti + (float)Green(b) * t) << 8;
-	retval |= (uint8_t)((float)Blue(a)  * ti + (float)Blue(b)  * t) << 0;
-
-	return retval;
-
+    return CrossFadeColorFixed(ColorScaleFromFloat(t), a, b);
 }
 
-void GameEngine::SparkleAnimator::Step(TickCount localTime, LedColor* pColors)
+int GameEngine::SparkleAnimator::DrawSparkles(TickCount localTime, LedColor* pColors, LedSpanList& spans) const
 {
-    if(localTime < lastLocalTime_)
-    {
-        // we're a stateful animator and only expect time to move forward.
-        // If localTime goes back, it will need to catch up to the start times
-        // for the sparkles before you see any sparkles.
-        // So reset the sparkles if we detedt time moving backwards
-        for(Sparkle* pSparkle = pSparkles_; pSparkle < pSparkles_ + sparkleCount_; ++pSparkle)
-        {
-            pSparkle->Invalidate();
-        }
-    }
-    lastLocalTime_ = localTime;
+    // Sparkles start early enough in their cycle to finish before the next
+    TickCount startRange = (sparkleCycleDuration_ > sparkleDuration_) ? sparkleCycleDuration_ - sparkleDuration_ : 1;
 
-    // Set the LED for any active sparkle
-    for(Sparkle* pSparkle = pSparkles_; pSparkle < pSparkles_ + sparkleCount_; ++pSparkle)
+    int activeSparkleCount = 0;
+    for(int slot = 0; slot < sparkleCount_; ++slot)
     {
-        if(!pSparkle->IsValid()) continue;
+        // Each slot's cycles are offset by a phase so they don't all line up.
+        // Times here are localTime + phase.
+        TickCount phase = SparkleHash(seed_, slot, 0, SS_PHASE) % sparkleCycleDuration_;
+        TickCount time = localTime + phase;
+        uint32_t cycle = time / sparkleCycleDuration_;
+        TickCount startTime = cycle * sparkleCycleDuration_ + SparkleHash(seed_, slot, cycle, SS_START) % startRange;
+
+        // Nothing that would have started before localTime 0
+        if(startTime < phase) continue;
+        if(startTime >= time || startTime + sparkleDuration_ <= time) continue;
+
+        const Lane* pLane = pLanes_ + SparkleHash(seed_, slot, cycle, SS_LANE) % laneCount_;
+        int startLedIndex;
+        int ledCount;
+        LedIndicesToStartAndCount(pLane->startIndex, pLane->endIndex, startLedIndex, ledCount);
+        int ledIndex = startLedIndex + SparkleHash(seed_, slot, cycle, SS_LED) % ledCount;
 
-        if(pSparkle->startTime < localTime && pSparkle->startTime + sparkleDuration_ > localTime)
+        float t = (float)(time - startTime) / (float)sparkleDuration_;
+        float i = t < 0.5f ? sqr(2.0f * t) : sqr(2.0f * (0.5f - (t - 0.5f)));
+        if(drawAlpha_)
         {
-            // sparkle is active
-            float t = (float)(localTime - pSparkle->startTime) / (float)sparkleDuration_;
-            float i = t < 0.5f ? sqr(2.0f * t) : sqr(2.0f * (0.5f - (t - 0.5f)));
-            pColors[pSparkle->index] = CrossFadeColor(i, pColors[pSparkle->index], sparkleColor_);
+            // A sparkle already on the LED shows through this one
+            uint32_t alpha = (uint32_t)(i * 255.0f + 0.5f);
+            uint32_t underAlpha = pColors[ledIndex] >> 24;
+            alpha += (underAlpha * (255 - alpha)) / 255;
+            pColors[ledIndex] = (sparkleColor_ & 0x00FFFFFF) | (alpha << 24);
         }
-
-        // see if this sparkle is done
-        if(pSparkle->startTime + sparkleCycleDuration_ < localTime)
+        else
         {
-            pSparkle->Invalidate();
+            pColors[ledIndex] = CrossFadeColor(i, pColors[ledIndex], sparkleColor_);
         }
+        spans.Add(ledIndex, 1);
+        activeSparkleCount++;
     }
+    return activeSparkleCount;
+}
 
-    // Create sparkles for any open spots
-    for(int sparkleIndex = 0; sparkleIndex < sparkleCount_; ++sparkleIndex)
-    {
-        Sparkle* pSparkle = pSparkles_ + sparkleIndex;
-
-        if(pSparkle->IsValid()) continue;
-
-        const Lane* pLane = pLanes_ + (rand() % laneCount_);
-        int startLedIndex;
-        int ledCount;
-        LedIndicesToStartAndCount(pLane->startIndex, pLane->endIndex, startLedIndex, ledCount);
+bool GameEngine::SparkleAnimator::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+{
+    int activeSparkleCount = DrawSparkles(localTime, pColors, spans);
 
-        pSparkle->startTime = localTime + (rand() % (int) sparkleCycleDuration_);
-        pSparkle->index = startLedIndex + (rand() % ledCount);
-    }
+    // Sparkles are always fading in or out, and one that just ended leaves
+    // its LED to whatever is under it
+    bool changed = (activeSparkleCount > 0 || lastActiveSparkleCount_ > 0);
+    lastActiveSparkleCount_ = activeSparkleCount;
+    return changed;
 }
 
@@ -1,6 +1,18 @@
 #pragma once
 
 #include "Animator.h"
+#include "ColorKernels.h"
+#include "FixedPoint.h"
+#include "GameEvents.h"
+#include "TreeConfig.h"
+
+#include <string.h>
+#include <type_traits>
+
+#ifndef _ASSERT
+#define _ASSERT(exp)
+#include <spark_wiring_logging.h>
+#endif
 
 #ifndef ARRASIZE
 #define ARRAYSIZE(a) ((int)(sizeof(a) / sizeof(*a)))
@@ -16,28 +28,49 @@ class GameEngine
     friend class UnitTests::UnitTests;
 
 private:
-    static const int totalLedCount = 400;
-    static const int treeBaseStartLedIndex = 1;
-    static const int treeBaseEndLedIndex = 17;
-    static const int pathLeftLedIndex = 55;
-    static const int pathRightLedIndex = 27;
-    static const int pathLedCount = 29; // abs(pathRightLedIndex - pathLeftLedIndex) + 1;
+    // Geometry and capacities come from the tree's TreeConfig
+    static const int totalLedCount = TreeConfig::totalLedCount;
+    static const int treeBaseStartLedIndex = TreeConfig::treeBaseStartLedIndex;
+    static const int treeBaseEndLedIndex = TreeConfig::treeBaseEndLedIndex;
+    static const int pathLeftLedIndex = TreeConfig::pathLeftLedIndex;
+    static const int pathRightLedIndex = TreeConfig::pathRightLedIndex;
+    static const int pathLedCount = TreeLedRangeLength(pathLeftLedIndex, pathRightLedIndex);
 
     static const int levelCount = 5;
 
-    static const int laneCount = 7;
-    static const int maxEnemies = 20; // maximum number of simultanious enemies
-
-    static const int maxActiveShots = 30; // maximum number of simultanious shots (player and enemy)
-    static const int maxPlayerShots = 4; // maximum number of shots the player can have active on the board at once
-    const float shotSpeed = 0.4f; // how lane lengths a player shot travels in a second
-
-    const float shotEnemyCollisionThreshold = 0.05f; // how close a shot needs to be to an enemy hit it
-    const float shotEnemySideCollisionPositionThreshold = 0.95f; // When the enemy is on the player path, how far down the lane the shot still needs to be to have then enemy get destroyed
-    const float playerEnemySideDestroyPositionThreshold = 0.1f; // When the enemy is on the player path, how close the enemy needs to be to the player to destroy the enemy
-    const float playerShotEnemyShotCollisionThreshold = 0.05f; // how close the player's shot needs to be to an enemy shot to count a hit
-    const float playerEnemyCollisionThreshold = 0.05f; // How close a player needs to be to an enemy for the player to die
-    const float playerEnemyShotCollisionThreshold = 0.1f; // How close a player needs to be to an enemy shot on the player path for the player to die
+    static const int laneCount = TreeConfig::laneCount;
+    static const int longestLaneLength = TreeLongestLaneLength(TreeConfig::lanes, laneCount);
+    // More than the LED count of the longest lane and the path so a bucket of
+    // the position tables never holds more than one LED change.  A power of
+    // two so the bucket edges are exact.  Layouts loaded at runtime have to fit
+    // in the tables built for the flash lanes.
+    static const int positionTableQuanta = TreePowerOfTwoAbove((longestLaneLength > pathLedCount) ? longestLaneLength : pathLedCount);
+    static const int maxEnemies = TreeConfig::maxEnemies;
+
+    static const int maxActiveShots = TreeConfig::maxActiveShots;
+    static const int maxPlayerShots = TreeConfig::maxPlayerShots;
+    static const int maxBucketEntries = (maxEnemies > maxActiveShots) ? maxEnemies : maxActiveShots;
+    static const int maxSpriteLeds = maxActiveShots + maxEnemies + 1; // shots, enemies and the player
+    static const uint32_t defaultRandomSeed = 2463534242u;
+    static const int maxSubstepsPerStep = 25; // with a fixed timestep, more time than this in one Step is dropped so a long stall doesn't snowball
+    static const size_t stateArenaChunkSize = 8192; // the state animators fit in one chunk
+    static_assert(treeBaseStartLedIndex >= 0 && treeBaseEndLedIndex < totalLedCount, "tree base doesn't fit on the LEDs");
+    static_assert(pathLeftLedIndex >= 0 && pathLeftLedIndex < totalLedCount && pathRightLedIndex >= 0 && pathRightLedIndex < totalLedCount, "path doesn't fit on the LEDs");
+    static_assert(pathLedCount < positionTableQuanta, "path is too long for the position tables");
+    static_assert(laneCount > 0 && laneCount <= INT8_MAX, "lane indices are stored in int8_t");
+    static_assert(TreeLanesFit(TreeConfig::lanes, laneCount, totalLedCount, pathLedCount, positionTableQuanta - 1), "a lane doesn't fit on the LEDs or is too long for the position tables");
+    static_assert(maxPlayerShots > 0 && maxPlayerShots < maxActiveShots, "the enemies need some of the shots");
+    static_assert(maxBucketEntries <= UINT8_MAX + 1, "bucket entries are stored in uint8_t");
+    static_assert(totalLedCount <= UINT16_MAX + 1, "LED indices are stored in LedIndex");
+
+    const GameReal shotSpeed = 0.4f; // how lane lengths a player shot travels in a second
+
+    const GameReal shotEnemyCollisionThreshold = 0.05f; // how close a shot needs to be to an enemy hit it
+    const GameReal shotEnemySideCollisionPositionThreshold = 0.95f; // When the enemy is on the player path, how far down the lane the shot still needs to be to have then enemy get destroyed
+    const GameReal playerEnemySideDestroyPositionThreshold = 0.1f; // When the enemy is on the player path, how close the enemy needs to be to the player to destroy the enemy
+    const GameReal playerShotEnemyShotCollisionThreshold = 0.05f; // how close the player's shot needs to be to an enemy shot to count a hit
+    const GameReal playerEnemyCollisionThreshold = 0.05f; // How close a player needs to be to an enemy for the player to die
+    const GameReal playerEnemyShotCollisionThreshold = 0.1f; // How close a player needs to be to an enemy shot on the player path for the player to die
     const int startingLifeCount = 4;
 
     enum class GameState
@@ -50,22 +83,52 @@ private:
         GS_GAME_OVER_ANIMATION,
     };
 
+    // Animators are created at run time so the flash table refers to them by
+    // their slot in stateAnimators
+    enum AnimatorSlot
+    {
+        AS_NONE = -1, // SetAnimatedStateLeds draws the state itself
+        AS_ATTRACT = 0,
+        AS_GAME_START,
+        AS_GAME_OVER,
+        AS_COUNT,
+    };
+
     struct AnimatedState
     {
         GameState state;
-        TickCount duration;
+        TickCount duration; // 0 to use the duration of the animator
         bool loop;
-        Animator* pAnimator;
+        AnimatorSlot animatorSlot;
     };
 
-    struct Lane
+    typedef TreeLane Lane;
+
+    // Maps a position along a range of LEDs (0 is the start LED, 1 is the end
+    // LED) straight to an LED index with the same answer as LedIndexFromRange.
+    // Positions get quantized into positionTableQuanta buckets.  Each bucket
+    // has the LED at the start of the bucket and the position where the next
+    // LED starts.  Since the range is shorter than positionTableQuanta there
+    // is never more than one LED change in a bucket.
+    struct PositionLedTable
     {
-        int startIndex; // side of the lane where the enemies start
-        int endIndex; // side of the lane where the player is
-        int count; // TODO - are we using this?
-        int pathLedIndex; // position on the path.  0 is the start of the path.  The end of the path is abs(pathEndLedIndex - pathStartLedIndex) - test this :-)
-        int GetLedIndex(float lanePosition) const { return GameEngine::LedIndexFromRange(startIndex, endIndex, lanePosition); }
-        float GetPathPosition() const { return (float)pathLedIndex / (float)GameEngine::pathLedCount;}
+        int startIndex;
+        int endIndex;
+        int direction; // 1 or -1 - which way the LED index moves as the position goes up
+        LedIndex ledIndices[positionTableQuanta + 1];
+        GameReal nextLedPositions[positionTableQuanta + 1];
+
+        void Build(int startIndex, int endIndex);
+        int GetLedIndex(GameReal position) const
+        {
+            if (position < 0 || position > 1)
+            {
+                // off the table - rare so just do the math
+                return GameEngine::LedIndexFromRange(startIndex, endIndex, position);
+            }
+            int quantum = GameRealToInt(position * positionTableQuanta);
+            return ledIndices[quantum] + ((position >= nextLedPositions[quantum]) ? direction : 0);
+        }
     };
 
     struct Level
@@ -73,20 +136,53 @@ private:
         int whiteEnemyCount;
         int redEnemyCount;
         int greenEnemyCount;
-        float fireRateMultiplier;
-        float speedMultiplier;
-        float enemySpawnDelta;
+        GameReal fireRateMultiplier;
+        GameReal speedMultiplier;
+        GameReal enemySpawnDelta; // seconds
     };
-
-    struct Shot
+    // enemySpawnDelta gets turned into ticks as a GameReal, which tops out
+    // at about 32 seconds worth
+    static constexpr int maxEnemySpawnDeltaSeconds = 30;
+
+    // Shots and enemies are kept in packed structure-of-arrays pools.  The
+    // live entries are always [0, count) - removing an entry moves the last
+    // one into its place - so the per-frame loops only touch live objects and
+    // each field is one contiguous array.
+    // Loops that remove entries walk the pool backwards so the entry that gets
+    // moved into the current slot has already been visited.
+    template<int capacity>
+    struct ShotPool
     {
-        bool player; // otherwise enemy
-        int laneIndex;
-        float speed; // lane-lengths per second
-        float lanePosition;
+        static const int maxCount = capacity;
+
+        int count;
+        int8_t laneIndex[capacity];
+        GameReal speed[capacity]; // lane-lengths per second
+        GameReal lanePosition[capacity];
+        GameReal previousLanePosition[capacity]; // lanePosition before the last step - collisions test the whole move
+
+        bool IsFull() const { return count >= capacity; }
+        void Clear() { count = 0; }
+
+        int Add(int newLaneIndex, GameReal newSpeed, GameReal newLanePosition)
+        {
+            if (IsFull()) return -1;
+            int index = count++;
+            laneIndex[index] = (int8_t)newLaneIndex;
+            speed[index] = newSpeed;
+            lanePosition[index] = newLanePosition;
+            previousLanePosition[index] = newLanePosition;
+            return index;
+        }
 
-        inline bool IsValid() const { return laneIndex >= 0; }
-        inline void Invalidate() { laneIndex = -1; }
+        void Remove(int index)
+        {
+            int last = --count;
+            laneIndex[index] = laneIndex[last];
+            speed[index] = speed[last];
+            lanePosition[index] = lanePosition[last];
+            previousLanePosition[index] = previousLanePosition[last];
+        }
     };
 
     enum class EnemyType
@@ -107,44 +203,61 @@ private:
 
     class AttractAnimator : public Animator
     {
-            Animator* pRootAnimator;
+            std::unique_ptr<Animator> pRootAnimator;
         public:
             AttractAnimator(int treeBaseStartLedIndex, int treeBaseEndLedIndex, int pathLeftLedIndex, int pathRightLedIndex, const Lane* pLanes, int laneCount);
-	        virtual void Step(TickCount localTime, LedColor* pColors);
+	        virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	        virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
+	        virtual bool IsSeekable() const { return pRootAnimator->IsSeekable(); }
     };
 
     class TreeTransitionAnimator : public Animator
     {
-            Animator* pRootAnimator;
+            std::unique_ptr<Animator> pRootAnimator;
         public:
             TreeTransitionAnimator(TickCount duration, const Lane* pLanes, int laneCount, LedColor colorStart, LedColor colorEnd);
-	        virtual void Step(TickCount localTime, LedColor* pColors);
+	        virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	        virtual void Compile(RenderProgram& program, TickCount timeOrigin, TickCount windowStart, TickCount windowEnd);
+	        virtual bool IsSeekable() const { return pRootAnimator->IsSeekable(); }
     };
 
+    // Each of sparkleCount slots sparkles once every sparkleCycleDuration at
+    // a random time on a random lane LED.  The randomness is a hash of the
+    // seed, the slot and which cycle it's in, so what gets drawn only depends
+    // on localTime - it can be stepped at any time in any order, or from
+    // several threads at once through DrawSparkles.
+    //
+    // Sparkles cross-fade whatever is on the LED to sparkleColor.  With
+    // drawAlpha they're drawn as sparkleColor with how far they've faded in as
+    // the alpha in the top byte instead, which only works inside a BM_ALPHA
+    // layer of a LayerCompositor - anywhere else they show up as solid dots.
     class SparkleAnimator : public Animator
     {
-            struct Sparkle
-            {
-                TickCount startTime = 0;
-                LedIndex index = 0;
-
-                bool IsValid() { return startTime > 0; }
-                void Invalidate() { startTime = 0; }
-            };
-            
             const Lane* pLanes_;
             int laneCount_;
             int sparkleCount_;
             TickCount sparkleDuration_;
             TickCount sparkleCycleDuration_;
             LedColor sparkleColor_;
+            uint32_t seed_;
+            bool drawAlpha_;
+
+            int lastActiveSparkleCount_; // only for StepSpans's changed flag
 
-            TickCount lastLocalTime_;
-            Sparkle* pSparkles_;
+            enum SparkleStream
+            {
+                SS_PHASE,
+                SS_START,
+                SS_LANE,
+                SS_LED,
+            };
+            static uint32_t SparkleHash(uint32_t seed, uint32_t slot, uint32_t cycle, SparkleStream stream);
 
         public:
-            SparkleAnimator(TickCount duration, const Lane* pLanes, int laneCount, int sparkleCount, TickCount sparkleDuration,  TickCount sparkleCycleDuration,  LedColor sparkleColor);
-	        virtual void Step(TickCount localTime, LedColor* pColors);
+            SparkleAnimator(TickCount duration, const Lane* pLanes, int laneCount, int sparkleCount, TickCount sparkleDuration,  TickCount sparkleCycleDuration,  LedColor sparkleColor, uint32_t seed = defaultRandomSeed, bool drawAlpha = false);
+            // Draws the sparkles at localTime and returns how many there are
+            int DrawSparkles(TickCount localTime, LedColor* pColors, LedSpanList& spans) const;
+	        virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
     };
 
     EnemyType NextEnemyType(EnemyType et)
@@ -152,43 +265,140 @@ private:
         return static_cast<EnemyType>((static_cast<int>(et) + 1));
     }
 
-    struct Enemy
+    // Broad phase for HandleCollisions.  A counting sort puts pool entries in
+    // per-lane buckets and each bucket is then sorted by the low end of the
+    // stretch of lane the entry covered during the step (the buckets are tiny
+    // and mostly already in order so insertion sort is the right tool) so the
+    // collisions in a lane can be found with one merge sweep instead of
+    // testing every pair.
+    struct LaneBuckets
+    {
+        int laneStart[laneCount + 1]; // bucket for lane L is sortedIndices[laneStart[L]] up to sortedIndices[laneStart[L + 1]]
+        uint8_t sortedIndices[maxBucketEntries];
+
+        // pInclude can be NULL to include every entry
+        void Build(const int8_t* pLaneIndices, const GameReal* pPreviousPositions, const GameReal* pPositions, int count, const bool* pInclude);
+        int Count(int laneIndex) const { return laneStart[laneIndex + 1] - laneStart[laneIndex]; }
+        const uint8_t* Begin(int laneIndex) const { return sortedIndices + laneStart[laneIndex]; }
+    };
+
+    // One side of a SweepLane - the sorted entries of a lane bucket and the
+    // pool arrays they index
+    struct SweepRun
+    {
+        const uint8_t* pSorted;
+        int count;
+        const GameReal* pPreviousPositions;
+        const GameReal* pPositions;
+        bool* pUsed;
+    };
+
+    struct EnemyPool
     {
-        float speed;
-        TickCount shotDelta;
-        LedColor color;
-        bool laneSwitching;
+        static const int maxCount = maxEnemies;
+
+        int count;
+        GameReal speed[maxEnemies];
+        GameTickRate speedPerTick[maxEnemies]; // speed worked out at spawn so moving down the lane doesn't need a divide
+        TickCount shotDelta[maxEnemies];
+        LedColor color[maxEnemies];
+        bool laneSwitching[maxEnemies];
         // enemy type?
-        EnemyState state;
-        TickCount startTime;
+        EnemyState state[maxEnemies];
+        TickCount startTime[maxEnemies];
+
+        int8_t laneIndex[maxEnemies];
+        GameReal lanePosition[maxEnemies];
+        GameReal previousLanePosition[maxEnemies];
+        int shotsRemaining[maxEnemies];
+        TickCount nextShotTime[maxEnemies];
+        TickCount nextLaneSwitchTime[maxEnemies];
 
-        int laneIndex;
-        float lanePosition;
-        int shotsRemaining;
-        TickCount nextShotTime;
-        TickCount nextLaneSwitchTime;
+        GameReal pathPosition[maxEnemies]; // could share with lanePosition
+        GameReal previousPathPosition[maxEnemies];
 
-        float pathPosition; // could share with lanePosition
+        bool IsFull() const { return count >= maxEnemies; }
+        void Clear() { count = 0; }
+        int Add() { return IsFull() ? -1 : count++; }
 
-        inline bool IsValid() const { return startTime > 0; }
-        inline void Invalidate() { startTime = 0; }
+        void Remove(int index)
+        {
+            int last = --count;
+            speed[index] = speed[last];
+            speedPerTick[index] = speedPerTick[last];
+            shotDelta[index] = shotDelta[last];
+            color[index] = color[last];
+            laneSwitching[index] = laneSwitching[last];
+            state[index] = state[last];
+            startTime[index] = startTime[last];
+            laneIndex[index] = laneIndex[last];
+            lanePosition[index] = lanePosition[last];
+            previousLanePosition[index] = previousLanePosition[last];
+            shotsRemaining[index] = shotsRemaining[last];
+            nextShotTime[index] = nextShotTime[last];
+            nextLaneSwitchTime[index] = nextLaneSwitchTime[last];
+            pathPosition[index] = pathPosition[last];
+            previousPathPosition[index] = previousPathPosition[last];
+        }
     };
 
 
-    AnimatedState animatedStates[5];
-    Lane lanes[laneCount];
-    Level levels[levelCount];
+    // The lane, level and animated state tables are constexpr so they live
+    // in flash.  lanes and levels point at the flash tables unless
+    // LoadLayout replaced them.
+    static constexpr AnimatedState animatedStates[] =
+    {
+        {GameState::GS_ATTRACT_ANIMATION, 0, true, AS_ATTRACT},
+        {GameState::GS_GAME_START_ANIMATION, 0, false, AS_GAME_START},
+        {GameState::GS_LEVEL_START_ANIMATION, 4000, false, AS_NONE},
+        {GameState::GS_LIFE_LOST_ANIMATION, 1000, false, AS_NONE},
+        {GameState::GS_GAME_OVER_ANIMATION, 0, false, AS_GAME_OVER},
+    };
+    static constexpr Level defaultLevels[levelCount] =
+    {
+        // whiteEnemyCount, redEnemyCount, greenEnemyCount, fireRateMultiplier, speedMultiplier, enemySpawnDelta
+        { 15,  0, 0,  1.0f, 1.0f, 2.0f },
+        { 15, 10, 0,  1.0f, 1.0f, 1.0f },
+        { 15, 10, 5,  2.0f, 1.0f, 0.75f },
+        { 20, 20, 10, 3.0f, 2.5f, 0.5f },
+        { 30, 30, 10, 4.0f, 3.5f, 0.5f },
+    };
+
+    // RAM copy of the tables when LoadLayout was used
+    struct LoadedLayout
+    {
+        Lane lanes[laneCount];
+        Level levels[levelCount];
+    };
+
+    const Lane* lanes = TreeConfig::lanes;
+    const Level* levels = defaultLevels;
+    LoadedLayout* pLoadedLayout = NULL;
+    AnimatorArena stateArena{stateArenaChunkSize}; // owns the state animators
+    Animator* stateAnimators[AS_COUNT] = {};
+    RenderProgram statePrograms[AS_COUNT]; // stateAnimators flattened - these are what get drawn
+
+    // Geometry tables - built from lanes by BuildGeometryTables()
+    PositionLedTable laneLedTables[laneCount];
+    PositionLedTable pathLedTable;
+    int8_t playerPositionLaneIndices[pathLedCount]; // closest lane to each player position
 
     GameState gameState = GameState::GS_ATTRACT_ANIMATION;
     TickCount stepTime = 0;
     TickCount stepDeltaTicks = 0;
-    float stepDeltaSeconds = 0.0f;
+    GameReal stepDeltaSeconds = 0;
+    TickCount fixedStepTicks = 0; // 0 runs one simulation step per Step call
+    bool interpolateRendering = false;
+    TickCount frameTime = 0; // time passed to the last Step.  stepTime trails it by less than fixedStepTicks
     int currentLevelIndex = 0;
     int score = 0;
     int livesRemaining = 0;
-    float stepPlayerPosition = 0;
-    Shot shots[maxActiveShots] = {};
-    Enemy enemies[maxEnemies] = {};
+    GameReal stepPlayerPosition = 0;
+    GameReal previousStepPlayerPosition = 0;
+    int stepPlayerPathIndex = 0; // player position in path LEDs from the start of the path
+    ShotPool<maxPlayerShots> playerShots = {};
+    ShotPool<maxActiveShots - maxPlayerShots> enemyShots = {};
+    EnemyPool enemies = {};
     TickCount nextEmenySpawnTime = 0;
     int whiteEnemiesRemaining = 0;
     int redEnemiesRemaining = 0;
@@ -196,12 +406,63 @@ private:
     bool stepFireButtonPressed = false;
     bool fireButtonWasReleased = false;
     bool startButtonWasReleased = false;
-
-    AnimatedState* pCurrentAnimatedState = NULL;
+    uint32_t randomState = defaultRandomSeed; // xorshift32 - the engine has its own so a snapshot can carry it
+
+    // Retained background for GS_PLAYING_LEVEL - the tree base, path and
+    // lanes only change when one of the values it was built from changes.
+    // SetLeds copies it in once and after that only puts back the LEDs the
+    // sprites covered last frame.
+    LedColor background[totalLedCount];
+    bool backgroundValid = false;
+    int backgroundLivesRemaining = 0;
+    int backgroundLevelIndex = 0;
+    LedColor backgroundLaneColor = color_black;
+    bool ledsHoldBackground = false; // the caller's LEDs are the background plus the sprites in spriteLedIndices
+    LedIndex spriteLedIndices[maxSpriteLeds];
+    int spriteLedCount = 0;
+
+    // The animated states draw over black.  When the caller's LEDs still
+    // hold the last animated frame only the spans it wrote get cleared.
+    bool ledsHoldAnimation = false;
+    LedSpanList animationSpans;
+
+    const AnimatedState* pCurrentAnimatedState = NULL;
     TickCount animationStartTime = 0;
     TickCount animationEndTime = 0;
 
+    // Output only - not part of the game state
+    GameEventQueue events;
 
+
+    void BuildGeometryTables();
+    int Random(int range)
+    {
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return (int)(randomState % (uint32_t)range);
+    }
+    void CreateStateAnimators();
+    TickCount GetAnimatedStateDuration(const AnimatedState* pAnimatedState) const;
+    GameReal GetLanePathPosition(int laneIndex) const { return GameRealFromRatio(lanes[laneIndex].pathLedIndex, pathLedCount); }
+    static constexpr bool LevelsValid(const Level* pLevels, int count)
+    {
+        return count == 0 ||
+            (pLevels->whiteEnemyCount >= 0 && pLevels->redEnemyCount >= 0 && pLevels->greenEnemyCount >= 0 &&
+             pLevels->whiteEnemyCount + pLevels->redEnemyCount + pLevels->greenEnemyCount > 0 &&
+             pLevels->fireRateMultiplier > GameReal(0) && pLevels->speedMultiplier > GameReal(0) &&
+             pLevels->enemySpawnDelta > GameReal(0) && pLevels->enemySpawnDelta <= GameReal(maxEnemySpawnDeltaSeconds) &&
+             LevelsValid(pLevels + 1, count - 1));
+    }
+    static constexpr bool AnimatedStatesValid(const AnimatedState* pStates, int count)
+    {
+        return count == 0 ||
+            (pStates->animatorSlot < AS_COUNT && (pStates->animatorSlot != AS_NONE || pStates->duration > 0) &&
+             AnimatedStatesValid(pStates + 1, count - 1));
+    }
+    void Simulate();
+    GameReal GetRenderAlpha() const;
+    GameReal GetRenderPosition(GameReal previous, GameReal current, GameReal alpha) const { return interpolateRendering ? previous + ((current - previous) * alpha) : current; }
     void StartAttractAnimation();
     void ResetShotsAndEnemies();
     void StartLevel();
@@ -210,32 +471,184 @@ private:
     void SpawnNextEnemy();
     void FireEnemyShots();
     void HandleCollisions();
+    static int SweepLane(const SweepRun& a, const SweepRun& b, GameReal threshold);
+    static bool SweptHit(GameReal previousA, GameReal a, GameReal previousB, GameReal b, GameReal threshold);
     void HandleLevelCompleted();
 
     void BeginAnimatedState(GameState newState);
     void StepAnimatedState();
-    void SetAnimatedStateLeds(LedColor* pLeds) const;
+    void SetAnimatedStateLeds(LedColor* pLeds, LedSpanList& spans);
+    void BuildBackground(LedColor laneColor);
+    void SetSpriteLed(LedColor* pLeds, int ledIndex, LedColor color)
+    {
+        pLeds[ledIndex] = color;
+        _ASSERT(spriteLedCount < maxSpriteLeds);
+        spriteLedIndices[spriteLedCount++] = (LedIndex)ledIndex;
+    }
 
     void SetLevelStartAnimationLeds(TickCount animationTime, LedColor* pLeds) const;
+    void PushEvent(GameEventType type, int laneIndex = -1, int value = 0, LedColor color = color_black)
+    {
+        GameEvent event = {stepTime, type, (int8_t)laneIndex, (uint8_t)value, color};
+        events.Push(event);
+    }
     int& GetEnemiesRemaining(EnemyType et);
-    void AddShot(bool isPlayer, int laneIndex, float speed, float startingLanePosition);
-    int GetClosestLaneToPathPosition(float pathPosition) const;
+    void AddShot(bool isPlayer, int laneIndex, GameReal speed, GameReal startingLanePosition);
+    int GetClosestLaneToPathPosition(GameReal pathPosition) const;
 
 
 public:
     GameEngine();
+    ~GameEngine();
 
     void FireShot() { stepFireButtonPressed = true; }
 
     void Step(TickCount time, int playerPosition, bool fireButtonPressed, bool startButtonPressed);
 
+    // Run the simulation in fixed steps of stepTicks no matter how often Step
+    // is called.  Step runs as many steps as fit in the time since the last
+    // call and carries the rest over.  With interpolate, SetLeds draws shots
+    // and enemies part way between the last two steps based on the leftover
+    // time so movement stays smooth.  stepTicks of 0 goes back to one
+    // variable length step per Step call.
+    void SetFixedTimestep(TickCount stepTicks, bool interpolate);
+
+    // 0 isn't a valid seed for the generator so it's swapped for the default
+    void SetRandomSeed(uint32_t seed) { randomState = (0 == seed) ? defaultRandomSeed : seed; }
+
+    // Running totals for tuning the levels table (the BatchSimulator tool
+    // plays thousands of games and adds these up).  They aren't part of the
+    // game so snapshots leave them alone and they keep counting across games
+    // until ResetStats.
+    struct GameStats
+    {
+        uint32_t simulationSteps;
+        uint32_t shotsFired;
+        uint32_t enemiesSpawned;
+        uint32_t laneKills; // player shot hit an enemy in a lane
+        uint32_t pathKills; // player shot an enemy on the player path
+        uint32_t enemyShotsDestroyed;
+        uint32_t deathsByEnemyShot;
+        uint32_t deathsByEnemyCollision;
+        TickCount levelPlayTicks[levelCount]; // time spent in GS_PLAYING_LEVEL
+        uint32_t levelKills[levelCount];
+        uint32_t levelDeaths[levelCount];
+        uint32_t levelClears[levelCount];
+    };
+
+    const GameStats& GetStats() const { return stats; }
+    void ResetStats() { memset(&stats, 0, sizeof(stats)); }
+
+    // Read-only view of the board for scripted players
+    bool IsAttractMode() const { return GameState::GS_ATTRACT_ANIMATION == gameState; }
+    bool IsPlayingLevel() const { return GameState::GS_PLAYING_LEVEL == gameState; }
+    int GetLaneCount() const { return laneCount; }
+    int GetLanePathLedIndex(int laneIndex) const { return lanes[laneIndex].pathLedIndex; }
+    const Lane& GetLane(int laneIndex) const { return lanes[laneIndex]; }
+    int GetEnemyCount() const { return enemies.count; }
+    int GetEnemyLaneIndex(int enemyIndex) const { return enemies.laneIndex[enemyIndex]; }
+    float GetEnemyLanePosition(int enemyIndex) const { return GameRealToFloat(enemies.lanePosition[enemyIndex]); }
+    bool IsEnemyOnPlayerPath(int enemyIndex) const { return EnemyState::onPlayerPath == enemies.state[enemyIndex]; }
+    int GetEnemyPathLedIndex(int enemyIndex) const { return GameRealToInt(enemies.pathPosition[enemyIndex] * pathLedCount); }
+    int GetEnemyShotCount() const { return enemyShots.count; }
+    int GetEnemyShotLaneIndex(int shotIndex) const { return enemyShots.laneIndex[shotIndex]; }
+    float GetEnemyShotLanePosition(int shotIndex) const { return GameRealToFloat(enemyShots.lanePosition[shotIndex]); }
+
+    // Everything about a game in progress - enough to roll back, fork a copy
+    // of the game or dump the state from the tree and replay it on the PC.
+    // It's plain data so it can be memcpy'd and written out as is.  The
+    // layout, the Step timing mode and the LED caches aren't included - a
+    // snapshot only makes sense on an engine with the same layout.
+    struct Snapshot
+    {
+        uint32_t version;
+        GameState gameState;
+        TickCount stepTime;
+        TickCount stepDeltaTicks;
+        GameReal stepDeltaSeconds;
+        TickCount frameTime;
+        int currentLevelIndex;
+        int score;
+        int livesRemaining;
+        GameReal stepPlayerPosition;
+        GameReal previousStepPlayerPosition;
+        int stepPlayerPathIndex;
+        ShotPool<maxPlayerShots> playerShots;
+        ShotPool<maxActiveShots - maxPlayerShots> enemyShots;
+        EnemyPool enemies;
+        TickCount nextEmenySpawnTime;
+        int whiteEnemiesRemaining;
+        int redEnemiesRemaining;
+        int greenEnemiesRemaining;
+        bool stepFireButtonPressed;
+        bool fireButtonWasReleased;
+        bool startButtonWasReleased;
+        uint32_t randomState;
+        int animatedStateIndex; // into animatedStates, -1 for none
+        TickCount animationStartTime;
+        TickCount animationEndTime;
+    };
+    static const uint32_t snapshotVersion = 1;
+
+    void SaveSnapshot(Snapshot& snapshot) const;
+    // Returns false and leaves the engine alone if the snapshot is from a
+    // different version or doesn't make sense
+    bool LoadSnapshot(const Snapshot& snapshot);
+
     int GetPathLedCount() const { return pathLedCount; }
-    void SetLeds(LedColor* pLeds) const;
+
+    // Replaces the lane and level tables with the ones in a layout blob so an
+    // installation can change its layout without a new build.  The lane and
+    // level counts in the blob have to match the build.  Returns false and
+    // keeps the current layout if the blob isn't valid.
+    //
+    // Layout blob, all values little endian:
+    //   uint32  layoutBlobMagic
+    //   uint8   layoutBlobVersion
+    //   uint8   lane count
+    //   uint8   level count
+    //   uint8   0
+    //   per lane:  int16 startIndex, int16 endIndex, int16 pathLedIndex
+    //   per level: uint8 white, red and green enemy counts, uint8 0,
+    //              int32 fireRateMultiplier, speedMultiplier and enemySpawnDelta as Q16.16
+    static const uint32_t layoutBlobMagic = 0x59414C54; // "TLAY"
+    static const uint8_t layoutBlobVersion = 1;
+    static const int layoutBlobSize = 8 + (laneCount * 6) + (levelCount * 16);
+    bool LoadLayout(const uint8_t* pBlob, int blobSize);
+    // Writes the current layout as a blob.  Returns the size or 0 if the buffer is too small.
+    int SaveLayout(uint8_t* pBlob, int blobSize) const;
+
+    // pLeds must hold totalLedCount LEDs and keep what the last SetLeds call
+    // left in it - only the LEDs that changed since then get written.  Call
+    // InvalidateLeds if something else wrote to the LEDs in between.
+    void SetLeds(LedColor* pLeds);
+    void InvalidateLeds() { ledsHoldBackground = false; ledsHoldAnimation = false; }
+
+    // The shows between levels and the attract loop only depend on the time,
+    // so the BatchSimulator can bake them into clips (see AnimationClip.h)
+    // or render them in pieces.  The animator draws one the same way SetLeds
+    // would, with this engine's layout, so the engine has to outlive it and
+    // shouldn't be playing while it's in use.
+    enum class Show
+    {
+        SH_ATTRACT,
+        SH_GAME_START,
+        SH_LEVEL_START,
+        SH_GAME_OVER,
+    };
+    Animator* CreateShowAnimator(Show show);
 
     int GetRemainingLives() const { return livesRemaining; }
     int GetLevel() const { return currentLevelIndex; }
     int GetScore() const { return score; }
-    // GetSoundTrigger
+
+    // Events for sound, scoring and the like.  There can be one consumer,
+    // which may be on another thread or in an interrupt handler - Step never
+    // waits for it.  If it falls behind by more than the queue holds, new
+    // events get dropped and counted.
+    bool PopEvent(GameEvent& event) { return events.Pop(event); }
+    int GetPendingEventCount() const { return events.GetCount(); }
+    uint32_t GetDroppedEventCount() const { return events.GetDroppedCount(); }
     // SetLedsLayoutCheck
 
     static void LedIndicesToStartAndCount(int a, int b, int& start, int& count)
@@ -262,13 +675,24 @@ public:
         return startIndex + indexInTheRange;
     }
 
+    // Same as above without any float math.  ledDistance * position then round
+    // half a LED away from the start.  Truncating towards zero matches the
+    // (int) cast in the float version.
+    static int LedIndexFromRange(int startIndex, int endIndex, Fixed position)
+    {
+        int ledDistance = endIndex - startIndex; // may be negative
+        int64_t scaled = (int64_t)ledDistance * position.Raw();
+        scaled += (ledDistance > 0) ? (Fixed::oneRaw / 2) : -(Fixed::oneRaw / 2);
+        int indexInTheRange = (int)(scaled / Fixed::oneRaw);
+        return startIndex + indexInTheRange;
+    }
+
     static void FillLedRange(LedColor* pLeds, int startLedIndex, int endLedIndex, LedColor color)
     {
-        int delta = (endLedIndex < startLedIndex) ? -1 : 1;
-        for (int ledIndex = startLedIndex; ledIndex != endLedIndex + delta; ledIndex += delta)
-        {
-            pLeds[(LedIndex)ledIndex] = color;
-        }
+        int start;
+        int count;
+        LedIndicesToStartAndCount(startLedIndex, endLedIndex, start, count);
+        FillColors(pLeds + start, count, color);
     }
 
     static void ColorWipeLed(LedColor* pLeds, int startLedIndex, int endLedIndex, LedColor startColor, LedColor endColor, float t)
@@ -288,15 +712,15 @@ public:
 
         int ledCount = (endLedIndex - startLedIndex) + 1;
         int startGroupCount = (int)(t * ((float)ledCount + 0.499f));
-        int divider = startLedIndex + startGroupCount;
-        for (int ledIndex = startLedIndex; ledIndex != endLedIndex + 1; ++ledIndex)
-        {
-            pLeds[ledIndex] = (ledIndex < divider) ? startColor : endColor;
-        }
-
+        if (startGroupCount > ledCount) startGroupCount = ledCount;
+        FillColors(pLeds + startLedIndex, startGroupCount, startColor);
+        FillColors(pLeds + startLedIndex + startGroupCount, ledCount - startGroupCount, endColor);
     }
 
-};
-
+private:
+    class ShowAnimator;
 
+    GameStats stats = {};
+};
 
+static_assert(std::is_trivially_copyable<GameEngine::Snapshot>::value, "snapshots get memcpy'd and written out as bytes");
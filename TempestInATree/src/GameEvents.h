@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+
+// Things that happen in the game that something outside the engine may want
+// to react to - sound, a scoreboard, telemetry.  GameEngine pushes them into
+// a GameEventQueue during Step and the consumer drains it whenever it gets
+// around to it.
+enum class GameEventType : uint8_t
+{
+    GE_GAME_STARTED,
+    GE_LEVEL_STARTED, // value is the level index
+    GE_SHOT_FIRED,
+    GE_ENEMY_KILLED, // value is a GameEventKill
+    GE_ENEMY_SHOT_DESTROYED,
+    GE_PLAYER_DIED, // value is a GameEventDeath
+    GE_GAME_OVER, // value is the level index the game ended on
+};
+
+enum GameEventKill
+{
+    GEK_IN_LANE,
+    GEK_ON_PATH,
+};
+
+enum GameEventDeath
+{
+    GED_ENEMY_SHOT,
+    GED_ENEMY_COLLISION,
+};
+
+struct GameEvent
+{
+    TickCount time; // stepTime of the simulation step it happened in
+    GameEventType type;
+    int8_t laneIndex; // -1 if it didn't happen in a lane
+    uint8_t value; // depends on the type
+    LedColor color; // of the enemy for GE_ENEMY_KILLED, otherwise black
+};
+
+// Fixed size single producer, single consumer ring buffer.  Nothing gets
+// allocated and neither side ever waits on the other - the producer only
+// writes head_ and the consumer only writes tail_ so Push and Pop can run on
+// different threads, or Pop in an interrupt handler, without a lock.
+//
+// When the consumer falls behind and the queue is full, new items are
+// dropped and counted rather than overwriting ones the consumer may be
+// reading.
+template<typename T, int capacity>
+class SpscQueue
+{
+    static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "capacity needs to be a power of two");
+
+    T items_[capacity];
+    std::atomic<uint32_t> head_; // next slot to write
+    std::atomic<uint32_t> tail_; // next slot to read
+    std::atomic<uint32_t> droppedCount_;
+
+public:
+    static const int maxCount = capacity;
+
+    SpscQueue() : head_(0), tail_(0), droppedCount_(0) {}
+
+    // Producer side.  Returns false and counts the item as dropped if the queue is full.
+    bool Push(const T& item)
+    {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= (uint32_t)capacity)
+        {
+            // Only the producer writes the count so this doesn't need to be an atomic add
+            droppedCount_.store(droppedCount_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        items_[head & (capacity - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.  Returns false if there's nothing to read.
+    bool Pop(T& item)
+    {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) return false;
+        item = items_[tail & (capacity - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Either side can look - the answer may be stale by the time it's used
+    int GetCount() const { return (int)(head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire)); }
+    uint32_t GetDroppedCount() const { return droppedCount_.load(std::memory_order_relaxed); }
+};
+
+typedef SpscQueue<GameEvent, 32> GameEventQueue;
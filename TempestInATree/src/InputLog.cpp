@@ -0,0 +1,234 @@
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+
+#include "GameEngine.h"
+#include "InputLog.h"
+
+static const int maxInlineTicks = 30; // bits 3-7 of the frame byte - 31 means a varint follows
+static const int inlineTicksEscape = 31;
+
+static void WriteLogInt32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t ReadLogInt32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int WriteVarint(uint8_t* p, uint32_t value)
+{
+    int count = 0;
+    while (value >= 0x80)
+    {
+        p[count++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[count++] = (uint8_t)value;
+    return count;
+}
+
+uint32_t HashLeds(const LedColor* pLeds, int ledCount)
+{
+    uint32_t hash = 2166136261u;
+    for (int ledIndex = 0; ledIndex < ledCount; ++ledIndex)
+    {
+        hash ^= pLeds[ledIndex];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+InputLogWriter::InputLogWriter(uint8_t* pBuffer, int bufferSize) :
+    pBuffer_(pBuffer),
+    bufferSize_(bufferSize),
+    size_(0),
+    frameCount_(0),
+    frameHashes_(false),
+    full_(true), // until Begin
+    lastTime_(0),
+    lastPlayerPosition_(0)
+{
+}
+
+void InputLogWriter::Begin(uint32_t randomSeed, TickCount fixedStepTicks, bool interpolate, bool frameHashes)
+{
+    size_ = 0;
+    frameCount_ = 0;
+    frameHashes_ = frameHashes;
+    full_ = false;
+    lastTime_ = 0;
+    lastPlayerPosition_ = 0;
+
+    uint8_t header[inputLogHeaderSize];
+    WriteLogInt32(header, inputLogMagic);
+    header[4] = inputLogVersion;
+    header[5] = (uint8_t)((frameHashes ? ILF_FRAME_HASHES : 0) | (interpolate ? ILF_INTERPOLATE : 0));
+    header[6] = (uint8_t)fixedStepTicks;
+    header[7] = (uint8_t)(fixedStepTicks >> 8);
+    WriteLogInt32(header + 8, randomSeed);
+    Write(header, sizeof(header));
+}
+
+bool InputLogWriter::Write(const uint8_t* pBytes, int count)
+{
+    if (full_ || size_ + count > bufferSize_)
+    {
+        full_ = true;
+        return false;
+    }
+    memcpy(pBuffer_ + size_, pBytes, count);
+    size_ += count;
+    return true;
+}
+
+bool InputLogWriter::AddFrame(TickCount time, int playerPosition, bool fireButtonPressed, bool startButtonPressed, const LedColor* pLeds)
+{
+    if (full_) return false;
+
+    // Build the whole frame first so a frame that doesn't fit isn't half written
+    uint8_t frame[1 + 5 + 5 + 4];
+    int frameSize = 1;
+    TickCount ticks = time - lastTime_;
+    int positionDelta = playerPosition - lastPlayerPosition_;
+
+    frame[0] = (uint8_t)((fireButtonPressed ? 1 : 0) | (startButtonPressed ? 2 : 0) | ((positionDelta != 0) ? 4 : 0));
+    if (ticks <= (TickCount)maxInlineTicks)
+    {
+        frame[0] |= (uint8_t)(ticks << 3);
+    }
+    else
+    {
+        frame[0] |= (uint8_t)(inlineTicksEscape << 3);
+        frameSize += WriteVarint(frame + frameSize, ticks);
+    }
+    if (positionDelta != 0)
+    {
+        uint32_t zigzag = (positionDelta < 0) ? (((uint32_t)-positionDelta << 1) - 1) : ((uint32_t)positionDelta << 1);
+        frameSize += WriteVarint(frame + frameSize, zigzag);
+    }
+    if (frameHashes_)
+    {
+        WriteLogInt32(frame + frameSize, HashLeds(pLeds, TreeConfig::totalLedCount));
+        frameSize += 4;
+    }
+
+    if (!Write(frame, frameSize)) return false;
+
+    lastTime_ = time;
+    lastPlayerPosition_ = playerPosition;
+    frameCount_++;
+    return true;
+}
+
+InputLogReader::InputLogReader(const uint8_t* pLog, int logSize) :
+    pLog_(pLog),
+    logSize_(logSize),
+    readOffset_(0),
+    valid_(false),
+    randomSeed_(0),
+    fixedStepTicks_(0),
+    flags_(0),
+    lastTime_(0),
+    lastPlayerPosition_(0)
+{
+    if (logSize < inputLogHeaderSize) return;
+    if (ReadLogInt32(pLog) != inputLogMagic || pLog[4] != inputLogVersion) return;
+
+    flags_ = pLog[5];
+    fixedStepTicks_ = pLog[6] | (pLog[7] << 8);
+    randomSeed_ = ReadLogInt32(pLog + 8);
+    valid_ = true;
+    Rewind();
+}
+
+void InputLogReader::Rewind()
+{
+    readOffset_ = inputLogHeaderSize;
+    lastTime_ = 0;
+    lastPlayerPosition_ = 0;
+}
+
+bool InputLogReader::ReadVarint(uint32_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (readOffset_ >= logSize_) return false;
+        uint8_t b = pLog_[readOffset_++];
+        value |= (uint32_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+bool InputLogReader::NextFrame(InputLogFrame& frame)
+{
+    if (!valid_ || readOffset_ >= logSize_) return false;
+
+    uint8_t bits = pLog_[readOffset_++];
+    TickCount ticks = bits >> 3;
+    if (inlineTicksEscape == ticks)
+    {
+        uint32_t value;
+        if (!ReadVarint(value)) return false;
+        ticks = value;
+    }
+    int positionDelta = 0;
+    if (bits & 4)
+    {
+        uint32_t zigzag;
+        if (!ReadVarint(zigzag)) return false;
+        positionDelta = (zigzag & 1) ? -(int)((zigzag + 1) >> 1) : (int)(zigzag >> 1);
+    }
+    frame.ledHash = 0;
+    if (HasFrameHashes())
+    {
+        if (readOffset_ + 4 > logSize_) return false;
+        frame.ledHash = ReadLogInt32(pLog_ + readOffset_);
+        readOffset_ += 4;
+    }
+
+    lastTime_ += ticks;
+    lastPlayerPosition_ += positionDelta;
+    frame.time = lastTime_;
+    frame.playerPosition = lastPlayerPosition_;
+    frame.fireButtonPressed = (bits & 1) != 0;
+    frame.startButtonPressed = (bits & 2) != 0;
+    return true;
+}
+
+int InputLogReader::Replay(GameEngine& ge, LedColor* pLeds, int* pFrameCount)
+{
+    int firstDifferentFrame = -1;
+    int frameIndex = 0;
+    if (valid_)
+    {
+        ge.SetRandomSeed(randomSeed_);
+        ge.SetFixedTimestep(fixedStepTicks_, GetInterpolate());
+
+        Rewind();
+        InputLogFrame frame;
+        for (; NextFrame(frame); ++frameIndex)
+        {
+            ge.Step(frame.time, frame.playerPosition, frame.fireButtonPressed, frame.startButtonPressed);
+            ge.SetLeds(pLeds);
+            if (HasFrameHashes() && firstDifferentFrame < 0 && HashLeds(pLeds, TreeConfig::totalLedCount) != frame.ledHash)
+            {
+                firstDifferentFrame = frameIndex;
+            }
+        }
+    }
+
+    if (NULL != pFrameCount)
+    {
+        *pFrameCount = frameIndex;
+    }
+    return firstDifferentFrame;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "Animator.h"
+
+class GameEngine;
+
+// Compact log of every GameEngine::Step call so a session played on the tree
+// can be played back exactly on the PC (or on the tree).  The engine only
+// depends on its seed, its timestep settings and the Step arguments so
+// that's all the log holds.  Logs can also hold a hash of the LEDs after
+// each frame so a replay can point at the first frame that drew something
+// different - handy for checking an optimization against a real session.
+//
+// Logs always start from a freshly constructed engine.
+//
+// Log format, all values little endian:
+//   uint32  inputLogMagic
+//   uint8   inputLogVersion
+//   uint8   flags - ILF_*
+//   uint16  fixed step ticks
+//   uint32  random seed
+//   frames up to the end of the log:
+//     uint8   bit 0 fire, bit 1 start, bit 2 player position changed,
+//             bits 3-7 ticks since the last frame, or 31 if they didn't fit
+//     varint  ticks since the last frame if they didn't fit
+//     varint  zigzag player position change if it changed
+//     uint32  LED hash if the log has ILF_FRAME_HASHES
+// A typical frame is one byte (five with the hash).
+const uint32_t inputLogMagic = 0x474C4E49; // "INLG"
+const uint8_t inputLogVersion = 1;
+const int inputLogHeaderSize = 12;
+
+enum InputLogFlags
+{
+    ILF_FRAME_HASHES = 1,
+    ILF_INTERPOLATE = 2,
+};
+
+// FNV-1a over whole LED colors - only used to notice frames that differ
+uint32_t HashLeds(const LedColor* pLeds, int ledCount);
+
+struct InputLogFrame
+{
+    TickCount time;
+    int playerPosition;
+    bool fireButtonPressed;
+    bool startButtonPressed;
+    uint32_t ledHash; // 0 if the log has no hashes
+};
+
+class InputLogWriter
+{
+    uint8_t* pBuffer_;
+    int bufferSize_;
+    int size_;
+    int frameCount_;
+    bool frameHashes_;
+    bool full_;
+    TickCount lastTime_;
+    int lastPlayerPosition_;
+
+    bool Write(const uint8_t* pBytes, int count);
+
+public:
+    InputLogWriter(uint8_t* pBuffer, int bufferSize);
+
+    // Starts a new log.  Call it with the settings given to a freshly
+    // constructed engine before its first Step.
+    void Begin(uint32_t randomSeed, TickCount fixedStepTicks, bool interpolate, bool frameHashes);
+
+    // One Step call.  pLeds is what SetLeds drew after it and is only used
+    // if the log has frame hashes.  Returns false once the buffer is full -
+    // the log is still good up to the last frame that fit.
+    bool AddFrame(TickCount time, int playerPosition, bool fireButtonPressed, bool startButtonPressed, const LedColor* pLeds);
+
+    int GetSize() const { return size_; }
+    int GetFrameCount() const { return frameCount_; }
+    bool IsFull() const { return full_; }
+};
+
+class InputLogReader
+{
+    const uint8_t* pLog_;
+    int logSize_;
+    int readOffset_;
+    bool valid_;
+    uint32_t randomSeed_;
+    TickCount fixedStepTicks_;
+    uint8_t flags_;
+    TickCount lastTime_;
+    int lastPlayerPosition_;
+
+    bool ReadVarint(uint32_t& value);
+
+public:
+    InputLogReader(const uint8_t* pLog, int logSize);
+
+    bool IsValid() const { return valid_; }
+    uint32_t GetRandomSeed() const { return randomSeed_; }
+    TickCount GetFixedStepTicks() const { return fixedStepTicks_; }
+    bool GetInterpolate() const { return (flags_ & ILF_INTERPOLATE) != 0; }
+    bool HasFrameHashes() const { return (flags_ & ILF_FRAME_HASHES) != 0; }
+
+    // Back to the first frame
+    void Rewind();
+    // False at the end of the log or if the last frame got cut off
+    bool NextFrame(InputLogFrame& frame);
+
+    // Plays the whole log on ge, which needs to be freshly constructed (with
+    // the same layout if LoadLayout was used).  pLeds needs room for all the
+    // LEDs and starts out black like the tree's.  Returns the index of the
+    // first frame that drew something different than when it was recorded
+    // or -1 if they all matched or the log has no hashes.
+    int Replay(GameEngine& ge, LedColor* pLeds, int* pFrameCount = NULL);
+};
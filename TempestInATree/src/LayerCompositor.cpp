@@ -0,0 +1,209 @@
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <string.h>
+
+#include "LayerCompositor.h"
+
+LayerCompositor::LayerCompositor(TickCount duration) :
+	scratchStartLedIndex_(0),
+	culledLayerCount_(0)
+{
+	duration_ = duration;
+}
+
+LayerCompositor::~LayerCompositor()
+{
+	for (Layer& layer : layers_)
+	{
+		delete layer.pAnimator;
+	}
+}
+
+void LayerCompositor::AddLayer(Animator* pAnimator, TickCount startTime, LedIndex startLedIndex, LedCount ledCount, BlendMode mode, ColorScale opacity, bool opaque)
+{
+	Layer layer;
+	layer.pAnimator = pAnimator;
+	layer.startTime = startTime;
+	layer.startLedIndex = startLedIndex;
+	layer.ledCount = ledCount;
+	layer.mode = mode;
+	layer.opacity = opacity;
+	layer.opaque = opaque;
+	layer.drawnOpacity = -1;
+	layers_.push_back(layer);
+
+	// Stepping doesn't allocate.  Doubling keeps the arena from holding a
+	// copy of these for every layer added.
+	if (drawLayers_.capacity() < layers_.size())
+	{
+		drawLayers_.reserve(2 * layers_.size());
+		hidden_.reserve(2 * layers_.size());
+	}
+	GrowScratch(layer);
+}
+
+void LayerCompositor::SetOpacity(int layerIndex, ColorScale opacity)
+{
+	layers_[layerIndex].opacity = opacity;
+	GrowScratch(layers_[layerIndex]);
+}
+
+void LayerCompositor::GrowScratch(const Layer& layer)
+{
+	if (!NeedsScratch(layer)) return;
+
+	int startLedIndex = layer.startLedIndex;
+	int endLedIndex = layer.startLedIndex + layer.ledCount;
+	if (!scratch_.empty())
+	{
+		if (startLedIndex >= scratchStartLedIndex_ && endLedIndex <= scratchStartLedIndex_ + (int)scratch_.size()) return;
+		startLedIndex = std::min(startLedIndex, (int)scratchStartLedIndex_);
+		endLedIndex = std::max(endLedIndex, scratchStartLedIndex_ + (int)scratch_.size());
+	}
+	scratchStartLedIndex_ = (LedIndex)startLedIndex;
+	scratch_.resize(endLedIndex - startLedIndex);
+}
+
+// True if the opaque layers drawn so far cover all of layer's LEDs.  There
+// are only ever a few of them so this just keeps looking for one that covers
+// the first LED not known to be hidden yet.
+bool LayerCompositor::IsHidden(const Layer& layer) const
+{
+	int ledIndex = layer.startLedIndex;
+	int endLedIndex = layer.startLedIndex + layer.ledCount;
+	bool found = true;
+	while (ledIndex < endLedIndex && found)
+	{
+		found = false;
+		for (const LedSpan& span : hidden_)
+		{
+			if (span.startLedIndex <= ledIndex && ledIndex < span.startLedIndex + span.ledCount)
+			{
+				ledIndex = span.startLedIndex + span.ledCount;
+				found = true;
+			}
+		}
+	}
+	return ledIndex >= endLedIndex;
+}
+
+void LayerCompositor::DrawLayer(Layer& layer, TickCount localTime, LedColor* pColors, LedSpanList& spans, bool& changed)
+{
+	if (!NeedsScratch(layer))
+	{
+		changed |= layer.pAnimator->StepSpans(localTime, pColors, spans);
+		return;
+	}
+
+	// Indexed like pColors, so only the layer's own LEDs are in the buffer.
+	// Start them at whatever the blend leaves alone.
+	LedColor* pScratch = scratch_.data() - scratchStartLedIndex_;
+	switch (layer.mode)
+	{
+		case BlendMode::BM_REPLACE:
+			memcpy(pScratch + layer.startLedIndex, pColors + layer.startLedIndex, layer.ledCount * sizeof(LedColor));
+			break;
+		case BlendMode::BM_MULTIPLY:
+			FillColors(pScratch + layer.startLedIndex, layer.ledCount, color_white);
+			break;
+		default:
+			FillColors(pScratch + layer.startLedIndex, layer.ledCount, color_black);
+			break;
+	}
+
+	LedSpanList layerSpans;
+	changed |= layer.pAnimator->StepSpans(localTime, pScratch, layerSpans);
+
+	for (int spanIndex = 0; spanIndex < layerSpans.GetCount(); ++spanIndex)
+	{
+		int startLedIndex = layerSpans[spanIndex].startLedIndex;
+		int ledCount = layerSpans[spanIndex].ledCount;
+		switch (layer.mode)
+		{
+			case BlendMode::BM_REPLACE:
+				MixColors(pColors + startLedIndex, pScratch + startLedIndex, ledCount, layer.opacity);
+				break;
+
+			case BlendMode::BM_ADD:
+				if (layer.opacity != colorScaleOne)
+				{
+					ScaleColors(pScratch + startLedIndex, ledCount, layer.opacity);
+				}
+				AddColorsSaturate(pColors + startLedIndex, pScratch + startLedIndex, ledCount);
+				break;
+
+			case BlendMode::BM_MULTIPLY:
+				// Less opaque is closer to white
+				if (layer.opacity != colorScaleOne)
+				{
+					CrossFadeColors(pScratch + startLedIndex, ledCount, color_white, colorScaleOne - layer.opacity);
+				}
+				MultiplyColors(pColors + startLedIndex, pScratch + startLedIndex, ledCount);
+				break;
+
+			case BlendMode::BM_ALPHA:
+				AlphaBlendColors(pColors + startLedIndex, pScratch + startLedIndex, ledCount, layer.opacity);
+				break;
+		}
+	}
+	spans.Add(layerSpans);
+}
+
+bool LayerCompositor::StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+{
+	// Top down, to find the layers that show before drawing any of them
+	drawLayers_.clear();
+	hidden_.clear();
+	culledLayerCount_ = 0;
+	for (int layerIndex = (int)layers_.size() - 1; layerIndex >= 0; --layerIndex)
+	{
+		Layer& layer = layers_[layerIndex];
+		if (localTime < layer.startTime || localTime >= layer.startTime + layer.pAnimator->duration() || layer.opacity == 0)
+		{
+			continue;
+		}
+		if (IsHidden(layer))
+		{
+			culledLayerCount_++;
+			continue;
+		}
+
+		drawLayers_.push_back(layerIndex);
+		if (layer.opaque && !NeedsScratch(layer))
+		{
+			LedSpan span = { layer.startLedIndex, layer.ledCount };
+			hidden_.push_back(span);
+		}
+	}
+
+	// A layer showing up, going away or changing opacity changes the output
+	bool changed = false;
+	size_t drawIndex = drawLayers_.size();
+	for (int layerIndex = 0; layerIndex < (int)layers_.size(); ++layerIndex)
+	{
+		Layer& layer = layers_[layerIndex];
+		bool drawn = (drawIndex > 0 && drawLayers_[drawIndex - 1] == layerIndex);
+		if (!drawn)
+		{
+			changed |= (layer.drawnOpacity != -1);
+			layer.drawnOpacity = -1;
+			continue;
+		}
+
+		--drawIndex;
+		changed |= (layer.drawnOpacity != layer.opacity);
+		layer.drawnOpacity = layer.opacity;
+		DrawLayer(layer, localTime - layer.startTime, pColors, spans, changed);
+	}
+	return changed;
+}
+
+bool LayerCompositor::IsSeekable() const
+{
+	for (const Layer& layer : layers_)
+	{
+		if (!layer.pAnimator->IsSeekable()) return false;
+	}
+	return true;
+}
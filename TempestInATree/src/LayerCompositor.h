@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Animator.h"
+#include "ColorKernels.h"
+
+// How a layer's LEDs go onto the layers under it
+enum class BlendMode : uint8_t
+{
+	BM_REPLACE,  // the layer's colors, cross-faded in by its opacity
+	BM_ADD,      // added on, stopping at full
+	BM_MULTIPLY, // what's under times the layer's colors - white leaves it be
+	BM_ALPHA,    // blended by the alpha in the top byte of each LED
+};
+
+// A stack of animators drawn bottom to top, each blended onto the ones under
+// it.  A full opacity replace layer draws straight onto the LEDs like an
+// AnimatorGroup child.  Every other layer draws into a scratch copy of its
+// LEDs first and only the spans it wrote get blended on.  The scratch LEDs
+// only cover the layers that need them.
+//
+// Each layer says which LEDs it draws in.  A layer that's also opaque -
+// replace, full opacity, and its animator writes every one of those LEDs
+// every step - hides whatever is under it, so any layer whose LEDs are all
+// hidden by the opaque layers above it that step doesn't get stepped at all.
+class LayerCompositor : public Animator
+{
+private:
+	struct Layer
+	{
+		Animator* pAnimator;
+		TickCount startTime;
+		LedIndex startLedIndex;
+		LedCount ledCount;
+		BlendMode mode;
+		ColorScale opacity;
+		bool opaque;
+		int drawnOpacity; // opacity it was drawn with last step, -1 if it wasn't drawn
+	};
+
+	ArenaVector<Layer> layers_; // bottom first
+	LedIndex scratchStartLedIndex_;
+	ArenaVector<LedColor> scratch_; // from scratchStartLedIndex_ to the end of the last layer that needs it
+	ArenaVector<int> drawLayers_; // the layers being drawn this step, top first
+	ArenaVector<LedSpan> hidden_; // the opaque layers drawn so far this step
+	int culledLayerCount_;
+
+	bool IsHidden(const Layer& layer) const;
+	bool NeedsScratch(const Layer& layer) const { return layer.mode != BlendMode::BM_REPLACE || layer.opacity != colorScaleOne; }
+	void GrowScratch(const Layer& layer);
+	void DrawLayer(Layer& layer, TickCount localTime, LedColor* pColors, LedSpanList& spans, bool& changed);
+
+public:
+	explicit LayerCompositor(TickCount duration);
+	~LayerCompositor();
+
+	// Adds a layer on top.  pAnimator only draws between startLedIndex and
+	// startLedIndex + ledCount, starting at startTime.  Only say opaque if
+	// it writes every one of those LEDs every step.
+	void AddLayer(Animator* pAnimator, TickCount startTime, LedIndex startLedIndex, LedCount ledCount, BlendMode mode = BlendMode::BM_REPLACE, ColorScale opacity = colorScaleOne, bool opaque = false);
+	void SetOpacity(int layerIndex, ColorScale opacity);
+
+	// Layers the last step skipped because they were hidden
+	int GetCulledLayerCount() const { return culledLayerCount_; }
+
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans);
+	virtual bool IsSeekable() const;
+};
@@ -0,0 +1,59 @@
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+
+#include "LedOutput.h"
+
+LedOutput::LedOutput(int ledCount, int chunkLedCount, TickCount fullRefreshTicks) :
+    lastFrame_(ledCount, color_black),
+    chunkLedCount_((chunkLedCount > 0) ? chunkLedCount : ledCount),
+    fullRefreshTicks_(fullRefreshTicks),
+    lastFullRefreshTime_(0),
+    valid_(false)
+{
+    ResetStats();
+}
+
+int LedOutput::Update(TickCount time, const LedColor* pLeds)
+{
+    int ledCount = (int)lastFrame_.size();
+    int sendLedCount = ledCount;
+
+    if(valid_ && time - lastFullRefreshTime_ < fullRefreshTicks_)
+    {
+        // Find the last chunk that changed, working back from the end
+        int chunkStart = ((ledCount - 1) / chunkLedCount_) * chunkLedCount_;
+        for(; chunkStart >= 0; chunkStart -= chunkLedCount_)
+        {
+            int chunkEnd = (chunkStart + chunkLedCount_ < ledCount) ? chunkStart + chunkLedCount_ : ledCount;
+            if(0 != memcmp(pLeds + chunkStart, lastFrame_.data() + chunkStart, (chunkEnd - chunkStart) * sizeof(LedColor)))
+            {
+                break;
+            }
+        }
+        sendLedCount = (chunkStart < 0) ? 0 : (chunkStart + chunkLedCount_ < ledCount) ? chunkStart + chunkLedCount_ : ledCount;
+    }
+    else
+    {
+        valid_ = true;
+        lastFullRefreshTime_ = time;
+    }
+
+    if(0 == sendLedCount)
+    {
+        stats_.skippedFrames++;
+    }
+    else if(sendLedCount < ledCount)
+    {
+        stats_.partialFrames++;
+    }
+    else
+    {
+        stats_.fullFrames++;
+    }
+    stats_.sentLeds += sendLedCount;
+
+    memcpy(lastFrame_.data(), pLeds, sendLedCount * sizeof(LedColor));
+    return sendLedCount;
+}
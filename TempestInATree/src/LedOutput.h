@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string.h>
+
+#include "Animator.h"
+
+// Decides how much of each frame has to go out on the wire.  Sending 400
+// WS2812s takes about 12ms with interrupts off, but each LED keeps the last
+// color it latched - so a frame that matches the last one sent doesn't need
+// sending at all, and a frame that only changed near the start of the chain
+// only needs sending up to the last LED that changed.  The LEDs past the end
+// of a short send keep what they had.
+//
+// Frames are compared a chunk at a time (a string of LEDs on the tree) and
+// sends are rounded up to whole chunks.  Every so often the whole chain gets
+// sent anyway in case an LED picked up a glitch.
+class LedOutput
+{
+public:
+    struct Stats
+    {
+        uint32_t skippedFrames; // nothing changed
+        uint32_t partialFrames; // sent up to the last changed chunk
+        uint32_t fullFrames;
+        uint32_t sentLeds;
+    };
+
+private:
+    std::vector<LedColor> lastFrame_; // what the LEDs are showing
+    int chunkLedCount_;
+    TickCount fullRefreshTicks_;
+    TickCount lastFullRefreshTime_;
+    bool valid_;
+    Stats stats_;
+
+public:
+    LedOutput(int ledCount, int chunkLedCount, TickCount fullRefreshTicks);
+
+    // How many LEDs from the start of the chain need to go out to show
+    // pLeds - 0 if none.  Assumes the caller sends exactly that many.
+    int Update(TickCount time, const LedColor* pLeds);
+
+    // The next Update sends everything
+    void Invalidate() { valid_ = false; }
+
+    const Stats& GetStats() const { return stats_; }
+    void ResetStats() { memset(&stats_, 0, sizeof(stats_)); }
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include "Animator.h"
+#include "ColorKernels.h"
+
+// Shows that never change can be put together from types instead of
+// animator objects:
+//
+//   typedef StaticSequence<
+//       StaticFade<1000, 0, 1000, 0, 400, StaticChase<10000, 0, 400, color_red, 5, 10, 50>>,
+//       StaticSolidColor<1000, 0, 400, color_black>> Show;
+//   StaticShowAnimator<Show> showAnimator;
+//
+// The compiler works out the durations and the patterns, the patterns go in
+// flash with the code, and drawing is plain calls it can inline - no heap,
+// no arena, no virtual calls below the one StaticShowAnimator at the top.
+//
+// Each piece is a type with static members only:
+//   duration()           its length in ticks
+//   Draw(localTime, ...) what StepSpans would draw, localTime from 0 up to
+//                        the duration
+//   Differs(a, b)        true if it draws something different at a than at
+//                        b - the static version of what StepSpans returns
+//
+// They draw the same thing as the matching animators in Animator.h.
+
+// A list of colors known at compile time, each scaled by scale
+template<ColorScale scale, LedColor... colors>
+struct StaticColors
+{
+	static constexpr int size() { return sizeof...(colors); }
+
+	static const LedColor* data()
+	{
+		static const LedColor scaledColors[] = { ScaleColorFixed(scale, colors)... };
+		return scaledColors;
+	}
+};
+
+// 0 to count - 1 as template arguments, for building arrays
+template<int... indices>
+struct StaticIndices
+{
+};
+
+template<int count, int... indices>
+struct MakeStaticIndices : MakeStaticIndices<count - 1, count - 1, indices...>
+{
+};
+
+template<int... indices>
+struct MakeStaticIndices<0, indices...>
+{
+	typedef StaticIndices<indices...> type;
+};
+
+// LED colorIndex of ChaseAnimator's pattern for an odd width
+constexpr LedColor StaticChaseColor(LedColor color, int rampCount, int colorIndex)
+{
+	return (colorIndex < rampCount) ? ScaleColorFixed(ColorScaleFromFloat((colorIndex + 1) * (1.0f / (rampCount + 1.0f))), color) :
+		(colorIndex == rampCount) ? color :
+		(colorIndex <= 2 * rampCount) ? ScaleColorFixed(ColorScaleFromFloat((colorIndex - rampCount) * (1.0f - 1.0f / (rampCount + 1.0f))), color) :
+		color_black;
+}
+
+template<LedColor color, int width, typename Indices>
+struct StaticChaseColors;
+
+template<LedColor color, int width, int... indices>
+struct StaticChaseColors<color, width, StaticIndices<indices...>>
+{
+	static const LedColor* data()
+	{
+		static const LedColor chaseColors[] = { StaticChaseColor(color, width / 2, indices)... };
+		return chaseColors;
+	}
+};
+
+// ChaseAnimator's pattern - a bright spot ramping up and down, then space
+// LEDs of black.  Width gets rounded up to odd like ChaseAnimator does.
+template<LedColor color, LedCount width, LedCount space>
+struct StaticChasePattern
+{
+	static constexpr int oddWidth() { return (width % 2 == 0) ? width + 1 : width; }
+	static constexpr int size() { return oddWidth() + space; }
+
+	static const LedColor* data()
+	{
+		return StaticChaseColors<color, oddWidth(), typename MakeStaticIndices<oddWidth() + space>::type>::data();
+	}
+};
+
+template<TickCount duration_, LedIndex startLedIndex, LedCount ledCount, LedColor color>
+struct StaticSolidColor
+{
+	static constexpr TickCount duration() { return duration_; }
+
+	static void Draw(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+	{
+		FillColors(pColors + startLedIndex, ledCount, color);
+		spans.Add(startLedIndex, ledCount);
+	}
+
+	static bool Differs(TickCount a, TickCount b) { return false; }
+};
+
+// Pattern is a StaticColors or anything else with size() and data()
+template<TickCount duration_, LedIndex startLedIndex, LedCount ledCount, typename Pattern>
+struct StaticRepeatedPattern
+{
+	static constexpr TickCount duration() { return duration_; }
+
+	static void Draw(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+	{
+		RepeatPattern(pColors + startLedIndex, ledCount, Pattern::data(), Pattern::size(), 0);
+		spans.Add(startLedIndex, ledCount);
+	}
+
+	static bool Differs(TickCount a, TickCount b) { return false; }
+};
+
+template<TickCount duration_, LedIndex startLedIndex, LedCount ledCount, LedColor color, LedCount width, LedCount space, TickCount stepTicks>
+struct StaticChase
+{
+	typedef StaticChasePattern<color, width, space> Pattern;
+
+	static constexpr TickCount duration() { return duration_; }
+
+	// The pattern moves one LED toward the end every step
+	static constexpr int PatternIndex(TickCount localTime)
+	{
+		return (Pattern::size() - 1) - (int)((localTime / stepTicks) % Pattern::size());
+	}
+
+	static void Draw(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+	{
+		RepeatPattern(pColors + startLedIndex, ledCount, Pattern::data(), Pattern::size(), PatternIndex(localTime));
+		spans.Add(startLedIndex, ledCount);
+	}
+
+	static bool Differs(TickCount a, TickCount b) { return PatternIndex(a) != PatternIndex(b); }
+};
+
+// Scales whatever is on the LEDs after Child draws.  A holdDuration of 0
+// holds for the rest of Child's duration, like FadeAnimator.
+template<TickCount fadeInDuration, TickCount holdDuration_, TickCount fadeOutDuration, LedIndex startLedIndex, LedCount ledCount, typename Child>
+struct StaticFade
+{
+	static constexpr TickCount holdDuration()
+	{
+		return (holdDuration_ == 0) ? Child::duration() - (fadeInDuration + fadeOutDuration) : holdDuration_;
+	}
+	static constexpr TickCount duration() { return fadeInDuration + holdDuration() + fadeOutDuration; }
+
+	static void Draw(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+	{
+		Child::Draw(localTime, pColors, spans);
+
+		ColorScale scale = FadeScale(localTime, fadeInDuration, holdDuration(), fadeOutDuration);
+		if (scale != colorScaleOne)
+		{
+			ScaleColors(pColors + startLedIndex, ledCount, scale);
+			spans.Add(startLedIndex, ledCount);
+		}
+	}
+
+	static bool Differs(TickCount a, TickCount b)
+	{
+		return FadeScale(a, fadeInDuration, holdDuration(), fadeOutDuration) != FadeScale(b, fadeInDuration, holdDuration(), fadeOutDuration) ||
+			Child::Differs(a, b);
+	}
+};
+
+// The children one after another, like AnimatorGroup::AppendAnimator.
+// Nothing gets drawn at the very end.
+template<typename... Children>
+struct StaticSequence;
+
+template<>
+struct StaticSequence<>
+{
+	static constexpr TickCount duration() { return 0; }
+	static void Draw(TickCount localTime, LedColor* pColors, LedSpanList& spans) {}
+	static bool Differs(TickCount a, TickCount b) { return false; }
+};
+
+template<typename First, typename... Rest>
+struct StaticSequence<First, Rest...>
+{
+	typedef StaticSequence<Rest...> Next;
+
+	static constexpr TickCount duration() { return First::duration() + Next::duration(); }
+
+	static void Draw(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+	{
+		if (localTime < First::duration())
+		{
+			First::Draw(localTime, pColors, spans);
+		}
+		else
+		{
+			Next::Draw(localTime - First::duration(), pColors, spans);
+		}
+	}
+
+	static bool Differs(TickCount a, TickCount b)
+	{
+		bool aInFirst = a < First::duration();
+		if (aInFirst != (b < First::duration()))
+		{
+			return true; // one child stopped and another started
+		}
+		if (aInFirst)
+		{
+			return First::Differs(a, b);
+		}
+		return Next::Differs(a - First::duration(), b - First::duration());
+	}
+};
+
+// A static show as an Animator, for anything that takes one
+template<typename Show>
+class StaticShowAnimator : public Animator
+{
+private:
+	TickCount lastLocalTime_;
+	bool stepped_;
+
+public:
+	StaticShowAnimator() : lastLocalTime_(0), stepped_(false) { duration_ = Show::duration(); }
+
+	virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+	{
+		Show::Draw(localTime, pColors, spans);
+
+		bool changed = !stepped_ || Show::Differs(lastLocalTime_, localTime);
+		lastLocalTime_ = localTime;
+		stepped_ = true;
+		return changed;
+	}
+};
+
+// CreateChristmasLightsAnimator as a static show
+template<LedCount ledCount, ColorScale powerScale, TickCount patternDuration>
+using StaticChristmasLights = StaticSequence<
+	StaticFade<1000, patternDuration - 2000, 1000, 0, ledCount,
+		StaticRepeatedPattern<patternDuration, 0, ledCount,
+			StaticColors<powerScale, color_white, color_black, color_black, color_green, color_black, color_black, color_blue, color_black, color_black, color_red, color_black, color_black>>>,
+	StaticSolidColor<1000, 0, ledCount, color_black>>;
@@ -9,7 +9,11 @@
 #include <memory>
 
 #include "Animator.h"
+#include "StaticAnimator.h"
 #include "GameEngine.h"
+#include "InputLog.h"
+#include "AudioMixer.h"
+#include "LedOutput.h"
 #include <neopixel.h>
 
 SerialLogHandler logHandler;
@@ -30,13 +34,21 @@ int encoderValue;
 const int encoderClicksPerLED = 4; // 400 encoder clicks per full rotation
 
 
-#define PIXEL_COUNT 400
+#define PIXEL_COUNT (TreeConfig::totalLedCount)
 #define PIXEL_PIN D2
 #define PIXEL_TYPE WS2812B
 
 Adafruit_NeoPixel strip(PIXEL_COUNT, PIXEL_PIN, PIXEL_TYPE);
 
-AnimatorGroup* rootAnimator;
+// Scale factor to compensate a litte for the power problems on the long string of leds
+constexpr float powerScale = 0.4f;
+
+// The show for when we aren't playing the game.  It's built by the compiler
+// so its patterns sit in flash and it takes no heap at all.
+const bool testShow = false;
+typedef StaticChristmasLights<PIXEL_COUNT, ColorScaleFromFloat(powerScale), (testShow ? 1 : 30) * 1000> ChristmasLightsShow;
+StaticShowAnimator<ChristmasLightsShow> rootAnimator;
+LedSpanList animatorSpans; // what rootAnimator wrote this frame
 TickCount rootDuration;
 TickCount localTimeOffset;
 std::vector<LedColor> leds(PIXEL_COUNT, 0x00000000);
@@ -46,6 +58,16 @@ const LedCount sectionLength = 50; // length of one string of LEDs
 const LedCount sectionCount = pixelCount / sectionLength;
 const LedCount halfSectionLength = sectionLength / 2;
 
+// Only sends the strings up to the last one that changed, and the whole
+// chain once a second in case something glitched
+LedOutput ledOutput(PIXEL_COUNT, sectionLength, 1000);
+
+// A strip for each length a send can be - the first 1, 2, ... strings.
+// strip.updateLength frees and mallocs the pixel buffer and a partial send
+// changes length about every third frame in play, so these all get
+// allocated once in setup instead (about 5K).  The last one is strip.
+Adafruit_NeoPixel* sendStrips[sectionCount];
+
 
 // Keeps the LEDs from glitching
 // Comment this out if you want to see spark::Log stuff
@@ -64,9 +86,6 @@ GAME_STATE gameState = GS_PLAYING;
 
 int encoderHomeValue;
 
-// Scale factor to compensate a litte for the power problems on the long string of leds
-const float powerScale = 0.4f;
-
 #ifdef NO
 const LedColor color_dark_red = ScaleColor(powerScale, color_red);
 const LedColor color_dark_green = ScaleColor(powerScale, color_green);
@@ -74,11 +93,72 @@ const LedColor color_dark_blue = ScaleColor(powerScale, color_blue);
 const LedColor color_dark_white = ScaleColor(powerScale, color_white);
 #endif
 
+// Nothing checks for NULL when building shows so running out of memory
+// ends up here.  It has to be set before gameEngine builds its animators.
+void AnimatorOutOfMemory(size_t size)
+{
+  Log.error("Out of memory allocating %u bytes for the animators", (unsigned)size);
+  System.reset();
+}
+const bool animatorOutOfMemoryHandlerSet = (AnimatorArena::SetOutOfMemoryHandler(AnimatorOutOfMemory), true);
+
 GameEngine gameEngine;
+const uint32_t gameRandomSeed = 1;
+const TickCount simulationStepTicks = 4;
+
+// Uncomment to record the play session so it can be replayed on the PC
+// (BatchSimulator -replay).  The log gets dumped to the log handler as hex
+// once the buffer fills up - comment out SYSTEM_MODE(MANUAL) to see it.
+//#define RECORD_INPUT_LOG
+#ifdef RECORD_INPUT_LOG
+uint8_t inputLogBuffer[32 * 1024];
+InputLogWriter inputLog(inputLogBuffer, sizeof(inputLogBuffer));
+bool inputLogDumped = false;
+#endif
 
 // Used only in GS_LED_INDEX_MODE
 int testLedIndex = 0;
 
+// Uncomment once there's an amp and speaker on the DAC1 pin.  The samples
+// go out from a timer interrupt and the mixing happens in loop() only when
+// a block is free.
+//
+// strip.show() turns interrupts off while it sends.  With the stock
+// neopixel library that's the whole send - about 12ms for all 400 LEDs, so
+// close to 190 samples - and the DAC holds its last sample until it's done.
+// That's a buzz at the frame rate whenever LEDs are going out.  With the
+// library tweak from the Readme that turns them back on after each LED the
+// samples only run up to an LED's 30us late.  The underrun count doesn't
+// see either since no samples get skipped, they just play late, so the
+// interrupt counts the sample periods it missed itself.  Getting rid of the
+// stall without the tweak would take feeding the DAC from timer triggered
+// DMA.
+//#define ENABLE_SOUND
+#ifdef ENABLE_SOUND
+#include <SparkIntervalTimer.h>
+AudioMixer audioMixer;
+AudioBlockBuffer audioBuffer;
+IntervalTimer audioTimer;
+uint32_t maxAudioMixTicks = 0; // CPU cycles - worst case since the last FPS report
+uint32_t audioSampleTicks; // CPU cycles per sample
+uint32_t lastAudioInterruptTicks = 0;
+volatile uint32_t stalledAudioSamples = 0; // since the last FPS report
+
+void AudioTimerInterrupt()
+{
+  uint32_t ticks = System.ticks();
+  uint32_t gapTicks = ticks - lastAudioInterruptTicks;
+  lastAudioInterruptTicks = ticks;
+  if(gapTicks > 2 * audioSampleTicks)
+  {
+    stalledAudioSamples += gapTicks / audioSampleTicks - 1;
+  }
+
+  // DAC is 12 bits unsigned
+  analogWrite(DAC1, (audioBuffer.NextSample() + 32768) >> 4);
+}
+#endif
+
 int frameCount = 0;
 TickCount nextFPSReportTime = 0;
 
@@ -103,29 +183,39 @@ void setup()
   // Setup the LED strip
   strip.begin();
   strip.show(); // Initialize all pixels to 'off'
+  for(int stripIndex = 0; stripIndex < sectionCount - 1; ++stripIndex)
+  {
+    LedCount stripLedCount = (stripIndex + 1) * sectionLength;
+    sendStrips[stripIndex] = new Adafruit_NeoPixel(stripLedCount, PIXEL_PIN, PIXEL_TYPE);
+    if(sendStrips[stripIndex]->numPixels() != stripLedCount)
+    {
+      // No memory for its buffer - sends that short go out full length
+      Log.error("No memory for the %d LED send strip", (int)stripLedCount);
+      delete sendStrips[stripIndex];
+      sendStrips[stripIndex] = &strip;
+    }
+    sendStrips[stripIndex]->begin();
+  }
+  sendStrips[sectionCount - 1] = &strip;
 
   // TODO - Put us in GS_LED_INDEX_MODE if some button is pressed at startup
 
-  // setup the animations for when we aren't playing the game
-  rootAnimator = new AnimatorGroup();
-  const bool test = false;
+  rootDuration = rootAnimator.duration();
+  localTimeOffset = millis2();
 
-  // Pretend to be normal christmas lights
-  {
-    std::vector<LedColor> pattern = {color_white, color_black, color_black, color_green, color_black, color_black, color_blue, color_black, color_black, color_red, color_black, color_black};
-    ScalePattern(powerScale, pattern);
-    const TickCount duration = (test ? 1 : 30) * 1000;
-      
-    auto pRep = new RepeatedPatternAnimator(duration, 0, pixelCount, pattern);
-    auto pFade = new FadeAnimator(1000, duration - 2000, 1000, 0, pixelCount, pRep);
-    rootAnimator->AppendAnimator(pFade);
-  }
-  
-  // All leds black for a second
-  rootAnimator->AppendAnimator(new SolidColor(1000, color_black, 0, pixelCount));
+#ifdef ENABLE_SOUND
+  pinMode(DAC1, OUTPUT);
+  audioSampleTicks = System.ticksPerMicrosecond() * 1000000 / AudioMixer::sampleRate;
+  lastAudioInterruptTicks = System.ticks();
+  audioTimer.begin(AudioTimerInterrupt, 1000000 / AudioMixer::sampleRate, uSec);
+#endif
 
-  rootDuration = rootAnimator->duration();
-  localTimeOffset = millis2();
+  // Simulate at 250Hz no matter how long strip.show() takes
+  gameEngine.SetRandomSeed(gameRandomSeed);
+  gameEngine.SetFixedTimestep(simulationStepTicks, true);
+#ifdef RECORD_INPUT_LOG
+  inputLog.Begin(gameRandomSeed, simulationStepTicks, true, true);
+#endif
 }
 
 // loop() runs over and over again, as quickly as it can execute.
@@ -158,7 +248,8 @@ void loop()
           localTime = 0;
       }
 
-      rootAnimator->Step(localTime, leds.data());
+      animatorSpans.Clear();
+      rootAnimator.StepSpans(localTime, leds.data(), animatorSpans);
 
       if(EncoderMoved())
       {
@@ -171,19 +262,68 @@ void loop()
     case GS_PLAYING:
       int playerPosition = ((encoderValue - encoderHomeValue) / encoderClicksPerLED) % gameEngine.GetPathLedCount();
       if(playerPosition < 0) playerPosition += gameEngine.GetPathLedCount();
-      gameEngine.Step(millis2(), playerPosition, firePressed, startPressed);
+      TickCount now = millis2();
+      gameEngine.Step(now, playerPosition, firePressed, startPressed);
       gameEngine.SetLeds(leds.data());
+
+      // Only sound listens to the events so far - drain them here either
+      // way so they don't pile up
+      GameEvent event;
+      while(gameEngine.PopEvent(event))
+      {
+#ifdef ENABLE_SOUND
+        audioMixer.PlayEvent(event);
+#endif
+      }
+#ifdef RECORD_INPUT_LOG
+      inputLog.AddFrame(now, playerPosition, firePressed, startPressed, leds.data());
+      if(inputLog.IsFull() && !inputLogDumped)
+      {
+        DumpInputLog();
+      }
+#endif
       break;
 
   }
 
-  unsigned int pixelIndex = 0;
-  for(auto c = leds.begin(); c != leds.end(); ++c, ++pixelIndex)
+  int sendLedCount = ledOutput.Update(millis2(), leds.data());
+  if(sendLedCount > 0)
+  {
+    // Sends are whole strings.  The strip may be longer than the send if
+    // its own buffer couldn't be allocated.
+    Adafruit_NeoPixel* pSendStrip = sendStrips[(sendLedCount + sectionLength - 1) / sectionLength - 1];
+    for(int pixelIndex = 0; pixelIndex < pSendStrip->numPixels(); ++pixelIndex)
+    {
+      pSendStrip->setPixelColor(pixelIndex, leds[pixelIndex]);
+    }
+    pSendStrip->show();
+  }
+
+#ifdef ENABLE_SOUND
+  // Both blocks may have played during a long frame
+  uint32_t mixStartTicks = System.ticks();
+  while(audioBuffer.FillBlock(audioMixer))
+  {
+    uint32_t mixTicks = System.ticks() - mixStartTicks;
+    if(mixTicks > maxAudioMixTicks) maxAudioMixTicks = mixTicks;
+    mixStartTicks = System.ticks();
+  }
+#endif
+
+  if(gameState == GS_ANIMATING)
   {
-      strip.setPixelColor(pixelIndex, *c);
+    // Only what the animators wrote needs to go back to black
+    for(int spanIndex = 0; spanIndex < animatorSpans.GetCount(); ++spanIndex)
+    {
+      auto pSpanStart = leds.begin() + animatorSpans[spanIndex].startLedIndex;
+      fill(pSpanStart, pSpanStart + animatorSpans[spanIndex].ledCount, 0x00000000);
+    }
+  }
+  else if(gameState != GS_PLAYING)
+  {
+    // The game engine keeps its frames up to date itself
+    fill(leds.begin(), leds.end(), 0x00000000);
   }
-  strip.show();
-  fill(leds.begin(), leds.end(), 0x00000000);
 
 
   frameCount++;
@@ -191,6 +331,14 @@ void loop()
   {
     Log.info("FPS: %d", frameCount);
     frameCount = 0;
+    const LedOutput::Stats& outputStats = ledOutput.GetStats();
+    Log.info("Frames sent: %lu full, %lu partial, %lu skipped, %lu LEDs", outputStats.fullFrames, outputStats.partialFrames, outputStats.skippedFrames, outputStats.sentLeds);
+    ledOutput.ResetStats();
+#ifdef ENABLE_SOUND
+    Log.info("Audio block mix max: %lu us, underrun samples: %lu, stalled samples: %lu", maxAudioMixTicks / System.ticksPerMicrosecond(), audioBuffer.GetUnderrunCount(), stalledAudioSamples);
+    maxAudioMixTicks = 0;
+    stalledAudioSamples = 0;
+#endif
     nextFPSReportTime = millis2() + 1000;
 
     if(gameState == GS_LED_INDEX_MODE)
@@ -202,6 +350,24 @@ void loop()
   }
 }
 
+#ifdef RECORD_INPUT_LOG
+void DumpInputLog()
+{
+  inputLogDumped = true;
+  char line[2 * 32 + 1];
+  for(int offset = 0; offset < inputLog.GetSize(); offset += 32)
+  {
+    int lineLength = 0;
+    for(int i = offset; i < offset + 32 && i < inputLog.GetSize(); ++i)
+    {
+      lineLength += sprintf(line + lineLength, "%02x", inputLogBuffer[i]);
+    }
+    Log.info("INPUTLOG %s", line);
+  }
+  Log.info("INPUTLOG END %d frames", inputLog.GetFrameCount());
+}
+#endif
+
 unsigned long millis2()
 {
     return millis(); // * 4;
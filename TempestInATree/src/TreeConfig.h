@@ -0,0 +1,86 @@
+#pragma once
+
+// Compile time description of a tree - where the LEDs are and how many
+// shots and enemies the game can have going at once.  GameEngine pulls all
+// its geometry and capacities from TreeConfig so each tree gets a build with
+// its own numbers baked in.
+//
+// To build for a different tree, write a struct with the same members as
+// DefaultTreeConfig in its own header and define TEMPEST_TREE_CONFIG_HEADER
+// to that header (in quotes) and TEMPEST_TREE_CONFIG to the struct name.
+// The static_asserts in GameEngine.h check the numbers fit.
+
+struct TreeLane
+{
+    int startIndex; // side of the lane where the enemies start
+    int endIndex; // side of the lane where the player is
+    int pathLedIndex; // position on the path.  0 is the start of the path.
+};
+
+// The tree on the front porch
+struct DefaultTreeConfig
+{
+    static constexpr int totalLedCount = 400;
+    static constexpr int treeBaseStartLedIndex = 1;
+    static constexpr int treeBaseEndLedIndex = 17;
+    static constexpr int pathLeftLedIndex = 55;
+    static constexpr int pathRightLedIndex = 27;
+
+    static constexpr int maxEnemies = 20; // maximum number of simultanious enemies
+    static constexpr int maxActiveShots = 30; // maximum number of simultanious shots (player and enemy)
+    static constexpr int maxPlayerShots = 4; // maximum number of shots the player can have active on the board at once
+
+    static constexpr TreeLane lanes[] =
+    {
+        // start led index, end led index, player path led index of end
+        {99,  56,  0},
+        {100, 142, 5},
+        {188, 147, 10},
+        {189, 229, 14},
+        {274, 233, 18},
+        {275, 315, 23},
+        {363, 320, 27},
+    };
+    static constexpr int laneCount = sizeof(lanes) / sizeof(*lanes);
+};
+
+#ifdef TEMPEST_TREE_CONFIG_HEADER
+#include TEMPEST_TREE_CONFIG_HEADER
+#endif
+
+#ifndef TEMPEST_TREE_CONFIG
+#define TEMPEST_TREE_CONFIG DefaultTreeConfig
+#endif
+
+typedef TEMPEST_TREE_CONFIG TreeConfig;
+
+// Used by the static_asserts in GameEngine.h.  One lane at a time since
+// constexpr functions can't loop in C++11.
+constexpr int TreeLedRangeLength(int a, int b)
+{
+    return ((b >= a) ? (b - a) : (a - b)) + 1;
+}
+
+constexpr bool TreeLanesFit(const TreeLane* pLanes, int count, int totalLedCount, int pathLedCount, int maxLaneLength)
+{
+    return count == 0 ||
+        (pLanes->startIndex >= 0 && pLanes->startIndex < totalLedCount &&
+         pLanes->endIndex >= 0 && pLanes->endIndex < totalLedCount &&
+         pLanes->pathLedIndex >= 0 && pLanes->pathLedIndex < pathLedCount &&
+         TreeLedRangeLength(pLanes->startIndex, pLanes->endIndex) <= maxLaneLength &&
+         TreeLanesFit(pLanes + 1, count - 1, totalLedCount, pathLedCount, maxLaneLength));
+}
+
+// LED count of the longest lane, for sizing GameEngine's position tables
+constexpr int TreeLongestLaneLength(const TreeLane* pLanes, int count)
+{
+    return (count == 0) ? 0 :
+        (TreeLedRangeLength(pLanes->startIndex, pLanes->endIndex) > TreeLongestLaneLength(pLanes + 1, count - 1)) ?
+            TreeLedRangeLength(pLanes->startIndex, pLanes->endIndex) : TreeLongestLaneLength(pLanes + 1, count - 1);
+}
+
+// Smallest power of two bigger than value
+constexpr int TreePowerOfTwoAbove(int value, int powerOfTwo = 1)
+{
+    return (powerOfTwo > value) ? powerOfTwo : TreePowerOfTwoAbove(value, powerOfTwo * 2);
+}
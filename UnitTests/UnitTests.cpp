@@ -3,12 +3,20 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <thread>
 #include <stdlib.h>
 #include <string.h>
 #include <strsafe.h>
 
 #include "..\TempestInATree\src\Animator.h"
 #include "..\TempestInATree\src\GameEngine.h"
+#include "..\TempestInATree\src\InputLog.h"
+#include "..\TempestInATree\src\AudioMixer.h"
+#include "..\TempestInATree\src\LedOutput.h"
+#include "..\TempestInATree\src\AnimationClip.h"
+#include "..\TempestInATree\src\ColorKernels.h"
+#include "..\TempestInATree\src\StaticAnimator.h"
+#include "..\TempestInATree\src\LayerCompositor.h"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -183,68 +191,978 @@ namespace UnitTests
 			Assert::AreEqual(10, GameEngine::LedIndexFromRange(15, 5, 0.5f));
 		}
 
+		TEST_METHOD(LedSpanListTest)
+		{
+			LedSpanList spans;
+			Assert::IsTrue(spans.IsEmpty());
+			Assert::AreEqual(0, spans.GetEndLedIndex());
+
+			spans.Add(5, 3);
+			spans.Add(10, 2);
+			spans.Add(20, 0); // nothing
+			Assert::AreEqual(2, spans.GetCount());
+			Assert::AreEqual(5, (int)spans[0].startLedIndex);
+			Assert::AreEqual(3, (int)spans[0].ledCount);
+			Assert::AreEqual(10, (int)spans[1].startLedIndex);
+
+			// Touches both - all three become one
+			spans.Add(8, 2);
+			Assert::AreEqual(1, spans.GetCount());
+			Assert::AreEqual(5, (int)spans[0].startLedIndex);
+			Assert::AreEqual(7, (int)spans[0].ledCount);
+
+			// Goes in front and overlaps
+			spans.Add(0, 1);
+			spans.Add(4, 3);
+			Assert::AreEqual(2, spans.GetCount());
+			Assert::AreEqual(0, (int)spans[0].startLedIndex);
+			Assert::AreEqual(4, (int)spans[1].startLedIndex);
+			Assert::AreEqual(8, (int)spans[1].ledCount);
+			Assert::AreEqual(12, spans.GetEndLedIndex());
+
+			// Full list - the two closest spans get merged
+			spans.Clear();
+			for (int spanIndex = 0; spanIndex < LedSpanList::maxSpanCount; ++spanIndex)
+			{
+				spans.Add(spanIndex * 10, 1);
+			}
+			Assert::AreEqual((int)LedSpanList::maxSpanCount, spans.GetCount());
+			spans.Add(152, 1);
+			Assert::AreEqual((int)LedSpanList::maxSpanCount, spans.GetCount());
+			Assert::AreEqual(0, (int)spans[0].startLedIndex);
+			Assert::AreEqual(1, (int)spans[0].ledCount);
+			Assert::AreEqual(150, (int)spans[LedSpanList::maxSpanCount - 1].startLedIndex);
+			Assert::AreEqual(3, (int)spans[LedSpanList::maxSpanCount - 1].ledCount);
+
+			LedSpanList all;
+			all.Add(0, 400);
+			spans.Add(all);
+			Assert::AreEqual(1, spans.GetCount());
+			Assert::AreEqual(400, spans.GetEndLedIndex());
+		}
+
+		TEST_METHOD(AnimatorSpansTest)
+		{
+			std::vector<LedColor> leds(20, 0);
+			LedSpanList spans;
+
+			AnimatorGroup group;
+			group.AddAnimator(new SolidColor(100, 0, 5, 1), 0);
+			group.AddAnimator(new SingleChaseAnimator(100, 10, 10, 9, 3), 50);
+
+			Assert::IsTrue(group.StepSpans(0, leds.data(), spans)); // first time
+			Assert::AreEqual(1, spans.GetCount());
+			Assert::AreEqual(5, spans.GetEndLedIndex());
+
+			spans.Clear();
+			Assert::IsFalse(group.StepSpans(10, leds.data(), spans));
+			Assert::AreEqual(1, spans.GetCount());
+
+			// Chase starts with just the end of its pattern on the LEDs
+			spans.Clear();
+			Assert::IsTrue(group.StepSpans(50, leds.data(), spans));
+			Assert::AreEqual(2, spans.GetCount());
+			Assert::AreEqual(10, (int)spans[1].startLedIndex);
+			Assert::AreEqual(2, (int)spans[1].ledCount);
+
+			spans.Clear();
+			Assert::IsFalse(group.StepSpans(51, leds.data(), spans));
+
+			// 7 ticks per step
+			spans.Clear();
+			Assert::IsTrue(group.StepSpans(57, leds.data(), spans));
+			Assert::AreEqual(3, (int)spans[1].ledCount);
+
+			// Solid color stopping changes the output even though the chase didn't move
+			spans.Clear();
+			Assert::IsTrue(group.StepSpans(100, leds.data(), spans));
+			Assert::AreEqual(1, spans.GetCount());
+			Assert::AreEqual(16, (int)spans[0].startLedIndex); // step 7
+
+			// Clearing only what the animations wrote draws the same as clearing everything
+			GameEngine ge;
+			GameEngine check;
+			std::vector<LedColor> geLeds(GameEngine::totalLedCount, 0);
+			std::vector<LedColor> checkLeds(GameEngine::totalLedCount, 0);
+			TickCount time = 1;
+			for (int frame = 0; frame < 600; ++frame, time += 16)
+			{
+				bool start = (frame == 300);
+				ge.Step(time, 0, false, start);
+				check.Step(time, 0, false, start);
+				ge.SetLeds(geLeds.data());
+				check.InvalidateLeds();
+				check.SetLeds(checkLeds.data());
+				Assert::IsTrue(geLeds == checkLeds);
+			}
+			Assert::IsFalse(ge.IsAttractMode());
+		}
+
+		// Steps the animator and runs the program at each time, each onto black,
+		// and checks they draw the same LEDs, spans and change flag
+		void AssertProgramMatches(Animator& animator, RenderProgram& program, const std::vector<TickCount>& times, int ledCount)
+		{
+			std::vector<LedColor> animatorLeds(ledCount);
+			std::vector<LedColor> programLeds(ledCount);
+			for (TickCount time : times)
+			{
+				fill(animatorLeds.begin(), animatorLeds.end(), color_black);
+				fill(programLeds.begin(), programLeds.end(), color_black);
+				LedSpanList animatorSpans;
+				LedSpanList programSpans;
+				bool animatorChanged = animator.StepSpans(time, animatorLeds.data(), animatorSpans);
+				bool programChanged = program.Run(time, programLeds.data(), programSpans);
+
+				Assert::IsTrue(animatorLeds == programLeds);
+				Assert::AreEqual(animatorChanged, programChanged);
+				Assert::AreEqual(animatorSpans.GetCount(), programSpans.GetCount());
+				for (int spanIndex = 0; spanIndex < animatorSpans.GetCount(); ++spanIndex)
+				{
+					Assert::AreEqual(animatorSpans[spanIndex].startLedIndex, programSpans[spanIndex].startLedIndex);
+					Assert::AreEqual(animatorSpans[spanIndex].ledCount, programSpans[spanIndex].ledCount);
+				}
+			}
+		}
+
+		static AnimatorGroup* BuildRenderProgramTestTree()
+		{
+			// Every kind of animator, nested
+			AnimatorGroup* pInner = new AnimatorGroup();
+			pInner->AddAnimator(new SolidColor(300, 0, 40, color_green), 0);
+			pInner->AddAnimator(new ChaseAnimator(300, 10, 30, color_red, 4, 3, 7), 50);
+			pInner->AddAnimator(new SingleChaseAnimator(200, 40, 20, color_blue, 5), 100);
+
+			RangeAnimator* pRange = new RangeAnimator(200, 30);
+			pRange->AddRange(80, 5);
+			pRange->AddRange(90, 5);
+			pRange->AddColor(color_red);
+			pRange->AddColor(color_blue);
+			pRange->AddColor(color_yellow);
+
+			std::vector<LedColor> pattern = { color_white, color_black, color_cyan };
+
+			AnimatorGroup* pRoot = new AnimatorGroup();
+			pRoot->AddAnimator(new FadeAnimator(100, 0, 100, 0, 60, pInner), 0);
+			pRoot->AddAnimator(new FillInAnimator(150, 60, 20, color_white), 250);
+			pRoot->AddAnimator(pRange, 350);
+			pRoot->AppendAnimator(new RepeatedPatternAnimator(100, 0, 100, pattern), 10);
+			return pRoot;
+		}
+
+		TEST_METHOD(RenderProgramTest)
+		{
+			// Same tree twice since animators have state
+			std::unique_ptr<AnimatorGroup> pTree(BuildRenderProgramTestTree());
+			std::unique_ptr<AnimatorGroup> pCompiled(BuildRenderProgramTestTree());
+			RenderProgram program;
+			program.Compile(pCompiled.get());
+			Assert::AreEqual(7, program.GetOpCount());
+
+			// Around twice to check the ops start again
+			std::vector<TickCount> times;
+			for (TickCount time = 0; time < 2 * pTree->duration(); ++time)
+			{
+				times.push_back(time % pTree->duration());
+			}
+			AssertProgramMatches(*pTree, program, times, 100);
+
+			// The engine's animations, sparkles and all
+			GameEngine treeEngine;
+			GameEngine programEngine;
+			std::vector<TickCount> engineTimes;
+			for (TickCount time = 0; time < 5000; time += 7)
+			{
+				engineTimes.push_back(time);
+			}
+			for (int slot = 0; slot < GameEngine::AS_COUNT; ++slot)
+			{
+				AssertProgramMatches(*treeEngine.stateAnimators[slot], programEngine.statePrograms[slot], engineTimes, GameEngine::totalLedCount);
+			}
+		}
+
+		static AnimatorGroup* BuildPlaylist()
+		{
+			// Hundreds of overlapping segments added out of start order, some
+			// starting together and some with nothing to draw
+			AnimatorGroup* pGroup = new AnimatorGroup();
+			uint32_t random = 99;
+			for (int segmentIndex = 0; segmentIndex < 300; ++segmentIndex)
+			{
+				random = random * 1664525 + 1013904223;
+				TickCount startTime = (random >> 8) % 3000;
+				TickCount duration = (segmentIndex % 17 == 0) ? 0 : 1 + (random >> 20) % 120;
+				LedIndex startLedIndex = (LedIndex)(segmentIndex % 90);
+				pGroup->AddAnimator(new SolidColor(duration, startLedIndex, 10, 0x00010000 * (segmentIndex + 1)), (segmentIndex % 5 == 0) ? 100 : startTime);
+			}
+			pGroup->AddAnimator(new FillInAnimator(3000, 0, 100, color_blue), 0);
+			return pGroup;
+		}
+
+		TEST_METHOD(AnimatorGroupTimelineTest)
+		{
+			std::unique_ptr<AnimatorGroup> pGroup(BuildPlaylist());
+			std::unique_ptr<AnimatorGroup> pCompiled(BuildPlaylist());
+			RenderProgram program;
+			program.Compile(pCompiled.get());
+
+			// Mostly forward with the odd jump back, checked against the
+			// program which works out every child's window on its own
+			TickCount times[] = { 0, 1, 5, 100, 101, 350, 351, 352, 1200, 900, 905, 2999, 10, 11, 3005, 2000, 2001 };
+			std::vector<TickCount> allTimes(times, times + ARRAYSIZE(times));
+			for (TickCount time = 0; time < pGroup->duration() + 10; time += 3)
+			{
+				allTimes.push_back(time);
+			}
+			AssertProgramMatches(*pGroup, program, allTimes, 100);
+		}
+
+		TEST_METHOD(AnimatorArenaTest)
+		{
+			static uint64_t buffer[8192];
+			AnimatorArena arena(buffer, sizeof(buffer));
+			const uint8_t* pBufferStart = (const uint8_t*)buffer;
+			const uint8_t* pBufferEnd = pBufferStart + sizeof(buffer);
+
+			// Built in the arena it draws the same as off the heap
+			std::unique_ptr<AnimatorGroup> pHeapGroup(BuildPlaylist());
+			AnimatorGroup* pArenaGroup;
+			{
+				AnimatorArena::Scope arenaScope(arena);
+				pArenaGroup = BuildPlaylist();
+			}
+			Assert::IsTrue((const uint8_t*)pArenaGroup >= pBufferStart && (const uint8_t*)pArenaGroup < pBufferEnd);
+			size_t builtBytes = arena.GetBytesUsed();
+			Assert::IsTrue(builtBytes > 300 * sizeof(SolidColor));
+			Assert::AreEqual(0, arena.GetExtraChunkCount());
+
+			// The first step builds the group's timeline, in the arena even
+			// though the scope is gone
+			std::vector<LedColor> heapLeds(100);
+			std::vector<LedColor> arenaLeds(100);
+			for (TickCount time = 0; time < pHeapGroup->duration(); time += 7)
+			{
+				fill(heapLeds.begin(), heapLeds.end(), color_black);
+				fill(arenaLeds.begin(), arenaLeds.end(), color_black);
+				pHeapGroup->Step(time, heapLeds.data());
+				pArenaGroup->Step(time, arenaLeds.data());
+				Assert::IsTrue(heapLeds == arenaLeds);
+			}
+			Assert::IsTrue(arena.GetBytesUsed() > builtBytes);
+
+			// Deleting something in the arena doesn't free it
+			{
+				AnimatorArena::Scope arenaScope(arena);
+				SolidColor* pSolid = new SolidColor(10, 0, 10, color_red);
+				size_t allocatedBytes = arena.GetBytesUsed();
+				delete pSolid;
+				Assert::AreEqual(allocatedBytes, arena.GetBytesUsed());
+			}
+
+			arena.Reset();
+			Assert::AreEqual((size_t)0, arena.GetBytesUsed());
+			Assert::IsTrue(arena.Allocate(16, 8) == (void*)buffer);
+
+			// Running out of heap goes to the out of memory handler instead of
+			// handing back NULL
+			AnimatorArena::SetOutOfMemoryHandler([](size_t size) { throw size; });
+			Assert::ExpectException<size_t>([&]() { arena.Allocate(SIZE_MAX / 2, 8); });
+			AnimatorArena::SetOutOfMemoryHandler(NULL);
+
+			// Past the end of the buffer goes to the heap until the reset
+			Assert::IsNotNull(arena.Allocate(sizeof(buffer), 8));
+			Assert::AreEqual(1, arena.GetExtraChunkCount());
+			arena.Reset();
+			Assert::AreEqual(0, arena.GetExtraChunkCount());
+			Assert::IsNull(AnimatorArena::GetCurrent());
+
+			// The engine's state animators fit in its first chunk
+			std::unique_ptr<GameEngine> pEngine(new GameEngine());
+			std::vector<LedColor> leds(GameEngine::totalLedCount, 0);
+			for (int frame = 0; frame < 600; ++frame)
+			{
+				pEngine->Step(1 + frame * 16, 0, false, frame == 300);
+				pEngine->SetLeds(leds.data());
+			}
+			Assert::IsTrue(pEngine->stateArena.GetBytesUsed() > 0);
+			Assert::AreEqual(0, pEngine->stateArena.GetExtraChunkCount());
+		}
+
+		TEST_METHOD(SparkleAnimatorTest)
+		{
+			GameEngine ge;
+			const TickCount duration = 20000;
+			GameEngine::SparkleAnimator seeked(duration, ge.lanes, GameEngine::laneCount, 20, 2000, 5000, color_white);
+			GameEngine::SparkleAnimator seeking(duration, ge.lanes, GameEngine::laneCount, 20, 2000, 5000, color_white);
+			GameEngine::SparkleAnimator otherSeed(duration, ge.lanes, GameEngine::laneCount, 20, 2000, 5000, color_white, 12345);
+
+			// Nothing sparkles at the very start
+			std::vector<LedColor> leds(GameEngine::totalLedCount, color_black);
+			LedSpanList spans;
+			Assert::AreEqual(0, seeked.DrawSparkles(0, leds.data(), spans));
+
+			// Stepped in order or jumping around, the same time draws the same
+			std::vector<LedColor> seekedLeds(GameEngine::totalLedCount);
+			std::vector<LedColor> seekingLeds(GameEngine::totalLedCount);
+			std::vector<LedColor> otherLeds(GameEngine::totalLedCount);
+			int mostSparkles = 0;
+			bool seedsDiffer = false;
+			for (TickCount time = 0; time < duration; time += 16)
+			{
+				TickCount seekTime = duration - 16 - time;
+				fill(seekedLeds.begin(), seekedLeds.end(), color_black);
+				fill(seekingLeds.begin(), seekingLeds.end(), color_black);
+				seeked.Step(seekTime, seekedLeds.data());
+				seeking.Step(time, seekingLeds.data());
+				fill(seekingLeds.begin(), seekingLeds.end(), color_black);
+				seeking.Step(seekTime, seekingLeds.data());
+				Assert::IsTrue(seekedLeds == seekingLeds);
+
+				fill(leds.begin(), leds.end(), color_black);
+				fill(otherLeds.begin(), otherLeds.end(), color_black);
+				LedSpanList sparkleSpans;
+				int sparkleCount = seeked.DrawSparkles(time, leds.data(), sparkleSpans);
+				otherSeed.Step(time, otherLeds.data());
+				if (sparkleCount > mostSparkles) mostSparkles = sparkleCount;
+				if (leds != otherLeds) seedsDiffer = true;
+
+				int litCount = 0;
+				for (LedColor color : leds)
+				{
+					if (color != color_black) litCount++;
+				}
+				Assert::IsTrue(litCount <= sparkleCount);
+			}
+
+			// Sparkles last 2s of every 5s cycle so there are always a few
+			Assert::IsTrue(mostSparkles > 5 && mostSparkles <= 20);
+			Assert::IsTrue(seedsDiffer);
+
+			// On their own sparkles cross-fade the LEDs, and only draw alpha
+			// for a compositor when asked to
+			GameEngine::SparkleAnimator alpha(duration, ge.lanes, GameEngine::laneCount, 20, 2000, 5000, color_white, GameEngine::defaultRandomSeed, true);
+			std::vector<LedColor> alphaLeds(GameEngine::totalLedCount, color_black);
+			fill(leds.begin(), leds.end(), color_black);
+			LedSpanList crossFadeSpans;
+			LedSpanList alphaSpans;
+			Assert::IsTrue(seeked.DrawSparkles(10000, leds.data(), crossFadeSpans) > 0);
+			alpha.DrawSparkles(10000, alphaLeds.data(), alphaSpans);
+			for (int spanIndex = 0; spanIndex < crossFadeSpans.GetCount(); ++spanIndex)
+			{
+				LedIndex ledIndex = crossFadeSpans[spanIndex].startLedIndex;
+				Assert::AreEqual((LedColor)0, leds[ledIndex] & 0xFF000000);
+				Assert::AreEqual((LedColor)0x00FFFFFF, alphaLeds[ledIndex] & 0x00FFFFFF);
+				Assert::AreNotEqual((LedColor)0, alphaLeds[ledIndex] & 0xFF000000);
+			}
+		}
+
+		TEST_METHOD(SeekableAnimatorTest)
+		{
+			// Every show draws from the time alone now, the attract loop's
+			// sparkles included
+			GameEngine ge;
+			GameEngine::Show shows[] = { GameEngine::Show::SH_ATTRACT, GameEngine::Show::SH_GAME_START, GameEngine::Show::SH_LEVEL_START, GameEngine::Show::SH_GAME_OVER };
+			for (GameEngine::Show show : shows)
+			{
+				std::unique_ptr<Animator> pShow(ge.CreateShowAnimator(show));
+				Assert::IsTrue(pShow->IsSeekable());
+			}
+
+			// A group is only seekable if all its children are
+			class HistoryAnimator : public Animator
+			{
+			public:
+				HistoryAnimator() { duration_ = 100; }
+				virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans) { return false; }
+				virtual bool IsSeekable() const { return false; }
+			};
+			std::unique_ptr<AnimatorGroup> pGroup(new AnimatorGroup());
+			pGroup->AddAnimator(new SolidColor(100, 0, 10, color_red), 0);
+			Assert::IsTrue(pGroup->IsSeekable());
+			pGroup->AddAnimator(new FadeAnimator(10, 10, 10, 0, 10, new HistoryAnimator()), 50);
+			Assert::IsFalse(pGroup->IsSeekable());
+		}
+
+		TEST_METHOD(StaticAnimatorTest)
+		{
+			// The static Christmas lights draw what the animator version does
+			const LedCount ledCount = 100;
+			StaticShowAnimator<StaticChristmasLights<ledCount, ColorScaleFromFloat(0.4f), 5000>> staticLights;
+			std::unique_ptr<AnimatorGroup> pLights(CreateChristmasLightsAnimator(ledCount, 0.4f, 5000));
+			Assert::AreEqual(pLights->duration(), staticLights.duration());
+
+			std::vector<LedColor> expected(ledCount);
+			std::vector<LedColor> actual(ledCount);
+			for (TickCount t = 0; t <= staticLights.duration(); t += 7)
+			{
+				std::fill(expected.begin(), expected.end(), color_black);
+				std::fill(actual.begin(), actual.end(), color_black);
+				LedSpanList expectedSpans;
+				LedSpanList actualSpans;
+				pLights->StepSpans(t, expected.data(), expectedSpans);
+				staticLights.StepSpans(t, actual.data(), actualSpans);
+				Assert::IsTrue(expected == actual);
+				Assert::AreEqual(expectedSpans.GetEndLedIndex(), actualSpans.GetEndLedIndex());
+			}
+
+			// The compile-time chase pattern matches the one ChaseAnimator
+			// builds, and so does when it reports a change
+			StaticShowAnimator<StaticChase<3000, 10, 60, color_red, 6, 4, 40>> staticChase;
+			std::unique_ptr<ChaseAnimator> pChase(new ChaseAnimator(3000, 10, 60, color_red, 6, 4, 40));
+			Assert::AreEqual(11, StaticChasePattern<color_red, 6, 4>::size());
+			for (TickCount t = 0; t < 3000; t += 15)
+			{
+				LedSpanList expectedSpans;
+				LedSpanList actualSpans;
+				bool expectedChanged = pChase->StepSpans(t, expected.data(), expectedSpans);
+				bool actualChanged = staticChase.StepSpans(t, actual.data(), actualSpans);
+				Assert::IsTrue(expected == actual);
+				Assert::AreEqual(expectedChanged, actualChanged);
+				Assert::AreEqual(expectedSpans.GetEndLedIndex(), actualSpans.GetEndLedIndex());
+			}
+
+			// Fades and sequences work their durations out at compile time
+			typedef StaticSequence<
+				StaticFade<100, 0, 200, 0, 10, StaticSolidColor<1000, 0, 10, color_blue>>,
+				StaticSolidColor<500, 0, 10, color_green>> Show;
+			static_assert(Show::duration() == 1500, "sequence duration");
+			StaticShowAnimator<Show> show;
+			LedSpanList spans;
+			Assert::IsTrue(show.StepSpans(0, actual.data(), spans)); // first step
+			Assert::IsTrue(show.StepSpans(50, actual.data(), spans)); // fading in
+			Assert::IsTrue(show.StepSpans(300, actual.data(), spans));
+			Assert::IsFalse(show.StepSpans(400, actual.data(), spans)); // holding
+			Assert::IsFalse(show.StepSpans(700, actual.data(), spans));
+			Assert::IsTrue(show.StepSpans(900, actual.data(), spans)); // fading out
+			Assert::IsTrue(show.StepSpans(1000, actual.data(), spans)); // second child
+			Assert::AreEqual(color_green, actual[0]);
+			Assert::IsFalse(show.StepSpans(1400, actual.data(), spans));
+			Assert::IsTrue(show.StepSpans(1500, actual.data(), spans)); // the end draws nothing
+		}
+
+		TEST_METHOD(LayerCompositorTest)
+		{
+			// Counts its steps to tell when its layer got skipped
+			class CountingAnimator : public Animator
+			{
+			public:
+				int stepCount;
+				CountingAnimator(TickCount duration) : stepCount(0) { duration_ = duration; }
+				virtual bool StepSpans(TickCount localTime, LedColor* pColors, LedSpanList& spans)
+				{
+					stepCount++;
+					FillColors(pColors + 5, 10, color_blue);
+					spans.Add(5, 10);
+					return false;
+				}
+			};
+
+			// A layer hidden by the opaque layers above it doesn't get stepped,
+			// even when it takes two of them to cover it
+			LayerCompositor layers(1000);
+			CountingAnimator* pBottom = new CountingAnimator(1000);
+			layers.AddLayer(pBottom, 0, 5, 10);
+			layers.AddLayer(new SolidColor(1000, 0, 10, color_red), 0, 0, 10, BlendMode::BM_REPLACE, colorScaleOne, true);
+			layers.AddLayer(new SolidColor(500, 10, 10, color_green), 0, 10, 10, BlendMode::BM_REPLACE, colorScaleOne, true);
+			std::vector<LedColor> leds(30, color_black);
+			LedSpanList spans;
+			Assert::IsTrue(layers.StepSpans(0, leds.data(), spans));
+			Assert::AreEqual(0, pBottom->stepCount);
+			Assert::AreEqual(1, layers.GetCulledLayerCount());
+			Assert::AreEqual(color_red, leds[5]);
+			Assert::AreEqual(color_green, leds[14]);
+			Assert::IsFalse(layers.StepSpans(100, leds.data(), spans));
+
+			// Once the green layer ends the bottom one shows through
+			Assert::IsTrue(layers.StepSpans(500, leds.data(), spans));
+			Assert::AreEqual(1, pBottom->stepCount);
+			Assert::AreEqual(0, layers.GetCulledLayerCount());
+			Assert::AreEqual(color_red, leds[9]);
+			Assert::AreEqual(color_blue, leds[14]);
+
+			// Non-opaque layers don't hide anything
+			layers.SetOpacity(1, 128);
+			Assert::IsTrue(layers.StepSpans(600, leds.data(), spans));
+			Assert::AreEqual(2, pBottom->stepCount);
+
+			// Each blend mode onto the same background, only where the layer drew
+			auto blend = [](BlendMode mode, ColorScale opacity, LedColor color) -> LedColor
+			{
+				LayerCompositor layers(100);
+				layers.AddLayer(new SolidColor(100, 0, 10, 0x00804020), 0, 0, 10, BlendMode::BM_REPLACE, colorScaleOne, true);
+				layers.AddLayer(new SolidColor(100, 2, 4, color), 0, 2, 4, mode, opacity);
+				std::vector<LedColor> leds(10, color_black);
+				layers.Step(0, leds.data());
+				Assert::AreEqual((LedColor)0x00804020, leds[0]);
+				return leds[3];
+			};
+			Assert::AreEqual((LedColor)0x00204080, blend(BlendMode::BM_REPLACE, colorScaleOne, 0x00204080));
+			Assert::AreEqual(CrossFadeColorFixed(128, 0x00804020, 0x00204080), blend(BlendMode::BM_REPLACE, 128, 0x00204080));
+			Assert::AreEqual((LedColor)0x00A08060, blend(BlendMode::BM_ADD, colorScaleOne, 0x00204040));
+			Assert::AreEqual((LedColor)0x00A06040, blend(BlendMode::BM_ADD, 128, 0x00404040));
+			Assert::AreEqual((LedColor)0x00402010, blend(BlendMode::BM_MULTIPLY, colorScaleOne, 0x007F7F7F));
+			Assert::AreEqual((LedColor)0x00804020, blend(BlendMode::BM_MULTIPLY, 0, color_black));
+			Assert::AreEqual((LedColor)0x00204080, blend(BlendMode::BM_ALPHA, colorScaleOne, 0xFF204080));
+			Assert::AreEqual((LedColor)0x00804020, blend(BlendMode::BM_ALPHA, colorScaleOne, 0x00204080));
+			Assert::AreEqual(CrossFadeColorFixed(64, 0x00804020, 0x00204080), blend(BlendMode::BM_ALPHA, 128, 0x80204080));
+
+			// Blended layers apart from each other share scratch LEDs covering both
+			LayerCompositor apart(100);
+			apart.AddLayer(new SolidColor(100, 20, 5, 0xFF204080), 0, 20, 5, BlendMode::BM_ALPHA);
+			apart.AddLayer(new SolidColor(100, 2, 4, 0xFF804020), 0, 2, 4, BlendMode::BM_ALPHA);
+			std::vector<LedColor> apartLeds(30, color_black);
+			apart.Step(0, apartLeds.data());
+			Assert::AreEqual((LedColor)0x00804020, apartLeds[3]);
+			Assert::AreEqual(color_black, apartLeds[10]);
+			Assert::AreEqual((LedColor)0x00204080, apartLeds[22]);
+		}
+
+		TEST_METHOD(LedOutputTest)
+		{
+			// 4 chunks of 10, the last one short
+			std::vector<LedColor> leds(35, 0);
+			LedOutput output(35, 10, 1000);
+
+			Assert::AreEqual(35, output.Update(1, leds.data())); // always sends the first frame
+			Assert::AreEqual(0, output.Update(2, leds.data()));
+
+			leds[12] = color_red;
+			Assert::AreEqual(20, output.Update(3, leds.data()));
+			Assert::AreEqual(0, output.Update(4, leds.data()));
+
+			leds[0] = color_blue;
+			Assert::AreEqual(10, output.Update(5, leds.data()));
+
+			leds[34] = color_green;
+			Assert::AreEqual(35, output.Update(6, leds.data()));
+
+			// Changing back counts as a change
+			leds[12] = color_black;
+			Assert::AreEqual(20, output.Update(7, leds.data()));
+
+			// Full refresh once the time is up, even with nothing changed
+			Assert::AreEqual(35, output.Update(1001, leds.data()));
+			Assert::AreEqual(0, output.Update(1002, leds.data()));
+
+			output.Invalidate();
+			Assert::AreEqual(35, output.Update(1003, leds.data()));
+
+			const LedOutput::Stats& stats = output.GetStats();
+			Assert::AreEqual(4u, stats.fullFrames);
+			Assert::AreEqual(3u, stats.partialFrames);
+			Assert::AreEqual(3u, stats.skippedFrames);
+			Assert::AreEqual(35u * 4 + 20 + 10 + 20, stats.sentLeds);
+		}
+
+		TEST_METHOD(ColorKernelsTest)
+		{
+			Assert::AreEqual((ColorScale)0, ColorScaleFromFloat(-0.5f));
+			Assert::AreEqual((ColorScale)128, ColorScaleFromFloat(0.5f));
+			Assert::AreEqual(colorScaleOne, ColorScaleFromFloat(1.5f));
+			Assert::AreEqual((LedColor)0x00FFFFFF, ScaleColorFixed(colorScaleOne, 0xFFFFFFFF));
+			Assert::AreEqual((LedColor)0x007F4000, ScaleColorFixed(128, 0x00FF8001));
+			Assert::AreEqual((LedColor)0x00FF8001, CrossFadeColorFixed(colorScaleOne, 0x00123456, 0x00FF8001));
+			Assert::AreEqual((LedColor)0x00FFFF30, AddColorSaturate(0x00F08010, 0x00208020));
+			Assert::AreEqual((LedColor)0x00F08010, MultiplyColorFixed(0x00F08010, color_white));
+			Assert::AreEqual((LedColor)0x00784000, MultiplyColorFixed(0x00F08010, 0x007F7F00));
+			Assert::AreEqual((LedColor)0x00FF8001, AlphaBlendColorFixed(colorScaleOne, 0x00123456, 0xFFFF8001));
+			Assert::AreEqual((LedColor)0x00123456, AlphaBlendColorFixed(colorScaleOne, 0x00123456, 0x00FF8001));
+
+			// Every length around the SSE2 width, against the per-channel versions
+			uint32_t random = 12345;
+			std::vector<LedColor> input(41);
+			std::vector<LedColor> add(41);
+			for (size_t ledIndex = 0; ledIndex < input.size(); ++ledIndex)
+			{
+				random = random * 1664525 + 1013904223;
+				input[ledIndex] = random;
+				random = random * 1664525 + 1013904223;
+				add[ledIndex] = random;
+			}
+			ColorScale scales[] = { 0, 1, 77, 128, 255, colorScaleOne };
+			for (int count = 0; count <= (int)input.size() - 1; ++count)
+			{
+				for (ColorScale scale : scales)
+				{
+					// Starting one in so the SSE2 loads aren't aligned
+					std::vector<LedColor> expected(input);
+					std::vector<LedColor> swar(input);
+					std::vector<LedColor> best(input);
+					ScaleColorsReference(expected.data() + 1, count, scale);
+					ScaleColorsSwar(swar.data() + 1, count, scale);
+					ScaleColors(best.data() + 1, count, scale);
+					Assert::IsTrue(expected == swar);
+					Assert::IsTrue(expected == best);
+
+					expected = swar = best = input;
+					CrossFadeColorsReference(expected.data() + 1, count, add[count], scale);
+					CrossFadeColorsSwar(swar.data() + 1, count, add[count], scale);
+					CrossFadeColors(best.data() + 1, count, add[count], scale);
+					Assert::IsTrue(expected == swar);
+					Assert::IsTrue(expected == best);
+
+					expected = best = input;
+					MixColorsReference(expected.data() + 1, add.data(), count, scale);
+					MixColors(best.data() + 1, add.data(), count, scale);
+					Assert::IsTrue(expected == best);
+
+					expected = best = input;
+					AlphaBlendColorsReference(expected.data() + 1, add.data(), count, scale);
+					AlphaBlendColors(best.data() + 1, add.data(), count, scale);
+					Assert::IsTrue(expected == best);
+				}
+
+				std::vector<LedColor> expected(input);
+				std::vector<LedColor> swar(input);
+				std::vector<LedColor> best(input);
+				AddColorsSaturateReference(expected.data() + 1, add.data(), count);
+				AddColorsSaturateSwar(swar.data() + 1, add.data(), count);
+				AddColorsSaturate(best.data() + 1, add.data(), count);
+				Assert::IsTrue(expected == swar);
+				Assert::IsTrue(expected == best);
+
+				expected = best = input;
+				MultiplyColorsReference(expected.data() + 1, add.data(), count);
+				MultiplyColors(best.data() + 1, add.data(), count);
+				Assert::IsTrue(expected == best);
+
+				expected = best = input;
+				FillColorsReference(expected.data() + 1, count, add[0]);
+				FillColors(best.data() + 1, count, add[0]);
+				Assert::IsTrue(expected == best);
+
+				for (int patternSize = 1; patternSize <= 13; patternSize += 3)
+				{
+					for (int patternIndex = 0; patternIndex < patternSize; ++patternIndex)
+					{
+						expected = best = input;
+						RepeatPatternReference(expected.data() + 1, count, add.data(), patternSize, patternIndex);
+						RepeatPattern(best.data() + 1, count, add.data(), patternSize, patternIndex);
+						Assert::IsTrue(expected == best);
+					}
+				}
+			}
+		}
+
+		TEST_METHOD(AnimationClipTest)
+		{
+			const TickCount frameTicks = 5;
+			std::unique_ptr<AnimatorGroup> pTree(BuildRenderProgramTestTree());
+			std::vector<uint8_t> clip;
+			Assert::IsTrue(BakeAnimationClip(*pTree, 100, frameTicks, 4, clip));
+
+			ClipAnimator player(clip.data(), (int)clip.size(), 100);
+			Assert::IsTrue(player.IsValid());
+			int frameCount = player.GetFrameCount();
+			Assert::AreEqual((int)((pTree->duration() + frameTicks - 1) / frameTicks), frameCount);
+			Assert::AreEqual((TickCount)(frameCount * frameTicks), player.duration());
+			Assert::IsTrue((int)clip.size() < frameCount * 100 * 3);
+
+			// Every frame in order, against a fresh tree
+			std::unique_ptr<AnimatorGroup> pCheckTree(BuildRenderProgramTestTree());
+			std::vector<std::vector<LedColor>> frames(frameCount, std::vector<LedColor>(100, color_black));
+			std::vector<LedColor> leds(100);
+			for (int frameIndex = 0; frameIndex < frameCount; ++frameIndex)
+			{
+				pCheckTree->Step(frameIndex * frameTicks, frames[frameIndex].data());
+				for (TickCount time = frameIndex * frameTicks; time < (frameIndex + 1) * frameTicks; time += 2)
+				{
+					fill(leds.begin(), leds.end(), color_black);
+					LedSpanList spans;
+					bool changed = player.StepSpans(time, leds.data(), spans);
+					Assert::IsTrue(frames[frameIndex] == leds);
+					Assert::AreEqual(1, spans.GetCount());
+					if (time != frameIndex * frameTicks) Assert::IsFalse(changed);
+				}
+			}
+
+			// Jumping around goes through the keyframes
+			ClipAnimator seekPlayer(clip.data(), (int)clip.size(), 100);
+			int frameIndices[] = { 50, 3, 3, 4, 11, 9, frameCount - 1, 0, 1, 2, 70 };
+			for (int frameIndex : frameIndices)
+			{
+				fill(leds.begin(), leds.end(), color_black);
+				seekPlayer.Step(frameIndex * frameTicks, leds.data());
+				Assert::IsTrue(frames[frameIndex] == leds);
+			}
+			fill(leds.begin(), leds.end(), color_black);
+			seekPlayer.Step(player.duration() + 100, leds.data());
+			Assert::IsTrue(frames[frameCount - 1] == leds); // holds the last frame
+
+			// Only the LEDs the animation touches get stored
+			FillInAnimator fillIn(100, 10, 20, color_blue);
+			Assert::IsTrue(BakeAnimationClip(fillIn, 100, 10, 4, clip));
+			ClipAnimator fillInPlayer(clip.data(), (int)clip.size(), 100);
+			Assert::AreEqual(10, (int)fillInPlayer.GetStartLedIndex());
+			Assert::AreEqual(18, (int)fillInPlayer.GetLedCount()); // the last frame is at 90
+			fill(leds.begin(), leds.end(), color_black);
+			LedSpanList spans;
+			fillInPlayer.StepSpans(95, leds.data(), spans);
+			Assert::AreEqual(10, (int)spans[0].startLedIndex);
+			Assert::AreEqual(18, (int)spans[0].ledCount);
+			Assert::AreEqual(color_blue, leds[27]);
+			Assert::AreEqual(color_black, leds[28]);
+
+			// A clip that draws past the LEDs it's given doesn't play
+			ClipAnimator tooShort(clip.data(), (int)clip.size(), 27);
+			Assert::IsFalse(tooShort.IsValid());
+			spans.Clear();
+			Assert::IsFalse(tooShort.StepSpans(0, leds.data(), spans));
+			Assert::IsTrue(spans.IsEmpty());
+
+			// Neither does one cut off before its frames
+			ClipAnimator noFrames(clip.data(), animationClipHeaderSize + 2, 100);
+			Assert::IsFalse(noFrames.IsValid());
+
+			// One cut off part way through plays up to where it's missing
+			ClipAnimator cutOff(clip.data(), (int)clip.size() - 1, 100);
+			Assert::IsTrue(cutOff.IsValid());
+			spans.Clear();
+			cutOff.StepSpans(0, leds.data(), spans);
+			Assert::AreEqual(1, spans.GetCount());
+			spans.Clear();
+			Assert::IsTrue(cutOff.StepSpans(95, leds.data(), spans));
+			Assert::IsTrue(spans.IsEmpty());
+			Assert::IsFalse(cutOff.IsValid());
+		}
+
+		TEST_METHOD(FixedPointTest)
+		{
+			Assert::AreEqual((int32_t)Fixed::oneRaw, Fixed(1).Raw());
+			Assert::AreEqual(Fixed::oneRaw / 2, Fixed(0.5f).Raw());
+			Assert::AreEqual(-Fixed::oneRaw / 4, Fixed(-0.25f).Raw());
+			Assert::AreEqual(3277, Fixed(0.05f).Raw()); // rounds to nearest
+
+			Assert::AreEqual(0.75f, (Fixed(0.5f) + Fixed(0.25f)).ToFloat());
+			Assert::AreEqual(-0.25f, (Fixed(0.25f) - Fixed(0.5f)).ToFloat());
+			Assert::AreEqual(0.125f, (Fixed(0.5f) * Fixed(0.25f)).ToFloat());
+			Assert::AreEqual(2.0f, (Fixed(0.5f) / Fixed(0.25f)).ToFloat());
+			Assert::AreEqual(0.25f, Fixed::FromRatio(250, 1000).ToFloat());
+			Assert::AreEqual(0.3f, Fixed::FromTicks(1000, Fixed::RatePerTick(Fixed(0.3f), 1000)).ToFloat(), 0.0001f);
+
+			// Out of range and divide by zero saturate
+			int big = 40000;
+			Assert::AreEqual(INT32_MAX, Fixed(big).Raw());
+			Assert::AreEqual(INT32_MIN, Fixed(-big).Raw());
+			Assert::AreEqual(INT32_MAX, (Fixed(1) / Fixed()).Raw());
+			Assert::AreEqual(INT32_MIN, (Fixed(-1) / Fixed()).Raw());
+			Assert::AreEqual(INT32_MAX, Fixed::FromRatio(1, 0).Raw());
+
+			Assert::AreEqual(1, Fixed(1.75f).ToInt());
+			Assert::AreEqual(-1, Fixed(-1.75f).ToInt());
+
+			Assert::IsTrue(Fixed(0.05f) < Fixed(0.1f));
+			Assert::IsTrue(Fixed(-0.05f) < 0);
+		}
+
+		TEST_METHOD(FixedLedIndexFromRangeTest)
+		{
+			// The fixed point version needs to give the same answers as the float
+			// version for any position that both can represent exactly
+			const int ranges[][2] = { {0, 1}, {0, 10}, {5, 15}, {1, 0}, {10, 0}, {15, 5}, {99, 56}, {100, 142}, {55, 27} };
+			for (const auto& range : ranges)
+			{
+				for (int32_t raw = 0; raw <= Fixed::oneRaw; raw += 61)
+				{
+					Fixed position = Fixed::FromRaw(raw);
+					Assert::AreEqual(GameEngine::LedIndexFromRange(range[0], range[1], position.ToFloat()),
+						GameEngine::LedIndexFromRange(range[0], range[1], position));
+				}
+			}
+
+			Assert::AreEqual(10, GameEngine::LedIndexFromRange(0, 10, Fixed(1)));
+			Assert::AreEqual(10, GameEngine::LedIndexFromRange(15, 5, Fixed(0.5f)));
+		}
+
+		TEST_METHOD(TreeConfigTest)
+		{
+			GameEngine ge;
+			// Copies, since Assert::AreEqual takes references and the class constants have no definitions
+			const int configLaneCount = TreeConfig::laneCount;
+			const int laneCount = GameEngine::laneCount;
+			const int pathLedCount = GameEngine::pathLedCount;
+			const int maxEnemies = TreeConfig::maxEnemies;
+			const int maxActiveShots = TreeConfig::maxActiveShots;
+			Assert::AreEqual(configLaneCount, laneCount);
+			Assert::AreEqual(TreeLedRangeLength(TreeConfig::pathLeftLedIndex, TreeConfig::pathRightLedIndex), pathLedCount);
+			for (int i = 0; i < laneCount; ++i)
+			{
+				Assert::AreEqual(TreeConfig::lanes[i].startIndex, ge.lanes[i].startIndex);
+				Assert::AreEqual(TreeConfig::lanes[i].endIndex, ge.lanes[i].endIndex);
+				Assert::AreEqual(TreeConfig::lanes[i].pathLedIndex, ge.lanes[i].pathLedIndex);
+			}
+			Assert::AreEqual(maxEnemies, ARRAYSIZE(ge.enemies.laneIndex));
+			Assert::AreEqual(maxActiveShots, ARRAYSIZE(ge.playerShots.laneIndex) + ARRAYSIZE(ge.enemyShots.laneIndex));
+
+			// The position tables grow with the longest lane
+			const TreeLane longLanes[] = { {99, 56, 0}, {100, 199, 5} };
+			Assert::AreEqual(100, TreeLongestLaneLength(longLanes, ARRAYSIZE(longLanes)));
+			Assert::AreEqual(128, TreePowerOfTwoAbove(100));
+			Assert::AreEqual(64, TreePowerOfTwoAbove(63));
+			Assert::AreEqual(128, TreePowerOfTwoAbove(64));
+		}
+
+		TEST_METHOD(LayoutBlobTest)
+		{
+			GameEngine ge;
+			uint8_t blob[GameEngine::layoutBlobSize];
+			Assert::AreEqual(0, ge.SaveLayout(blob, sizeof(blob) - 1));
+			Assert::AreEqual((int)GameEngine::layoutBlobSize, ge.SaveLayout(blob, sizeof(blob)));
+
+			// Loading the default layout back in doesn't change anything
+			Assert::IsTrue(ge.LoadLayout(blob, sizeof(blob)));
+			for (int i = 0; i < ge.laneCount; ++i)
+			{
+				Assert::AreEqual(TreeConfig::lanes[i].startIndex, ge.lanes[i].startIndex);
+				Assert::AreEqual(TreeConfig::lanes[i].endIndex, ge.lanes[i].endIndex);
+				Assert::AreEqual(TreeConfig::lanes[i].pathLedIndex, ge.lanes[i].pathLedIndex);
+			}
+			for (int i = 0; i < ge.levelCount; ++i)
+			{
+				Assert::AreEqual(GameEngine::defaultLevels[i].whiteEnemyCount, ge.levels[i].whiteEnemyCount);
+				Assert::IsTrue(GameEngine::defaultLevels[i].enemySpawnDelta == ge.levels[i].enemySpawnDelta);
+			}
+
+			// Move the start of lane 1 in by one LED and change the level 0 spawn delta
+			const int laneOffset = 8;
+			const int levelOffset = 8 + (ge.laneCount * 6);
+			blob[laneOffset + 6] = 101;
+			blob[levelOffset + 14] = 3; // 3.0 seconds in Q16.16
+			Assert::IsTrue(ge.LoadLayout(blob, sizeof(blob)));
+			Assert::AreEqual(101, ge.lanes[1].startIndex);
+			Assert::AreEqual(101, (int)ge.laneLedTables[1].ledIndices[0]);
+			Assert::AreEqual(3.0f, GameRealToFloat(ge.levels[0].enemySpawnDelta), 0.0001f);
+
+			// Bad blobs are rejected and the layout stays as it was
+			uint8_t badBlob[GameEngine::layoutBlobSize];
+			memcpy(badBlob, blob, sizeof(blob));
+			badBlob[4] = GameEngine::layoutBlobVersion + 1;
+			Assert::IsFalse(ge.LoadLayout(badBlob, sizeof(badBlob)));
+			memcpy(badBlob, blob, sizeof(blob));
+			badBlob[5] = (uint8_t)(ge.laneCount + 1);
+			Assert::IsFalse(ge.LoadLayout(badBlob, sizeof(badBlob)));
+			memcpy(badBlob, blob, sizeof(blob));
+			badBlob[laneOffset + 1] = 0x7F; // lane 0 starts past the end of the LEDs
+			Assert::IsFalse(ge.LoadLayout(badBlob, sizeof(badBlob)));
+			memcpy(badBlob, blob, sizeof(blob));
+			badBlob[levelOffset + 14] = 40; // 40 seconds between spawns is too many ticks for a GameReal
+			Assert::IsFalse(ge.LoadLayout(badBlob, sizeof(badBlob)));
+			Assert::IsFalse(ge.LoadLayout(blob, sizeof(blob) - 1));
+			Assert::AreEqual(101, ge.lanes[1].startIndex);
+		}
+
+		TEST_METHOD(PositionLedTableTest)
+		{
+			// The lookup tables need to give exactly the same answers as LedIndexFromRange
+			GameEngine ge;
+			std::vector<GameEngine::PositionLedTable> tables(ge.laneLedTables, ge.laneLedTables + ARRAYSIZE(ge.laneLedTables));
+			tables.push_back(ge.pathLedTable);
+
+			// and the ranges from LedIndexFromRangeTest
+			const int ranges[][2] = { {0, 1}, {0, 10}, {5, 15}, {1, 0}, {10, 0}, {15, 5} };
+			for (const auto& range : ranges)
+			{
+				GameEngine::PositionLedTable table;
+				table.Build(range[0], range[1]);
+				tables.push_back(table);
+			}
+
+			const float positions[] = { 0.0f, 0.0499f, 0.05f, 0.1499f, 0.15f, 0.2f, 0.2499f, 0.25f, 0.4999f, 0.5f, 0.9f, 0.99f, 1.0f };
+			for (const auto& table : tables)
+			{
+				for (float position : positions)
+				{
+					Assert::AreEqual(GameEngine::LedIndexFromRange(table.startIndex, table.endIndex, GameReal(position)), table.GetLedIndex(position));
+				}
+
+				for (int i = 0; i <= 4096; ++i)
+				{
+					GameReal position = GameRealFromRatio(i, 4096);
+					Assert::AreEqual(GameEngine::LedIndexFromRange(table.startIndex, table.endIndex, position), table.GetLedIndex(position));
+				}
+
+				// right on the LED changes
+				for (int quantum = 0; quantum < GameEngine::positionTableQuanta; ++quantum)
+				{
+					GameReal position = table.nextLedPositions[quantum];
+					Assert::AreEqual(GameEngine::LedIndexFromRange(table.startIndex, table.endIndex, position), table.GetLedIndex(position));
+				}
+			}
+		}
+
+		TEST_METHOD(PlayerPositionLaneTableTest)
+		{
+			GameEngine ge;
+			for (int playerPosition = 0; playerPosition < ge.pathLedCount; ++playerPosition)
+			{
+				Assert::AreEqual(ge.GetClosestLaneToPathPosition(GameRealFromRatio(playerPosition, ge.pathLedCount)), (int)ge.playerPositionLaneIndices[playerPosition]);
+			}
+			Assert::AreEqual(0, (int)ge.playerPositionLaneIndices[0]);
+			Assert::AreEqual(ge.laneCount - 1, (int)ge.playerPositionLaneIndices[ge.pathLedCount - 1]);
+		}
+
 		TEST_METHOD(ShotSmokeTest)
 		{
 			const float floatTolerance = 0.0001f;
 			GameEngine ge;
+			ge.SetRandomSeed(1); // the first enemy to reach the path stays clear of the last lane
 			TickCount time = 0;
-			const TickCount ticksPerShot = (TickCount)((float)TicksPerSecond * ge.shotSpeed);
+			const TickCount ticksPerShot = (TickCount)((float)TicksPerSecond / GameRealToFloat(ge.shotSpeed)); // ticks to travel a whole lane
 
-			ge.Start(time++);
+			ge.Step(time++, 0, false, false); // start button up
+			ge.Step(time++, 0, false, true); // start button down
 			while (ge.gameState != GameEngine::GameState::GS_PLAYING_LEVEL)
 			{
-				ge.Step(time++, 0, false);
+				ge.Step(time++, 0, false, false);
 			}
 
 			// Add a player shot
 			Assert::AreEqual(0, PlayerShotCount(ge));
-			ge.Step(time++, 0, false); // Step once with button up
-			ge.Step(time, 0, true); // fire button down
+			ge.Step(time++, 0, false, false); // Step once with button up
+			ge.Step(time, 0, true, false); // fire button down
 			Assert::AreEqual(1, PlayerShotCount(ge));
 			Assert::AreEqual(1.0f, PlayerShotPosition(ge), floatTolerance);
 
 			// See the player shot 1/4 way up the lane
 			time += ticksPerShot / 4;
-			ge.Step(time, 0, false);
+			ge.Step(time, 0, false, false);
 			Assert::AreEqual(1, PlayerShotCount(ge));
 			Assert::AreEqual(0.75f, PlayerShotPosition(ge), floatTolerance);
 
-			// See the player shot all the way up the lane
-			time += (ticksPerShot / 4) * 3;
-			ge.Step(time, 0, false);
+			// See the player shot just short of the top of the lane - it's removed once it gets to 0
+			time += ((ticksPerShot / 4) * 3) - 1;
+			ge.Step(time, 0, false, false);
 			Assert::AreEqual(1, PlayerShotCount(ge));
-			Assert::AreEqual(0.0f, PlayerShotPosition(ge), floatTolerance);
+			Assert::AreEqual(0.0f, PlayerShotPosition(ge), 0.001f);
 
 			// Player shot didn't hit anything and is off the lane
-			time += 1;
-			ge.Step(time, 0, false);
+			time += 2;
+			ge.Step(time, 0, false, false);
 			Assert::AreEqual(0, PlayerShotCount(ge));
 
 
 			// Player shot near the second lane
 			time += 1;
-			ge.Step(time, ge.lanes[1].pathLedIndex, true);
+			ge.Step(time, ge.lanes[1].pathLedIndex, true, false);
 			Assert::AreEqual(1, PlayerShotCount(ge));
-			Assert::AreEqual(1, ge.shots[0].laneIndex);
+			Assert::AreEqual(1, PlayerShotLaneIndex(ge));
 			time += ticksPerShot + 1;
-			ge.Step(time, 0, false);
+			ge.Step(time, 0, false, false);
 			Assert::AreEqual(0, PlayerShotCount(ge));
 
 			// Player shot near the last lane
 			time += 1;
-			ge.Step(time, ge.pathLedCount - 1, true);
+			ge.Step(time, ge.pathLedCount - 1, true, false);
 			Assert::AreEqual(1, PlayerShotCount(ge));
-			Assert::AreEqual(ARRAYSIZE(ge.lanes) - 1, ge.shots[0].laneIndex);
+			Assert::AreEqual(ge.laneCount - 1, PlayerShotLaneIndex(ge));
 			time += ticksPerShot + 1;
-			ge.Step(time, 0, false);
+			ge.Step(time, 0, false, false);
 			Assert::AreEqual(0, PlayerShotCount(ge));
 
 
-			//for (int i = 0; i < ARRAYSIZE(ge.shots); i++)
+			//for (int i = 0; i < ge.playerShots.count; i++)
 			//{
-			//	const GameEngine::Shot* pShot = ge.shots + i;
-			//	Log("Shot %d: valid:%s player:%s, laneIndex:%d, speed:%f, lanePosition:%f\r\n",
-			//		i, pShot->IsValid()?"valid":"invalid", pShot->player?"player":"enemy", pShot->laneIndex, pShot->speed, pShot->lanePosition);
+			//	Log("Shot %d: laneIndex:%d, speed:%f, lanePosition:%f\r\n",
+			//		i, ge.playerShots.laneIndex[i], GameRealToFloat(ge.playerShots.speed[i]), GameRealToFloat(ge.playerShots.lanePosition[i]));
 			//}
 		}
 
@@ -255,60 +1173,718 @@ namespace UnitTests
 			TickCount time = 0;
 			const TickCount ticksPerWhiteEnemy = (TickCount)((float)TicksPerSecond / 0.3f);
 
-			ge.Start(time++);
+			ge.Step(time++, 0, false, false); // start button up
+			ge.Step(time++, 0, false, true); // start button down
 			while (ge.gameState != GameEngine::GameState::GS_PLAYING_LEVEL)
 			{
-				ge.Step(time++, 0, false);
+				ge.Step(time++, 0, false, false);
 			}
 
 			Assert::AreEqual(0, EnemyCount(ge));
-			ge.Step(time++, 0, false);
+			const TickCount spawnTime = time;
+			ge.Step(time++, 0, false, false);
 			Assert::AreEqual(1, EnemyCount(ge));
-			Assert::AreEqual(0.0f, ge.enemies[0].lanePosition, floatTolerance);
-			ge.Step(TicksPerSecond, 0, false);
-			Assert::AreEqual(ge.enemies[0].speed, ge.enemies[0].lanePosition, floatTolerance);
+			Assert::AreEqual(0.0f, GameRealToFloat(ge.enemies.lanePosition[0]), floatTolerance);
+			time = spawnTime + TicksPerSecond;
+			ge.Step(time, 0, false, false);
+			Assert::AreEqual(GameRealToFloat(ge.enemies.speed[0]), GameRealToFloat(ge.enemies.lanePosition[0]), floatTolerance);
 			for (int i = 0; i < 100 * 5; i++)
 			{
 				time += 10;
-				ge.Step(time, 0, false);
+				ge.Step(time, 0, false, false);
 			}
-			Assert::AreEqual(1.0f, ge.enemies[0].lanePosition, 0.0f);
+			Assert::AreEqual(1.0f, GameRealToFloat(ge.enemies.lanePosition[0]), 0.0f);
 
 		}
 
-		int PlayerShotCount(const GameEngine& ge)
+		TEST_METHOD(EntityPoolTest)
 		{
-			int retval = 0;
-			for (const GameEngine::Shot* pShot = ge.shots; pShot != ge.shots + ARRAYSIZE(ge.shots); pShot++)
+			GameEngine::ShotPool<3> pool = {};
+			Assert::AreEqual(0, pool.Add(0, 0.1f, 0.0f));
+			Assert::AreEqual(1, pool.Add(1, 0.2f, 0.0f));
+			Assert::AreEqual(2, pool.Add(2, 0.3f, 0.0f));
+			Assert::IsTrue(pool.IsFull());
+			Assert::AreEqual(-1, pool.Add(3, 0.4f, 0.0f));
+
+			// Removing moves the last entry into the hole
+			pool.Remove(0);
+			Assert::AreEqual(2, pool.count);
+			Assert::AreEqual(2, (int)pool.laneIndex[0]);
+			Assert::AreEqual(0.3f, GameRealToFloat(pool.speed[0]), 0.0001f);
+			Assert::AreEqual(1, (int)pool.laneIndex[1]);
+
+			// Removing the last entry just shrinks the pool
+			pool.Remove(1);
+			Assert::AreEqual(1, pool.count);
+			Assert::AreEqual(2, (int)pool.laneIndex[0]);
+
+			pool.Clear();
+			Assert::AreEqual(0, pool.count);
+		}
+
+		TEST_METHOD(CollisionSweepTest)
+		{
+			GameEngine ge;
+			StartLevelWithPlayerInMiddle(ge);
+
+			// lane 2: the shot close to the enemy kills it, the other shot keeps going
+			ge.playerShots.Add(2, -0.4f, 0.30f);
+			ge.playerShots.Add(2, -0.4f, 0.60f);
+			AddEnemy(ge, 2, 0.62f);
+
+			// lane 3: nothing close enough
+			ge.playerShots.Add(3, -0.4f, 0.50f);
+			AddEnemy(ge, 3, 0.70f);
+
+			// lane 4: one shot and two enemies right next to each other - only one dies
+			ge.playerShots.Add(4, -0.4f, 0.40f);
+			AddEnemy(ge, 4, 0.41f);
+			AddEnemy(ge, 4, 0.42f);
+
+			ge.HandleCollisions();
+
+			Assert::AreEqual(2, ge.playerShots.count);
+			Assert::AreEqual(2, ge.enemies.count);
+			for (int i = 0; i < ge.playerShots.count; ++i)
+			{
+				Assert::IsTrue(ge.playerShots.laneIndex[i] == 2 || ge.playerShots.laneIndex[i] == 3);
+			}
+			int lane4Enemies = 0;
+			for (int i = 0; i < ge.enemies.count; ++i)
 			{
-				retval += pShot->IsValid() && pShot->player;
+				lane4Enemies += (ge.enemies.laneIndex[i] == 4);
 			}
-			return retval;
+			Assert::AreEqual(1, lane4Enemies);
+
+			// lane 5: player shot and enemy shot take each other out, the other enemy shot is too far away
+			ge.ResetShotsAndEnemies();
+			ge.playerShots.Add(5, -0.4f, 0.20f);
+			ge.enemyShots.Add(5, 0.3f, 0.22f);
+			ge.enemyShots.Add(5, 0.3f, 0.10f);
+			ge.HandleCollisions();
+			Assert::AreEqual(0, ge.playerShots.count);
+			Assert::AreEqual(1, ge.enemyShots.count);
+			Assert::AreEqual(0.1f, GameRealToFloat(ge.enemyShots.lanePosition[0]), 0.0001f);
+			Assert::IsTrue(GameEngine::GameState::GS_PLAYING_LEVEL == ge.gameState);
 		}
 
-		float PlayerShotPosition(const GameEngine& ge)
+		TEST_METHOD(PathCollisionTest)
+		{
+			GameEngine ge;
+			StartLevelWithPlayerInMiddle(ge);
+
+			// enemies on the player path - one close enough to shoot, one far away
+			AddEnemy(ge, 0, 1.0f, GameEngine::EnemyState::onPlayerPath, 0.42f);
+			AddEnemy(ge, 0, 1.0f, GameEngine::EnemyState::onPlayerPath, 0.1f);
+			ge.playerShots.Add(3, -0.4f, 0.99f); // just fired
+
+			ge.HandleCollisions();
+			Assert::AreEqual(0, ge.playerShots.count);
+			Assert::AreEqual(1, ge.enemies.count);
+			Assert::AreEqual(0.1f, GameRealToFloat(ge.enemies.pathPosition[0]), 0.0001f);
+			Assert::AreEqual(ge.startingLifeCount, ge.livesRemaining);
+
+			// enemy runs into the player
+			AddEnemy(ge, 0, 1.0f, GameEngine::EnemyState::onPlayerPath, 0.48f);
+			ge.HandleCollisions();
+			Assert::AreEqual(ge.startingLifeCount - 1, ge.livesRemaining);
+			Assert::AreEqual(0, ge.enemies.count);
+			Assert::IsTrue(GameEngine::GameState::GS_LIFE_LOST_ANIMATION == ge.gameState);
+
+			// A shot just fired kills the enemy beside the player before it can
+			// hit an enemy shot coming down its lane
+			ge.gameState = GameEngine::GameState::GS_PLAYING_LEVEL;
+			ge.ResetShotsAndEnemies();
+			ge.playerShots.Add(3, -0.4f, 0.99f);
+			ge.enemyShots.Add(3, 0.4f, 0.97f);
+			AddEnemy(ge, 0, 1.0f, GameEngine::EnemyState::onPlayerPath, 0.56f);
+			ge.HandleCollisions();
+			Assert::AreEqual(0, ge.playerShots.count);
+			Assert::AreEqual(0, ge.enemies.count);
+			Assert::AreEqual(1, ge.enemyShots.count);
+		}
+
+		TEST_METHOD(SweptCollisionTest)
+		{
+			// The gap closes linearly so it's a hit if they passed each other
+			// or were close at either end of the step
+			Assert::IsTrue(GameEngine::SweptHit(0.8f, 0.2f, 0.3f, 0.5f, 0.05f));
+			Assert::IsTrue(GameEngine::SweptHit(0.5f, 0.5f, 0.52f, 0.9f, 0.05f));
+			Assert::IsFalse(GameEngine::SweptHit(0.9f, 0.6f, 0.1f, 0.4f, 0.05f));
+
+			GameEngine ge;
+			StartLevelWithPlayerInMiddle(ge);
+
+			// A slow frame moved the shot and the enemy right through each
+			// other - their end positions are far apart but they still hit
+			int shotIndex = ge.playerShots.Add(2, -0.4f, 0.30f);
+			ge.playerShots.previousLanePosition[shotIndex] = 0.70f;
+			AddEnemy(ge, 2, 0.60f);
+			ge.enemies.previousLanePosition[0] = 0.40f;
+
+			// Same lane, moving apart - no hit
+			shotIndex = ge.playerShots.Add(3, -0.4f, 0.30f);
+			ge.playerShots.previousLanePosition[shotIndex] = 0.50f;
+			AddEnemy(ge, 3, 0.70f);
+			ge.enemies.previousLanePosition[1] = 0.60f;
+
+			ge.HandleCollisions();
+			Assert::AreEqual(1, ge.playerShots.count);
+			Assert::AreEqual(3, (int)ge.playerShots.laneIndex[0]);
+			Assert::AreEqual(1, ge.enemies.count);
+			Assert::AreEqual(3, (int)ge.enemies.laneIndex[0]);
+
+			// Enemy on the path jumped over the player during the step
+			ge.ResetShotsAndEnemies();
+			AddEnemy(ge, 0, 1.0f, GameEngine::EnemyState::onPlayerPath, 0.60f);
+			ge.enemies.previousPathPosition[0] = 0.40f;
+			ge.HandleCollisions();
+			Assert::AreEqual(ge.startingLifeCount - 1, ge.livesRemaining);
+			Assert::AreEqual(0, ge.enemies.count);
+		}
+
+		TEST_METHOD(GameStatsTest)
+		{
+			GameEngine ge;
+			StartLevelWithPlayerInMiddle(ge);
+
+			// A lane kill and a shot that takes out an enemy shot
+			ge.playerShots.Add(2, -0.4f, 0.50f);
+			AddEnemy(ge, 2, 0.52f);
+			ge.playerShots.Add(3, -0.4f, 0.50f);
+			ge.enemyShots.Add(3, 0.4f, 0.51f);
+			ge.HandleCollisions();
+			Assert::AreEqual(1u, ge.GetStats().laneKills);
+			Assert::AreEqual(1u, ge.GetStats().levelKills[0]);
+			Assert::AreEqual(1u, ge.GetStats().enemyShotsDestroyed);
+
+			// Each death is counted once with what caused it
+			ge.gameState = GameEngine::GameState::GS_PLAYING_LEVEL;
+			AddEnemy(ge, 0, 1.0f, GameEngine::EnemyState::onPlayerPath, 0.5f);
+			ge.HandleCollisions();
+			ge.gameState = GameEngine::GameState::GS_PLAYING_LEVEL;
+			int laneIndex = ge.playerPositionLaneIndices[ge.pathLedCount / 2];
+			ge.stepPlayerPosition = ge.GetLanePathPosition(laneIndex);
+			ge.enemyShots.Add(laneIndex, 0.4f, 1.0f);
+			ge.enemyShots.Add(laneIndex, 0.4f, 1.0f);
+			ge.HandleCollisions();
+			Assert::AreEqual(1u, ge.GetStats().deathsByEnemyCollision);
+			Assert::AreEqual(1u, ge.GetStats().deathsByEnemyShot);
+			Assert::AreEqual(2u, ge.GetStats().levelDeaths[0]);
+
+			// Snapshots don't carry the stats and ResetStats clears them
+			GameEngine::Snapshot snapshot;
+			ge.SaveSnapshot(snapshot);
+			GameEngine geCopy;
+			Assert::IsTrue(geCopy.LoadSnapshot(snapshot));
+			Assert::AreEqual(0u, geCopy.GetStats().laneKills);
+			ge.ResetStats();
+			Assert::AreEqual(0u, ge.GetStats().levelDeaths[0]);
+		}
+
+		TEST_METHOD(SpscQueueTest)
 		{
-			for (const GameEngine::Shot* pShot = ge.shots; pShot != ge.shots + ARRAYSIZE(ge.shots); pShot++)
+			SpscQueue<int, 4> queue;
+			int item = 0;
+			Assert::IsFalse(queue.Pop(item));
+
+			// Full queue drops new items and counts them
+			for (int i = 0; i < 6; ++i)
 			{
-				if (pShot->IsValid() && pShot->player)
+				Assert::AreEqual(i < 4, queue.Push(i));
+			}
+			Assert::AreEqual(4, queue.GetCount());
+			Assert::AreEqual(2u, queue.GetDroppedCount());
+
+			// Keeps order across the wrap
+			for (int i = 0; i < 10; ++i)
+			{
+				Assert::IsTrue(queue.Pop(item));
+				Assert::AreEqual(i, item);
+				Assert::IsTrue(queue.Push(i + 4));
+			}
+
+			// One thread pushing and one popping never lose or reorder anything
+			SpscQueue<int, 8> threadQueue;
+			const int itemCount = 10000;
+			std::thread producer([&threadQueue]()
+			{
+				for (int i = 0; i < itemCount; ++i)
+				{
+					while (!threadQueue.Push(i))
+					{
+						std::this_thread::yield();
+					}
+				}
+			});
+			int expected = 0;
+			while (expected < itemCount)
+			{
+				if (!threadQueue.Pop(item))
 				{
-					return pShot->lanePosition;
+					std::this_thread::yield();
+					continue;
 				}
+				Assert::AreEqual(expected, item);
+				expected++;
 			}
-			return -1;
+			producer.join();
 		}
 
-		int EnemyCount(const GameEngine& ge)
+		TEST_METHOD(GameEventTest)
 		{
-			int enemyCount = 0;
-			for (const GameEngine::Enemy* pEnemy = ge.enemies; pEnemy < ge.enemies + ARRAYSIZE(ge.enemies); pEnemy++)
+			GameEngine ge;
+			GameEvent event;
+			ge.Step(0, 0, false, false);
+			ge.Step(1, 0, false, true);
+			Assert::IsTrue(ge.PopEvent(event));
+			Assert::IsTrue(GameEventType::GE_GAME_STARTED == event.type);
+
+			ge.StartLevel();
+			Assert::IsTrue(ge.PopEvent(event));
+			Assert::IsTrue(GameEventType::GE_LEVEL_STARTED == event.type);
+			Assert::AreEqual(0, (int)event.value);
+
+			// A lane kill and a path kill in the same step
+			ge.stepPlayerPosition = 0.5f;
+			ge.previousStepPlayerPosition = 0.5f;
+			ge.playerShots.Add(2, -0.4f, 0.50f);
+			AddEnemy(ge, 2, 0.52f);
+			ge.enemies.color[0] = color_red;
+			ge.playerShots.Add(4, -0.4f, 0.99f);
+			AddEnemy(ge, 4, 1.0f, GameEngine::EnemyState::onPlayerPath, 0.5f);
+			ge.HandleCollisions();
+			Assert::IsTrue(ge.PopEvent(event));
+			Assert::IsTrue(GameEventType::GE_ENEMY_KILLED == event.type);
+			Assert::AreEqual(2, (int)event.laneIndex);
+			Assert::AreEqual((int)GEK_IN_LANE, (int)event.value);
+			Assert::AreEqual(color_red, event.color);
+			Assert::IsTrue(ge.PopEvent(event));
+			Assert::IsTrue(GameEventType::GE_ENEMY_KILLED == event.type);
+			Assert::AreEqual((int)GEK_ON_PATH, (int)event.value);
+			Assert::IsFalse(ge.PopEvent(event));
+
+			AddEnemy(ge, 0, 1.0f, GameEngine::EnemyState::onPlayerPath, 0.5f);
+			ge.HandleCollisions();
+			Assert::IsTrue(ge.PopEvent(event));
+			Assert::IsTrue(GameEventType::GE_PLAYER_DIED == event.type);
+			Assert::AreEqual((int)GED_ENEMY_COLLISION, (int)event.value);
+
+			// Nobody draining the queue doesn't hold up the game
+			ge.gameState = GameEngine::GameState::GS_PLAYING_LEVEL;
+			for (int i = 0; i < GameEventQueue::maxCount + 3; ++i)
 			{
-				if (pEnemy->IsValid())
-				{
-					enemyCount++;
-				}
+				ge.AddShot(true, 0, ge.shotSpeed, 1);
+				ge.playerShots.Clear();
 			}
-			return enemyCount;
+			Assert::AreEqual((int)GameEventQueue::maxCount, ge.GetPendingEventCount());
+			Assert::AreEqual(3u, ge.GetDroppedEventCount());
+		}
+
+		TEST_METHOD(AudioMixerTest)
+		{
+			AudioMixer mixer;
+			int16_t block[AudioMixer::blockSize];
+
+			// 1kHz square - 16 cycles in a 16ms block
+			SoundEffect tone = {Waveform::WF_SQUARE, 1000, 1000, 1000, 255};
+			mixer.Play(tone);
+			mixer.MixBlock(block);
+			int signChanges = 0;
+			for (int i = 1; i < AudioMixer::blockSize; ++i)
+			{
+				signChanges += ((block[i] < 0) != (block[i - 1] < 0)) ? 1 : 0;
+			}
+			Assert::AreEqual(31, signChanges);
+			Assert::AreEqual((-127 * 255) >> 1, (int)block[0]); // starts low.  Full volume is about half scale
+
+			// Runs out after its duration and fades out on the way
+			for (int i = 0; i < 100 && mixer.GetActiveVoiceCount() > 0; ++i)
+			{
+				mixer.MixBlock(block);
+			}
+			Assert::AreEqual(0, mixer.GetActiveVoiceCount());
+			mixer.MixBlock(block);
+			Assert::AreEqual(0, (int)block[0]);
+
+			// Samples play back as is
+			const int8_t samples[] = {10, -20, 30};
+			mixer.PlaySample(samples, ARRAYSIZE(samples), 2);
+			mixer.MixBlock(block);
+			Assert::AreEqual(10, (int)block[0]);
+			Assert::AreEqual(-20, (int)block[1]);
+			Assert::AreEqual(30, (int)block[2]);
+			Assert::AreEqual(0, (int)block[3]);
+
+			// Game events start sounds and busy voices get stolen
+			GameEvent event = {0, GameEventType::GE_SHOT_FIRED, 0, 0, color_black};
+			for (int i = 0; i < AudioMixer::voiceCount + 2; ++i)
+			{
+				mixer.PlayEvent(event);
+			}
+			Assert::AreEqual((int)AudioMixer::voiceCount, mixer.GetActiveVoiceCount());
+
+			// Loud voices piling up clip instead of wrapping
+			mixer.StopAll();
+			for (int i = 0; i < AudioMixer::voiceCount; ++i)
+			{
+				mixer.Play(tone);
+			}
+			mixer.MixBlock(block);
+			Assert::AreEqual(INT16_MIN, (int)block[0]);
+		}
+
+		TEST_METHOD(AudioBlockBufferTest)
+		{
+			AudioMixer mixer;
+			AudioBlockBuffer buffer;
+
+			// Nothing mixed yet - silence and an underrun
+			Assert::AreEqual(0, (int)buffer.NextSample());
+			Assert::AreEqual(1u, buffer.GetUnderrunCount());
+
+			SoundEffect tone = {Waveform::WF_SQUARE, 1000, 1000, 1000, 255};
+			mixer.Play(tone);
+			Assert::IsTrue(buffer.FillBlock(mixer));
+			Assert::IsTrue(buffer.FillBlock(mixer));
+			Assert::IsFalse(buffer.FillBlock(mixer));
+
+			// Playing a whole block frees it for the mixer
+			for (int i = 0; i < AudioMixer::blockSize; ++i)
+			{
+				Assert::AreNotEqual(0, (int)buffer.NextSample());
+			}
+			Assert::IsTrue(buffer.FillBlock(mixer));
+			Assert::AreEqual(1u, buffer.GetUnderrunCount());
+		}
+
+		TEST_METHOD(FixedTimestepTest)
+		{
+			// The same game played with short and long frames ends up in the
+			// same place when the simulation runs in fixed steps
+			GameEngine geShort;
+			GameEngine geLong;
+			geShort.SetFixedTimestep(4, false);
+			geLong.SetFixedTimestep(4, false);
+
+			PlayFixedTimestepGame(geShort, 4);
+			PlayFixedTimestepGame(geLong, 40);
+
+			Assert::AreEqual(geShort.stepTime, geLong.stepTime);
+			Assert::AreEqual(geShort.playerShots.count, geLong.playerShots.count);
+			for (int i = 0; i < geShort.playerShots.count; ++i)
+			{
+				Assert::IsTrue(geShort.playerShots.lanePosition[i] == geLong.playerShots.lanePosition[i]);
+			}
+			Assert::AreEqual(geShort.enemies.count, geLong.enemies.count);
+			for (int i = 0; i < geShort.enemies.count; ++i)
+			{
+				Assert::IsTrue(geShort.enemies.lanePosition[i] == geLong.enemies.lanePosition[i]);
+			}
+
+			// Leftover time carries over to the next Step
+			TickCount time = geLong.stepTime + 6;
+			geLong.Step(time, 0, false, false);
+			Assert::AreEqual(time - 2, geLong.stepTime);
+			geLong.Step(time + 2, 0, false, false);
+			Assert::AreEqual(time + 2, geLong.stepTime);
+
+			// A long stall only catches up the most it's allowed to
+			time += 10000;
+			geLong.Step(time, 0, false, false);
+			Assert::AreEqual(time, geLong.stepTime);
+			Assert::IsTrue(GameEngine::GameState::GS_PLAYING_LEVEL == geLong.gameState);
+		}
+
+		TEST_METHOD(InterpolatedRenderTest)
+		{
+			GameEngine ge;
+			ge.SetFixedTimestep(4, true);
+			ge.StartLevel();
+			ge.Step(ge.stepTime + 100, 0, false, false);
+			ge.ResetShotsAndEnemies();
+			int laneIndex = 2;
+			int shotIndex = ge.playerShots.Add(laneIndex, -0.4f, 0.20f);
+			ge.playerShots.previousLanePosition[shotIndex] = 0.80f;
+
+			// Half way through the next step the shot is drawn half way along
+			ge.frameTime = ge.stepTime + 2;
+			std::vector<LedColor> leds(ge.totalLedCount, color_black);
+			ge.SetLeds(leds.data());
+			Assert::AreEqual(color_white, leds[GameEngine::LedIndexFromRange(ge.lanes[laneIndex].startIndex, ge.lanes[laneIndex].endIndex, 0.5f)]);
+			Assert::AreNotEqual(color_white, leds[GameEngine::LedIndexFromRange(ge.lanes[laneIndex].startIndex, ge.lanes[laneIndex].endIndex, 0.2f)]);
+		}
+
+		TEST_METHOD(BackgroundCacheTest)
+		{
+			GameEngine ge;
+			ge.StartLevel();
+			int laneIndex = 2;
+			ge.playerShots.Add(laneIndex, -0.4f, 0.80f);
+
+			std::vector<LedColor> leds(ge.totalLedCount, color_pink);
+			ge.SetLeds(leds.data());
+			int oldShotLed = GameEngine::LedIndexFromRange(ge.lanes[laneIndex].startIndex, ge.lanes[laneIndex].endIndex, 0.80f);
+			Assert::AreEqual(color_white, leds[oldShotLed]);
+			Assert::AreEqual(color_black, leds[0]);
+
+			// The shot moves - its old LED goes back to the lane color
+			ge.playerShots.lanePosition[0] = 0.5f;
+			ge.SetLeds(leds.data());
+			Assert::AreEqual(color_blue, leds[oldShotLed]);
+			Assert::AreEqual(color_white, leds[GameEngine::LedIndexFromRange(ge.lanes[laneIndex].startIndex, ge.lanes[laneIndex].endIndex, 0.5f)]);
+			AssertLedsMatchFullRender(ge, leds);
+
+			// Losing a life rebuilds the background
+			ge.livesRemaining--;
+			ge.SetLeds(leds.data());
+			AssertLedsMatchFullRender(ge, leds);
+
+			// Animated states start from black
+			leds[0] = color_pink;
+			ge.BeginAnimatedState(GameEngine::GameState::GS_LEVEL_START_ANIMATION);
+			ge.SetLeds(leds.data());
+			Assert::AreEqual(color_black, leds[0]);
+		}
+
+		TEST_METHOD(SnapshotTest)
+		{
+			GameEngine ge;
+			ge.SetRandomSeed(7);
+			TickCount time = 0;
+			ge.Step(time, 0, false, false);
+			ge.Step(time, 0, false, true); // start button down
+			for (int i = 0; i < 3000; ++i)
+			{
+				time += 7;
+				ge.Step(time, (i / 50) % ge.pathLedCount, (i % 20) == 0, false);
+			}
+			Assert::IsTrue(ge.enemies.count > 0);
+
+			GameEngine::Snapshot snapshot;
+			ge.SaveSnapshot(snapshot);
+
+			// A fresh engine picks up from the snapshot and plays exactly the same
+			GameEngine fork;
+			Assert::IsTrue(fork.LoadSnapshot(snapshot));
+			for (int i = 0; i < 2000; ++i)
+			{
+				time += 7;
+				int playerPosition = (i / 30) % ge.pathLedCount;
+				ge.Step(time, playerPosition, (i % 15) == 0, false);
+				fork.Step(time, playerPosition, (i % 15) == 0, false);
+			}
+			GameEngine::Snapshot original;
+			GameEngine::Snapshot forked;
+			ge.SaveSnapshot(original);
+			fork.SaveSnapshot(forked);
+			Assert::IsTrue(memcmp(&original, &forked, sizeof(original)) == 0);
+
+			// Rolling back
+			Assert::IsTrue(ge.LoadSnapshot(snapshot));
+			GameEngine::Snapshot rolledBack;
+			ge.SaveSnapshot(rolledBack);
+			Assert::IsTrue(memcmp(&snapshot, &rolledBack, sizeof(snapshot)) == 0);
+
+			// Snapshots that don't make sense are ignored
+			GameEngine::Snapshot bad = snapshot;
+			bad.version = GameEngine::snapshotVersion + 1;
+			Assert::IsFalse(ge.LoadSnapshot(bad));
+			bad = snapshot;
+			bad.enemies.count = ge.maxEnemies + 1;
+			Assert::IsFalse(ge.LoadSnapshot(bad));
+			bad = snapshot;
+			bad.gameState = (GameEngine::GameState)99;
+			Assert::IsFalse(ge.LoadSnapshot(bad));
+
+			// A bad lane index in any pool would index past the lane tables
+			bad = snapshot;
+			bad.playerShots.count = 1;
+			bad.playerShots.laneIndex[0] = (int8_t)ge.laneCount;
+			Assert::IsFalse(ge.LoadSnapshot(bad));
+			bad = snapshot;
+			bad.enemyShots.count = 1;
+			bad.enemyShots.laneIndex[0] = -1;
+			Assert::IsFalse(ge.LoadSnapshot(bad));
+			bad = snapshot;
+			bad.enemies.count = 1;
+			bad.enemies.laneIndex[0] = (int8_t)ge.laneCount;
+			Assert::IsFalse(ge.LoadSnapshot(bad));
+			bad.enemies.laneIndex[0] = (int8_t)(ge.laneCount - 1);
+			Assert::IsTrue(ge.LoadSnapshot(bad));
+		}
+
+		TEST_METHOD(InputLogTest)
+		{
+			// Record a session the way the tree does - Step, SetLeds, log the frame
+			std::vector<uint8_t> log(64 * 1024);
+			InputLogWriter writer(log.data(), (int)log.size());
+			writer.Begin(77, 4, true, true);
+			GameEngine ge;
+			ge.SetRandomSeed(77);
+			ge.SetFixedTimestep(4, true);
+			std::vector<LedColor> leds(GameEngine::totalLedCount, 0);
+
+			TickCount time = 3000; // the tree has been up a while - doesn't fit in the frame byte
+			int frameCount = 0;
+			for (int frame = 0; frame < 2000; ++frame, ++frameCount)
+			{
+				time += 15 + (frame % 3);
+				int position = (frame / 7) % (2 * ge.pathLedCount);
+				if (position >= ge.pathLedCount) position = (2 * ge.pathLedCount) - 1 - position; // back and forth
+				bool start = (frame >= 100 && frame < 105);
+				bool fire = (frame % 10) < 2;
+				ge.Step(time, position, fire, start);
+				ge.SetLeds(leds.data());
+				Assert::IsTrue(writer.AddFrame(time, position, fire, start, leds.data()));
+			}
+			Assert::AreEqual(frameCount, writer.GetFrameCount());
+			log.resize(writer.GetSize());
+
+			// Replaying on a fresh engine draws exactly the same frames
+			InputLogReader reader(log.data(), (int)log.size());
+			Assert::IsTrue(reader.IsValid());
+			Assert::AreEqual(77u, reader.GetRandomSeed());
+			GameEngine geReplay;
+			std::vector<LedColor> replayLeds(GameEngine::totalLedCount, 0);
+			int replayFrameCount = 0;
+			Assert::AreEqual(-1, reader.Replay(geReplay, replayLeds.data(), &replayFrameCount));
+			Assert::AreEqual(frameCount, replayFrameCount);
+			Assert::IsTrue(leds == replayLeds);
+
+			// A frame that draws differently is found
+			std::vector<uint8_t> badLog = log;
+			badLog[badLog.size() - 1] ^= 1;
+			InputLogReader badReader(badLog.data(), (int)badLog.size());
+			GameEngine geBad;
+			Assert::AreEqual(frameCount - 1, badReader.Replay(geBad, replayLeds.data()));
+
+			// A cut off frame is dropped
+			InputLogReader cutReader(log.data(), (int)log.size() - 2);
+			GameEngine geCut;
+			Assert::AreEqual(-1, cutReader.Replay(geCut, replayLeds.data(), &replayFrameCount));
+			Assert::AreEqual(frameCount - 1, replayFrameCount);
+
+			// A full buffer stops the log at the last whole frame
+			uint8_t smallLog[inputLogHeaderSize + 9];
+			InputLogWriter smallWriter(smallLog, sizeof(smallLog));
+			smallWriter.Begin(1, 0, false, false);
+			Assert::IsTrue(smallWriter.AddFrame(10, 5, true, false, NULL));
+			Assert::IsTrue(smallWriter.AddFrame(500, 2, false, false, NULL));
+			Assert::IsTrue(smallWriter.AddFrame(1000, 2, false, false, NULL));
+			Assert::IsFalse(smallWriter.AddFrame(100000, 2, false, false, NULL));
+			Assert::IsTrue(smallWriter.IsFull());
+			InputLogReader smallReader(smallLog, smallWriter.GetSize());
+			InputLogFrame frame;
+			Assert::IsTrue(smallReader.NextFrame(frame));
+			Assert::AreEqual(5, frame.playerPosition);
+			Assert::IsTrue(frame.fireButtonPressed);
+			Assert::IsTrue(smallReader.NextFrame(frame));
+			Assert::AreEqual(500u, frame.time);
+			Assert::AreEqual(2, frame.playerPosition);
+			Assert::IsTrue(smallReader.NextFrame(frame));
+			Assert::IsFalse(smallReader.NextFrame(frame));
+		}
+
+		void AssertLedsMatchFullRender(GameEngine& ge, const std::vector<LedColor>& leds)
+		{
+			std::vector<LedColor> fullLeds(ge.totalLedCount, color_pink);
+			ge.InvalidateLeds();
+			ge.SetLeds(fullLeds.data());
+			for (int i = 0; i < ge.totalLedCount; ++i)
+			{
+				Assert::AreEqual(fullLeds[i], leds[i]);
+			}
+		}
+
+		void PlayFixedTimestepGame(GameEngine& ge, TickCount frameTicks)
+		{
+			TickCount time = 0;
+			ge.Step(time, 0, false, false);
+			ge.Step(time, 0, false, true); // start button down
+			while (ge.gameState != GameEngine::GameState::GS_PLAYING_LEVEL)
+			{
+				time += 4;
+				ge.Step(time, 0, false, false);
+			}
+
+			// tap fire every 400ms for a few seconds.  Input is only seen once
+			// per frame so the taps land on frames both frame lengths have.
+			for (TickCount elapsed = 0; elapsed < 3000; elapsed += frameTicks)
+			{
+				time += frameTicks;
+				ge.Step(time, ge.lanes[3].pathLedIndex, (elapsed % 400) == 0, false);
+			}
+		}
+
+		TEST_METHOD(PlayerJumpTest)
+		{
+			GameEngine ge;
+			TickCount time = 0;
+			ge.Step(time++, 0, false, false); // start button up
+			ge.Step(time++, 0, false, true); // start button down
+			while (ge.gameState != GameEngine::GameState::GS_PLAYING_LEVEL)
+			{
+				ge.Step(time++, 0, false, false);
+			}
+
+			// The encoder wrapping from one end of the path to the other doesn't
+			// run the player through the enemy in the middle
+			int middlePathIndex = ge.pathLedCount / 2;
+			ge.ResetShotsAndEnemies();
+			ge.Step(time++, ge.pathLedCount - 1, false, false);
+			AddEnemy(ge, 0, 1.0f, GameEngine::EnemyState::onPlayerPath, (float)middlePathIndex / ge.pathLedCount);
+			ge.Step(time++, 0, false, false);
+			Assert::AreEqual(ge.startingLifeCount, ge.livesRemaining);
+
+			// Neither does any other jump past it
+			ge.Step(time++, middlePathIndex + 3, false, false);
+			Assert::AreEqual(ge.startingLifeCount, ge.livesRemaining);
+
+			// Landing on it still counts
+			ge.Step(time++, middlePathIndex, false, false);
+			Assert::AreEqual(ge.startingLifeCount - 1, ge.livesRemaining);
+		}
+
+		void StartLevelWithPlayerInMiddle(GameEngine& ge)
+		{
+			ge.StartLevel();
+			ge.stepPlayerPosition = 0.5f;
+			ge.previousStepPlayerPosition = 0.5f;
+		}
+
+		void AddEnemy(GameEngine& ge, int laneIndex, float lanePosition, GameEngine::EnemyState state = GameEngine::EnemyState::inLane, float pathPosition = 0.0f)
+		{
+			int enemyIndex = ge.enemies.Add();
+			ge.enemies.state[enemyIndex] = state;
+			ge.enemies.laneIndex[enemyIndex] = (int8_t)laneIndex;
+			ge.enemies.lanePosition[enemyIndex] = lanePosition;
+			ge.enemies.previousLanePosition[enemyIndex] = lanePosition;
+			ge.enemies.pathPosition[enemyIndex] = pathPosition;
+			ge.enemies.previousPathPosition[enemyIndex] = pathPosition;
+			ge.enemies.speed[enemyIndex] = 0.2f;
+			ge.enemies.speedPerTick[enemyIndex] = GameTickRateFromRate(ge.enemies.speed[enemyIndex], TicksPerSecond);
+			ge.enemies.startTime[enemyIndex] = ge.stepTime;
+		}
+
+		int PlayerShotCount(const GameEngine& ge)
+		{
+			return ge.playerShots.count;
+		}
+
+		float PlayerShotPosition(const GameEngine& ge)
+		{
+			return (ge.playerShots.count > 0) ? GameRealToFloat(ge.playerShots.lanePosition[0]) : -1.0f;
+		}
+
+		int PlayerShotLaneIndex(const GameEngine& ge)
+		{
+			return (ge.playerShots.count > 0) ? ge.playerShots.laneIndex[0] : -1;
+		}
+
+		int EnemyCount(const GameEngine& ge)
+		{
+			return ge.enemies.count;
 		}
 
 		void Log(const char* pszFormat, ...)